@@ -0,0 +1,211 @@
+#include "archive.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../utils/utils.h"
+#include "../storage/storage.h"
+#include "../index/fileindex.h"
+
+// File of an archive, stat'ed when the archive is built
+struct ArchiveMember {
+    std::string name;
+    uint64_t size;
+    int64_t mtime;
+};
+
+static size_t getPaddingLen(uint64_t size) {
+    return (ARCHIVE_BLOCK_SIZE - size % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE;
+}
+
+// Octal number on len - 1 digits followed by a NUL, numbers too large for it are written in base 256 (GNU tar, star)
+static void writeNumber(char* field, size_t len, uint64_t value) {
+    if (value >> (3 * (len - 1)) == 0) {
+        snprintf(field, len, "%0*llo", static_cast<int>(len - 1), static_cast<unsigned long long>(value));
+        return;
+    }
+    field[0] = static_cast<char>(0x80);
+    for (size_t i = len - 1; i > 0; --i, value >>= 8) {
+        field[i] = static_cast<char>(value & 0xff);
+    }
+}
+
+// pax record "<len> <key>=<value>\n", where len counts the whole record with its own digits
+static std::string getPaxRecord(const std::string& key, const std::string& value) {
+    size_t bodyLen = key.size() + value.size() + 3;
+    size_t digits = std::to_string(bodyLen).size();
+    while (std::to_string(bodyLen + digits).size() != digits) {
+        ++digits;
+    }
+    return std::to_string(bodyLen + digits) + " " + key + "=" + value + "\n";
+}
+
+bool Archive::parseQuery(const std::string& queryString, ArchiveQuery& query, std::string& error) {
+    for (const auto& param : parseQueryString(queryString)) {
+        if (param.first == "name") {
+            if (!Storage::isValidName(param.second)) {
+                error = "invalid file name";
+                return false;
+            }
+            query.names.push_back(param.second);
+        } else if (param.first == "prefix") {
+            query.hasPrefix = true;
+            query.prefix = param.second;
+        }
+    }
+    if (query.names.empty() != query.hasPrefix) {
+        error = "give the files with name parameters or with a prefix";
+        return false;
+    }
+    if (query.names.size() > ARCHIVE_MEMBER_MAX) {
+        error = "an archive holds at most " + std::to_string(ARCHIVE_MEMBER_MAX) + " files";
+        return false;
+    }
+    return true;
+}
+
+int Archive::build(const ArchiveQuery& query, std::vector<BodyPart>& parts, unsigned long& bodyLen, std::string& error) {
+    std::vector<std::string> names = query.names;
+    if (query.hasPrefix) {
+        if (FileIndex::isReady()) {
+            // Pages of the index in name order, each one starts after the last name of the previous one
+            ListQuery listQuery;
+            listQuery.prefix = query.prefix;
+            listQuery.limit = INDEX_PAGE_MAX;
+            while (names.size() <= ARCHIVE_MEMBER_MAX) {
+                ListPage page;
+                FileIndex::list(listQuery, page);
+                for (const FileEntry& entry : page.entries) {
+                    names.push_back(entry.name);
+                }
+                if (page.nextCursor.empty() || page.entries.empty()) {
+                    break;
+                }
+                listQuery.hasCursor = true;
+                listQuery.cursorName = page.entries.back().name;
+            }
+        } else {
+            std::vector<std::string> allNames;
+            Storage::listFiles(allNames);
+            for (const std::string& name : allNames) {
+                if (name.compare(0, query.prefix.size(), query.prefix) == 0) {
+                    names.push_back(name);
+                }
+            }
+        }
+        if (names.size() > ARCHIVE_MEMBER_MAX) {
+            error = "more than " + std::to_string(ARCHIVE_MEMBER_MAX) + " files start with this prefix";
+            return 400;
+        }
+    }
+
+    std::vector<ArchiveMember> members;
+    for (const std::string& name : names) {
+        struct stat fileStat;
+        if (Storage::statFile(name, fileStat) != 0 || !S_ISREG(fileStat.st_mode)) {
+            // A file of the index may have been deleted since, only the files asked by name must exist
+            if (query.hasPrefix) {
+                continue;
+            }
+            error = "no file named " + name;
+            return 404;
+        }
+        ArchiveMember member;
+        member.name = name;
+        member.size = fileStat.st_size;
+        member.mtime = fileStat.st_mtime;
+        members.push_back(member);
+    }
+
+    // The padding of a member and the header of the next one are sent together
+    parts.clear();
+    std::string pending;
+    for (const ArchiveMember& member : members) {
+        appendMemberHeader(member.name, member.size, member.mtime, pending);
+        if (member.size == 0) {
+            continue;
+        }
+        BodyPart header;
+        header.data.swap(pending);
+        parts.push_back(header);
+
+        BodyPart file;
+        file.fileName = member.name;
+        file.fileLen = member.size;
+        parts.push_back(file);
+        pending.assign(getPaddingLen(member.size), '\0');
+    }
+    // End of the archive: two zero blocks
+    pending.append(2 * ARCHIVE_BLOCK_SIZE, '\0');
+    BodyPart end;
+    end.data.swap(pending);
+    parts.push_back(end);
+
+    bodyLen = 0;
+    for (const BodyPart& part : parts) {
+        bodyLen += part.fileName.empty() ? part.data.size() : part.fileLen;
+    }
+    return 0;
+}
+
+bool Archive::openParts(std::vector<BodyPart>& parts, size_t first) {
+    int opened = 0;
+    for (size_t i = first; i < parts.size() && opened < ARCHIVE_OPEN_BATCH; ++i) {
+        if (parts[i].fileName.empty() || parts[i].fd != -1) {
+            continue;
+        }
+        parts[i].fd = Storage::openFile(parts[i].fileName, O_RDONLY);
+        if (parts[i].fd == -1 && i == first) {
+            return false;
+        }
+        ++opened;
+    }
+    return true;
+}
+
+void Archive::closeParts(std::vector<BodyPart>& parts) {
+    for (BodyPart& part : parts) {
+        if (part.fd != -1) {
+            close(part.fd);
+            part.fd = -1;
+        }
+    }
+}
+
+void Archive::appendHeaderBlock(const std::string& name, char typeFlag, uint64_t size, int64_t mtime, std::string& out) {
+    char block[ARCHIVE_BLOCK_SIZE];
+    memset(block, 0, sizeof(block));
+    memcpy(block, name.data(), name.size() < 100 ? name.size() : 100);
+    writeNumber(block + 100, 8, 0644);                  // mode
+    writeNumber(block + 108, 8, 0);                     // uid
+    writeNumber(block + 116, 8, 0);                     // gid
+    writeNumber(block + 124, 12, size);
+    writeNumber(block + 136, 12, mtime > 0 ? mtime : 0);
+    block[156] = typeFlag;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    // The checksum is computed with its own field filled with spaces
+    memset(block + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (unsigned char c : block) {
+        checksum += c;
+    }
+    snprintf(block + 148, 8, "%06o", checksum);
+    block[155] = ' ';
+    out.append(block, sizeof(block));
+}
+
+void Archive::appendMemberHeader(const std::string& name, uint64_t size, int64_t mtime, std::string& out) {
+    if (name.size() > 100) {
+        std::string record = getPaxRecord("path", name);
+        appendHeaderBlock("PaxHeader/" + name.substr(0, 90), 'x', record.size(), mtime, out);
+        out += record;
+        out.append(getPaddingLen(record.size()), '\0');
+    }
+    appendHeaderBlock(name, '0', size, mtime, out);
+}
@@ -0,0 +1,46 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "../message/message.h"
+
+#define ARCHIVE_BLOCK_SIZE 512        // tar works in blocks, a header is one block and the data is padded to a block
+#define ARCHIVE_MEMBER_MAX 10000      // Largest number of files in one archive
+#define ARCHIVE_OPEN_BATCH 32         // Files opened by one filesystem call, the others wait for their turn
+
+// Parameters of GET /archive?name=a&name=b or /archive?prefix=p
+struct ArchiveQuery {
+    std::vector<std::string> names;   // Files asked by name, in this order
+    bool hasPrefix = false;           // All the files starting with prefix, in name order
+    std::string prefix;
+};
+
+// tar (ustar) archives of stored files, streamed without a temporary file. The headers are built in memory and
+// the data of each member is sent with sendfile straight from its file: the body of the response is a sequence
+// of BodyPart, in memory and file parts, sent by HandleSend like any other body.
+class Archive {
+public:
+    // Fills query from the query string of the request, returns false with an error message on invalid parameters
+    static bool parseQuery(const std::string& queryString, ArchiveQuery& query, std::string& error);
+
+    // Finds and stats the files of the query and builds the parts of the archive and its length. Returns 0,
+    // or the HTTP status of the error (400 or 404) with its message. Blocks on the filesystem.
+    static int build(const ArchiveQuery& query, std::vector<BodyPart>& parts, unsigned long& bodyLen, std::string& error);
+
+    // Opens the next ARCHIVE_OPEN_BATCH file parts from first, returns false if the file of first cannot be opened
+    static bool openParts(std::vector<BodyPart>& parts, size_t first);
+
+    // Closes the files still open, when the response ends
+    static void closeParts(std::vector<BodyPart>& parts);
+
+    // Header blocks of a member: a pax header before the ustar header for names longer than the ustar field
+    static void appendMemberHeader(const std::string& name, uint64_t size, int64_t mtime, std::string& out);
+
+private:
+    static void appendHeaderBlock(const std::string& name, char typeFlag, uint64_t size, int64_t mtime, std::string& out);
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+
+#include "../utils/utils.h"
+
+void BenchState::pauseTiming() {
+    m_pauseStart = getMonotonicNs();
+}
+
+void BenchState::resumeTiming() {
+    m_pausedNs += getMonotonicNs() - m_pauseStart;
+}
+
+void BenchRunner::add(const std::string& name, std::function<void(BenchState&)> func) {
+    Bench bench;
+    bench.name = name;
+    bench.func = func;
+    m_benches.push_back(bench);
+}
+
+double BenchRunner::runRepetition(const Bench& bench, long long iterations, double& bytesPerOp) {
+    BenchState state(iterations);
+    long long start = getMonotonicNs();
+    bench.func(state);
+    long long elapsed = getMonotonicNs() - start - state.getPausedNs();
+    bytesPerOp = state.getBytesPerOp();
+    return static_cast<double>(elapsed) / iterations;
+}
+
+BenchResult BenchRunner::runOne(const Bench& bench, long long minTimeNs, int repetitions) {
+    // Grow the number of iterations until one repetition lasts the minimum time
+    long long iterations = 1;
+    double bytesPerOp = 0;
+    while (true) {
+        double nsPerOp = runRepetition(bench, iterations, bytesPerOp);
+        double elapsed = nsPerOp * iterations;
+        if (elapsed >= minTimeNs || iterations >= 1000000000LL) {
+            break;
+        }
+        long long next = elapsed > 0 ? static_cast<long long>(iterations * 1.4 * minTimeNs / elapsed) : iterations * 100;
+        iterations = std::min(std::max(next, iterations * 2), iterations * 100);
+    }
+
+    std::vector<double> samples;
+    for (int i = 0; i < repetitions; ++i) {
+        samples.push_back(runRepetition(bench, iterations, bytesPerOp));
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    result.name = bench.name;
+    result.iterations = iterations;
+    result.nsPerOp = samples[samples.size() / 2];
+    result.minNsPerOp = samples.front();
+    result.bytesPerSec = bytesPerOp > 0 ? bytesPerOp * 1e9 / result.nsPerOp : 0;
+    return result;
+}
+
+void BenchRunner::writeResults(const std::vector<BenchResult>& results, const std::string& format, FILE* out) {
+    if (format == "csv") {
+        fprintf(out, "name,iterations,ns_per_op,min_ns_per_op,bytes_per_sec\n");
+        for (const BenchResult& result : results) {
+            fprintf(out, "%s,%lld,%.2f,%.2f,%.0f\n", result.name.c_str(), result.iterations, result.nsPerOp, result.minNsPerOp, result.bytesPerSec);
+        }
+        return;
+    }
+
+    // One benchmark per line, compareBaseline reads the file back line by line
+    fprintf(out, "{\"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+        fprintf(out, "{\"name\": \"%s\", \"iterations\": %lld, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, \"bytes_per_sec\": %.0f}%s\n",
+                result.name.c_str(), result.iterations, result.nsPerOp, result.minNsPerOp, result.bytesPerSec, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+bool BenchRunner::compareBaseline(const std::vector<BenchResult>& results, const std::string& baselinePath, double threshold) {
+    std::ifstream file(baselinePath);
+    if (!file) {
+        fprintf(stderr, "[error] Cannot open baseline %s\n", baselinePath.c_str());
+        return false;
+    }
+
+    std::map<std::string, double> baseline;
+    std::string line;
+    while (getline(file, line)) {
+        std::string::size_type nameIndex = line.find("\"name\": \"");
+        std::string::size_type nsIndex = line.find("\"ns_per_op\": ");
+        if (nameIndex == std::string::npos || nsIndex == std::string::npos) {
+            continue;
+        }
+        nameIndex += strlen("\"name\": \"");
+        std::string name = line.substr(nameIndex, line.find('"', nameIndex) - nameIndex);
+        baseline[name] = atof(line.c_str() + nsIndex + strlen("\"ns_per_op\": "));
+    }
+
+    bool regressed = false;
+    fprintf(stderr, "%-40s %14s %14s %9s\n", "benchmark", "baseline ns", "current ns", "change");
+    for (const BenchResult& result : results) {
+        std::map<std::string, double>::iterator it = baseline.find(result.name);
+        if (it == baseline.end() || it->second <= 0) {
+            fprintf(stderr, "%-40s %14s %14.2f %9s\n", result.name.c_str(), "-", result.nsPerOp, "new");
+            continue;
+        }
+        double change = (result.nsPerOp - it->second) * 100 / it->second;
+        bool isRegression = change > threshold;
+        regressed = regressed || isRegression;
+        fprintf(stderr, "%-40s %14.2f %14.2f %+8.1f%%%s\n", result.name.c_str(), it->second, result.nsPerOp, change, isRegression ? "  REGRESSION" : "");
+    }
+    return !regressed;
+}
+
+int BenchRunner::run(int argc, char* argv[]) {
+    std::string filter, format = "json", outPath, baselinePath;
+    double threshold = 10;
+    long long minTimeMs = 200;
+    int repetitions = 5;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "[error] Missing value for %s\n", arg.c_str());
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--filter") {
+            filter = value;
+        } else if (arg == "--format") {
+            format = value;
+        } else if (arg == "--out") {
+            outPath = value;
+        } else if (arg == "--baseline") {
+            baselinePath = value;
+        } else if (arg == "--threshold") {
+            threshold = atof(value.c_str());
+        } else if (arg == "--min-time") {
+            minTimeMs = std::max(1LL, atoll(value.c_str()));
+        } else if (arg == "--repetitions") {
+            repetitions = std::max(1, atoi(value.c_str()));
+        } else {
+            fprintf(stderr, "[error] Unknown option %s\n", arg.c_str());
+            return 2;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for (const Bench& bench : m_benches) {
+        if (!filter.empty() && bench.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        results.push_back(runOne(bench, minTimeMs * 1000000LL, repetitions));
+        fprintf(stderr, "[bench] %-40s %12.2f ns/op\n", bench.name.c_str(), results.back().nsPerOp);
+    }
+
+    FILE* out = stdout;
+    if (!outPath.empty()) {
+        out = fopen(outPath.c_str(), "w");
+        if (out == nullptr) {
+            fprintf(stderr, "[error] Cannot write %s\n", outPath.c_str());
+            return 2;
+        }
+    }
+    writeResults(results, format, out);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    if (!baselinePath.empty() && !compareBaseline(results, baselinePath, threshold)) {
+        return 1;
+    }
+    return 0;
+}
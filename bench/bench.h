@@ -0,0 +1,72 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdio>
+
+// Result of one benchmark, the time per operation is the median of the repetitions
+struct BenchResult {
+    std::string name;
+    long long iterations = 0;     // Operations per repetition
+    double nsPerOp = 0;
+    double minNsPerOp = 0;
+    double bytesPerSec = 0;       // 0 when the benchmark does not process bytes
+};
+
+// Given to a benchmark function, which runs iterations() operations
+class BenchState {
+public:
+    explicit BenchState(long long iterations) : m_iterations(iterations), m_pausedNs(0), m_pauseStart(0), m_bytesPerOp(0) {}
+
+    long long iterations() const { return m_iterations; }
+
+    // Excludes the setup of an operation from the measure
+    void pauseTiming();
+    void resumeTiming();
+
+    // Bytes processed by one operation, reported as a throughput
+    void setBytesPerOp(double bytes) { m_bytesPerOp = bytes; }
+
+    long long getPausedNs() const { return m_pausedNs; }
+    double getBytesPerOp() const { return m_bytesPerOp; }
+
+private:
+    long long m_iterations;
+    long long m_pausedNs;
+    long long m_pauseStart;
+    double m_bytesPerOp;
+};
+
+// Small benchmark harness: each benchmark is calibrated until one repetition lasts at least the minimum time,
+// then repeated, and the results are written as JSON (or CSV) so that a run can be compared to a saved baseline.
+//
+//   --filter <substring>     only run the benchmarks whose name contains it
+//   --format json|csv        output format, json by default
+//   --out <file>             write the results to a file instead of stdout
+//   --baseline <file>        compare with the JSON results of an earlier run, exit with 1 on a regression
+//   --threshold <percent>    slowdown counted as a regression, 10 by default
+//   --min-time <ms>          minimum duration of one repetition, 200 by default
+//   --repetitions <n>        repetitions of each benchmark, 5 by default
+class BenchRunner {
+public:
+    void add(const std::string& name, std::function<void(BenchState&)> func);
+
+    int run(int argc, char* argv[]);
+
+private:
+    struct Bench {
+        std::string name;
+        std::function<void(BenchState&)> func;
+    };
+
+    BenchResult runOne(const Bench& bench, long long minTimeNs, int repetitions);
+    static double runRepetition(const Bench& bench, long long iterations, double& bytesPerOp);
+    static void writeResults(const std::vector<BenchResult>& results, const std::string& format, FILE* out);
+    static bool compareBaseline(const std::vector<BenchResult>& results, const std::string& baselinePath, double threshold);
+
+    std::vector<Bench> m_benches;
+};
+
+#endif
@@ -0,0 +1,439 @@
+// Microbenchmarks of the hot paths of the server, run with `make bench`.
+// The results are JSON on stdout: save a run with `make bench BENCH_ARGS="--out base.json"` and
+// compare a later one with `make bench BENCH_ARGS="--baseline base.json"`.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "../message/message.h"
+#include "../event/myevent.h"
+#include "../threadpool/threadpool.h"
+#include "../search/namesearch.h"
+
+// Prevents the compiler from removing a computation whose result is not used
+template <typename T>
+static void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Header set of a browser request and of a multipart upload
+static const char* browserHeaders[] = {
+    "Host: 127.0.0.1:8888\r\n",
+    "Connection: keep-alive\r\n",
+    "Cache-Control: max-age=0\r\n",
+    "Upgrade-Insecure-Requests: 1\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/126.0.0.0 Safari/537.36\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n",
+    "Referer: http://127.0.0.1:8888/\r\n",
+    "Accept-Encoding: gzip, deflate, br\r\n",
+    "Accept-Language: fr-FR,fr;q=0.9,en-US;q=0.8,en;q=0.7\r\n",
+    "Cookie: session=4f2a9c1e7b3d5a8f6e0c2b4d9a7f1e3c; theme=dark\r\n",
+};
+
+static const char* uploadHeaders[] = {
+    "Host: 127.0.0.1:8888\r\n",
+    "User-Agent: curl/8.5.0\r\n",
+    "Accept: */*\r\n",
+    "Content-Length: 1048731\r\n",
+    "Content-Type: multipart/form-data; boundary=------------------------d74496d66958873e\r\n",
+};
+
+static void benchRequestLine(BenchState& state) {
+    for (long long i = 0; i < state.iterations(); ++i) {
+        Request request;
+        request.setRequestLine("GET /downl/testfile.txt HTTP/1.1\r\n");
+        doNotOptimize(request.getRequestResource());
+    }
+}
+
+template <size_t N>
+static void benchHeaders(BenchState& state, const char* (&headers)[N]) {
+    for (long long i = 0; i < state.iterations(); ++i) {
+        Request request;
+        request.setRequestLine("GET / HTTP/1.1\r\n");
+        for (size_t h = 0; h < N; ++h) {
+            request.addHeaderOpt(headers[h]);
+        }
+        doNotOptimize(request.getHeaders());
+    }
+}
+
+// Upload body: payload followed by the closing boundary, random bytes (about one CR in 256) or a CR every crEvery bytes
+static std::string makeMultipartBody(size_t size, size_t crEvery, const std::string& boundary) {
+    std::string body(size, 'a');
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        body[i] = static_cast<char>(seed >> 16);
+        if (crEvery != 0) {
+            body[i] = (i % crEvery == 0) ? '\r' : (body[i] == '\r' ? 'r' : body[i]);
+        }
+    }
+    return body + "\r\n--" + boundary + "--\r\n";
+}
+
+static void benchMultipart(BenchState& state, size_t size, size_t crEvery) {
+    const std::string boundary = "------------------------d74496d66958873e";
+    const std::string body = makeMultipartBody(size, crEvery, boundary);
+    state.setBytesPerOp(size);
+    for (long long i = 0; i < state.iterations(); ++i) {
+        state.pauseTiming();
+        std::string recvMsg = body;
+        std::string fileData;
+        fileData.reserve(size);
+        state.resumeTiming();
+        if (!HandleRecv::extractFileContent(recvMsg, boundary, fileData)) {
+            std::cerr << "[error] closing boundary not found" << std::endl;
+            exit(1);
+        }
+    }
+}
+
+// CRC32C of the data of an upload, computed while it is written
+static void benchCrc32c(BenchState& state, size_t size) {
+    std::string data = makeMultipartBody(size, 0, "");
+    for (long long i = 0; i < state.iterations(); ++i) {
+        doNotOptimize(Crc32c::compute(data.data(), data.size()));
+    }
+    state.setBytesPerOp(size);
+}
+
+static void benchStatusLine(BenchState& state) {
+    ResponseHead head;
+    for (long long i = 0; i < state.iterations(); ++i) {
+        head.start(HTTP_OK);
+        doNotOptimize(head.size());
+    }
+}
+
+// Whole heads as HandleSend builds them: the file list page, a download and the redirect that follows an upload
+static void benchMessageHeader(BenchState& state, bool file) {
+    ResponseHead head;
+    for (long long i = 0; i < state.iterations(); ++i) {
+        head.start(HTTP_OK);
+        head.addContentLength(file ? 1048576 : 4306);
+        head.addContentType(file ? CONTENT_FILE : CONTENT_HTML);
+        head.finish();
+        doNotOptimize(head.size());
+    }
+}
+
+static void benchRedirectHeader(BenchState& state) {
+    ResponseHead head;
+    for (long long i = 0; i < state.iterations(); ++i) {
+        head.start(HTTP_FOUND);
+        head.addContentLength(0);
+        head.addContentType(CONTENT_HTML);
+        head.addHeader("Location", "/", 1);
+        head.finish();
+        doNotOptimize(head.size());
+    }
+}
+
+// Event that does nothing, the benchmark measures the submission
+class NopEvent : public EventBase {
+public:
+    virtual void process() override {}
+    virtual EVENTTYPE getEventType() const override { return EVENT_TYPE_SIG; }
+};
+
+static void benchAppendEvent(BenchState& state, int producerNum) {
+    // Workers of the pool are detached and never stop, the pool is shared by all the runs and never destroyed
+    static ThreadPool* pool = new ThreadPool(2);
+
+    long long perProducer = std::max(1LL, state.iterations() / producerNum);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producerNum; ++p) {
+        producers.push_back(std::thread([perProducer]() {
+            for (long long i = 0; i < perProducer; ++i) {
+                pool->appendEvent(new NopEvent(), "NopEvent", EVENT_CONTROL);
+            }
+        }));
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+
+    // The next run starts with an empty queue
+    state.pauseTiming();
+    while (pool->getQueuedNum() > 0) {
+        usleep(100);
+    }
+    state.resumeTiming();
+}
+
+static std::string benchRoot;
+static std::string repoRoot;
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
+}
+
+// Directory with a filedir of fileNum files and a link to the html templates, created once per file count
+static std::string getListingDir(int fileNum) {
+    static std::map<int, std::string> dirs;
+    if (dirs.count(fileNum)) {
+        return dirs[fileNum];
+    }
+    std::string dir = benchRoot + "/listing-" + std::to_string(fileNum);
+    mkdir(dir.c_str(), 0755);
+    mkdir((dir + "/filedir").c_str(), 0755);
+    symlink((repoRoot + "/html").c_str(), (dir + "/html").c_str());
+    for (int i = 0; i < fileNum; ++i) {
+        std::string path = dir + "/filedir/file-" + std::to_string(i) + ".bin";
+        int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    dirs[fileNum] = dir;
+    return dir;
+}
+
+static void benchFileList(BenchState& state, int fileNum) {
+    // getFileListPage reads filedir and html relative to the working directory
+    state.pauseTiming();
+    std::string dir = getListingDir(fileNum);
+    if (chdir(dir.c_str()) != 0) {
+        std::cerr << "[error] Cannot enter " << dir << std::endl;
+        exit(1);
+    }
+    state.resumeTiming();
+
+    for (long long i = 0; i < state.iterations(); ++i) {
+        std::string page;
+        HandleSend::getFileListPage(page);
+        doNotOptimize(page);
+    }
+
+    state.pauseTiming();
+    if (chdir(repoRoot.c_str()) != 0) {
+        exit(1);
+    }
+    state.resumeTiming();
+}
+
+// Loopback TCP connection whose other end is drained by a thread, shared by all the runs and never closed
+static int getServeSocket() {
+    static int clientFd = -1;
+    if (clientFd != -1) {
+        return clientFd;
+    }
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 1) != 0 ||
+        getsockname(listenFd, (sockaddr*)&addr, &addrLen) != 0) {
+        std::cerr << "[error] Cannot listen on the loopback interface" << std::endl;
+        exit(1);
+    }
+    clientFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(clientFd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        std::cerr << "[error] Cannot connect on the loopback interface" << std::endl;
+        exit(1);
+    }
+    int peerFd = accept(listenFd, nullptr, nullptr);
+    close(listenFd);
+    std::thread([peerFd]() {
+        char buf[256 * 1024];
+        while (read(peerFd, buf, sizeof(buf)) > 0) {
+        }
+    }).detach();
+    return clientFd;
+}
+
+static std::string getServeFile(long long size) {
+    std::string path = benchRoot + "/serve-" + std::to_string(size) + ".bin";
+    struct stat fileStat;
+    if (stat(path.c_str(), &fileStat) != 0) {
+        std::ofstream file(path.c_str(), std::ios::binary);
+        std::string data(size, 'x');
+        file.write(data.data(), data.size());
+    }
+    return path;
+}
+
+// One download as the server sends it: from memory with its header in one writev, or with the header then sendfile.
+// The crossing point of the two gives ServeLimits::smallFileMax.
+static void benchServe(BenchState& state, long long size, bool fromMemory) {
+    state.pauseTiming();
+    int sock = getServeSocket();
+    std::string path = getServeFile(size);
+    ResponseHead head;
+    head.start(HTTP_OK);
+    head.addContentLength(size);
+    head.addContentType(CONTENT_FILE);
+    head.finish();
+    std::string header(head.data(), head.size());
+    state.resumeTiming();
+
+    for (long long i = 0; i < state.iterations(); ++i) {
+        int fileFd = open(path.c_str(), O_RDONLY);
+        struct stat fileStat;
+        if (fileFd == -1 || fstat(fileFd, &fileStat) != 0) {
+            exit(1);
+        }
+        if (fromMemory) {
+            std::string body(fileStat.st_size, '\0');
+            if (read(fileFd, &body[0], body.size()) != static_cast<ssize_t>(body.size())) {
+                exit(1);
+            }
+            close(fileFd);
+            struct iovec iov[2];
+            iov[0].iov_base = const_cast<char*>(header.data());
+            iov[0].iov_len = header.size();
+            iov[1].iov_base = &body[0];
+            iov[1].iov_len = body.size();
+            for (ssize_t ret; iov[1].iov_len > 0; ) {
+                if ((ret = writev(sock, iov, 2)) <= 0) {
+                    exit(1);
+                }
+                for (int v = 0; v < 2 && ret > 0; ++v) {
+                    size_t done = std::min(static_cast<size_t>(ret), iov[v].iov_len);
+                    iov[v].iov_base = static_cast<char*>(iov[v].iov_base) + done;
+                    iov[v].iov_len -= done;
+                    ret -= done;
+                }
+            }
+        } else {
+            if (send(sock, header.data(), header.size(), MSG_MORE) != static_cast<ssize_t>(header.size())) {
+                exit(1);
+            }
+            off_t offset = 0;
+            while (offset < fileStat.st_size) {
+                if (sendfile(sock, fileFd, &offset, fileStat.st_size - offset) <= 0) {
+                    exit(1);
+                }
+            }
+            close(fileFd);
+        }
+    }
+    state.setBytesPerOp(size);
+}
+
+// Names shaped like the files of a shared directory, sorted as the file index gives them
+static const std::vector<std::string>& getSearchNames(size_t nameNum) {
+    static std::map<size_t, std::vector<std::string> > sets;
+    std::vector<std::string>& names = sets[nameNum];
+    if (!names.empty()) {
+        return names;
+    }
+    static const char* words[] = {"report", "invoice", "IMG", "backup", "draft", "photo", "scan", "notes",
+                                  "budget", "video", "export", "thesis", "slides", "contract", "release", "meeting"};
+    static const char* extensions[] = {".pdf", ".jpg", ".png", ".txt", ".tar.gz", ".docx", ".mp4", ".csv"};
+    uint32_t seed = 12345;
+    names.reserve(nameNum);
+    for (size_t i = 0; i < nameNum; ++i) {
+        seed = seed * 1103515245 + 12345;
+        names.push_back(std::string(words[(seed >> 8) % 16]) + "_" + words[(seed >> 16) % 16] + "-" + std::to_string(i) +
+                        extensions[(seed >> 24) % 8]);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static void benchSearchBuild(BenchState& state, size_t nameNum) {
+    state.pauseTiming();
+    const std::vector<std::string>& names = getSearchNames(nameNum);
+    int threadNum = std::max<int>(std::thread::hardware_concurrency(), 1);
+    state.resumeTiming();
+    for (long long i = 0; i < state.iterations(); ++i) {
+        NameSearch::build(names, threadNum);
+    }
+}
+
+// One query of /api/search on an index of nameNum names, without the HTTP request
+static void benchSearch(BenchState& state, size_t nameNum, const std::string& text, SEARCHMODE mode) {
+    static size_t builtNum = 0;
+    state.pauseTiming();
+    if (builtNum != nameNum) {
+        NameSearch::build(getSearchNames(nameNum), std::max<int>(std::thread::hardware_concurrency(), 1));
+        builtNum = nameNum;
+    }
+    SearchQuery query;
+    query.text = text;
+    query.mode = mode;
+    state.resumeTiming();
+    for (long long i = 0; i < state.iterations(); ++i) {
+        SearchResult result;
+        NameSearch::search(query, result);
+        doNotOptimize(result.names.size());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        return 2;
+    }
+    repoRoot = cwd;
+    char rootTemplate[] = "/tmp/cherokee-bench-XXXXXX";
+    if (mkdtemp(rootTemplate) == nullptr) {
+        std::cerr << "[error] Cannot create the benchmark directory" << std::endl;
+        return 2;
+    }
+    benchRoot = rootTemplate;
+
+    // The server logs every event on std::cout, the results are written with stdio
+    std::ofstream devNull("/dev/null");
+    std::streambuf* coutBuf = std::cout.rdbuf(devNull.rdbuf());
+
+    BenchRunner runner;
+    runner.add("parse/request_line", benchRequestLine);
+    runner.add("parse/headers_browser", [](BenchState& state) { benchHeaders(state, browserHeaders); });
+    runner.add("parse/headers_upload", [](BenchState& state) { benchHeaders(state, uploadHeaders); });
+    runner.add("multipart/64KiB_random", [](BenchState& state) { benchMultipart(state, 64 * 1024, 0); });
+    runner.add("multipart/64KiB_cr_every_64", [](BenchState& state) { benchMultipart(state, 64 * 1024, 64); });
+    runner.add("multipart/64KiB_cr_every_8", [](BenchState& state) { benchMultipart(state, 64 * 1024, 8); });
+    runner.add("checksum/crc32c_1MiB", [](BenchState& state) { benchCrc32c(state, 1024 * 1024); });
+    runner.add("header/status_line", benchStatusLine);
+    runner.add("header/message_header_html", [](BenchState& state) { benchMessageHeader(state, false); });
+    runner.add("header/message_header_file", [](BenchState& state) { benchMessageHeader(state, true); });
+    runner.add("header/redirect", benchRedirectHeader);
+    runner.add("pool/append_event_1_producer", [](BenchState& state) { benchAppendEvent(state, 1); });
+    runner.add("pool/append_event_2_producers", [](BenchState& state) { benchAppendEvent(state, 2); });
+    runner.add("pool/append_event_4_producers", [](BenchState& state) { benchAppendEvent(state, 4); });
+    runner.add("pool/append_event_8_producers", [](BenchState& state) { benchAppendEvent(state, 8); });
+    runner.add("listing/10_files", [](BenchState& state) { benchFileList(state, 10); });
+    runner.add("listing/10000_files", [](BenchState& state) { benchFileList(state, 10000); });
+    runner.add("listing/100000_files", [](BenchState& state) { benchFileList(state, 100000); });
+    for (long long size : {1024LL, 4 * 1024LL, 8 * 1024LL, 16 * 1024LL, 64 * 1024LL, 1024 * 1024LL}) {
+        std::string sizeName = size < 1024 * 1024 ? std::to_string(size / 1024) + "KiB" : std::to_string(size / (1024 * 1024)) + "MiB";
+        runner.add("serve/" + sizeName + "_memory", [size](BenchState& state) { benchServe(state, size, true); });
+        runner.add("serve/" + sizeName + "_sendfile", [size](BenchState& state) { benchServe(state, size, false); });
+    }
+
+    runner.add("search/build_1M_names", [](BenchState& state) { benchSearchBuild(state, 1000000); });
+    // A common substring stops at the limit, a rare one reads a short posting list, an absent one none at all.
+    // A query of two bytes has no trigram and scans every name.
+    runner.add("search/substring_common_1M_names", [](BenchState& state) { benchSearch(state, 1000000, "voice_draft", SEARCH_SUBSTRING); });
+    runner.add("search/substring_rare_1M_names", [](BenchState& state) { benchSearch(state, 1000000, "-777777", SEARCH_SUBSTRING); });
+    runner.add("search/substring_absent_1M_names", [](BenchState& state) { benchSearch(state, 1000000, "zebra", SEARCH_SUBSTRING); });
+    runner.add("search/substring_2_bytes_1M_names", [](BenchState& state) { benchSearch(state, 1000000, "-9", SEARCH_SUBSTRING); });
+    runner.add("search/prefix_1M_names", [](BenchState& state) { benchSearch(state, 1000000, "report_sl", SEARCH_PREFIX); });
+
+    int ret = runner.run(argc, argv);
+
+    std::cout.rdbuf(coutBuf);
+    nftw(benchRoot.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    return ret;
+}
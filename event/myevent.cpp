@@ -1,4 +1,5 @@
 #include "myevent.h"
+#include "../threadpool/threadpool.h"
 
 // Utility function to remove spaces from filenames
 std::string removeSpaces(const std::string &str) {
@@ -11,156 +12,727 @@ std::string removeSpaces(const std::string &str) {
     return result;
 }
 
+// "/api/list" with or without a query string
+static bool isApiListResource(const std::string &resource) {
+    return resource.compare(0, 9, "/api/list") == 0 && (resource.size() == 9 || resource[9] == '?');
+}
+
+// "/api/search" with or without a query string
+static bool isApiSearchResource(const std::string &resource) {
+    return resource.compare(0, 11, "/api/search") == 0 && (resource.size() == 11 || resource[11] == '?');
+}
+
+static bool isArchiveResource(const std::string &resource) {
+    return resource.compare(0, 8, "/archive") == 0 && (resource.size() == 8 || resource[8] == '?');
+}
+
+static std::string getQueryString(const std::string &resource) {
+    std::string::size_type queryIndex = resource.find('?');
+    return queryIndex == std::string::npos ? "" : resource.substr(queryIndex + 1);
+}
+
+// Digest field of a CRC32C (RFC 9530): crc32c=:<base64 of the 4 bytes, big endian>:
+static std::string formatCrc32cDigest(uint32_t crc) {
+    std::string bytes;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        bytes += static_cast<char>((crc >> shift) & 0xff);
+    }
+    return "crc32c=:" + base64Encode(bytes) + ":";
+}
+
+// Finds the crc32c member of a Repr-Digest or Content-Digest field, the other algorithms are ignored
+static bool parseCrc32cDigest(const std::string &field, uint32_t &crc) {
+    std::string::size_type begin = field.find("crc32c=:");
+    if (begin == std::string::npos) {
+        return false;
+    }
+    begin += 8;
+    std::string::size_type end = field.find(':', begin);
+    std::string bytes;
+    if (end == std::string::npos || !base64Decode(field.substr(begin, end - begin), bytes) || bytes.size() != 4) {
+        return false;
+    }
+    crc = 0;
+    for (unsigned char byte : bytes) {
+        crc = (crc << 8) | byte;
+    }
+    return true;
+}
+
+// Digest sent with the body of a request, Repr-Digest first
+static std::string getDigestField(const std::unordered_map<std::string, std::string> &headers) {
+    std::unordered_map<std::string, std::string>::const_iterator it = headers.find("Repr-Digest");
+    if (it == headers.end()) {
+        it = headers.find("Content-Digest");
+    }
+    return it == headers.end() ? "" : it->second;
+}
+
+// Bytes of parsed headers: the strings by capacity, the nodes and the buckets of the map
+static long long getHeadersMemory(const std::unordered_map<std::string, std::string> &headers) {
+    long long bytes = headers.bucket_count() * sizeof(void*);
+    for (const auto &header : headers) {
+        bytes += sizeof(header) + 2 * sizeof(void*) + header.first.capacity() + header.second.capacity();
+    }
+    return bytes;
+}
+
+// Memory of a request: received data, parser state and the buffer of its upload
+static long long getRequestMemory(const Request &request) {
+    long long bytes = sizeof(Request) + request.recvMsg.capacity() + getHeadersMemory(request.getHeaders());
+    bytes += request.getRequestMethod().capacity() + request.getRequestResource().capacity() + request.getHttpVersion().capacity();
+    bytes += request.getRecvFileName().capacity() + request.getUploadDigest().capacity();
+    if (request.getUploadWriter()) {
+        bytes += request.getUploadWriter()->getBufferCapacity();
+    }
+    return bytes;
+}
+
+// Memory of a response: head, body in memory, parts of an archive and state of a file list page
+static long long getResponseMemory(Response &response) {
+    long long bytes = sizeof(Response) + response.getMsgBody().capacity() + response.getBodyFileName().capacity();
+    for (const BodyPart &part : response.getBodyPartsRef()) {
+        bytes += sizeof(BodyPart) + part.data.capacity() + part.fileName.capacity();
+    }
+    bytes += response.getListingRef().tail.capacity() + response.getListingRef().cursor.capacity();
+    bytes += response.getReprDigest().capacity();
+    return bytes;
+}
+
+// Closes the file or the archive parts a response is sending, a second call does nothing
+static void closeResponseBody(Response &response) {
+    if (response.getBodyType() == FILE_TYPE && response.getFileMsgFd() != -1) {
+        close(response.getFileMsgFd());
+        response.setFileMsgFd(-1);
+    } else if (response.getBodyType() == PARTS_TYPE) {
+        Archive::closeParts(response.getBodyPartsRef());
+    } else if (response.getBodyType() == CHUNKED_TYPE) {
+        Storage::closeCursor(response.getListingRef().walkCursor);
+    }
+}
+
 // Out-of-class initialization of static members
+Request* EventBase::requestSlots[MAX_STATE_FD];
+Response* EventBase::responseSlots[MAX_STATE_FD];
 std::unordered_map<int, Request> EventBase::requestStatus;
 std::unordered_map<int, Response> EventBase::responseStatus;
+pthread_mutex_t EventBase::statusLocker = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<unsigned char> EventBase::fdEventClass[MAX_CLASS_HINT_FD];
+std::atomic<unsigned char> EventBase::fdInterest[MAX_INTEREST_FD];
+ThreadPool* EventBase::fsExecutor = nullptr;
+OverloadLimits EventBase::overloadLimits;
+ServeLimits EventBase::serveLimits;
+MemoryLimits EventBase::memoryLimits;
+std::atomic<long long> EventBase::requestMemory[MAX_ACCOUNTED_FD];
+std::atomic<long long> EventBase::responseMemory[MAX_ACCOUNTED_FD];
+std::atomic<long long> EventBase::bufferedBytes(0);
+std::string EventBase::overloadResponse = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+std::atomic<int> EventBase::activeConnNum(0);
+std::atomic<bool> EventBase::draining(false);
+
+EVENTCLASS EventBase::getFdEventClass(int fd) {
+    if (fd < 0 || fd >= MAX_CLASS_HINT_FD) {
+        return EVENT_CONTROL;
+    }
+    // Slots are zero-initialized, a connection never uses EVENT_ACCEPT so zero means no hint yet
+    unsigned char eventClass = fdEventClass[fd].load(std::memory_order_relaxed);
+    return eventClass == EVENT_ACCEPT ? EVENT_CONTROL : static_cast<EVENTCLASS>(eventClass);
+}
+
+void EventBase::setFdEventClass(int fd, EVENTCLASS eventClass) {
+    if (fd < 0 || fd >= MAX_CLASS_HINT_FD) {
+        return;
+    }
+    fdEventClass[fd].store(static_cast<unsigned char>(eventClass), std::memory_order_relaxed);
+}
+
+void EventBase::setFdFired(int fd) {
+    if (fd < 0 || fd >= MAX_INTEREST_FD) {
+        return;
+    }
+    fdInterest[fd].fetch_and(static_cast<unsigned char>(~INTEREST_ARMED));
+}
+
+void EventBase::rearmDroppedFd(int epollFd, int fd, bool send) {
+    bool out = send;
+    if (fd >= 0 && fd < MAX_INTEREST_FD) {
+        out = (fdInterest[fd].load() & INTEREST_OUT) != 0;
+    }
+    rearmConnFd(epollFd, fd, out);
+}
+
+void EventBase::addConnFd(int epollFd, int fd) {
+    if (fd >= 0 && fd < MAX_INTEREST_FD) {
+        fdInterest[fd].store(INTEREST_IN | INTEREST_ARMED);
+    }
+    Metrics::countSyscall(SYSCALL_EPOLL_CTL);
+    addWaitFd(epollFd, fd, true, true);
+}
+
+void EventBase::rearmConnFd(int epollFd, int fd, bool out) {
+    unsigned char interest = INTEREST_IN | INTEREST_ARMED | (out ? INTEREST_OUT : 0);
+    // Recorded before the call: the event may be reported, and the reactor clear the armed bit, before epoll_ctl returns
+    if (fd >= 0 && fd < MAX_INTEREST_FD && fdInterest[fd].exchange(interest) == interest) {
+        Metrics::countSyscall(SYSCALL_EPOLL_CTL_AVOIDED);
+        return;
+    }
+    Metrics::countSyscall(SYSCALL_EPOLL_CTL);
+    modifyWaitFd(epollFd, fd, true, true, out);
+}
+
+void EventBase::releaseConnFd(int epollFd, int fd) {
+    if (fd >= 0 && fd < MAX_INTEREST_FD && (fdInterest[fd].exchange(0) & INTEREST_ARMED) == 0) {
+        Metrics::countSyscall(SYSCALL_EPOLL_CTL_AVOIDED);
+        return;
+    }
+    Metrics::countSyscall(SYSCALL_EPOLL_CTL);
+    deleteWaitFd(epollFd, fd);
+}
+
+int EventBase::closeIdleConnections(int epollFd) {
+    int closedNum = 0;
+    for (int fd = 0; fd < MAX_INTEREST_FD; ++fd) {
+        // Waiting for reading only, with no request started and no response left to send. The interest is taken
+        // from the connection so that no event of it is dispatched anymore.
+        unsigned char interest = INTEREST_IN | INTEREST_ARMED;
+        if (fdInterest[fd].load(std::memory_order_relaxed) != interest || findRequest(fd) != nullptr || hasResponse(fd)) {
+            continue;
+        }
+        if (!fdInterest[fd].compare_exchange_strong(interest, INTEREST_IN)) {
+            continue;
+        }
+        closeConnection(epollFd, fd, SHUT_RDWR);
+        ++closedNum;
+    }
+    return closedNum;
+}
+
+void EventBase::chargeRequestMemory(int fd, long long bytes) {
+    if (fd < 0 || fd >= MAX_ACCOUNTED_FD) {
+        return;
+    }
+    long long previous = requestMemory[fd].exchange(bytes, std::memory_order_relaxed);
+    bufferedBytes.fetch_add(bytes - previous, std::memory_order_relaxed);
+}
+
+void EventBase::chargeResponseMemory(int fd, long long bytes) {
+    if (fd < 0 || fd >= MAX_ACCOUNTED_FD) {
+        return;
+    }
+    long long previous = responseMemory[fd].exchange(bytes, std::memory_order_relaxed);
+    bufferedBytes.fetch_add(bytes - previous, std::memory_order_relaxed);
+}
+
+long long EventBase::getConnectionMemory(int fd) {
+    if (fd < 0 || fd >= MAX_ACCOUNTED_FD) {
+        return 0;
+    }
+    return requestMemory[fd].load(std::memory_order_relaxed) + responseMemory[fd].load(std::memory_order_relaxed);
+}
+
+long long EventBase::getLargestConnectionBytes() {
+    long long largest = 0;
+    for (int fd = 0; fd < MAX_ACCOUNTED_FD; ++fd) {
+        long long bytes = requestMemory[fd].load(std::memory_order_relaxed) + responseMemory[fd].load(std::memory_order_relaxed);
+        if (bytes > largest) {
+            largest = bytes;
+        }
+    }
+    return largest;
+}
+
+Request& EventBase::getRequest(int fd) {
+    if (fd >= 0 && fd < MAX_STATE_FD) {
+        if (requestSlots[fd] == nullptr) {
+            requestSlots[fd] = new Request();
+        }
+        return *requestSlots[fd];
+    }
+    pthread_mutex_lock(&statusLocker);
+    Request& request = requestStatus[fd];
+    pthread_mutex_unlock(&statusLocker);
+    return request;
+}
+
+Request* EventBase::findRequest(int fd) {
+    if (fd >= 0 && fd < MAX_STATE_FD) {
+        return requestSlots[fd];
+    }
+    pthread_mutex_lock(&statusLocker);
+    std::unordered_map<int, Request>::iterator it = requestStatus.find(fd);
+    Request* request = (it == requestStatus.end()) ? nullptr : &it->second;
+    pthread_mutex_unlock(&statusLocker);
+    return request;
+}
+
+void EventBase::eraseRequest(int fd) {
+    if (fd >= 0 && fd < MAX_STATE_FD) {
+        delete requestSlots[fd];
+        requestSlots[fd] = nullptr;
+    } else {
+        pthread_mutex_lock(&statusLocker);
+        requestStatus.erase(fd);
+        pthread_mutex_unlock(&statusLocker);
+    }
+    chargeRequestMemory(fd, 0);
+}
+
+Response& EventBase::getResponse(int fd) {
+    if (fd >= 0 && fd < MAX_STATE_FD) {
+        if (responseSlots[fd] == nullptr) {
+            responseSlots[fd] = new Response();
+        }
+        return *responseSlots[fd];
+    }
+    pthread_mutex_lock(&statusLocker);
+    Response& response = responseStatus[fd];
+    pthread_mutex_unlock(&statusLocker);
+    return response;
+}
+
+bool EventBase::hasResponse(int fd) {
+    if (fd >= 0 && fd < MAX_STATE_FD) {
+        return responseSlots[fd] != nullptr;
+    }
+    pthread_mutex_lock(&statusLocker);
+    bool found = responseStatus.find(fd) != responseStatus.end();
+    pthread_mutex_unlock(&statusLocker);
+    return found;
+}
+
+void EventBase::eraseResponse(int fd) {
+    if (fd >= 0 && fd < MAX_STATE_FD) {
+        delete responseSlots[fd];
+        responseSlots[fd] = nullptr;
+    } else {
+        pthread_mutex_lock(&statusLocker);
+        responseStatus.erase(fd);
+        pthread_mutex_unlock(&statusLocker);
+    }
+    chargeResponseMemory(fd, 0);
+}
+
+void EventBase::resetConnState(int fd) {
+    eraseRequest(fd);
+    eraseResponse(fd);
+    setFdEventClass(fd, EVENT_CONTROL);
+    if (fd >= 0 && fd < MAX_INTEREST_FD) {
+        fdInterest[fd].store(0);
+    }
+}
+
+void EventBase::closeConnection(int epollFd, int fd, int how) {
+    releaseConnFd(epollFd, fd);
+    RateLimiter::releaseConnection(fd);
+    shutdown(fd, how);
+    if (hasResponse(fd)) {
+        closeResponseBody(getResponse(fd));
+    }
+    // Before the close: afterwards the descriptor may already be the one of a new connection
+    resetConnState(fd);
+    close(fd);
+    activeConnNum.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventBase::setFsExecutor(ThreadPool* executor) {
+    fsExecutor = executor;
+}
+
+void EventBase::submitFsTask(HandleFs* task) {
+    if (fsExecutor == nullptr || fsExecutor->appendEvent(task, "HandleFs", EVENT_BLOCKING) != 0) {
+        task->process();
+        delete task;
+    }
+}
+
+void EventBase::setOverloadLimits(const OverloadLimits& limits) {
+    overloadLimits = limits;
+    overloadResponse = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " + std::to_string(limits.retryAfterSec) +
+                       "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+}
+
+void EventBase::sendOverloadResponse(int fd) {
+    send(fd, overloadResponse.c_str(), overloadResponse.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    Metrics::countRequest(ROUTE_OTHER, 503);
+}
+
+void EventBase::sendRefusal(int fd, HTTPSTATUS status, int retryAfterSec) {
+    ResponseHead head;
+    head.start(status);
+    if (retryAfterSec > 0) {
+        head.addHeader("Retry-After", std::to_string(retryAfterSec));
+    }
+    head.addContentLength(0);
+    head.finish(false);
+    send(fd, head.data(), head.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    Metrics::countRequest(ROUTE_OTHER, ResponseHead::getStatusCode(status));
+}
 
 AcceptConn::AcceptConn(int listenFd, int epollFd) : m_listenFd(listenFd), m_epollFd(epollFd) {}
 
 void AcceptConn::process() {
-    // accept a connection
-    clientAddrLen = sizeof(clientAddr);
-    accetpFd = accept(m_listenFd, (sockaddr*)&clientAddr, &clientAddrLen);
-    if (accetpFd == -1) {
-        std::cout << "[error] Failed to accept new connection" << std::endl;
-        return;
+    // The listening socket is edge-triggered, connections that arrived together are all accepted now. Once the
+    // server drains, the connections of the queue are left to the server that replaces it.
+    while (!isDraining()) {
+        clientAddrLen = sizeof(clientAddr);
+        accetpFd = accept(m_listenFd, (sockaddr*)&clientAddr, &clientAddrLen);
+        if (accetpFd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cout << "[error] Failed to accept new connection" << std::endl;
+            }
+            return;
+        }
+
+        if (activeConnNum.load(std::memory_order_relaxed) >= overloadLimits.maxConnections) {
+            std::cout << "[error] Too many connections, answering new connection " << accetpFd << " with 503" << std::endl;
+            sendOverloadResponse(accetpFd);
+            close(accetpFd);
+            continue;
+        }
+
+        // Limits of the client address: denied ranges and clients with too many connections are refused
+        RATEVERDICT verdict = RateLimiter::acquireConnection(accetpFd, clientAddr);
+        if (verdict != RATE_ACCEPTED) {
+            std::cout << "[error] " << (verdict == RATE_DENIED ? "Address denied" : "Too many connections from the address") << ", answering new connection " << accetpFd
+                      << " with " << (verdict == RATE_DENIED ? 403 : 429) << std::endl;
+            sendRefusal(accetpFd, verdict == RATE_DENIED ? HTTP_FORBIDDEN : HTTP_TOO_MANY_REQUESTS, verdict == RATE_DENIED ? 0 : 1);
+            close(accetpFd);
+            continue;
+        }
+        activeConnNum.fetch_add(1, std::memory_order_relaxed);
+
+        // Setting the connection to non-blocking
+        setNonBlocking(accetpFd);
+
+        // The descriptor may be reused from a closed connection, nothing of its state must remain
+        resetConnState(accetpFd);
+        Trace::beginConnection(accetpFd);
+
+        // The connection is added to the listener, and the client sockets are both set to EPOLLET and EPOLLONESHOT.
+        addConnFd(m_epollFd, accetpFd);
+        std::cout << "[info] Accepting new connections " << accetpFd << " successes" << std::endl;
     }
+}
 
-    // Setting the connection to non-blocking
-    setNonBlocking(accetpFd);
+bool AcceptConn::reject() {
+    while (!isDraining()) {
+        clientAddrLen = sizeof(clientAddr);
+        accetpFd = accept(m_listenFd, (sockaddr*)&clientAddr, &clientAddrLen);
+        if (accetpFd == -1) {
+            return true;
+        }
+        std::cout << "[error] Queue delay too high, answering new connection " << accetpFd << " with 503" << std::endl;
+        sendOverloadResponse(accetpFd);
+        close(accetpFd);
+    }
+    return true;
+}
 
-    // The connection is added to the listener, and the client sockets are both set to EPOLLET and EPOLLONESHOT.
-    addWaitFd(m_epollFd, accetpFd, true, true);
-    std::cout << "[info] Accepting new connections " << accetpFd << " successes" << std::endl;
+// Reads a whole small file, a file that shrank since its fstat is sent with its new length
+static bool readSmallFile(int fileFd, long long fileLen, std::string& body) {
+    body.resize(fileLen);
+    long long readLen = 0;
+    while (readLen < fileLen) {
+        ssize_t ret = read(fileFd, &body[readLen], fileLen - readLen);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1) {
+            return false;
+        }
+        if (ret == 0) {
+            break;
+        }
+        readLen += ret;
+    }
+    body.resize(readLen);
+    return true;
+}
+
+HandleFs::HandleFs(int clientFd, int epollFd, FSOPERATION operation, const std::string &name, bool rearmOut)
+    : m_clientFd(clientFd), m_epollFd(epollFd), m_operation(operation), m_name(name), m_rearmOut(rearmOut) {}
+
+void HandleFs::process() {
+    int ret = 0;
+
+    if (m_operation == FS_LIST) {
+        // The rows are rendered from the index while the page is sent, a batch at a time. Without the index they
+        // come from a walk of the storage, in the order of its directories.
+        Response& response = getResponse(m_clientFd);
+        std::string head;
+        HandleSend::getFileListTemplate(head, response.getListingRef().tail);
+        response.getListingRef().walk = !FileIndex::isReady();
+        char size[20];
+        int sizeLen = snprintf(size, sizeof(size), "%zx\r\n", head.size());
+        response.getMsgBodyRef().assign(size, sizeLen);
+        response.getMsgBodyRef() += head + "\r\n";
+        response.setBodyType(CHUNKED_TYPE);
+    } else if (m_operation == FS_OPEN) {
+        Response& response = getResponse(m_clientFd);
+        int fileFd = Storage::openFile(m_name, O_RDONLY);
+        struct stat fileStat;
+        if (fileFd != -1 && fstat(fileFd, &fileStat) == 0) {
+            if (fileStat.st_size <= serveLimits.smallFileMax) {
+                // The file is sent from memory with its header, the response keeps no descriptor
+                ret = readSmallFile(fileFd, fileStat.st_size, response.getMsgBodyRef()) ? 0 : -1;
+                response.setMsgBodyLen(response.getMsgBody().size());
+                response.setReprDigest(formatCrc32cDigest(Crc32c::compute(response.getMsgBody().data(), response.getMsgBody().size())));
+                response.setBodyType(HTML_TYPE);
+                close(fileFd);
+                fileFd = -1;
+            } else {
+                if (fileStat.st_size >= serveLimits.sequentialFileMin) {
+                    posix_fadvise(fileFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                    posix_fadvise(fileFd, 0, serveLimits.readaheadLen, POSIX_FADV_WILLNEED);
+                }
+                response.setMsgBodyLen(fileStat.st_size);
+                response.setBodyType(FILE_TYPE);
+                uint32_t crc;
+                if (Storage::getFileCrc32c(fileFd, crc)) {
+                    response.setReprDigest(formatCrc32cDigest(crc));
+                }
+            }
+        } else {
+            if (fileFd != -1) {
+                close(fileFd);
+                fileFd = -1;
+            }
+            ret = -1;
+        }
+        response.setFileMsgFd(fileFd);
+    } else if (m_operation == FS_UNLINK) {
+        ret = Storage::unlinkFile(m_name);
+        if (ret == 0) {
+            FileIndex::remove(m_name);
+            NameSearch::remove(m_name);
+        }
+    } else if (m_operation == FS_APPEND || m_operation == FS_COMMIT) {
+        if (!m_writer->write(m_data.data(), m_data.size())) {
+            std::cout << "[error] client (computing) " << m_clientFd << " The file " << m_name << " could not be written (errno = " << errno << ")" << std::endl;
+            ret = -1;
+        }
+        if (m_operation == FS_COMMIT) {
+            // The response of the upload or of the PUT is already prepared, a digest mismatch turns it into an error
+            if (ret == 0 && !m_writer->commit()) {
+                if (errno == EBADMSG) {
+                    std::cout << "[error] client (computing) " << m_clientFd << " The file " << m_name << " does not match its digest, it is refused" << std::endl;
+                    ret = 400;
+                } else {
+                    std::cout << "[error] client (computing) " << m_clientFd << " The file " << m_name << " could not be stored (errno = " << errno << ")" << std::endl;
+                    ret = -1;
+                }
+            }
+            if (m_writer->hasCrc32c()) {
+                getResponse(m_clientFd).setReprDigest(formatCrc32cDigest(m_writer->getCrc32c()));
+            }
+            // The indexes only learn of the files that were stored
+            if (ret == 0) {
+                FileIndex::update(m_name, m_writer->hasCrc32c() ? m_writer->getCrc32c() : 0);
+                NameSearch::add(m_name);
+            }
+        }
+    } else if (m_operation == FS_ARCHIVE) {
+        // On failure the result is the HTTP status and the body its JSON message
+        Response& response = getResponse(m_clientFd);
+        ArchiveQuery query;
+        std::string error;
+        unsigned long bodyLen = 0;
+        if (!Archive::parseQuery(m_name, query, error)) {
+            ret = 400;
+        } else {
+            ret = Archive::build(query, response.getBodyPartsRef(), bodyLen, error);
+        }
+        if (ret == 0) {
+            response.setMsgBodyLen(bodyLen);
+            Archive::openParts(response.getBodyPartsRef(), 0);
+        } else {
+            response.setMsgBody(error);
+        }
+    } else if (m_operation == FS_ARCHIVE_OPEN) {
+        Response& response = getResponse(m_clientFd);
+        if (!Archive::openParts(response.getBodyPartsRef(), response.getCurPart())) {
+            std::cout << "[error] client (computing) " << m_clientFd << " The file " << response.getBodyPartsRef()[response.getCurPart()].fileName << " of the archive could not be opened (errno = " << errno << ")" << std::endl;
+            ret = -1;
+        }
+    }
+
+    // Writing a chunk of a body does not produce a response: the connection goes back to reading
+    if (m_operation != FS_APPEND) {
+        getResponse(m_clientFd).setFsDone(true);
+        getResponse(m_clientFd).setFsResult(ret);
+    }
+
+    rearmConnFd(m_epollFd, m_clientFd, m_rearmOut);
 }
 
 HandleRecv::HandleRecv(int clientFd, int epollFd) : m_clientFd(clientFd), m_epollFd(epollFd) {}
 
 void HandleRecv::process() {
     std::cout << "[info] Starting client processing " << m_clientFd << " A HandleRecv event of the" << std::endl;
-    requestStatus[m_clientFd];
+    getRequest(m_clientFd);
 
     char buf[2048];
     int recvLen = 0;
 
+    // Filesystem call to hand to the executor once this event no longer touches the connection state
+    HandleFs* fsTask = nullptr;
+
     while (1) {
         recvLen = recv(m_clientFd, buf, 2048, 0);
 
         if (recvLen == 0) {
             std::cout << "[info] client (computing) " << m_clientFd << " Close connection" << std::endl;
-            requestStatus[m_clientFd].setStatus(HANDLE_ERROR);
+            getRequest(m_clientFd).setStatus(HANDLE_ERROR);
             break;
         }
 
         if (recvLen == -1) {
             if (errno != EAGAIN) {
-                requestStatus[m_clientFd].setStatus(HANDLE_ERROR);
+                getRequest(m_clientFd).setStatus(HANDLE_ERROR);
                 std::cout << "[error] Returned when receiving data -1 (errno = " << errno << ")" << std::endl;
                 break;
             }
-            modifyWaitFd(m_epollFd, m_clientFd, true, true, false);
+            // Reads are dispatched before writes, keep the write interest of a response that is still waiting
+            rearmConnFd(m_epollFd, m_clientFd, hasResponse(m_clientFd));
             break;
         }
 
-        requestStatus[m_clientFd].recvMsg.append(buf, recvLen);
+        Metrics::addBytesIn(recvLen);
+        if (getRequest(m_clientFd).getStartTime() == 0) {
+            getRequest(m_clientFd).setStartTime(getMonotonicNs());
+            Trace::record(m_clientFd, TRACE_FIRST_READ, 0, recvLen);
+            // Each request takes a token of its client when its first byte arrives
+            int retryAfterSec = 0;
+            if (!RateLimiter::allowRequest(m_clientFd, retryAfterSec)) {
+                std::cout << "[error] client (computing) " << m_clientFd << " is over its request rate, answering with 429" << std::endl;
+                refuseRequest(HTTP_TOO_MANY_REQUESTS, retryAfterSec);
+                break;
+            }
+        }
+        getRequest(m_clientFd).recvMsg.append(buf, recvLen);
+
+        if (!checkMemory()) {
+            break;
+        }
 
         std::string::size_type endIndex = 0;
 
-        if (requestStatus[m_clientFd].getStatus() == HANDLE_INIT) {
-            endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");
+        if (getRequest(m_clientFd).getStatus() == HANDLE_INIT) {
+            endIndex = getRequest(m_clientFd).recvMsg.find("\r\n");
 
             if (endIndex != std::string::npos) {
-                requestStatus[m_clientFd].setRequestLine(requestStatus[m_clientFd].recvMsg.substr(0, endIndex + 2));
-                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);
-                requestStatus[m_clientFd].setStatus(HANDLE_HEAD);
+                getRequest(m_clientFd).setRequestLine(getRequest(m_clientFd).recvMsg.substr(0, endIndex + 2));
+                getRequest(m_clientFd).recvMsg.erase(0, endIndex + 2);
+                getRequest(m_clientFd).setHeaderLen(endIndex + 2);
+                getRequest(m_clientFd).setStatus(HANDLE_HEAD);
                 std::cout << "[info] Processing Clients " << m_clientFd << " The request line is completed" << std::endl;
             }
         }
 
-        if (requestStatus[m_clientFd].getStatus() == HANDLE_HEAD) {
+        if (getRequest(m_clientFd).getStatus() == HANDLE_HEAD) {
             std::string curLine;
 
             while (1) {
-                endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");
+                endIndex = getRequest(m_clientFd).recvMsg.find("\r\n");
                 if (endIndex == std::string::npos) {
                     break;
                 }
 
-                curLine = requestStatus[m_clientFd].recvMsg.substr(0, endIndex + 2);
-                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);
+                curLine = getRequest(m_clientFd).recvMsg.substr(0, endIndex + 2);
+                getRequest(m_clientFd).recvMsg.erase(0, endIndex + 2);
+                getRequest(m_clientFd).setHeaderLen(getRequest(m_clientFd).getHeaderLen() + curLine.size());
 
                 if (curLine == "\r\n") {
-                    requestStatus[m_clientFd].setStatus(HANDLE_BODY);
-                    if (requestStatus[m_clientFd].getHeaders().find("Content-Type") != requestStatus[m_clientFd].getHeaders().end() &&
-                        requestStatus[m_clientFd].getHeaders().at("Content-Type") == "multipart/form-data") {
-                        requestStatus[m_clientFd].setFileMsgStatus(FILE_BEGIN_FLAG);
+                    getRequest(m_clientFd).setStatus(HANDLE_BODY);
+                    if (getRequest(m_clientFd).getHeaders().find("Content-Type") != getRequest(m_clientFd).getHeaders().end() &&
+                        getRequest(m_clientFd).getHeaders().at("Content-Type") == "multipart/form-data") {
+                        getRequest(m_clientFd).setFileMsgStatus(FILE_BEGIN_FLAG);
                     }
+                    Trace::record(m_clientFd, TRACE_HEADER_DONE);
                     std::cout << "[info] Processing Clients " << m_clientFd << " The message header of the" << std::endl;
-                    if (requestStatus[m_clientFd].getRequestMethod() == "POST") {
+                    if (getRequest(m_clientFd).getRequestMethod() == "POST") {
                         std::cout << "[info] client (computing) " << m_clientFd << " Send a POST request to start processing the request body" << std::endl;
                     }
                     break;
                 }
 
-                requestStatus[m_clientFd].addHeaderOpt(curLine);
+                getRequest(m_clientFd).addHeaderOpt(curLine);
             }
         }
 
-        if (requestStatus[m_clientFd].getStatus() == HANDLE_BODY) {
-            if (requestStatus[m_clientFd].getRequestMethod() == "GET") {
-                responseStatus[m_clientFd].setBodyFileName(requestStatus[m_clientFd].getRequestResource());
-                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-                requestStatus[m_clientFd].setStatus(HANDLE_COMPLETE);
+        // The bytes that are not yet a full line are counted too, a header without its end cannot grow forever
+        if ((getRequest(m_clientFd).getStatus() == HANDLE_INIT || getRequest(m_clientFd).getStatus() == HANDLE_HEAD) &&
+            getRequest(m_clientFd).getHeaderLen() + static_cast<long long>(getRequest(m_clientFd).recvMsg.size()) > memoryLimits.maxHeaderBytes) {
+            std::cout << "[error] client (computing) " << m_clientFd << " sent more than " << memoryLimits.maxHeaderBytes << " bytes of request line and headers, answering with 431" << std::endl;
+            refuseRequest(HTTP_HEADER_TOO_LARGE);
+            break;
+        }
+
+        if (getRequest(m_clientFd).getStatus() == HANDLE_BODY) {
+            if (getRequest(m_clientFd).getRequestMethod() == "GET") {
+                prepareResponse(getRequest(m_clientFd).getRequestResource());
+                setFdEventClass(m_clientFd, EVENT_CONTROL);
+                getRequest(m_clientFd).setStatus(HANDLE_COMPLETE);
                 std::cout << "[info] client (computing) " << m_clientFd << " Sending a GET request, the requested resource has been composed into a Response Write event waiting to send data." << std::endl;
                 break;
             }
 
-            if (requestStatus[m_clientFd].getRequestMethod() == "POST") {
-                std::string::size_type beginSize = requestStatus[m_clientFd].recvMsg.size();
-                if (requestStatus[m_clientFd].getHeaders().find("Content-Type") != requestStatus[m_clientFd].getHeaders().end() &&
-                    requestStatus[m_clientFd].getHeaders().at("Content-Type") == "multipart/form-data") {
-                    if (requestStatus[m_clientFd].getFileMsgStatus() == FILE_BEGIN_FLAG) {
+            if (getRequest(m_clientFd).getRequestMethod() == "POST") {
+                std::string::size_type beginSize = getRequest(m_clientFd).recvMsg.size();
+                if (getRequest(m_clientFd).getHeaders().find("Content-Type") != getRequest(m_clientFd).getHeaders().end() &&
+                    getRequest(m_clientFd).getHeaders().at("Content-Type") == "multipart/form-data") {
+                    if (getRequest(m_clientFd).getFileMsgStatus() == FILE_BEGIN_FLAG) {
                         std::cout << "[info] client (computing) " << m_clientFd << " The POST request is used to upload a file, looking for the file header start boundary..." << std::endl;
-                        endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");
+                        endIndex = getRequest(m_clientFd).recvMsg.find("\r\n");
 
                         if (endIndex != std::string::npos) {
-                            std::string flagStr = requestStatus[m_clientFd].recvMsg.substr(0, endIndex);
+                            std::string flagStr = getRequest(m_clientFd).recvMsg.substr(0, endIndex);
 
-                            if (flagStr == "--" + requestStatus[m_clientFd].getHeaders().at("boundary")) {
-                                requestStatus[m_clientFd].setFileMsgStatus(FILE_HEAD);
-                                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);
+                            if (flagStr == "--" + getRequest(m_clientFd).getHeaders().at("boundary")) {
+                                getRequest(m_clientFd).setFileMsgStatus(FILE_HEAD);
+                                getRequest(m_clientFd).recvMsg.erase(0, endIndex + 2);
                                 std::cout << "[info] client (computing) " << m_clientFd << " The header start boundary is found in the body of the POST request for the file header being processed..." << std::endl;
                             } else {
-                                responseStatus[m_clientFd].setBodyFileName("/redirect");
-                                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-                                requestStatus[m_clientFd].setStatus(HANDLE_COMPLETE);
+                                prepareResponse("/redirect");
+                                getRequest(m_clientFd).setStatus(HANDLE_COMPLETE);
                                 std::cout << "[error] client (computing) " << m_clientFd << " in the body of a POST request that does not find a file header start boundary, add a Redirect Response Write event to redirect the client to the file list" << std::endl;
                                 break;
                             }
                         }
                     }
 
-                    if (requestStatus[m_clientFd].getFileMsgStatus() == FILE_HEAD) {
+                    if (getRequest(m_clientFd).getFileMsgStatus() == FILE_HEAD) {
                         std::string strLine;
                         while (1) {
-                            endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");
+                            endIndex = getRequest(m_clientFd).recvMsg.find("\r\n");
                             if (endIndex != std::string::npos) {
-                                strLine = requestStatus[m_clientFd].recvMsg.substr(0, endIndex + 2);
-                                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);
+                                strLine = getRequest(m_clientFd).recvMsg.substr(0, endIndex + 2);
+                                getRequest(m_clientFd).recvMsg.erase(0, endIndex + 2);
 
                                 if (strLine == "\r\n") {
-                                    requestStatus[m_clientFd].setFileMsgStatus(FILE_CONTENT);
+                                    getRequest(m_clientFd).setFileMsgStatus(FILE_CONTENT);
+                                    getRequest(m_clientFd).setUploadWriter(std::make_shared<StorageWriter>(getRequest(m_clientFd).getRecvFileName(), true, getRequest(m_clientFd).getContentLength()));
+                                    uint32_t expectedCrc;
+                                    if (parseCrc32cDigest(getRequest(m_clientFd).getUploadDigest(), expectedCrc)) {
+                                        getRequest(m_clientFd).getUploadWriter()->setExpectedCrc32c(expectedCrc);
+                                    }
+                                    setFdEventClass(m_clientFd, EVENT_BULK);
                                     std::cout << "[info] client (computing) " << m_clientFd << " The file header in the body of the POST request was processed successfully, and the contents of the file are being received and saved..." << std::endl;
                                     break;
                                 }
+                                // Digest of the file given in the headers of its part
+                                if (strLine.compare(0, 12, "Repr-Digest:") == 0 || strLine.compare(0, 15, "Content-Digest:") == 0) {
+                                    getRequest(m_clientFd).setUploadDigest(strLine.substr(strLine.find(':') + 1));
+                                    continue;
+                                }
                                 endIndex = strLine.find("filename");
                                 if (endIndex != std::string::npos) {
                                     strLine.erase(0, endIndex + std::string("filename=\"").size());
                                     for (int i = 0; strLine[i] != '\"'; ++i) {
-                                        requestStatus[m_clientFd].setRecvFileName(requestStatus[m_clientFd].getRecvFileName() + strLine[i]);
+                                        getRequest(m_clientFd).setRecvFileName(getRequest(m_clientFd).getRecvFileName() + strLine[i]);
                                     }
-                                    requestStatus[m_clientFd].setRecvFileName(removeSpaces(requestStatus[m_clientFd].getRecvFileName()));
-                                    std::cout << "[info] client (computing) " << m_clientFd << " to find the file name in the body of the POST request for the " << requestStatus[m_clientFd].getRecvFileName() << " The header of the document continues to be processed..." << std::endl;
+                                    getRequest(m_clientFd).setRecvFileName(removeSpaces(getRequest(m_clientFd).getRecvFileName()));
+                                    std::cout << "[info] client (computing) " << m_clientFd << " to find the file name in the body of the POST request for the " << getRequest(m_clientFd).getRecvFileName() << " The header of the document continues to be processed..." << std::endl;
                                 }
                             } else {
                                 break;
@@ -168,368 +740,743 @@ void HandleRecv::process() {
                         }
                     }
 
-                    if (requestStatus[m_clientFd].getFileMsgStatus() == FILE_CONTENT) {
-                        std::ofstream ofs("filedir/" + requestStatus[m_clientFd].getRecvFileName(), std::ios::out | std::ios::app | std::ios::binary);
-                        if (!ofs) {
-                            std::cout << "[error] client (computing) " << m_clientFd << " The file to be saved in the body of the POST request failed to open and is being reopened..." << std::endl;
-                            break;
+                    if (getRequest(m_clientFd).getFileMsgStatus() == FILE_CONTENT) {
+                        std::string fileData;
+                        if (extractFileContent(getRequest(m_clientFd).recvMsg, getRequest(m_clientFd).getHeaders().at("boundary"), fileData)) {
+                            std::cout << "[info] client (computing) " << m_clientFd << " The file data in the body of the POST request is received and saved." << std::endl;
+                            getRequest(m_clientFd).setFileMsgStatus(FILE_COMPLETE);
                         }
 
-                        while (1) {
-                            int saveLen = requestStatus[m_clientFd].recvMsg.size();
-                            if (saveLen == 0) {
-                                break;
-                            }
-                            endIndex = requestStatus[m_clientFd].recvMsg.find('\r');
-                                        
-                            if (endIndex != std::string::npos) {
-                                int boundarySecLen = requestStatus[m_clientFd].getHeaders().at("boundary").size() + 8;
-                                if (requestStatus[m_clientFd].recvMsg.size() - endIndex >= boundarySecLen) {
-                                    if (requestStatus[m_clientFd].recvMsg.substr(endIndex, boundarySecLen) == "\r\n--" + requestStatus[m_clientFd].getHeaders().at("boundary") + "--\r\n") {
-                                        if (endIndex == 0) {
-                                            std::cout << "[info] client (computing) " << m_clientFd << " The file data in the body of the POST request is received and saved." << std::endl;
-                                            requestStatus[m_clientFd].setFileMsgStatus(FILE_COMPLETE);
-                                            break;
-                                        }
-                                        saveLen = endIndex;
-                                    } else {
-                                        endIndex = requestStatus[m_clientFd].recvMsg.find('\r', endIndex + 1);
-                                        if (endIndex != std::string::npos) {
-                                            saveLen = endIndex;
-                                        }
-                                    }
-                                } else {
-                                    if (endIndex == 0) {
-                                        break;
-                                    }
-                                    saveLen = endIndex;
-                                }
-                            }
-                            ofs.write(requestStatus[m_clientFd].recvMsg.c_str(), saveLen);
-                            requestStatus[m_clientFd].recvMsg.erase(0, saveLen);
+                        // The data is gathered in the buffer of the writer, and written by the filesystem executor
+                        // once the buffer is full, with the rest of the data of this read. The executor re-arms the
+                        // connection afterwards: for reading while the upload goes on, for writing the redirect once
+                        // it is complete. The last task commits the file, even without data.
+                        bool complete = getRequest(m_clientFd).getFileMsgStatus() == FILE_COMPLETE;
+                        fileData.erase(0, getRequest(m_clientFd).getUploadWriter()->buffer(fileData.data(), fileData.size()));
+                        if (getRequest(m_clientFd).getUploadWriter()->isBufferFull() || complete) {
+                            fsTask = new HandleFs(m_clientFd, m_epollFd, complete ? FS_COMMIT : FS_APPEND, getRequest(m_clientFd).getRecvFileName(), complete);
+                            fsTask->setData(fileData);
+                            fsTask->setWriter(getRequest(m_clientFd).getUploadWriter());
                         }
-                        ofs.close();
                     }
 
-                    if (requestStatus[m_clientFd].getFileMsgStatus() == FILE_COMPLETE) {
-                        responseStatus[m_clientFd].setBodyFileName("/redirect");
-                        modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-                        requestStatus[m_clientFd].setStatus(HANDLE_COMPLETE);
+                    if (getRequest(m_clientFd).getFileMsgStatus() == FILE_COMPLETE) {
+                        prepareResponse("/redirect");
+                        setFdEventClass(m_clientFd, EVENT_CONTROL);
+                        getRequest(m_clientFd).setStatus(HANDLE_COMPLETE);
                         std::cout << "[info] client (computing) " << m_clientFd << " The POST request body is processed, a Response write event is added, and a redirect message is sent to refresh the file list." << std::endl;
                         break;
                     }
+
+                    if (fsTask != nullptr) {
+                        // Wait for the write to finish before reading more of the body
+                        break;
+                    }
                 } else {
-                    responseStatus[m_clientFd].setBodyFileName("/redirect");
-                    modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-                    requestStatus[m_clientFd].setStatus(HANDLE_COMPLETE);
+                    prepareResponse("/redirect");
+                    getRequest(m_clientFd).setStatus(HANDLE_COMPLETE);
                     std::cout << "[error] client (computing) " << m_clientFd << "If you receive data in a POST request that cannot be processed, add a Response write event that returns a message redirecting to the file list." << std::endl;
                     break;
                 }
             }
 
-            if (requestStatus[m_clientFd].getRequestMethod() == "PUT") {
-                std::string::size_type beginSize = requestStatus[m_clientFd].recvMsg.size();
-                responseStatus[m_clientFd].setBodyFileName(requestStatus[m_clientFd].getRequestResource());
-                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-                requestStatus[m_clientFd].setStatus(HANDLE_BODY);
-                std::cout << "[info] client (computing) " << m_clientFd << " Sending a PUT request, the requested resource has been composed into a Response Write event waiting to receive data." << std::endl;
-                break;
+            if (getRequest(m_clientFd).getRequestMethod() == "PUT") {
+                // The body is written as it arrives, like the file of an upload, and replaces the file once complete.
+                // Only the buffer of the writer is held in memory.
+                if (getRequest(m_clientFd).getUploadWriter() == nullptr) {
+                    // The response answers any other resource without writing, the empty name is never stored
+                    if (getRequest(m_clientFd).getRequestResource().compare(0, 5, "/put/") == 0) {
+                        getRequest(m_clientFd).setRecvFileName(getRequest(m_clientFd).getRequestResource().substr(5));
+                    }
+                    getRequest(m_clientFd).setUploadWriter(std::make_shared<StorageWriter>(getRequest(m_clientFd).getRecvFileName(), false, getRequest(m_clientFd).getContentLength()));
+                    uint32_t expectedCrc;
+                    if (parseCrc32cDigest(getDigestField(getRequest(m_clientFd).getHeaders()), expectedCrc)) {
+                        getRequest(m_clientFd).getUploadWriter()->setExpectedCrc32c(expectedCrc);
+                    }
+                    setFdEventClass(m_clientFd, EVENT_BULK);
+                }
+
+                // What follows the body belongs to the next request
+                std::string::size_type bodyLen = std::min<unsigned long long>(getRequest(m_clientFd).recvMsg.size(),
+                                                                             getRequest(m_clientFd).getContentLength() - getRequest(m_clientFd).getMsgBodyRecvLen());
+                std::string bodyData = getRequest(m_clientFd).recvMsg.substr(0, bodyLen);
+                getRequest(m_clientFd).recvMsg.erase(0, bodyLen);
+                getRequest(m_clientFd).setMsgBodyRecvLen(getRequest(m_clientFd).getMsgBodyRecvLen() + bodyLen);
+
+                // Written by the filesystem executor once the buffer of the writer is full, the last task commits the file
+                bool complete = getRequest(m_clientFd).getMsgBodyRecvLen() >= getRequest(m_clientFd).getContentLength();
+                bodyData.erase(0, getRequest(m_clientFd).getUploadWriter()->buffer(bodyData.data(), bodyData.size()));
+                if (getRequest(m_clientFd).getUploadWriter()->isBufferFull() || complete) {
+                    fsTask = new HandleFs(m_clientFd, m_epollFd, complete ? FS_COMMIT : FS_APPEND, getRequest(m_clientFd).getRecvFileName(), complete);
+                    fsTask->setData(bodyData);
+                    fsTask->setWriter(getRequest(m_clientFd).getUploadWriter());
+                }
+
+                if (complete) {
+                    prepareResponse(getRequest(m_clientFd).getRequestResource());
+                    setFdEventClass(m_clientFd, EVENT_CONTROL);
+                    getRequest(m_clientFd).setStatus(HANDLE_COMPLETE);
+                    std::cout << "[info] client (computing) " << m_clientFd << " Sending a PUT request, the requested resource has been composed into a Response Write event waiting to receive data." << std::endl;
+                    break;
+                }
+
+                if (fsTask != nullptr) {
+                    // Wait for the write to finish before reading more of the body
+                    break;
+                }
             }
         }
     }
 
-    if (requestStatus[m_clientFd].getStatus() == HANDLE_COMPLETE) {
+    if (getRequest(m_clientFd).getStatus() == HANDLE_COMPLETE) {
         std::cout << "[info] client (computing) " << m_clientFd << " request message was processed successfully" << std::endl;
-        requestStatus.erase(m_clientFd);
-    } else if (requestStatus[m_clientFd].getStatus() == HANDLE_ERROR) {
+        eraseRequest(m_clientFd);
+        // Sent only once the request is erased: the send re-arms the connection, and the next request can then be
+        // read by another worker right away. The socket is almost always writable, so the response is written now
+        // rather than after a re-arm for writing. A pending append re-arms the connection from the filesystem executor
+        if (fsTask == nullptr) {
+            HandleSend send(m_clientFd, m_epollFd);
+            send.process();
+        }
+    } else if (getRequest(m_clientFd).getStatus() == HANDLE_ERROR) {
         std::cout << "[error] Client " << m_clientFd << " request message processing fails, closing the connection" << std::endl;
-        deleteWaitFd(m_epollFd, m_clientFd);
-        shutdown(m_clientFd, SHUT_RDWR);
-        close(m_clientFd);
-        requestStatus.erase(m_clientFd);
+        closeConnection(m_epollFd, m_clientFd, SHUT_RDWR);
+    }
+
+    if (fsTask != nullptr) {
+        submitFsTask(fsTask);
+    }
+}
+
+bool HandleRecv::checkMemory() {
+    Request& request = getRequest(m_clientFd);
+    chargeRequestMemory(m_clientFd, getRequestMemory(request));
+
+    bool inBody = request.getStatus() == HANDLE_BODY;
+    if (inBody && static_cast<long long>(request.recvMsg.size()) > memoryLimits.maxBodyBytes) {
+        std::cout << "[error] client (computing) " << m_clientFd << " buffered more than " << memoryLimits.maxBodyBytes << " bytes of request body, answering with 413" << std::endl;
+        refuseRequest(HTTP_PAYLOAD_TOO_LARGE);
+        return false;
+    }
+    if (getConnectionMemory(m_clientFd) > memoryLimits.maxConnectionBytes) {
+        std::cout << "[error] client (computing) " << m_clientFd << " holds more than " << memoryLimits.maxConnectionBytes << " bytes of memory, answering with " << (inBody ? 413 : 431) << std::endl;
+        refuseRequest(inBody ? HTTP_PAYLOAD_TOO_LARGE : HTTP_HEADER_TOO_LARGE);
+        return false;
+    }
+    return true;
+}
+
+void HandleRecv::refuseRequest(HTTPSTATUS status, int retryAfterSec) {
+    getRequest(m_clientFd).setStatus(HANDLE_ERROR);
+    if (hasResponse(m_clientFd)) {
+        Metrics::countRequest(ROUTE_OTHER, ResponseHead::getStatusCode(status));
+        return;
+    }
+    sendRefusal(m_clientFd, status, retryAfterSec);
+}
+
+bool HandleRecv::extractFileContent(std::string &recvMsg, const std::string &boundary, std::string &fileData) {
+    while (1) {
+        int saveLen = recvMsg.size();
+        if (saveLen == 0) {
+            break;
+        }
+        std::string::size_type endIndex = recvMsg.find('\r');
+
+        if (endIndex != std::string::npos) {
+            int boundarySecLen = boundary.size() + 8;
+            if (recvMsg.size() - endIndex >= boundarySecLen) {
+                if (recvMsg.substr(endIndex, boundarySecLen) == "\r\n--" + boundary + "--\r\n") {
+                    if (endIndex == 0) {
+                        return true;
+                    }
+                    saveLen = endIndex;
+                } else {
+                    endIndex = recvMsg.find('\r', endIndex + 1);
+                    if (endIndex != std::string::npos) {
+                        saveLen = endIndex;
+                    }
+                }
+            } else {
+                if (endIndex == 0) {
+                    break;
+                }
+                saveLen = endIndex;
+            }
+        }
+        fileData.append(recvMsg.c_str(), saveLen);
+        recvMsg.erase(0, saveLen);
+    }
+    return false;
+}
+
+void HandleRecv::prepareResponse(const std::string &bodyFileName) {
+    const Request& request = getRequest(m_clientFd);
+    METRICSROUTE route = ROUTE_OTHER;
+    if (request.getRequestMethod() == "POST") {
+        route = ROUTE_UPLOAD;
+    } else if (request.getRequestMethod() == "PUT") {
+        route = ROUTE_PUT;
+    } else if (request.getRequestResource() == "/") {
+        route = ROUTE_LIST;
+    } else if (request.getRequestResource() == "/metrics") {
+        route = ROUTE_METRICS;
+    } else if (isApiListResource(request.getRequestResource())) {
+        route = ROUTE_API_LIST;
+    } else if (isApiSearchResource(request.getRequestResource())) {
+        route = ROUTE_API_SEARCH;
+    } else if (isArchiveResource(request.getRequestResource())) {
+        route = ROUTE_ARCHIVE;
+    } else if (request.getRequestResource().compare(0, 7, "/downl/") == 0) {
+        route = ROUTE_DOWNL;
+    } else if (request.getRequestResource().compare(0, 5, "/del/") == 0) {
+        route = ROUTE_DEL;
+    }
+
+    Response& response = getResponse(m_clientFd);
+    response.setBodyFileName(bodyFileName);
+    response.setRoute(route);
+    response.setStartTime(request.getStartTime());
+    Trace::record(m_clientFd, TRACE_BODY_DONE, route, request.getMsgBodyRecvLen());
+}
+
+bool HandleRecv::reject() {
+    Request* request = findRequest(m_clientFd);
+    if (request != nullptr && (request->getStatus() != HANDLE_INIT || !request->recvMsg.empty())) {
+        return false;
     }
+    if (hasResponse(m_clientFd)) {
+        return false;
+    }
+
+    // Read the new request so that closing the connection does not reset it before the 503 is delivered
+    char buf[2048];
+    while (recv(m_clientFd, buf, sizeof(buf), 0) > 0) {
+    }
+
+    std::cout << "[error] Queue delay too high, answering client " << m_clientFd << " with 503 and closing the connection" << std::endl;
+    sendOverloadResponse(m_clientFd);
+    closeConnection(m_epollFd, m_clientFd, SHUT_RDWR);
+    return true;
 }
 
 HandleSend::HandleSend(int clientFd, int epollFd) : m_clientFd(clientFd), m_epollFd(epollFd) {}
 
 void HandleSend::process() {
     std::cout << "[info] Starting client processing " << m_clientFd << " A HandleSend event of the" << std::endl;
-    if (responseStatus.find(m_clientFd) == responseStatus.end()) {
+    if (!hasResponse(m_clientFd)) {
         std::cout << "[info] client (computing) " << m_clientFd << " There are no response messages to process" << std::endl;
         return;
     }
 
-    if (responseStatus[m_clientFd].getStatus() == HANDLE_INIT) {
+    if (getResponse(m_clientFd).getStatus() == HANDLE_INIT) {
+        // A response waiting for the filesystem executor passes here twice, the span starts on the first pass
+        if (!getResponse(m_clientFd).getFsDone()) {
+            Trace::record(m_clientFd, TRACE_HANDLER_START, getResponse(m_clientFd).getRoute());
+        }
         std::string opera, filename;
-        if (responseStatus[m_clientFd].getBodyFileName() == "/") {
+        if (getResponse(m_clientFd).getBodyFileName() == "/") {
             opera = "/";
+        } else if (getResponse(m_clientFd).getBodyFileName() == "/metrics") {
+            opera = "metrics";
+        } else if (isApiListResource(getResponse(m_clientFd).getBodyFileName())) {
+            opera = "api_list";
+        } else if (isApiSearchResource(getResponse(m_clientFd).getBodyFileName())) {
+            opera = "api_search";
+        } else if (isArchiveResource(getResponse(m_clientFd).getBodyFileName())) {
+            opera = "archive";
         } else {
             int i = 1;
-            while (i < responseStatus[m_clientFd].getBodyFileName().size() && responseStatus[m_clientFd].getBodyFileName()[i] != '/') {
+            while (i < getResponse(m_clientFd).getBodyFileName().size() && getResponse(m_clientFd).getBodyFileName()[i] != '/') {
                 ++i;
             }
-            if (i < responseStatus[m_clientFd].getBodyFileName().size() - 1) {
-                opera = responseStatus[m_clientFd].getBodyFileName().substr(1, i - 1);
-                filename = responseStatus[m_clientFd].getBodyFileName().substr(i + 1);
+            if (i < getResponse(m_clientFd).getBodyFileName().size() - 1) {
+                opera = getResponse(m_clientFd).getBodyFileName().substr(1, i - 1);
+                filename = getResponse(m_clientFd).getBodyFileName().substr(i + 1);
             } else {
                 opera = "redirect";
             }
         }
 
+        // Blocking filesystem calls are run by the filesystem executor, which re-arms the connection
+        // for writing when it is done, the response is then built from the result on the next HandleSend
+        if (opera == "/" || opera == "downl" || opera == "del" || opera == "archive") {
+            if (!getResponse(m_clientFd).getFsDone()) {
+                HandleFs* fsTask = nullptr;
+                if (opera == "/") {
+                    fsTask = new HandleFs(m_clientFd, m_epollFd, FS_LIST, "", true);
+                } else if (opera == "downl") {
+                    fsTask = new HandleFs(m_clientFd, m_epollFd, FS_OPEN, filename, true);
+                } else if (opera == "del") {
+                    fsTask = new HandleFs(m_clientFd, m_epollFd, FS_UNLINK, filename, true);
+                } else {
+                    fsTask = new HandleFs(m_clientFd, m_epollFd, FS_ARCHIVE, getQueryString(getResponse(m_clientFd).getBodyFileName()), true);
+                }
+                std::cout << "[info] client (computing) " << m_clientFd << " The response needs a filesystem call, it is handed to the filesystem executor" << std::endl;
+                submitFsTask(fsTask);
+                return;
+            }
+        }
+
         if (opera == "/") {
-            responseStatus[m_clientFd].setBeforeBodyMsg(getStatusLine("HTTP/1.1", "200", "OK"));
-            getFileListPage(responseStatus[m_clientFd].getMsgBodyRef());
-            responseStatus[m_clientFd].setMsgBodyLen(responseStatus[m_clientFd].getMsgBody().size());
-            responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + getMessageHeader(std::to_string(responseStatus[m_clientFd].getMsgBodyLen()), "html"));
-            responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + "\r\n");
-            responseStatus[m_clientFd].setBeforeBodyMsgLen(responseStatus[m_clientFd].getBeforeBodyMsg().size());
-            responseStatus[m_clientFd].setBodyType(HTML_TYPE);
-            responseStatus[m_clientFd].setStatus(HANDLE_HEAD);
-            responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+            getResponse(m_clientFd).setMsgBodyLen(getResponse(m_clientFd).getMsgBody().size());
+            if (getResponse(m_clientFd).getBodyType() == CHUNKED_TYPE) {
+                // The template head is the first chunk, its length is all that is known of the page
+                ResponseHead& head = getResponse(m_clientFd).getHeadRef();
+                head.start(HTTP_OK);
+                head.addChunkedEncoding();
+                head.addContentType(CONTENT_HTML);
+                head.finish(!isDraining());
+            } else {
+                setResponseHead(HTTP_OK, getResponse(m_clientFd).getMsgBodyLen(), CONTENT_HTML);
+            }
+            getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+            getResponse(m_clientFd).setCurStatusHasSendLen(0);
             std::cout << "[info] client (computing) " << m_clientFd << " The response message is used to return to the file list page, where the status line and message body have been constructed." << std::endl;
 
+        } else if (opera == "metrics") {
+            // Reserved route: the counters of all the threads merged in the Prometheus text format
+            Metrics::renderPrometheus(getResponse(m_clientFd).getMsgBodyRef());
+            getResponse(m_clientFd).setMsgBodyLen(getResponse(m_clientFd).getMsgBody().size());
+            setResponseHead(HTTP_OK, getResponse(m_clientFd).getMsgBodyLen(), CONTENT_METRICS);
+            getResponse(m_clientFd).setBodyType(HTML_TYPE);
+            getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+            getResponse(m_clientFd).setCurStatusHasSendLen(0);
+            std::cout << "[info] client (computing) " << m_clientFd << " The response message returns the metrics, the status line and message body have been constructed." << std::endl;
+
+        } else if (opera == "api_list") {
+            // Page of the file index, its cost depends on the page size and not on the number of files
+            ListQuery query;
+            std::string error;
+            HTTPSTATUS status = HTTP_OK;
+            if (FileIndex::parseQuery(getQueryString(getResponse(m_clientFd).getBodyFileName()), query, error)) {
+                ListPage page;
+                FileIndex::list(query, page);
+                FileIndex::renderJson(page, getResponse(m_clientFd).getMsgBodyRef());
+            } else {
+                status = HTTP_BAD_REQUEST;
+                getResponse(m_clientFd).setMsgBody("{\"error\":\"" + error + "\"}\n");
+            }
+            getResponse(m_clientFd).setMsgBodyLen(getResponse(m_clientFd).getMsgBody().size());
+            setResponseHead(status, getResponse(m_clientFd).getMsgBodyLen(), CONTENT_JSON);
+            getResponse(m_clientFd).setBodyType(HTML_TYPE);
+            getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+            getResponse(m_clientFd).setCurStatusHasSendLen(0);
+            std::cout << "[info] client (computing) " << m_clientFd << " The response message returns a page of the file index, the status line and message body have been constructed." << std::endl;
+
+        } else if (opera == "api_search") {
+            // Names matching a substring or a prefix, from the in-memory search index
+            SearchQuery query;
+            std::string error;
+            HTTPSTATUS status = HTTP_OK;
+            if (NameSearch::parseQuery(getQueryString(getResponse(m_clientFd).getBodyFileName()), query, error)) {
+                SearchResult result;
+                NameSearch::search(query, result);
+                NameSearch::renderJson(query, result, getResponse(m_clientFd).getMsgBodyRef());
+            } else {
+                status = HTTP_BAD_REQUEST;
+                getResponse(m_clientFd).setMsgBody("{\"error\":\"" + error + "\"}\n");
+            }
+            getResponse(m_clientFd).setMsgBodyLen(getResponse(m_clientFd).getMsgBody().size());
+            setResponseHead(status, getResponse(m_clientFd).getMsgBodyLen(), CONTENT_JSON);
+            getResponse(m_clientFd).setBodyType(HTML_TYPE);
+            getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+            getResponse(m_clientFd).setCurStatusHasSendLen(0);
+            std::cout << "[info] client (computing) " << m_clientFd << " The response message returns the names found by the search index, the status line and message body have been constructed." << std::endl;
+
+        } else if (opera == "archive") {
+            // The parts of the archive are built, its members are sent from their files as the body goes
+            if (getResponse(m_clientFd).getFsResult() != 0) {
+                // The error message was left in the body by the filesystem call
+                std::string error = getResponse(m_clientFd).getMsgBody();
+                setJsonErrorResponse(getResponse(m_clientFd).getFsResult() == 404 ? HTTP_NOT_FOUND : HTTP_BAD_REQUEST, error);
+            } else {
+                setResponseHead(HTTP_OK, getResponse(m_clientFd).getMsgBodyLen(), CONTENT_TAR);
+                getResponse(m_clientFd).setBodyType(PARTS_TYPE);
+                getResponse(m_clientFd).setCurPart(0);
+                getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+                getResponse(m_clientFd).setCurStatusHasSendLen(0);
+            }
+            std::cout << "[info] client (computing) " << m_clientFd << " The response message returns an archive, the status line and the parts of the body have been constructed." << std::endl;
+
         } else if (opera == "downl") {
-            responseStatus[m_clientFd].setBeforeBodyMsg(getStatusLine("HTTP/1.1", "200", "OK"));
-            responseStatus[m_clientFd].setFileMsgFd(open(("filedir/" + filename).c_str(), O_RDONLY));
-            if (responseStatus[m_clientFd].getFileMsgFd() == -1) {
+            if (getResponse(m_clientFd).getFsResult() != 0) {
                 std::cout << "[error] client (computing) " << m_clientFd << " request message to download the file " << filename << " But the file open failed, exit the current function, re-entry is used to return the redirection message, redirected to the file list" << std::endl;
-                responseStatus[m_clientFd] = Response();
-                responseStatus[m_clientFd].setBodyFileName("/redirect");
-                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
+                resetResponse("/redirect");
+                setFdEventClass(m_clientFd, EVENT_CONTROL);
+                process();
                 return;
             } else {
-                struct stat fileStat;
-                fstat(responseStatus[m_clientFd].getFileMsgFd(), &fileStat);
-                responseStatus[m_clientFd].setMsgBodyLen(fileStat.st_size);
-                responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + getMessageHeader(std::to_string(responseStatus[m_clientFd].getMsgBodyLen()), "file", std::to_string(responseStatus[m_clientFd].getMsgBodyLen() - 1)));
-                responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + "\r\n");
-                responseStatus[m_clientFd].setBeforeBodyMsgLen(responseStatus[m_clientFd].getBeforeBodyMsg().size());
-                responseStatus[m_clientFd].setBodyType(FILE_TYPE);
-                responseStatus[m_clientFd].setStatus(HANDLE_HEAD);
-                responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+                setResponseHead(HTTP_OK, getResponse(m_clientFd).getMsgBodyLen(), CONTENT_FILE);
+                getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+                getResponse(m_clientFd).setCurStatusHasSendLen(0);
                 std::cout << "[info] client (computing) " << m_clientFd << " request message to download the file " << filename << " File open successful, build response message status line and header information based on file successful" << std::endl;
             }
 
         } else if (opera == "del") {
-            int ret = remove(("filedir/" + filename).c_str());
-            if (ret != 0) {
+            if (getResponse(m_clientFd).getFsResult() != 0) {
                 std::cout << "[error] client (computing) " << m_clientFd << " The request message to delete the file " << filename << " But the file deletion failed" << std::endl;
             } else {
                 std::cout << "[info] client (computing) " << m_clientFd << " The request message to delete the file " << filename << " and the file is deleted successfully" << std::endl;
             }
 
-            responseStatus[m_clientFd] = Response();
-            responseStatus[m_clientFd].setBodyFileName("/");
+            resetResponse("/");
             std::cout << "[info] client (computing) " << m_clientFd << " request message is processed, a redirection message is sent" << std::endl;
-            modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
+            process();
             return;
 
         } else if (opera == "put") {
-            std::ofstream ofs("filedir/" + filename, std::ios::out | std::ios::binary);
-            if (!ofs) {
+            if (getResponse(m_clientFd).getFsResult() == 400) {
+                setJsonErrorResponse(HTTP_BAD_REQUEST, "the body does not match its digest");
+                std::cout << "[error] client (computing) " << m_clientFd << " PUT request refused, the body of " << filename << " does not match its digest" << std::endl;
+            } else if (getResponse(m_clientFd).getFsResult() != 0) {
                 std::cout << "[error] client (computing) " << m_clientFd << " Failed to open file for PUT request " << filename << std::endl;
-                responseStatus[m_clientFd] = Response();
-                responseStatus[m_clientFd].setBodyFileName("/redirect");
-                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
+                resetResponse("/redirect");
+                setFdEventClass(m_clientFd, EVENT_CONTROL);
+                process();
                 return;
-            }
-
-            ofs.write(requestStatus[m_clientFd].recvMsg.c_str(), requestStatus[m_clientFd].recvMsg.size());
-            ofs.close();
+            } else {
+                setResponseHead(HTTP_OK, 0, CONTENT_HTML);
+                getResponse(m_clientFd).setBodyType(EMPTY_TYPE);
+                getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+                getResponse(m_clientFd).setCurStatusHasSendLen(0);
 
-            responseStatus[m_clientFd].setBeforeBodyMsg(getStatusLine("HTTP/1.1", "200", "OK"));
-            responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + getMessageHeader("0", "html", "", ""));
-            responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + "\r\n");
-            responseStatus[m_clientFd].setBeforeBodyMsgLen(responseStatus[m_clientFd].getBeforeBodyMsg().size());
-            responseStatus[m_clientFd].setBodyType(EMPTY_TYPE);
-            responseStatus[m_clientFd].setStatus(HANDLE_HEAD);
-            responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+                std::cout << "[info] client (computing) " << m_clientFd << " PUT request processed, response message constructed." << std::endl;
+            }
 
-            std::cout << "[info] client (computing) " << m_clientFd << " PUT request processed, response message constructed." << std::endl;
+        } else if (getResponse(m_clientFd).getFsResult() == 400) {
+            // Redirect of an upload whose file did not match the digest of its part
+            setJsonErrorResponse(HTTP_BAD_REQUEST, "the uploaded file does not match its digest");
+            std::cout << "[error] client (computing) " << m_clientFd << " The upload was refused, an error message has been constructed" << std::endl;
 
         } else {
-            responseStatus[m_clientFd].setBeforeBodyMsg(getStatusLine("HTTP/1.1", "302", "Moved Temporarily"));
-            responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + getMessageHeader("0", "html", "/", ""));
-            responseStatus[m_clientFd].setBeforeBodyMsg(responseStatus[m_clientFd].getBeforeBodyMsg() + "\r\n");
-            responseStatus[m_clientFd].setBeforeBodyMsgLen(responseStatus[m_clientFd].getBeforeBodyMsg().size());
-            responseStatus[m_clientFd].setBodyType(EMPTY_TYPE);
-            responseStatus[m_clientFd].setStatus(HANDLE_HEAD);
-            responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+            setResponseHead(HTTP_FOUND, 0, CONTENT_HTML, "/");
+            getResponse(m_clientFd).setBodyType(EMPTY_TYPE);
+            getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+            getResponse(m_clientFd).setCurStatusHasSendLen(0);
             std::cout << "[info] client (computing) " << m_clientFd << " The response message is a redirected message with the status line and message header constructed" << std::endl;
         }
     }
 
+    chargeResponseMemory(m_clientFd, getResponseMemory(getResponse(m_clientFd)));
+
     while (1) {
         long long sentLen = 0;
-        if (responseStatus[m_clientFd].getStatus() == HANDLE_HEAD) {
-            sentLen = responseStatus[m_clientFd].getCurStatusHasSendLen();
-            sentLen = send(m_clientFd, responseStatus[m_clientFd].getBeforeBodyMsg().c_str() + sentLen, responseStatus[m_clientFd].getBeforeBodyMsgLen() - sentLen, 0);
+        if (getResponse(m_clientFd).getStatus() == HANDLE_HEAD) {
+            sentLen = getResponse(m_clientFd).getCurStatusHasSendLen();
+            if (getResponse(m_clientFd).getBodyType() == HTML_TYPE || getResponse(m_clientFd).getBodyType() == CHUNKED_TYPE) {
+                // A body in memory leaves with the header in one writev, the client gets both in the same segment
+                struct iovec iov[2];
+                iov[0].iov_base = const_cast<char*>(getResponse(m_clientFd).getBeforeBodyMsg()) + sentLen;
+                iov[0].iov_len = getResponse(m_clientFd).getBeforeBodyMsgLen() - sentLen;
+                iov[1].iov_base = const_cast<char*>(getResponse(m_clientFd).getMsgBody().c_str());
+                iov[1].iov_len = getResponse(m_clientFd).getMsgBodyLen();
+                sentLen = writev(m_clientFd, iov, 2);
+            } else {
+                // The header of a body sent from files waits for the first data instead of leaving in its own segment
+                bool bodyFollows = getResponse(m_clientFd).getBodyType() != EMPTY_TYPE && getResponse(m_clientFd).getMsgBodyLen() > 0;
+                sentLen = send(m_clientFd, getResponse(m_clientFd).getBeforeBodyMsg() + sentLen, getResponse(m_clientFd).getBeforeBodyMsgLen() - sentLen, bodyFollows ? MSG_MORE : 0);
+            }
             if (sentLen == -1) {
                 if (errno != EAGAIN) {
-                    requestStatus[m_clientFd].setStatus(HANDLE_ERROR);
+                    getResponse(m_clientFd).setStatus(HANDLE_ERROR);
                     std::cout << "[error] Returned when the response body and message header are sent -1 (errno = " << errno << ")" << std::endl;
                     break;
                 }
                 break;
             }
-            responseStatus[m_clientFd].setCurStatusHasSendLen(responseStatus[m_clientFd].getCurStatusHasSendLen() + sentLen);
-            if (responseStatus[m_clientFd].getCurStatusHasSendLen() >= responseStatus[m_clientFd].getBeforeBodyMsgLen()) {
-                responseStatus[m_clientFd].setStatus(HANDLE_BODY);
-                responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+            Metrics::addBytesOut(sentLen);
+            if (getResponse(m_clientFd).getCurStatusHasSendLen() == 0 && getResponse(m_clientFd).getStartTime() != 0) {
+                Metrics::recordFirstByte(static_cast<METRICSROUTE>(getResponse(m_clientFd).getRoute()), getMonotonicNs() - getResponse(m_clientFd).getStartTime());
+                Trace::record(m_clientFd, TRACE_FIRST_WRITE, getResponse(m_clientFd).getRoute(), sentLen);
+            }
+            getResponse(m_clientFd).setCurStatusHasSendLen(getResponse(m_clientFd).getCurStatusHasSendLen() + sentLen);
+            if (getResponse(m_clientFd).getCurStatusHasSendLen() >= getResponse(m_clientFd).getBeforeBodyMsgLen()) {
+                // Bytes of the body already sent by writev
+                getResponse(m_clientFd).setStatus(HANDLE_BODY);
+                getResponse(m_clientFd).setCurStatusHasSendLen(getResponse(m_clientFd).getCurStatusHasSendLen() - getResponse(m_clientFd).getBeforeBodyMsgLen());
                 std::cout << "[info] client (computing) " << m_clientFd << " Response message status line and message header send complete, message body being sent..." << std::endl;
             }
 
-            if (responseStatus[m_clientFd].getBodyType() == FILE_TYPE) {
-                std::cout << "[info] client (computing) " << m_clientFd << " The request is for a file, start sending the file " << responseStatus[m_clientFd].getBodyFileName() << " ..." << std::endl;
+            if (getResponse(m_clientFd).getBodyType() == FILE_TYPE || getResponse(m_clientFd).getBodyType() == PARTS_TYPE) {
+                setFdEventClass(m_clientFd, EVENT_BULK);
+                std::cout << "[info] client (computing) " << m_clientFd << " The request is for a file, start sending the file " << getResponse(m_clientFd).getBodyFileName() << " ..." << std::endl;
             }
         }
 
-        if (responseStatus[m_clientFd].getStatus() == HANDLE_BODY) {
-            if (responseStatus[m_clientFd].getBodyType() == HTML_TYPE) {
-                sentLen = responseStatus[m_clientFd].getCurStatusHasSendLen();
-                sentLen = send(m_clientFd, responseStatus[m_clientFd].getMsgBody().c_str() + sentLen, responseStatus[m_clientFd].getMsgBodyLen() - sentLen, 0);
+        if (getResponse(m_clientFd).getStatus() == HANDLE_BODY) {
+            if (getResponse(m_clientFd).getBodyType() == HTML_TYPE) {
+                sentLen = getResponse(m_clientFd).getCurStatusHasSendLen();
+                if (sentLen < static_cast<long long>(getResponse(m_clientFd).getMsgBodyLen())) {
+                    sentLen = send(m_clientFd, getResponse(m_clientFd).getMsgBody().c_str() + sentLen, getResponse(m_clientFd).getMsgBodyLen() - sentLen, 0);
+                } else {
+                    sentLen = 0;
+                }
                 if (sentLen == -1) {
                     if (errno != EAGAIN) {
-                        requestStatus[m_clientFd].setStatus(HANDLE_ERROR);
+                        getResponse(m_clientFd).setStatus(HANDLE_ERROR);
                         std::cout << "[error] Returned when sending HTML message body -1 (errno = " << errno << ")" << std::endl;
                         break;
                     }
                     break;
                 }
-                responseStatus[m_clientFd].setCurStatusHasSendLen(responseStatus[m_clientFd].getCurStatusHasSendLen() + sentLen);
-                if (responseStatus[m_clientFd].getCurStatusHasSendLen() >= responseStatus[m_clientFd].getMsgBodyLen()) {
-                    responseStatus[m_clientFd].setStatus(HANDLE_COMPLETE);
-                    responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+                Metrics::addBytesOut(sentLen);
+                getResponse(m_clientFd).setCurStatusHasSendLen(getResponse(m_clientFd).getCurStatusHasSendLen() + sentLen);
+                if (getResponse(m_clientFd).getCurStatusHasSendLen() >= getResponse(m_clientFd).getMsgBodyLen()) {
+                    getResponse(m_clientFd).setStatus(HANDLE_COMPLETE);
+                    getResponse(m_clientFd).setCurStatusHasSendLen(0);
                     std::cout << "[info] client (computing) " << m_clientFd << " The request was for an HTML file, and the file was sent successfully" << std::endl;
                     break;
                 }
 
-            } else if (responseStatus[m_clientFd].getBodyType() == FILE_TYPE) {
-                sentLen = responseStatus[m_clientFd].getCurStatusHasSendLen();
-                sentLen = sendfile(m_clientFd, responseStatus[m_clientFd].getFileMsgFd(), (off_t *)&sentLen, responseStatus[m_clientFd].getMsgBodyLen() - sentLen);
+            } else if (getResponse(m_clientFd).getBodyType() == CHUNKED_TYPE) {
+                // The next chunk is rendered once the previous one is in the socket, its rows replace it in msgBody
+                if (getResponse(m_clientFd).getCurStatusHasSendLen() >= getResponse(m_clientFd).getMsgBodyLen()) {
+                    if (getResponse(m_clientFd).getListingRef().lastChunk) {
+                        getResponse(m_clientFd).setStatus(HANDLE_COMPLETE);
+                        getResponse(m_clientFd).setCurStatusHasSendLen(0);
+                        std::cout << "[info] client (computing) " << m_clientFd << " The file list page was sent successfully" << std::endl;
+                        break;
+                    }
+                    renderListingChunk(getResponse(m_clientFd).getListingRef(), getResponse(m_clientFd).getMsgBodyRef());
+                    getResponse(m_clientFd).setMsgBodyLen(getResponse(m_clientFd).getMsgBody().size());
+                    chargeResponseMemory(m_clientFd, getResponseMemory(getResponse(m_clientFd)));
+                    getResponse(m_clientFd).setCurStatusHasSendLen(0);
+                }
+                sentLen = getResponse(m_clientFd).getCurStatusHasSendLen();
+                sentLen = send(m_clientFd, getResponse(m_clientFd).getMsgBody().c_str() + sentLen, getResponse(m_clientFd).getMsgBodyLen() - sentLen,
+                               getResponse(m_clientFd).getListingRef().lastChunk ? 0 : MSG_MORE);
+                if (sentLen == -1) {
+                    if (errno != EAGAIN) {
+                        getResponse(m_clientFd).setStatus(HANDLE_ERROR);
+                        std::cout << "[error] Returned when sending a chunk of the file list page -1 (errno = " << errno << ")" << std::endl;
+                    }
+                    break;
+                }
+                Metrics::addBytesOut(sentLen);
+                getResponse(m_clientFd).setCurStatusHasSendLen(getResponse(m_clientFd).getCurStatusHasSendLen() + sentLen);
+
+            } else if (getResponse(m_clientFd).getBodyType() == FILE_TYPE) {
+                sentLen = getResponse(m_clientFd).getCurStatusHasSendLen();
+                sentLen = sendfile(m_clientFd, getResponse(m_clientFd).getFileMsgFd(), (off_t *)&sentLen, getResponse(m_clientFd).getMsgBodyLen() - sentLen);
                 if (sentLen == -1) {
                     if (errno != EAGAIN) {
-                        requestStatus[m_clientFd].setStatus(HANDLE_ERROR);
+                        getResponse(m_clientFd).setStatus(HANDLE_ERROR);
                         std::cout << "[error] Returns when sending a file -1 (errno = " << errno << ")" << std::endl;
                         break;
                     }
                     break;
                 }
-                responseStatus[m_clientFd].setCurStatusHasSendLen(responseStatus[m_clientFd].getCurStatusHasSendLen() + sentLen);
-                if (responseStatus[m_clientFd].getCurStatusHasSendLen() >= responseStatus[m_clientFd].getMsgBodyLen()) {
-                    responseStatus[m_clientFd].setStatus(HANDLE_COMPLETE);
-                    responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+                Metrics::addBytesOut(sentLen);
+                getResponse(m_clientFd).setCurStatusHasSendLen(getResponse(m_clientFd).getCurStatusHasSendLen() + sentLen);
+                if (getResponse(m_clientFd).getCurStatusHasSendLen() >= getResponse(m_clientFd).getMsgBodyLen()) {
+                    getResponse(m_clientFd).setStatus(HANDLE_COMPLETE);
+                    getResponse(m_clientFd).setCurStatusHasSendLen(0);
                     std::cout << "[info] client (computing) " << m_clientFd << " Requested document delivery completed" << std::endl;
                     break;
                 }
 
-            } else if (responseStatus[m_clientFd].getBodyType() == EMPTY_TYPE) {
-                responseStatus[m_clientFd].setStatus(HANDLE_COMPLETE);
-                responseStatus[m_clientFd].setCurStatusHasSendLen(0);
+            } else if (getResponse(m_clientFd).getBodyType() == PARTS_TYPE) {
+                std::vector<BodyPart>& parts = getResponse(m_clientFd).getBodyPartsRef();
+                size_t curPart = getResponse(m_clientFd).getCurPart();
+                if (curPart >= parts.size()) {
+                    getResponse(m_clientFd).setStatus(HANDLE_COMPLETE);
+                    getResponse(m_clientFd).setCurStatusHasSendLen(0);
+                    std::cout << "[info] client (computing) " << m_clientFd << " The archive was sent successfully" << std::endl;
+                    break;
+                }
+                BodyPart& part = parts[curPart];
+                long long partLen = part.fileName.empty() ? static_cast<long long>(part.data.size()) : part.fileLen;
+                sentLen = getResponse(m_clientFd).getCurStatusHasSendLen();
+                if (part.fileName.empty()) {
+                    sentLen = send(m_clientFd, part.data.c_str() + sentLen, partLen - sentLen, curPart + 1 < parts.size() ? MSG_MORE : 0);
+                } else if (part.fd == -1) {
+                    // The next files are opened by the filesystem executor, which re-arms the connection for writing
+                    if (getResponse(m_clientFd).getFsResult() != 0) {
+                        getResponse(m_clientFd).setStatus(HANDLE_ERROR);
+                        break;
+                    }
+                    submitFsTask(new HandleFs(m_clientFd, m_epollFd, FS_ARCHIVE_OPEN, "", true));
+                    return;
+                } else {
+                    off_t offset = sentLen;
+                    sentLen = sendfile(m_clientFd, part.fd, &offset, partLen - sentLen);
+                    if (sentLen == 0) {
+                        // The file is shorter than in the header already sent, the archive cannot be completed
+                        std::cout << "[error] client (computing) " << m_clientFd << " The file " << part.fileName << " of the archive shrank while it was sent" << std::endl;
+                        getResponse(m_clientFd).setStatus(HANDLE_ERROR);
+                        break;
+                    }
+                }
+                if (sentLen == -1) {
+                    if (errno != EAGAIN) {
+                        getResponse(m_clientFd).setStatus(HANDLE_ERROR);
+                        std::cout << "[error] Returned when sending a part of an archive -1 (errno = " << errno << ")" << std::endl;
+                    }
+                    break;
+                }
+                Metrics::addBytesOut(sentLen);
+                getResponse(m_clientFd).setCurStatusHasSendLen(getResponse(m_clientFd).getCurStatusHasSendLen() + sentLen);
+                if (static_cast<long long>(getResponse(m_clientFd).getCurStatusHasSendLen()) >= partLen) {
+                    if (part.fd != -1) {
+                        close(part.fd);
+                        part.fd = -1;
+                    }
+                    getResponse(m_clientFd).setCurPart(curPart + 1);
+                    getResponse(m_clientFd).setCurStatusHasSendLen(0);
+                }
+
+            } else if (getResponse(m_clientFd).getBodyType() == EMPTY_TYPE) {
+                getResponse(m_clientFd).setStatus(HANDLE_COMPLETE);
+                getResponse(m_clientFd).setCurStatusHasSendLen(0);
                 std::cout << "[info] client (computing) " << m_clientFd << " The redirected message was sent successfully." << std::endl;
                 break;
             }
         }
 
-        if (responseStatus[m_clientFd].getStatus() == HANDLE_ERROR) {
+        if (getResponse(m_clientFd).getStatus() == HANDLE_ERROR) {
             break;
         }
     }
 
-    if (responseStatus[m_clientFd].getStatus() == HANDLE_COMPLETE) {
-        responseStatus.erase(m_clientFd);
-        modifyWaitFd(m_epollFd, m_clientFd, true, true, false);
+    // The downloaded file is closed before the state is erased and the connection re-armed,
+    // after that the state of the connection may already belong to its next request
+    if (getResponse(m_clientFd).getStatus() == HANDLE_COMPLETE || getResponse(m_clientFd).getStatus() == HANDLE_ERROR) {
+        closeResponseBody(getResponse(m_clientFd));
+    }
+
+    if (getResponse(m_clientFd).getStatus() == HANDLE_COMPLETE) {
+        METRICSROUTE route = static_cast<METRICSROUTE>(getResponse(m_clientFd).getRoute());
+        Trace::record(m_clientFd, TRACE_LAST_WRITE, route, getResponse(m_clientFd).getMsgBodyLen());
+        Metrics::countRequest(route, getResponse(m_clientFd).getResponseStatusCode());
+        if (getResponse(m_clientFd).getStartTime() != 0) {
+            Metrics::recordTotal(route, getMonotonicNs() - getResponse(m_clientFd).getStartTime());
+        }
+        if (isDraining()) {
+            // The response said "Connection: close", the server leaves once its connections are closed
+            closeConnection(m_epollFd, m_clientFd, SHUT_WR);
+            std::cout << "[info] client (computing) " << m_clientFd << " response message was sent, closing the connection of the draining server" << std::endl;
+            return;
+        }
+        eraseResponse(m_clientFd);
+        setFdEventClass(m_clientFd, EVENT_CONTROL);
+        rearmConnFd(m_epollFd, m_clientFd, false);
         std::cout << "[info] client (computing) " << m_clientFd << " response message was sent successfully" << std::endl;
-    } else if (responseStatus[m_clientFd].getStatus() == HANDLE_ERROR) {
-        responseStatus.erase(m_clientFd);
-        modifyWaitFd(m_epollFd, m_clientFd, true, false, false);
-        shutdown(m_clientFd, SHUT_WR);
-        close(m_clientFd);
+    } else if (getResponse(m_clientFd).getStatus() == HANDLE_ERROR) {
+        closeConnection(m_epollFd, m_clientFd, SHUT_WR);
         std::cout << "[error] client (computing) " << m_clientFd << " The response message to a file descriptor fails, closing the associated file descriptor." << std::endl;
     } else {
-        modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-        return;
+        rearmConnFd(m_epollFd, m_clientFd, true);
     }
+}
 
-    if (responseStatus[m_clientFd].getBodyType() == FILE_TYPE) {
-        close(responseStatus[m_clientFd].getFileMsgFd());
-    }
+void HandleSend::resetResponse(const std::string &bodyFileName) {
+    int route = getResponse(m_clientFd).getRoute();
+    long long startTime = getResponse(m_clientFd).getStartTime();
+    getResponse(m_clientFd) = Response();
+    getResponse(m_clientFd).setBodyFileName(bodyFileName);
+    getResponse(m_clientFd).setRoute(route);
+    getResponse(m_clientFd).setStartTime(startTime);
 }
 
-std::string HandleSend::getStatusLine(const std::string &httpVersion, const std::string &statusCode, const std::string &statusDes) {
-    std::string statusLine;
-    responseStatus[m_clientFd].setResponseHttpVersion(httpVersion);
-    responseStatus[m_clientFd].setResponseStatusCode(statusCode);
-    responseStatus[m_clientFd].setResponseStatusDes(statusDes);
-    statusLine = httpVersion + " " + statusCode + " " + statusDes + "\r\n";
-    return statusLine;
+// Row of a file in the table of the file list page
+static void appendFileListRow(const std::string &filename, std::string &out) {
+    out += "            <tr><td class=\"col1\">" + filename +
+           "</td> <td class=\"col2\"><a href=\"downl/" + filename +
+           "\">downl</a></td> <td class=\"col3\"><a href=\"#\" onclick=\"return confirmDelete('" + filename + "');\">remov</a></td></tr>" + "\n";
 }
 
-void HandleSend::getFileListPage(std::string &fileListHtml) {
-    std::vector<std::string> fileVec;
-    getFileVec("filedir", fileVec);
-    
+void HandleSend::getFileListTemplate(std::string &head, std::string &tail) {
     std::ifstream fileListStream("html/filelist.html", std::ios::in);
     std::string tempLine;
-    while (1) {
-        getline(fileListStream, tempLine);
+    while (getline(fileListStream, tempLine)) {
         if (tempLine == "<!--filelist_label-->") {
             break;
         }
-        fileListHtml += tempLine + "\n";
-    }
-
-    for (const auto &filename : fileVec) {
-        fileListHtml += "            <tr><td class=\"col1\">" + filename +
-                    "</td> <td class=\"col2\"><a href=\"downl/" + filename +
-                    "\">downl</a></td> <td class=\"col3\"><a href=\"#\" onclick=\"return confirmDelete('" + filename + "');\">remov</a></td></tr>" + "\n";
+        head += tempLine + "\n";
     }
 
     while (getline(fileListStream, tempLine)) {
-        fileListHtml += tempLine + "\n";
+        tail += tempLine + "\n";
     }
 }
 
-void HandleSend::getFileVec(const std::string &dirName, std::vector<std::string> &resVec) {
-    DIR *dir;
-    dir = opendir(dirName.c_str());
-    struct dirent *stdinfo;
-    while (1) {
-        stdinfo = readdir(dir);
-        if (stdinfo == nullptr) {
-            break;
-        }
-        resVec.push_back(stdinfo->d_name);
-        if (resVec.back() == "." || resVec.back() == "..") {
-            resVec.pop_back();
-        }
+void HandleSend::getFileListPage(std::string &fileListHtml) {
+    std::vector<std::string> fileVec;
+    if (!Storage::listFiles(fileVec)) {
+        std::cout << "[error] Failed to open directory " << Storage::getRoot() << " (errno = " << errno << ")" << std::endl;
     }
-}
 
-std::string HandleSend::getMessageHeader(const std::string &contentLength, const std::string &contentType, const std::string &redirectLocation, const std::string &contentRange) {
-    std::string headerOpt;
-
-    if (!contentLength.empty()) {
-        headerOpt += "Content-Length: " + contentLength + "\r\n";
+    std::string tail;
+    getFileListTemplate(fileListHtml, tail);
+    for (const auto &filename : fileVec) {
+        appendFileListRow(filename, fileListHtml);
     }
+    fileListHtml += tail;
+}
 
-    if (!contentType.empty()) {
-        if (contentType == "html") {
-            headerOpt += "Content-Type: text/html;charset=UTF-8\r\n";
-        } else if (contentType == "file") {
-            headerOpt += "Content-Type: application/octet-stream\r\n";
+void HandleSend::renderListingChunk(ListingState &listing, std::string &out) {
+    std::string data;
+    // A batch may have no row, such as a page of the index stopped by its scan limit: an empty chunk would end the
+    // body, the next batch is rendered instead
+    while (!listing.rowsDone && data.empty()) {
+        if (listing.walk) {
+            std::vector<std::string> names;
+            listing.rowsDone = !Storage::walkNext(listing.walkCursor, LISTING_BATCH_ROWS, names);
+            for (const std::string &name : names) {
+                appendFileListRow(name, data);
+            }
+            continue;
+        }
+        ListQuery query;
+        query.limit = LISTING_BATCH_ROWS;
+        if (!listing.cursor.empty()) {
+            FileIndex::parseCursor(listing.cursor, query);
         }
+        ListPage page;
+        FileIndex::list(query, page);
+        for (const FileEntry &entry : page.entries) {
+            appendFileListRow(entry.name, data);
+        }
+        listing.cursor = page.nextCursor;
+        listing.rowsDone = page.nextCursor.empty();
     }
-
-    if (!redirectLocation.empty()) {
-        headerOpt += "Location: " + redirectLocation + "\r\n";
+    if (listing.rowsDone) {
+        data += listing.tail;
+        listing.tail.clear();
+        listing.lastChunk = true;
     }
 
-    if (!contentRange.empty()) {
-        headerOpt += "Content-Range: 0-" + contentRange + "\r\n";
+    // Chunk size in hex, the data, then the zero-length chunk that ends the body
+    char size[20];
+    int sizeLen = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    out.assign(size, sizeLen);
+    out += data;
+    out += "\r\n";
+    if (listing.lastChunk) {
+        out += "0\r\n\r\n";
     }
+}
 
-    headerOpt += "Connection: keep-alive\r\n";
+void HandleSend::setJsonErrorResponse(HTTPSTATUS status, const std::string &error) {
+    getResponse(m_clientFd).setMsgBody("{\"error\":\"" + error + "\"}\n");
+    getResponse(m_clientFd).setMsgBodyLen(getResponse(m_clientFd).getMsgBody().size());
+    setResponseHead(status, getResponse(m_clientFd).getMsgBodyLen(), CONTENT_JSON);
+    getResponse(m_clientFd).setBodyType(HTML_TYPE);
+    getResponse(m_clientFd).setStatus(HANDLE_HEAD);
+    getResponse(m_clientFd).setCurStatusHasSendLen(0);
+}
 
-    return headerOpt;
+void HandleSend::setResponseHead(HTTPSTATUS status, unsigned long contentLength, CONTENTTYPE contentType, const char* location) {
+    ResponseHead& head = getResponse(m_clientFd).getHeadRef();
+    head.start(status);
+    head.addContentLength(contentLength);
+    head.addContentType(contentType);
+    if (location != nullptr) {
+        head.addHeader("Location", location, strlen(location));
+    }
+    if (!getResponse(m_clientFd).getReprDigest().empty()) {
+        head.addHeader("Repr-Digest", getResponse(m_clientFd).getReprDigest());
+    }
+    head.finish(!isDraining());
 }
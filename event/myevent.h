@@ -5,38 +5,251 @@
 #include <fstream>
 #include <vector>
 #include <cstdio>
+#include <cstring>
 #include <sstream>
 #include <algorithm>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <string>
+#include <atomic>
+#include <pthread.h>
 
 #include "../message/message.h"
 #include "../utils/utils.h"
+#include "../metrics/metrics.h"
+#include "../trace/trace.h"
+#include "../index/fileindex.h"
+#include "../search/namesearch.h"
+#include "../storage/storage.h"
+#include "../archive/archive.h"
+#include "../ratelimit/ratelimit.h"
+
+#define MAX_CLASS_HINT_FD 65536 // Connections with a larger descriptor are always scheduled as EVENT_CONTROL
+#define MAX_ACCOUNTED_FD 65536  // Connections with a larger descriptor are not held to MemoryLimits::maxConnectionBytes
+#define MAX_INTEREST_FD 65536   // Connections with a larger descriptor make every interest change with epoll_ctl
+#define MAX_STATE_FD 65536      // Connections with a larger descriptor keep their request and response in maps under a lock
+#define LISTING_BATCH_ROWS 256  // Rows of the file list page rendered into one chunk, once the previous one is sent
+
+// Scheduling class of an event, the thread pool keeps one queue per class.
+// The order of the values is their priority under strict scheduling.
+enum EVENTCLASS {
+    EVENT_ACCEPT,     // Accepting new connections
+    EVENT_CONTROL,    // Request lines, headers and small responses (redirects, empty bodies)
+    EVENT_BULK,       // Upload bodies and file downloads
+    EVENT_BLOCKING,   // Blocking filesystem calls, queued on the filesystem executor
+    EVENT_CLASS_NUM
+};
+
+// Filesystem operations that the filesystem executor runs on behalf of a connection
+enum FSOPERATION {
+    FS_LIST,     // Read the page template, the rows are rendered while the page is sent
+    FS_OPEN,     // Open and stat a file to download, small files are read into the response
+    FS_UNLINK,   // Delete a file
+    FS_APPEND,   // Write the full buffer of an upload or a PUT, then the data
+    FS_COMMIT,   // Write the last chunk of an upload or a PUT and make the file visible
+    FS_ARCHIVE,  // Find and stat the files of an archive, build its parts and open the first files
+    FS_ARCHIVE_OPEN,   // Open the next files of an archive
+};
+
+// Type of an event, the thread pool keeps its queue wait and service time per type
+enum EVENTTYPE {
+    EVENT_TYPE_ACCEPT,   // AcceptConn
+    EVENT_TYPE_RECV,     // HandleRecv
+    EVENT_TYPE_SEND,     // HandleSend
+    EVENT_TYPE_FS,       // HandleFs
+    EVENT_TYPE_SIG,      // HandleSig
+    EVENT_TYPE_NUM
+};
+
+// Limits used to shed load when the server is saturated
+struct OverloadLimits {
+    int maxConnections = 900;                           // Connections above this number are answered with 503 and closed
+    int maxQueueDepth = 512;                            // The reactor stops accepting when this many events wait in the pool
+    int codelTargetMs = 50;                             // Acceptable queue delay of an event, 0 disables queue delay dropping
+    int codelIntervalMs = 100;                          // Window over which the minimum queue delay is measured
+    int retryAfterSec = 1;                              // Value of the Retry-After header of the 503 response
+};
+
+// Memory a client may make the server hold, the request is refused and the connection closed above these limits
+struct MemoryLimits {
+    long long maxHeaderBytes = 32 * 1024;               // Request line and headers, 431 above
+    long long maxBodyBytes = 8 * 1024 * 1024;           // Body received but not yet processed, 413 above
+    long long maxConnectionBytes = 16 * 1024 * 1024;    // Buffers and parser state of the request and the response of a connection, 413 above
+};
+
+// Strategy of a download by file size: small files are read into memory and sent with the header in one writev,
+// the others are sent with sendfile, and large ones are read ahead sequentially (see make bench, serve/*)
+struct ServeLimits {
+    long long smallFileMax = 8 * 1024;                  // Files up to this size are served from memory, -1 always uses sendfile
+    long long sequentialFileMin = 4 * 1024 * 1024;      // Files from this size get sequential readahead hints
+    long long readaheadLen = 2 * 1024 * 1024;           // Start of a large file read ahead when it is opened
+};
+
+// Interest of a connection registered in epoll. The connections are EPOLLONESHOT: an event reported by epoll_wait
+// disarms the connection until its handler re-arms it.
+enum FDINTEREST {
+    INTEREST_IN = 1,
+    INTEREST_OUT = 2,
+    INTEREST_ARMED = 4,      // Set by the re-arm, cleared by the reactor when it dispatches an event of the connection
+};
+
+class ThreadPool;
+class HandleFs;
 
 // Base class for all events
 class EventBase {
 public:
-    EventBase() = default;
+    EventBase() : enqueueTime(0) {}
     virtual ~EventBase() = default;
 
     // Override this function for different types of events to perform different handlers
     virtual void process() = 0;
 
+    // Called instead of process() when the thread pool sheds load. Events that can be dropped answer the
+    // client with 503 and return true, events of a request or response in progress return false and are processed.
+    virtual bool reject() { return false; }
+
+    // Type of the event, used by the thread pool instrumentation
+    virtual EVENTTYPE getEventType() const = 0;
+
+    // Time at which the event was queued in the thread pool (monotonic, nanoseconds)
+    long long getEnqueueTime() const { return enqueueTime; }
+    void setEnqueueTime(long long value) { enqueueTime = value; }
+
+    // Sets the limits and renders the 503 response once
+    static void setOverloadLimits(const OverloadLimits& limits);
+    static const OverloadLimits& getOverloadLimits() { return overloadLimits; }
+
+    static void setServeLimits(const ServeLimits& limits) { serveLimits = limits; }
+    static const ServeLimits& getServeLimits() { return serveLimits; }
+
+    static void setMemoryLimits(const MemoryLimits& limits) { memoryLimits = limits; }
+    static const MemoryLimits& getMemoryLimits() { return memoryLimits; }
+
+    // Bytes held by the requests and responses of all the connections, and by the largest connection
+    static long long getBufferedBytes() { return bufferedBytes.load(std::memory_order_relaxed); }
+    static long long getLargestConnectionBytes();
+
+    // Number of client connections currently open
+    static int getActiveConnNum() { return activeConnNum.load(std::memory_order_relaxed); }
+
+    // Server being replaced by an upgrade: responses carry "Connection: close" and their connection is closed once sent
+    static void setDraining(bool value) { draining.store(value, std::memory_order_relaxed); }
+    static bool isDraining() { return draining.load(std::memory_order_relaxed); }
+
+    // Closes the keep-alive connections waiting for their next request, returns their number. Called by the reactor
+    // when the drain starts: an armed connection belongs to no handler. Connections from MAX_INTEREST_FD are closed
+    // after their next response.
+    static int closeIdleConnections(int epollFd);
+
+    // Class to use for the next event of a connection, read by the main thread when it dispatches epoll results
+    static EVENTCLASS getFdEventClass(int fd);
+
+    // Pool running the blocking filesystem calls, when it is not set the calls run on the calling thread
+    static void setFsExecutor(ThreadPool* executor);
+
+    // Called by the reactor for each event of a connection it dispatches: epoll disarmed the connection
+    static void setFdFired(int fd);
+
+    // Called by the reactor for an event of a connection it could not queue: the connection is armed again with
+    // the interest it had, or for writing when the event was a send and the interest is not tracked
+    static void rearmDroppedFd(int epollFd, int fd, bool send);
+
 protected:
+    // Hands a filesystem call to the filesystem executor, the caller must return without re-arming the connection
+    static void submitFsTask(HandleFs* task);
+
+    static ThreadPool* fsExecutor;
+
+    // Best-effort non-blocking send of the pre-rendered 503 response, the caller closes the connection
+    static void sendOverloadResponse(int fd);
+
+    // Best-effort non-blocking send of an empty response refusing a connection or a request, with Retry-After
+    // when retryAfterSec is not 0. The caller closes the connection.
+    static void sendRefusal(int fd, HTTPSTATUS status, int retryAfterSec = 0);
+
+    static OverloadLimits overloadLimits;
+    static std::string overloadResponse;      // 503 response with Retry-After, rendered by setOverloadLimits
+    static ServeLimits serveLimits;
+    static MemoryLimits memoryLimits;
+    static std::atomic<int> activeConnNum;
+    static std::atomic<bool> draining;
+
+    // Records the bytes now held by the request or the response of a connection, erasing it records 0
+    static void chargeRequestMemory(int fd, long long bytes);
+    static void chargeResponseMemory(int fd, long long bytes);
+
+    // Bytes held by the request and the response of a connection, 0 beyond MAX_ACCOUNTED_FD
+    static long long getConnectionMemory(int fd);
+
+    // Last charge of the request and of the response of each connection, and their sum over all connections
+    static std::atomic<long long> requestMemory[MAX_ACCOUNTED_FD];
+    static std::atomic<long long> responseMemory[MAX_ACCOUNTED_FD];
+    static std::atomic<long long> bufferedBytes;
+
+    long long enqueueTime;
+
+    // Set by the handlers when a connection switches between small messages and bulk transfers
+    static void setFdEventClass(int fd, EVENTCLASS eventClass);
+
+    // Scheduling hint per connection, written by the worker owning the connection and read by the main thread
+    static std::atomic<unsigned char> fdEventClass[MAX_CLASS_HINT_FD];
+
+    // Registers a new connection for reading
+    static void addConnFd(int epollFd, int fd);
+
+    // Re-arms the connection for reading, and for writing when out is set. No system call is made when the
+    // connection is still armed with this interest.
+    static void rearmConnFd(int epollFd, int fd, bool out);
+
+    // Forgets the interest of a connection the caller is about to close. The handler owning a connection runs
+    // after epoll disarmed it, and closing the descriptor removes it from the epoll set, so the connection is
+    // only removed with epoll_ctl when it was armed again in the meantime.
+    static void releaseConnFd(int epollFd, int fd);
+
+    // Interest of each connection in epoll, FDINTEREST bits
+    static std::atomic<unsigned char> fdInterest[MAX_INTEREST_FD];
+
+    // Frees everything kept for a descriptor: the request, the response, their memory charges, the scheduling
+    // hint and the interest
+    static void resetConnState(int fd);
+
+    // Closes a client connection on every path: releases its interest and its rate limiter slot, shuts the
+    // socket down with how (SHUT_WR lets the client read the end of a response), closes the file or archive
+    // parts the response still has open, frees its state and closes it
+    static void closeConnection(int epollFd, int fd, int how);
+
     // Saves the state of the request corresponding to the file descriptor, 
     // since the data on a connection may not be non-blocking enough to read all at once,
     // so it is saved here and can continue to be read and processed when there is new data on that connection
-    static std::unordered_map<int, Request> requestStatus;
+    static Request* requestSlots[MAX_STATE_FD];
 
     // Save the state of the file descriptor corresponding to the sent data,
     // a process non-blocking write data may not be able to pass all the data,
     // so save the current state of the data sent, you can continue to pass the data
+    static Response* responseSlots[MAX_STATE_FD];
+
+    // A slot is only used by the event that currently owns the connection, and the next owner is handed the
+    // connection through epoll and the queues of the thread pool, so the slots are read and written without a lock.
+    // The state is allocated on first use and freed when it is erased.
+    //
+    // Connections beyond MAX_STATE_FD keep their state in maps shared by all the workers: lookups, insertions and
+    // erasures take statusLocker, and references to the state stay valid when the maps rehash.
+    static std::unordered_map<int, Request> requestStatus;
     static std::unordered_map<int, Response> responseStatus;
+    static pthread_mutex_t statusLocker;
+
+    static Request& getRequest(int fd);
+    static Request* findRequest(int fd);
+    static void eraseRequest(int fd);
+    static Response& getResponse(int fd);
+    static bool hasResponse(int fd);
+    static void eraseResponse(int fd);
 };
 
 // Events for accepting client connections
@@ -47,6 +260,11 @@ public:
 
     virtual void process() override;
 
+    // Accepts the connection only to answer it with 503
+    virtual bool reject() override;
+
+    virtual EVENTTYPE getEventType() const override { return EVENT_TYPE_ACCEPT; }
+
 private:
     int m_listenFd;    // Save listening sockets 
     int m_epollFd;     // The epoll that was added after receiving the connection
@@ -64,6 +282,36 @@ public:
     virtual ~HandleSig() = default;
 
     virtual void process() override;
+
+    virtual EVENTTYPE getEventType() const override { return EVENT_TYPE_SIG; }
+};
+
+// Runs one blocking filesystem call for a connection on the filesystem executor, saves the result in the state
+// of the connection and re-arms the connection in epoll so that its handler continues with the result
+class HandleFs : public EventBase {
+public:
+    // rearmOut : re-arm the connection for writing (true) or for reading (false) once the call is done
+    HandleFs(int clientFd, int epollFd, FSOPERATION operation, const std::string& name, bool rearmOut);
+    virtual ~HandleFs() = default;
+
+    virtual void process() override;
+
+    virtual EVENTTYPE getEventType() const override { return EVENT_TYPE_FS; }
+
+    // Data written by FS_APPEND and FS_COMMIT, the argument is emptied
+    void setData(std::string& data) { m_data.swap(data); }
+
+    // Writer of the upload for FS_APPEND and FS_COMMIT, kept alive by the task after the request is erased
+    void setWriter(const std::shared_ptr<StorageWriter>& writer) { m_writer = writer; }
+
+private:
+    int m_clientFd;           // Connection waiting for the result
+    int m_epollFd;            // epoll file descriptor, used to re-arm the connection
+    FSOPERATION m_operation;  // Filesystem call to run
+    std::string m_name;       // Stored file the call works on, empty for FS_LIST, the query string for FS_ARCHIVE
+    std::string m_data;       // Data to write
+    std::shared_ptr<StorageWriter> m_writer;
+    bool m_rearmOut;          // Interest to re-arm when the call is done
 };
 
 // Processing requests sent by the client
@@ -74,7 +322,26 @@ public:
 
     virtual void process() override;
 
+    // Answers with 503 and closes the connection if it is waiting for a new request
+    virtual bool reject() override;
+
+    virtual EVENTTYPE getEventType() const override { return EVENT_TYPE_RECV; }
+
+    // Moves the file data at the start of recvMsg to fileData, stopping before a CR that may start the closing boundary.
+    // Returns true when recvMsg starts with the closing boundary.
+    static bool extractFileContent(std::string& recvMsg, const std::string& boundary, std::string& fileData);
+
 private:
+    // Sets the resource of the response to send, with the route and start time of the request for the metrics
+    void prepareResponse(const std::string& bodyFileName);
+
+    // Records the memory of the request and checks it against the limits for the part being received.
+    // Returns false after refusing the request with 413 or 431, the connection must then be closed.
+    bool checkMemory();
+
+    // Best-effort answer to a request over a limit, unless a response is already being sent on the connection
+    void refuseRequest(HTTPSTATUS status, int retryAfterSec = 0);
+
     int m_clientFd;   // Client socket to read data from that client
     int m_epollFd;    // epoll file descriptor, used when you need to reset an event or close a connection
 };
@@ -86,23 +353,35 @@ public:
     virtual ~HandleSend() = default;
 
     virtual void process() override;
-    
-    // Used to construct the status line, the parameters represent each of the three parts of the status line
-    std::string getStatusLine(const std::string& httpVersion, const std::string& statusCode, const std::string& statusDes);
 
-    // The following two functions are used to build the file list page, and the final result is saved in fileListHtml.
-    void getFileListPage(std::string& fileListHtml);
+    virtual EVENTTYPE getEventType() const override { return EVENT_TYPE_SEND; }
+    
+    // Builds the whole file list page from the names of the storage, the final result is saved in fileListHtml.
+    // It blocks on the filesystem, the server streams the page instead (renderListingChunk).
+    static void getFileListPage(std::string& fileListHtml);
 
-    void getFileVec(const std::string& dirName, std::vector<std::string>& resVec);
+    // Template of the file list page, before and after the rows. It blocks on the filesystem.
+    static void getFileListTemplate(std::string& head, std::string& tail);
 
-    // Constructing header fields：
-    // contentLength        : Specifies the length of the message body
-    // contentType          : Specify the type of message body
-    // redirectLocation = "" : In the case of a redirected message, you can specify the address of the redirection. An empty string indicates that this initialization is not added。
-    // contentRange = ""    : If this is a response message for downloading a file, specify the range of files currently being sent. An empty string indicates that this initialization is not added。
-    std::string getMessageHeader(const std::string& contentLength, const std::string& contentType, const std::string& redirectLocation = "", const std::string& contentRange = "");
+    // Renders the rows of the next LISTING_BATCH_ROWS files of the index after the cursor of listing, or of the
+    // walk of the storage without the index, with the end of the template after the last one, as one chunk of a
+    // chunked body in out
+    static void renderListingChunk(ListingState& listing, std::string& out);
 
 private:
+    // Replaces the response by a new one for bodyFileName, keeping the route and start time of the request
+    void resetResponse(const std::string& bodyFileName);
+
+    // Builds the status line and headers of the response in its head buffer:
+    // contentLength      : Length of the message body
+    // contentType        : Type of the message body
+    // location = nullptr : Address of a redirection, no Location header without it
+    // The Repr-Digest of the response is added when it is known.
+    void setResponseHead(HTTPSTATUS status, unsigned long contentLength, CONTENTTYPE contentType, const char* location = nullptr);
+
+    // Error response with a JSON body {"error": error}
+    void setJsonErrorResponse(HTTPSTATUS status, const std::string& error);
+
     int m_clientFd;   // Client socket to write data to this client
     int m_epollFd;    // epoll file descriptor, used when you need to reset an event or close a connection
 };
@@ -1,10 +1,45 @@
 #include "fileserver.h"
+#include "../upgrade/handoff.h"
 
 int WebServer::m_epollfd = -1;
 bool WebServer::isStop = false;
 int WebServer::eventHandlerPipe[2] = {-1, -1};
 
-WebServer::WebServer() : m_listenfd(-1), threadPool(nullptr) {}
+// Reader of the open connections gauge of /metrics
+static long long readActiveConnNum() {
+    return EventBase::getActiveConnNum();
+}
+
+// Readers of the memory gauges of /metrics
+static long long readBufferedBytes() {
+    return EventBase::getBufferedBytes();
+}
+
+static long long readLargestConnectionBytes() {
+    return EventBase::getLargestConnectionBytes();
+}
+
+static long long readRateClientNum() {
+    return RateLimiter::getClientNum();
+}
+
+static long long readSearchNameNum() {
+    return NameSearch::getNameNum();
+}
+
+static long long readSearchMemoryBytes() {
+    return NameSearch::getMemoryBytes();
+}
+
+WebServer::WebServer() : m_listenfd(-1), threadPool(nullptr), fsExecutor(nullptr), m_epollWaitNum(0), m_epollEventNum(0), m_acceptPaused(false), m_affinity(AFFINITY_NONE), m_affinitySlot(0),
+                         m_upgradeHandoff(false), m_upgrading(false), m_draining(false), m_drained(false), m_drainDeadlineNs(0) {
+    Metrics::registerGauge("cherokee_active_connections", "Client connections currently open", readActiveConnNum);
+    Metrics::registerGauge("cherokee_buffered_bytes", "Memory held by the requests and responses of all the connections", readBufferedBytes);
+    Metrics::registerGauge("cherokee_connection_buffered_bytes_max", "Memory held by the largest connection", readLargestConnectionBytes);
+    Metrics::registerGauge("cherokee_rate_limited_clients", "Client addresses tracked by the rate limiter", readRateClientNum);
+    Metrics::registerGauge("cherokee_search_names", "File names in the search index", readSearchNameNum);
+    Metrics::registerGauge("cherokee_search_memory_bytes", "Memory held by the search index", readSearchMemoryBytes);
+}
 
 WebServer::~WebServer() {
     if (m_listenfd != -1) {
@@ -13,40 +48,62 @@ WebServer::~WebServer() {
     if (threadPool) {
         delete threadPool;
     }
+    if (fsExecutor) {
+        EventBase::setFsExecutor(nullptr);
+        delete fsExecutor;
+    }
 }
 
-int WebServer::createListenFd(int port, const char* ip) {
-    bzero(&m_serverAddr, sizeof(m_serverAddr));
-    m_serverAddr.sin_family = AF_INET;
-    m_serverAddr.sin_port = htons(port);
+int WebServer::openListenSocket(int port, const char* ip, bool reusePort) {
+    sockaddr_in serverAddr;
+    bzero(&serverAddr, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
     
     if (ip != nullptr) {
-        m_serverAddr.sin_addr.s_addr = inet_addr(ip);
+        serverAddr.sin_addr.s_addr = inet_addr(ip);
     } else {
-        m_serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     }
 
-    m_listenfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (m_listenfd < 0) {
+    int listenfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenfd < 0) {
         throw std::runtime_error("Socket creation failure: " + std::string(strerror(errno)));
     }
 
     int reuseAddr = 1;
-    if (setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr)) < 0) {
-        close(m_listenfd);
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr)) < 0) {
+        close(listenfd);
         throw std::runtime_error("Socket set address reuse failed: " + std::string(strerror(errno)));
     }
 
-    if (bind(m_listenfd, (sockaddr*)&m_serverAddr, sizeof(m_serverAddr)) < 0) {
-        close(m_listenfd);
+    // Sockets bound to the same port with SO_REUSEPORT each get their share of the new connections
+    int reusePortOpt = 1;
+    if (reusePort && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reusePortOpt, sizeof(reusePortOpt)) < 0) {
+        close(listenfd);
+        throw std::runtime_error("Socket set port reuse failed: " + std::string(strerror(errno)));
+    }
+
+    if (bind(listenfd, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+        close(listenfd);
         throw std::runtime_error("Socket binding address failure: " + std::string(strerror(errno)));
     }
 
-    if (listen(m_listenfd, 5) < 0) {
-        close(m_listenfd);
+    if (listen(listenfd, 5) < 0) {
+        close(listenfd);
         throw std::runtime_error("Socket open listening failed: " + std::string(strerror(errno)));
     }
 
+    return listenfd;
+}
+
+int WebServer::createListenFd(int port, const char* ip) {
+    m_listenfd = openListenSocket(port, ip, false);
+    return 0;
+}
+
+int WebServer::setListenFd(int listenfd) {
+    m_listenfd = listenfd;
     return 0;
 }
 
@@ -102,7 +159,7 @@ int WebServer::addHandleSig(int signo) {
 }
 
 void WebServer::setSigHandler(int signo) {
-    if ((signo & SIGINT) || (signo & SIGTERM)) {
+    if (signo == SIGINT || signo == SIGTERM) {
         isStop = true;
     }
     int saveErrno = errno;
@@ -116,33 +173,219 @@ void WebServer::setSigHandler(int signo) {
 int WebServer::waitEpoll() {
     isStop = false;
 
-    std::unique_ptr<EventBase> event;
+    if (m_affinity != AFFINITY_NONE && !pinCurrentThread(ThreadPool::getSlotCpus(m_affinity, m_affinitySlot))) {
+        std::cout << outHead("error") << "Failed to pin the reactor thread to its CPUs" << std::endl;
+    }
+
+    // Events built from one epoll_wait result, handed to the thread pool in a single batch
+    EventBase* batchEvents[MAX_RESEVENT_SIZE];
+    EVENTCLASS batchClasses[MAX_RESEVENT_SIZE];
+    int batchResults[MAX_RESEVENT_SIZE];   // Index in resEvents of each event of the batch
 
     while (!isStop) {
-        int resNum = epoll_wait(m_epollfd, resEvents, MAX_RESEVENT_SIZE, -1);
+        updateAcceptState();
+
+        // While accepting is paused, wake up regularly to check whether it can resume, while draining whether it is done
+        int resNum = epoll_wait(m_epollfd, resEvents, MAX_RESEVENT_SIZE, (m_acceptPaused || m_draining) ? 100 : -1);
         if (resNum < 0 && errno != EINTR) {
             throw std::runtime_error("epoll_wait execution error: " + std::string(strerror(errno)));
         }
+        Metrics::countSyscall(SYSCALL_EPOLL_WAIT);
+        if (resNum > 0) {
+            m_epollWaitNum.fetch_add(1, std::memory_order_relaxed);
+            m_epollEventNum.fetch_add(resNum, std::memory_order_relaxed);
+        }
+
+        int batchNum = 0;
+        bool pipeReadable = false;
         for (int i = 0; i < resNum; ++i) {
             int resfd = resEvents[i].data.fd;
+            EventBase* event = nullptr;
+            EVENTCLASS eventClass = EVENT_CONTROL;
             if (resfd == m_listenfd) {
-                event.reset(new AcceptConn(m_listenfd, m_epollfd));
+                event = new AcceptConn(m_listenfd, m_epollfd);
+                eventClass = EVENT_ACCEPT;
             } else if ((resfd == eventHandlerPipe[0]) && (resEvents[i].events & EPOLLIN)) {
-                // Handle signaling events
+                // Handle signaling events once the batch is dispatched, a drain closes the listening socket
+                pipeReadable = true;
                 continue;
             } else if (resEvents[i].events & EPOLLIN) {
-                event.reset(new HandleRecv(resEvents[i].data.fd, m_epollfd));
+                EventBase::setFdFired(resfd);
+                event = new HandleRecv(resEvents[i].data.fd, m_epollfd);
+                eventClass = EventBase::getFdEventClass(resfd);
             } else if (resEvents[i].events & EPOLLOUT) {
-                event.reset(new HandleSend(resEvents[i].data.fd, m_epollfd));
+                EventBase::setFdFired(resfd);
+                event = new HandleSend(resEvents[i].data.fd, m_epollfd);
+                eventClass = EventBase::getFdEventClass(resfd);
             }
             if (event) {
-                threadPool->appendEvent(event.release(), "event");
+                batchEvents[batchNum] = event;
+                batchClasses[batchNum] = eventClass;
+                batchResults[batchNum] = i;
+                ++batchNum;
+            }
+        }
+        if (batchNum > 0 && threadPool->appendEvents(batchEvents, batchClasses, batchNum) == -1) {
+            // The connections were disarmed by epoll, they are armed again and report their event at the next wait.
+            // The listening socket is edge-triggered, modifying it reports the connections still in its queue.
+            std::cout << outHead("error") << "Failed to queue " << batchNum << " events, their descriptors are armed again" << std::endl;
+            for (int i = 0; i < batchNum; ++i) {
+                int resfd = resEvents[batchResults[i]].data.fd;
+                if (resfd == m_listenfd) {
+                    modifyWaitFd(m_epollfd, m_listenfd, true);
+                } else {
+                    EventBase::rearmDroppedFd(m_epollfd, resfd, (resEvents[batchResults[i]].events & EPOLLIN) == 0);
+                }
+                delete batchEvents[i];
             }
         }
+        if (pipeReadable) {
+            readEventPipe();
+        }
+
+        if (m_draining && (EventBase::getActiveConnNum() == 0 || getMonotonicNs() >= m_drainDeadlineNs)) {
+            std::cout << outHead("info") << "Drain finished, " << EventBase::getActiveConnNum() << " connections left" << std::endl;
+            m_drained = true;
+            break;
+        }
     }
     return 0;
 }
 
+int WebServer::enableUpgrade(bool handoff) {
+    m_upgradeHandoff = handoff;
+    epollAddEventPipe();
+    return addHandleSig(UPGRADE_SIGNAL);
+}
+
+void WebServer::readEventPipe() {
+    int msg;
+    while (recv(eventHandlerPipe[0], &msg, sizeof(msg), 0) == sizeof(msg)) {
+        if (msg == UPGRADE_SIGNAL) {
+            if (m_upgradeHandoff) {
+                beginUpgrade();
+            } else {
+                startDrain();
+            }
+        } else if (msg == UPGRADE_READY_MSG) {
+            startDrain();
+        }
+    }
+}
+
+void WebServer::beginUpgrade() {
+    if (m_draining || m_upgrading.exchange(true)) {
+        std::cout << outHead("error") << "An upgrade is already in progress" << std::endl;
+        return;
+    }
+    pthread_t thread;
+    int ret = pthread_create(&thread, nullptr, runHandoff, this);
+    if (ret != 0) {
+        m_upgrading.store(false);
+        std::cout << outHead("error") << "Failed to start the upgrade thread: " << strerror(ret) << std::endl;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+void* WebServer::runHandoff(void* arg) {
+    WebServer* server = static_cast<WebServer*>(arg);
+    // Both servers write the storage and the index until this one exits
+    if (!Storage::setShared()) {
+        std::cout << outHead("error") << "Failed to open the lock of the object store (errno = " << errno << ")" << std::endl;
+    }
+    FileIndex::setShared();
+
+    std::vector<int> listenFds(1, server->m_listenfd);
+    if (Handoff::start(listenFds) > 0) {
+        int msg = UPGRADE_READY_MSG;
+        if (send(eventHandlerPipe[1], &msg, sizeof(msg), 0) != sizeof(msg)) {
+            std::cout << outHead("error") << "Failed to report the end of the upgrade, the server keeps accepting" << std::endl;
+        }
+    }
+    server->m_upgrading.store(false);
+    return nullptr;
+}
+
+void WebServer::startDrain() {
+    if (m_draining) {
+        return;
+    }
+    m_draining = true;
+    m_drainDeadlineNs = getMonotonicNs() + HANDOFF_DRAIN_TIMEOUT_SEC * 1000000000LL;
+    EventBase::setDraining(true);
+    // The socket stays open in the new server, the connections in its queue are accepted there. It is not closed
+    // here: accept events already queued in the pool still use its number, they see the drain and accept nothing.
+    if (!m_acceptPaused) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, nullptr);
+    }
+    // Idle keep-alive connections would otherwise hold the drain until the client closes them or the timeout
+    int idleNum = EventBase::closeIdleConnections(m_epollfd);
+    std::cout << outHead("info") << "Not accepting anymore, " << idleNum << " idle connections closed, draining " << EventBase::getActiveConnNum() << " connections" << std::endl;
+}
+
+void WebServer::setOverloadLimits(const OverloadLimits &limits) {
+    EventBase::setOverloadLimits(limits);
+    if (threadPool) {
+        threadPool->setQueueDelayTarget(limits.codelTargetMs, limits.codelIntervalMs);
+    }
+}
+
+void WebServer::setServeLimits(const ServeLimits &limits) {
+    EventBase::setServeLimits(limits);
+}
+
+void WebServer::setMemoryLimits(const MemoryLimits &limits) {
+    EventBase::setMemoryLimits(limits);
+}
+
+void WebServer::setRateLimits(const RateLimits &limits) {
+    RateLimiter::setLimits(limits);
+}
+
+void WebServer::updateAcceptState() {
+    if (m_draining) {
+        return;
+    }
+    int queuedNum = threadPool->getQueuedNum();
+    int highWater = EventBase::getOverloadLimits().maxQueueDepth;
+
+    if (!m_acceptPaused && queuedNum >= highWater) {
+        if (epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, nullptr) == 0) {
+            m_acceptPaused = true;
+            std::cout << outHead("error") << "Event queue reached " << queuedNum << " events, accepting new connections is paused" << std::endl;
+        }
+    } else if (m_acceptPaused && queuedNum < highWater / 2) {
+        // Connections that arrived in the meantime are reported as soon as the socket is added back
+        addWaitFd(m_epollfd, m_listenfd, true, false);
+        m_acceptPaused = false;
+        std::cout << outHead("info") << "Event queue down to " << queuedNum << " events, accepting new connections again" << std::endl;
+    }
+}
+
+void WebServer::getEpollStats(unsigned long long &epollWaitNum, unsigned long long &epollEventNum) const {
+    epollWaitNum = m_epollWaitNum.load(std::memory_order_relaxed);
+    epollEventNum = m_epollEventNum.load(std::memory_order_relaxed);
+}
+
+void WebServer::getPoolStats(PoolStats &poolStats, PoolStats &fsStats) {
+    if (threadPool) {
+        threadPool->getStats(poolStats);
+    }
+    if (fsExecutor) {
+        fsExecutor->getStats(fsStats);
+    }
+}
+
+void WebServer::setStatsDumpInterval(int intervalSec) {
+    if (threadPool) {
+        threadPool->setStatsDumpInterval(intervalSec);
+    }
+    if (fsExecutor) {
+        fsExecutor->setStatsDumpInterval(intervalSec);
+    }
+}
+
 int WebServer::createThreadPool(int threadNum) {
     try {
         threadPool = new ThreadPool(threadNum);
@@ -155,6 +398,34 @@ int WebServer::createThreadPool(int threadNum) {
     return 0;
 }
 
+int WebServer::createThreadPool(const PoolConfig &config) {
+    try {
+        threadPool = new ThreadPool(config);
+    } catch (std::runtime_error &err) {
+        std::cout << err.what() << std::endl;
+    }
+    if (!threadPool) {
+        throw std::runtime_error("Thread pool creation failed");
+    }
+    m_affinity = config.affinity;
+    m_affinitySlot = config.firstSlot;
+    return 0;
+}
+
+int WebServer::createFsExecutor(int threadNum) {
+    try {
+        // Filesystem calls are served in arrival order, there is only one class of event in this pool
+        fsExecutor = new ThreadPool(threadNum, SCHED_STRICT);
+    } catch (std::runtime_error &err) {
+        std::cout << err.what() << std::endl;
+    }
+    if (!fsExecutor) {
+        throw std::runtime_error("Filesystem executor creation failed");
+    }
+    EventBase::setFsExecutor(fsExecutor);
+    return 0;
+}
+
 void WebServer::setNonBlocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1) {
@@ -13,10 +13,12 @@
 #include <fcntl.h>  // For fcntl
 #include <sys/socket.h>
 #include <memory>
+#include <atomic>
 
 #include "../threadpool/threadpool.h"
 
 #define MAX_RESEVENT_SIZE 1024 // Maximum number of events
+#define UPGRADE_READY_MSG 0      // Message of the event pipe once the new server accepts, signals are not 0
 
 class WebServer {
 public:
@@ -26,6 +28,12 @@ public:
     // Create sockets to wait for clients to connect and turn on listening
     int createListenFd(int port, const char* ip = nullptr);
 
+    // Serve on a socket that is already listening, such as one opened by the prefork supervisor
+    int setListenFd(int listenfd);
+
+    // Create a listening socket and return it, with reusePort several sockets can share the port
+    static int openListenSocket(int port, const char* ip = nullptr, bool reusePort = false);
+
     // Create epoll routines to listen on sockets
     int createEpoll();
 
@@ -44,12 +52,49 @@ public:
     // The main thread is responsible for listening to all events
     int waitEpoll();
 
+    // UPGRADE_SIGNAL, through the event pipe, starts a binary upgrade: with handoff the server passes its listening
+    // socket to the new binary (see upgrade/handoff.h) and drains once the new server accepts, without it (a prefork
+    // worker, its supervisor makes the handoff) it drains at once. Must be called after createEpoll.
+    int enableUpgrade(bool handoff);
+
+    // waitEpoll returned because the server drained its connections after an upgrade
+    bool isDrained() const { return m_drained; }
+
     // Creating a Thread Pool
     int createThreadPool(int threadNum = 8);
 
+    // Creating an elastic Thread Pool sized from the available CPUs, its affinity policy also places the reactor thread
+    int createThreadPool(const PoolConfig &config);
+
+    // Creating the pool that runs blocking filesystem calls (open, stat, unlink, directory reads, file writes),
+    // so that the threads serving sockets never wait on the disk
+    int createFsExecutor(int threadNum = 2);
+
+    // Number of epoll_wait calls that returned events and number of events they returned,
+    // the number of events per batch handed to the thread pool is given by ThreadPool::getBatchStats
+    void getEpollStats(unsigned long long &epollWaitNum, unsigned long long &epollEventNum) const;
+
+    // Instrumentation of the thread pool and of the filesystem executor (queue wait, service time, mutex contention, busy ratio)
+    void getPoolStats(PoolStats &poolStats, PoolStats &fsStats);
+
+    // Dumping the instrumentation of both pools to the log every intervalSec seconds, must be called after the pools are created
+    void setStatsDumpInterval(int intervalSec);
+
+    // Setting the limits used to shed load, must be called after createThreadPool
+    void setOverloadLimits(const OverloadLimits &limits);
+
+    // Setting the file sizes at which downloads switch from memory to sendfile and to sequential readahead
+    void setServeLimits(const ServeLimits &limits);
+
+    // Setting the largest headers, buffered body and memory per connection, requests over them get 431 or 413
+    void setMemoryLimits(const MemoryLimits &limits);
+
+    // Setting the limits of connections and request rate per client address and the allowed and denied ranges,
+    // must be called before the server accepts connections
+    void setRateLimits(const RateLimits &limits);
+
 private:
     int m_listenfd;                   // Sockets on the server side
-    sockaddr_in m_serverAddr;         // Address information for server-side socket bindings
     static int m_epollfd;             // epoll routine file descriptor for I/O multiplexing
     static bool isStop;               // Whether to suspend the server
 
@@ -58,6 +103,33 @@ private:
     epoll_event resEvents[MAX_RESEVENT_SIZE]; // Array holding results of epoll_wait
 
     ThreadPool *threadPool;
+    ThreadPool *fsExecutor;           // Filesystem executor, its events complete by re-arming their connection
+
+    std::atomic<unsigned long long> m_epollWaitNum;   // Number of epoll_wait calls that returned events
+    std::atomic<unsigned long long> m_epollEventNum;  // Number of events returned by epoll_wait
+
+    bool m_acceptPaused;              // The listening socket is removed from epoll
+    AFFINITYPOLICY m_affinity;        // Placement of the reactor thread
+    int m_affinitySlot;
+
+    // Stops accepting when the pool queue reaches the high-water mark, resumes below half of it
+    void updateAcceptState();
+
+    // Handles the signals and messages written to the event pipe
+    void readEventPipe();
+
+    // Hands the listening socket over in a thread of its own, the reactor keeps serving meanwhile
+    void beginUpgrade();
+    static void* runHandoff(void* arg);
+
+    // Stops accepting and closes the connections as their responses end, until none is left or the drain times out
+    void startDrain();
+
+    bool m_upgradeHandoff;            // UPGRADE_SIGNAL starts a handoff rather than a drain
+    std::atomic<bool> m_upgrading;    // A handoff is in progress
+    bool m_draining;
+    bool m_drained;
+    long long m_drainDeadlineNs;
 
     void setNonBlocking(int fd);
     int addWaitFd(int epollfd, int fd, bool enableET, bool oneShot);
@@ -0,0 +1,852 @@
+#include "fileindex.h"
+
+#include <map>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../utils/utils.h"
+#include "../storage/storage.h"
+
+// Change of a file kept in memory until the next snapshot, a removal hides the file of the snapshot
+struct DeltaEntry {
+    bool removed = false;
+    FileEntry entry;
+};
+
+// Record of the journal, followed by the name
+struct JournalRecord {
+    uint32_t removed;
+    uint32_t nameLen;
+    uint64_t size;
+    int64_t mtimeNs;
+    uint64_t hash;
+    int64_t dirMtimeNs;
+};
+
+static std::string snapshotPath;
+static std::string journalPath;
+static bool initialized = false;
+
+// Pages are read by the workers, changes come from the filesystem executor
+static pthread_rwlock_t indexLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void* snapshotMap = nullptr;
+static size_t snapshotMapLen = 0;
+static const IndexRecord* snapshotRecords = nullptr;
+static const uint32_t* snapshotBySize = nullptr;
+static const uint32_t* snapshotByMtime = nullptr;
+static const char* snapshotNames = nullptr;
+static uint64_t snapshotCount = 0;
+
+static std::map<std::string, DeltaEntry> delta;
+static uint64_t liveCount = 0;
+static int journalFd = -1;
+static int64_t lastDirMtimeNs = 0;   // Directory mtime after the last change known to the index
+
+// Index shared with other processes through its files. Set under the write lock, but read by list() before it locks:
+// an upgrade switches it while the workers serve.
+static std::atomic<bool> shared(false);
+static ino_t snapshotIno = 0;        // Inode of the mapped snapshot, a compaction renames a new one in its place
+static off_t journalReplayed = 0;    // Journal bytes applied to the delta
+
+// Lock of the journal between the processes sharing the index: appends and reads share it, a compaction takes it alone
+static void lockJournal(int operation) {
+    if (shared && journalFd != -1) {
+        while (flock(journalFd, operation) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+static int64_t getMtimeNs(const struct stat& fileStat) {
+    return static_cast<int64_t>(fileStat.st_mtim.tv_sec) * 1000000000LL + fileStat.st_mtim.tv_nsec;
+}
+
+static int64_t getDirMtimeNs() {
+    struct stat dirStat;
+    return stat(Storage::getRoot().c_str(), &dirStat) == 0 ? getMtimeNs(dirStat) : 0;
+}
+
+static uint64_t getSortKey(INDEXSORT sort, uint64_t size, int64_t mtimeNs) {
+    if (sort == SORT_SIZE) {
+        return size;
+    }
+    if (sort == SORT_MTIME) {
+        return mtimeNs > 0 ? static_cast<uint64_t>(mtimeNs) : 0;
+    }
+    return 0;
+}
+
+// Order of the sorts: by key, then by name compared as unsigned bytes
+static int compareKeys(uint64_t keyA, const char* nameA, size_t lenA, uint64_t keyB, const char* nameB, size_t lenB) {
+    if (keyA != keyB) {
+        return keyA < keyB ? -1 : 1;
+    }
+    int ret = memcmp(nameA, nameB, std::min(lenA, lenB));
+    if (ret != 0) {
+        return ret;
+    }
+    return lenA < lenB ? -1 : (lenA > lenB ? 1 : 0);
+}
+
+static bool hasPrefix(const char* name, size_t len, const std::string& prefix) {
+    return len >= prefix.size() && memcmp(name, prefix.data(), prefix.size()) == 0;
+}
+
+// First position of [0, n) where pred is false, pred being true and then false
+template <typename Pred>
+static uint64_t partitionPoint(uint64_t n, Pred pred) {
+    uint64_t low = 0, high = n;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (pred(mid)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Record at position pos of the order of sort
+static const IndexRecord& snapshotAt(INDEXSORT sort, uint64_t pos) {
+    if (sort == SORT_SIZE) {
+        return snapshotRecords[snapshotBySize[pos]];
+    }
+    if (sort == SORT_MTIME) {
+        return snapshotRecords[snapshotByMtime[pos]];
+    }
+    return snapshotRecords[pos];
+}
+
+static bool writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t ret = write(fd, data, len);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static int getHexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// A cursor is the sort letter, the key in 16 hex digits and the name in hex
+static std::string encodeCursor(INDEXSORT sort, uint64_t key, const std::string& name) {
+    std::string cursor(1, "nsm"[sort]);
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        cursor += hexDigits[(key >> shift) & 0xf];
+    }
+    for (unsigned char c : name) {
+        cursor += hexDigits[c >> 4];
+        cursor += hexDigits[c & 0xf];
+    }
+    return cursor;
+}
+
+static bool decodeCursor(const std::string& cursor, ListQuery& query) {
+    if (cursor.size() < 17 || cursor.size() % 2 != 1 || cursor[0] != "nsm"[query.sort]) {
+        return false;
+    }
+    uint64_t key = 0;
+    for (int i = 1; i <= 16; ++i) {
+        int value = getHexValue(cursor[i]);
+        if (value < 0) {
+            return false;
+        }
+        key = (key << 4) | value;
+    }
+    std::string name;
+    for (size_t i = 17; i < cursor.size(); i += 2) {
+        int high = getHexValue(cursor[i]), low = getHexValue(cursor[i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        name += static_cast<char>((high << 4) | low);
+    }
+    query.hasCursor = true;
+    query.cursorKey = key;
+    query.cursorName = name;
+    return true;
+}
+
+bool FileIndex::init(const std::string& indexPath) {
+    pthread_rwlock_wrlock(&indexLock);
+    snapshotPath = indexPath;
+    journalPath = indexPath + ".journal";
+
+    bool ok = loadSnapshot();
+    if (ok) {
+        journalReplayed = replayJournal(0);
+    }
+    // Files added or removed while the server was stopped change the mtime of the root, files dropped
+    // by hand into an existing shard directory are not seen until the index file is deleted
+    if (!ok || lastDirMtimeNs != getDirMtimeNs()) {
+        std::cout << outHead("info") << "Rebuilding the file index of " << Storage::getRoot() << std::endl;
+        ok = rebuild();
+    }
+    if (ok) {
+        journalFd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        ok = journalFd != -1;
+    }
+    if (ok && delta.size() >= INDEX_DELTA_MAX) {
+        compact();
+    }
+    initialized = ok;
+    uint64_t fileNum = liveCount;
+    pthread_rwlock_unlock(&indexLock);
+
+    if (ok) {
+        std::cout << outHead("info") << "File index of " << Storage::getRoot() << " loaded, " << fileNum << " files" << std::endl;
+    } else {
+        std::cout << outHead("error") << "Failed to load the file index " << indexPath << " (errno = " << errno << ")" << std::endl;
+    }
+    return ok;
+}
+
+void FileIndex::update(const std::string& name, uint64_t hash) {
+    if (!initialized) {
+        return;
+    }
+    struct stat fileStat;
+    if (Storage::statFile(name, fileStat) != 0) {
+        return;
+    }
+    FileEntry entry;
+    entry.name = name;
+    entry.size = fileStat.st_size;
+    entry.mtimeNs = getMtimeNs(fileStat);
+    entry.hash = hash;
+    int64_t dirMtimeNs = getDirMtimeNs();
+
+    pthread_rwlock_wrlock(&indexLock);
+    lockJournal(LOCK_SH);
+    refresh();
+    applyChange(false, entry);
+    lastDirMtimeNs = dirMtimeNs;
+    appendJournal(false, entry, dirMtimeNs);
+    lockJournal(LOCK_UN);
+    if (delta.size() >= INDEX_DELTA_MAX) {
+        compact();
+    }
+    pthread_rwlock_unlock(&indexLock);
+}
+
+void FileIndex::remove(const std::string& name) {
+    if (!initialized) {
+        return;
+    }
+    FileEntry entry;
+    entry.name = name;
+    int64_t dirMtimeNs = getDirMtimeNs();
+
+    pthread_rwlock_wrlock(&indexLock);
+    lockJournal(LOCK_SH);
+    refresh();
+    applyChange(true, entry);
+    lastDirMtimeNs = dirMtimeNs;
+    appendJournal(true, entry, dirMtimeNs);
+    lockJournal(LOCK_UN);
+    if (delta.size() >= INDEX_DELTA_MAX) {
+        compact();
+    }
+    pthread_rwlock_unlock(&indexLock);
+}
+
+bool FileIndex::isReady() {
+    return initialized;
+}
+
+void FileIndex::setShared() {
+    pthread_rwlock_wrlock(&indexLock);
+    shared = true;
+    // A descriptor of its own, the locks of a descriptor inherited from the parent would be shared with it
+    if (journalFd != -1) {
+        close(journalFd);
+        journalFd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+    pthread_rwlock_unlock(&indexLock);
+}
+
+void FileIndex::refresh() {
+    if (!shared || journalFd == -1) {
+        return;
+    }
+    struct stat snapshotStat, journalStat;
+    if (stat(snapshotPath.c_str(), &snapshotStat) != 0 || fstat(journalFd, &journalStat) != 0) {
+        return;
+    }
+    if (snapshotStat.st_ino != snapshotIno) {
+        // Another process compacted the index: its snapshot holds the journal it truncated
+        delta.clear();
+        journalReplayed = 0;
+        if (!loadSnapshot()) {
+            std::cout << outHead("error") << "Failed to load the file index snapshot " << snapshotPath << std::endl;
+            return;
+        }
+    }
+    if (journalStat.st_size > journalReplayed) {
+        journalReplayed = replayJournal(journalReplayed);
+    }
+}
+
+bool FileIndex::parseQuery(const std::string& queryString, ListQuery& query, std::string& error) {
+    std::string cursor;
+    for (const auto& param : parseQueryString(queryString)) {
+        const std::string& key = param.first;
+        const std::string& value = param.second;
+        if (key == "limit") {
+            if (value.empty() || value.size() > 4 || value.find_first_not_of("0123456789") != std::string::npos ||
+                atoi(value.c_str()) < 1 || atoi(value.c_str()) > INDEX_PAGE_MAX) {
+                error = "limit must be between 1 and " + std::to_string(INDEX_PAGE_MAX);
+                return false;
+            }
+            query.limit = atoi(value.c_str());
+        } else if (key == "sort") {
+            query.descending = !value.empty() && value[0] == '-';
+            std::string field = query.descending ? value.substr(1) : value;
+            if (field == "name") {
+                query.sort = SORT_NAME;
+            } else if (field == "size") {
+                query.sort = SORT_SIZE;
+            } else if (field == "mtime") {
+                query.sort = SORT_MTIME;
+            } else {
+                error = "sort must be name, size or mtime, with a leading - for a descending order";
+                return false;
+            }
+        } else if (key == "prefix") {
+            query.prefix = value;
+        } else if (key == "cursor") {
+            cursor = value;
+        }
+    }
+
+    // The cursor is decoded last, it depends on the sort
+    if (!cursor.empty() && !decodeCursor(cursor, query)) {
+        error = "invalid cursor for this sort";
+        return false;
+    }
+    return true;
+}
+
+bool FileIndex::parseCursor(const std::string& cursor, ListQuery& query) {
+    return decodeCursor(cursor, query);
+}
+
+void FileIndex::list(const ListQuery& query, ListPage& page) {
+    page.entries.clear();
+    page.nextCursor.clear();
+    page.total = 0;
+    if (!initialized) {
+        return;
+    }
+
+    if (shared) {
+        pthread_rwlock_wrlock(&indexLock);
+        lockJournal(LOCK_SH);
+        refresh();
+        lockJournal(LOCK_UN);
+        pthread_rwlock_unlock(&indexLock);
+    }
+
+    pthread_rwlock_rdlock(&indexLock);
+    const INDEXSORT sort = query.sort;
+    const bool asc = !query.descending;
+    const std::string& prefix = query.prefix;
+
+    // Names of the snapshot that match the prefix, contiguous in the name order
+    uint64_t pBegin = 0, pEnd = snapshotCount;
+    if (!prefix.empty()) {
+        pBegin = partitionPoint(snapshotCount, [&](uint64_t pos) {
+            const IndexRecord& rec = snapshotRecords[pos];
+            return compareKeys(0, snapshotNames + rec.nameOffset, rec.nameLen, 0, prefix.data(), prefix.size()) < 0;
+        });
+        pEnd = partitionPoint(snapshotCount, [&](uint64_t pos) {
+            const IndexRecord& rec = snapshotRecords[pos];
+            const char* name = snapshotNames + rec.nameOffset;
+            return compareKeys(0, name, rec.nameLen, 0, prefix.data(), prefix.size()) < 0 || hasPrefix(name, rec.nameLen, prefix);
+        });
+    }
+
+    // Files of the delta that match the prefix, in the order of the sort. With a prefix, the total counts the
+    // files of its snapshot range not changed in the delta, then the live files of the delta
+    std::vector<const FileEntry*> added;
+    uint64_t changed = 0;
+    for (std::map<std::string, DeltaEntry>::const_iterator it = delta.lower_bound(prefix);
+         it != delta.end() && hasPrefix(it->first.data(), it->first.size(), prefix); ++it) {
+        if (!it->second.removed) {
+            added.push_back(&it->second.entry);
+        }
+        if (!prefix.empty() && snapshotContains(it->first)) {
+            ++changed;
+        }
+    }
+    page.total = prefix.empty() ? liveCount : pEnd - pBegin - changed + added.size();
+    if (sort != SORT_NAME) {
+        std::sort(added.begin(), added.end(), [sort](const FileEntry* a, const FileEntry* b) {
+            return compareKeys(getSortKey(sort, a->size, a->mtimeNs), a->name.data(), a->name.size(),
+                               getSortKey(sort, b->size, b->mtimeNs), b->name.data(), b->name.size()) < 0;
+        });
+    }
+
+    // Range of positions to walk in the snapshot and in the delta: in the name order only the prefix range
+    // is walked, and the page starts after (or before, when descending) the cursor
+    uint64_t sBegin = 0, sEnd = snapshotCount;
+    if (sort == SORT_NAME) {
+        sBegin = pBegin;
+        sEnd = pEnd;
+    }
+    size_t dBegin = 0, dEnd = added.size();
+    if (query.hasCursor) {
+        const std::string& cursorName = query.cursorName;
+        uint64_t sCursor = partitionPoint(snapshotCount, [&](uint64_t pos) {
+            const IndexRecord& rec = snapshotAt(sort, pos);
+            int ret = compareKeys(getSortKey(sort, rec.size, rec.mtimeNs), snapshotNames + rec.nameOffset, rec.nameLen,
+                                  query.cursorKey, cursorName.data(), cursorName.size());
+            return asc ? ret <= 0 : ret < 0;
+        });
+        size_t dCursor = partitionPoint(added.size(), [&](uint64_t pos) {
+            const FileEntry* entry = added[pos];
+            int ret = compareKeys(getSortKey(sort, entry->size, entry->mtimeNs), entry->name.data(), entry->name.size(),
+                                  query.cursorKey, cursorName.data(), cursorName.size());
+            return asc ? ret <= 0 : ret < 0;
+        });
+        if (asc) {
+            sBegin = std::max(sBegin, sCursor);
+            dBegin = dCursor;
+        } else {
+            sEnd = std::min(sEnd, sCursor);
+            dEnd = dCursor;
+        }
+    }
+
+    // Walks the snapshot to its next file of the page, skipping the files changed in the delta and,
+    // outside of a name sort, the files without the prefix
+    uint64_t sPos = asc ? sBegin : sEnd;
+    size_t dPos = asc ? dBegin : dEnd;
+    size_t scanned = 0;
+    uint64_t lastKey = 0;
+    std::string lastName;
+    auto nextSnapshot = [&]() -> const IndexRecord* {
+        while (asc ? sPos < sEnd : sPos > sBegin) {
+            if (scanned >= INDEX_SCAN_MAX) {
+                return nullptr;
+            }
+            const IndexRecord& rec = snapshotAt(sort, asc ? sPos++ : --sPos);
+            const char* name = snapshotNames + rec.nameOffset;
+            if (hasPrefix(name, rec.nameLen, prefix) && delta.find(std::string(name, rec.nameLen)) == delta.end()) {
+                return &rec;
+            }
+            ++scanned;
+            lastKey = getSortKey(sort, rec.size, rec.mtimeNs);
+            lastName.assign(name, rec.nameLen);
+        }
+        return nullptr;
+    };
+
+    const IndexRecord* sCand = nextSnapshot();
+    while (true) {
+        const FileEntry* dCand = (asc ? dPos < dEnd : dPos > dBegin) ? added[asc ? dPos : dPos - 1] : nullptr;
+        if (sCand == nullptr && dCand == nullptr) {
+            // A page that stopped on the scan limit goes on from the last file it looked at
+            if (scanned >= INDEX_SCAN_MAX) {
+                page.nextCursor = encodeCursor(sort, lastKey, lastName);
+            }
+            break;
+        }
+        if (static_cast<int>(page.entries.size()) >= query.limit) {
+            page.nextCursor = encodeCursor(sort, lastKey, lastName);
+            break;
+        }
+
+        bool takeDelta = sCand == nullptr;
+        if (sCand != nullptr && dCand != nullptr) {
+            int ret = compareKeys(getSortKey(sort, dCand->size, dCand->mtimeNs), dCand->name.data(), dCand->name.size(),
+                                  getSortKey(sort, sCand->size, sCand->mtimeNs), snapshotNames + sCand->nameOffset, sCand->nameLen);
+            takeDelta = asc ? ret < 0 : ret > 0;
+        }
+        if (takeDelta) {
+            page.entries.push_back(*dCand);
+            asc ? ++dPos : --dPos;
+        } else {
+            FileEntry entry;
+            entry.name.assign(snapshotNames + sCand->nameOffset, sCand->nameLen);
+            entry.size = sCand->size;
+            entry.mtimeNs = sCand->mtimeNs;
+            entry.hash = sCand->hash;
+            page.entries.push_back(entry);
+            sCand = nextSnapshot();
+        }
+        lastKey = getSortKey(sort, page.entries.back().size, page.entries.back().mtimeNs);
+        lastName = page.entries.back().name;
+    }
+    pthread_rwlock_unlock(&indexLock);
+}
+
+void FileIndex::listNames(std::vector<std::string>& names) {
+    names.clear();
+    if (!initialized) {
+        return;
+    }
+    std::vector<FileEntry> entries;
+    pthread_rwlock_wrlock(&indexLock);
+    if (shared) {
+        lockJournal(LOCK_SH);
+        refresh();
+        lockJournal(LOCK_UN);
+    }
+    collectEntries(entries);
+    pthread_rwlock_unlock(&indexLock);
+
+    names.reserve(entries.size());
+    for (FileEntry& entry : entries) {
+        names.push_back(std::move(entry.name));
+    }
+}
+
+void FileIndex::renderJson(const ListPage& page, std::string& out) {
+    out += "{\"total\":" + std::to_string(page.total) + ",\"files\":[";
+    for (size_t i = 0; i < page.entries.size(); ++i) {
+        const FileEntry& entry = page.entries[i];
+        out += i == 0 ? "{\"name\":" : ",{\"name\":";
+        appendJsonString(out, entry.name);
+        out += ",\"size\":" + std::to_string(entry.size) + ",\"mtime\":" + std::to_string(entry.mtimeNs / 1000000000LL) +
+               ",\"mtime_ns\":" + std::to_string(entry.mtimeNs);
+        if (entry.hash != 0) {
+            out += ",\"hash\":\"";
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                out += hexDigits[(entry.hash >> shift) & 0xf];
+            }
+            out += "\"";
+        }
+        out += "}";
+    }
+    out += "],\"next_cursor\":";
+    if (page.nextCursor.empty()) {
+        out += "null";
+    } else {
+        appendJsonString(out, page.nextCursor);
+    }
+    out += "}\n";
+}
+
+bool FileIndex::loadSnapshot() {
+    unmapSnapshot();
+    int fd = open(snapshotPath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size < static_cast<off_t>(sizeof(IndexHeader))) {
+        close(fd);
+        return false;
+    }
+    size_t mapLen = fileStat.st_size;
+    ino_t ino = fileStat.st_ino;
+    void* map = mmap(nullptr, mapLen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const IndexHeader* header = static_cast<const IndexHeader*>(map);
+    const uint64_t count = header->count;
+    bool valid = header->magic == INDEX_MAGIC && header->version == INDEX_VERSION && header->recordSize == sizeof(IndexRecord) &&
+                 count <= 0xffffffffULL && header->namesBytes <= 0xffffffffULL &&
+                 mapLen >= sizeof(IndexHeader) + count * (sizeof(IndexRecord) + 2 * sizeof(uint32_t)) + header->namesBytes;
+    const IndexRecord* records = reinterpret_cast<const IndexRecord*>(header + 1);
+    const uint32_t* bySize = reinterpret_cast<const uint32_t*>(records + (valid ? count : 0));
+    const uint32_t* byMtime = bySize + (valid ? count : 0);
+    // A damaged snapshot is rebuilt from the directory rather than read out of bounds
+    for (uint64_t i = 0; valid && i < count; ++i) {
+        valid = static_cast<uint64_t>(records[i].nameOffset) + records[i].nameLen <= header->namesBytes && bySize[i] < count && byMtime[i] < count;
+    }
+    if (!valid) {
+        munmap(map, mapLen);
+        return false;
+    }
+
+    snapshotMap = map;
+    snapshotMapLen = mapLen;
+    snapshotRecords = records;
+    snapshotBySize = bySize;
+    snapshotByMtime = byMtime;
+    snapshotNames = reinterpret_cast<const char*>(byMtime + count);
+    snapshotCount = count;
+    snapshotIno = ino;
+    liveCount = count;
+    lastDirMtimeNs = header->dirMtimeNs;
+    return true;
+}
+
+void FileIndex::unmapSnapshot() {
+    if (snapshotMap != nullptr) {
+        munmap(snapshotMap, snapshotMapLen);
+    }
+    snapshotMap = nullptr;
+    snapshotMapLen = 0;
+    snapshotRecords = nullptr;
+    snapshotBySize = nullptr;
+    snapshotByMtime = nullptr;
+    snapshotNames = nullptr;
+    snapshotCount = 0;
+}
+
+bool FileIndex::writeSnapshot(const std::vector<FileEntry>& entries, int64_t dirMtimeNs) {
+    const uint64_t count = entries.size();
+    std::vector<uint32_t> bySize(count), byMtime(count);
+    uint64_t namesBytes = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        bySize[i] = byMtime[i] = static_cast<uint32_t>(i);
+        namesBytes += entries[i].name.size();
+    }
+    if (namesBytes > 0xffffffffULL) {
+        return false;
+    }
+    // The entries are sorted by name, a stable sort keeps the name order between equal keys
+    std::stable_sort(bySize.begin(), bySize.end(), [&](uint32_t a, uint32_t b) { return entries[a].size < entries[b].size; });
+    std::stable_sort(byMtime.begin(), byMtime.end(), [&](uint32_t a, uint32_t b) {
+        return getSortKey(SORT_MTIME, 0, entries[a].mtimeNs) < getSortKey(SORT_MTIME, 0, entries[b].mtimeNs);
+    });
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.recordSize = sizeof(IndexRecord);
+    header.count = count;
+    header.namesBytes = namesBytes;
+    header.dirMtimeNs = dirMtimeNs;
+
+    std::string data;
+    data.reserve(sizeof(header) + count * (sizeof(IndexRecord) + 2 * sizeof(uint32_t)) + namesBytes);
+    data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint32_t nameOffset = 0;
+    for (const FileEntry& entry : entries) {
+        IndexRecord rec;
+        rec.size = entry.size;
+        rec.mtimeNs = entry.mtimeNs;
+        rec.hash = entry.hash;
+        rec.nameOffset = nameOffset;
+        rec.nameLen = static_cast<uint32_t>(entry.name.size());
+        nameOffset += rec.nameLen;
+        data.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+    }
+    data.append(reinterpret_cast<const char*>(bySize.data()), count * sizeof(uint32_t));
+    data.append(reinterpret_cast<const char*>(byMtime.data()), count * sizeof(uint32_t));
+    for (const FileEntry& entry : entries) {
+        data += entry.name;
+    }
+
+    // Written aside and renamed, the mapped snapshot stays valid until it is unmapped
+    std::string tempPath = snapshotPath + ".tmp";
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = writeAll(fd, data.data(), data.size());
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tempPath.c_str(), snapshotPath.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FileIndex::rebuild() {
+    int64_t dirMtimeNs = getDirMtimeNs();
+    std::vector<FileEntry> entries;
+    bool ok = Storage::walk([&entries](int dirFd, const char* name) {
+        struct stat fileStat;
+        if (fstatat(dirFd, name, &fileStat, 0) != 0 || !S_ISREG(fileStat.st_mode)) {
+            return;
+        }
+        FileEntry entry;
+        entry.name = name;
+        entry.size = fileStat.st_size;
+        entry.mtimeNs = getMtimeNs(fileStat);
+        entries.push_back(entry);
+    });
+    if (!ok) {
+        return false;
+    }
+    std::sort(entries.begin(), entries.end(), [](const FileEntry& a, const FileEntry& b) { return a.name < b.name; });
+    // A file being migrated between the two layouts is seen twice
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const FileEntry& a, const FileEntry& b) { return a.name == b.name; }), entries.end());
+
+    if (!writeSnapshot(entries, dirMtimeNs) || !loadSnapshot()) {
+        return false;
+    }
+    delta.clear();
+    if (truncate(journalPath.c_str(), 0) != 0 && errno != ENOENT) {
+        return false;
+    }
+    journalReplayed = 0;
+    return true;
+}
+
+off_t FileIndex::replayJournal(off_t from) {
+    int fd = open(journalPath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return from;
+    }
+    if (lseek(fd, from, SEEK_SET) != from) {
+        close(fd);
+        return from;
+    }
+    std::string data;
+    char buf[65536];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, len);
+    }
+    close(fd);
+
+    // The records are absolute, replaying one twice is harmless. A record cut by a crash ends the journal.
+    size_t offset = 0;
+    while (offset + sizeof(JournalRecord) <= data.size()) {
+        JournalRecord rec;
+        memcpy(&rec, data.data() + offset, sizeof(rec));
+        if (offset + sizeof(rec) + rec.nameLen > data.size()) {
+            break;
+        }
+        FileEntry entry;
+        entry.name.assign(data.data() + offset + sizeof(rec), rec.nameLen);
+        entry.size = rec.size;
+        entry.mtimeNs = rec.mtimeNs;
+        entry.hash = rec.hash;
+        applyChange(rec.removed != 0, entry);
+        lastDirMtimeNs = rec.dirMtimeNs;
+        offset += sizeof(rec) + rec.nameLen;
+    }
+    return from + static_cast<off_t>(offset);
+}
+
+void FileIndex::appendJournal(bool removed, const FileEntry& entry, int64_t dirMtimeNs) {
+    JournalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.removed = removed ? 1 : 0;
+    rec.nameLen = static_cast<uint32_t>(entry.name.size());
+    rec.size = entry.size;
+    rec.mtimeNs = entry.mtimeNs;
+    rec.hash = entry.hash;
+    rec.dirMtimeNs = dirMtimeNs;
+
+    // One write per record, appends of the filesystem executor threads do not interleave
+    std::string data(reinterpret_cast<const char*>(&rec), sizeof(rec));
+    data += entry.name;
+    if (journalFd == -1 || !writeAll(journalFd, data.data(), data.size())) {
+        std::cout << outHead("error") << "Failed to append to the file index journal " << journalPath << std::endl;
+    }
+}
+
+void FileIndex::compact() {
+    // The changes other processes appended are merged too, none can append until the journal is truncated
+    lockJournal(LOCK_EX);
+    refresh();
+
+    std::vector<FileEntry> entries;
+    collectEntries(entries);
+
+    if (!writeSnapshot(entries, lastDirMtimeNs) || !loadSnapshot()) {
+        std::cout << outHead("error") << "Failed to write the file index snapshot " << snapshotPath << std::endl;
+        lockJournal(LOCK_UN);
+        return;
+    }
+    delta.clear();
+    if (journalFd != -1 && ftruncate(journalFd, 0) != 0) {
+        std::cout << outHead("error") << "Failed to truncate the file index journal " << journalPath << std::endl;
+    }
+    journalReplayed = 0;
+    lockJournal(LOCK_UN);
+}
+
+void FileIndex::collectEntries(std::vector<FileEntry>& entries) {
+    // Merges the snapshot, in name order, with the delta
+    entries.clear();
+    entries.reserve(liveCount);
+    std::map<std::string, DeltaEntry>::const_iterator it = delta.begin();
+    uint64_t pos = 0;
+    while (pos < snapshotCount || it != delta.end()) {
+        std::string name;
+        if (pos < snapshotCount) {
+            name.assign(snapshotNames + snapshotRecords[pos].nameOffset, snapshotRecords[pos].nameLen);
+        }
+        if (it != delta.end() && (pos == snapshotCount || it->first <= name)) {
+            if (!it->second.removed) {
+                entries.push_back(it->second.entry);
+            }
+            // The change replaces the file of the snapshot
+            if (pos < snapshotCount && it->first == name) {
+                ++pos;
+            }
+            ++it;
+        } else {
+            const IndexRecord& rec = snapshotRecords[pos];
+            FileEntry entry;
+            entry.name = name;
+            entry.size = rec.size;
+            entry.mtimeNs = rec.mtimeNs;
+            entry.hash = rec.hash;
+            entries.push_back(entry);
+            ++pos;
+        }
+    }
+}
+
+bool FileIndex::snapshotContains(const std::string& name) {
+    uint64_t pos = partitionPoint(snapshotCount, [&](uint64_t i) {
+        const IndexRecord& rec = snapshotRecords[i];
+        return compareKeys(0, snapshotNames + rec.nameOffset, rec.nameLen, 0, name.data(), name.size()) < 0;
+    });
+    return pos < snapshotCount && snapshotRecords[pos].nameLen == name.size() &&
+           memcmp(snapshotNames + snapshotRecords[pos].nameOffset, name.data(), name.size()) == 0;
+}
+
+void FileIndex::applyChange(bool removed, const FileEntry& entry) {
+    std::map<std::string, DeltaEntry>::iterator it = delta.find(entry.name);
+    bool inSnapshot = snapshotContains(entry.name);
+    bool wasLive = it != delta.end() ? !it->second.removed : inSnapshot;
+
+    if (removed) {
+        liveCount -= wasLive ? 1 : 0;
+        // A file that is not in the snapshot simply leaves the delta
+        if (inSnapshot) {
+            delta[entry.name].removed = true;
+            delta[entry.name].entry = entry;
+        } else if (it != delta.end()) {
+            delta.erase(it);
+        }
+    } else {
+        liveCount += wasLive ? 0 : 1;
+        delta[entry.name].removed = false;
+        delta[entry.name].entry = entry;
+    }
+}
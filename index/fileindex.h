@@ -0,0 +1,122 @@
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define INDEX_MAGIC 0x5845444e494b4843ULL   // "CHKINDEX" read as a little-endian integer
+#define INDEX_VERSION 1
+#define INDEX_DELTA_MAX 4096                // Changes kept in memory and in the journal before the snapshot is rewritten
+#define INDEX_PAGE_MAX 1000                 // Largest page of /api/list
+#define INDEX_SCAN_MAX 65536                // Entries a page may skip (prefix filter on a size or mtime sort) before it stops
+
+// Header of the snapshot file. It is followed by the records sorted by name, the positions of the records
+// sorted by (size, name) and by (mtime, name), then the names.
+struct IndexHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    uint64_t namesBytes;
+    int64_t dirMtimeNs;     // Modification time of the directory when the snapshot was written
+    uint64_t reserved[3];
+};
+
+// One file of the snapshot, 32 bytes
+struct IndexRecord {
+    uint64_t size;
+    int64_t mtimeNs;
+    uint64_t hash;          // CRC32C of the file computed when it was written, 0 when it is not known
+    uint32_t nameOffset;    // Offset of the name in the names area
+    uint32_t nameLen;
+};
+
+struct FileEntry {
+    std::string name;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    uint64_t hash = 0;
+};
+
+enum INDEXSORT {
+    SORT_NAME,
+    SORT_SIZE,
+    SORT_MTIME
+};
+
+// Parameters of GET /api/list?cursor=&limit=&sort=&prefix=
+struct ListQuery {
+    INDEXSORT sort = SORT_NAME;
+    bool descending = false;      // sort=-name, -size or -mtime
+    std::string prefix;           // Only the names starting with it
+    bool hasCursor = false;       // The page starts after the cursor entry
+    uint64_t cursorKey = 0;       // Size or mtime of the cursor entry, 0 for a name sort
+    std::string cursorName;
+    int limit = 100;
+};
+
+struct ListPage {
+    std::vector<FileEntry> entries;
+    std::string nextCursor;       // Empty on the last page
+    uint64_t total = 0;           // Files in the index that match the prefix
+};
+
+// Metadata index of the served directory. The bulk of the index is a snapshot file mapped in memory, sorted by name,
+// with two permutations for the size and mtime orders. Uploads and deletions are kept in a small in-memory delta,
+// appended to a journal, and merged into a new snapshot once the delta is large. A page is found by binary search
+// and merges the snapshot with the delta, so its cost depends on the page size and not on the number of files.
+class FileIndex {
+public:
+    // Maps the snapshot of the storage kept at indexPath and replays its journal. The storage is scanned again when
+    // there is no valid snapshot or when its root changed behind the server's back.
+    static bool init(const std::string& indexPath);
+
+    // The index loaded, pages list the stored files
+    static bool isReady();
+
+    // Shares the index files with other processes serving the same storage, such as the prefork workers: each
+    // process applies the journal appended by the others before it reads or changes the index, and a compaction
+    // locks the journal. Called in each process once it is forked, after init.
+    static void setShared();
+
+    // Reads the size and mtime of a stored file after it was written, hash is 0 when it is not known
+    static void update(const std::string& name, uint64_t hash = 0);
+    static void remove(const std::string& name);
+
+    // Fills query from the query string of the request, returns false with an error message on invalid parameters
+    static bool parseQuery(const std::string& queryString, ListQuery& query, std::string& error);
+
+    static void list(const ListQuery& query, ListPage& page);
+
+    // Starts query after the nextCursor of a page, returns false when the cursor is not one of its sort
+    static bool parseCursor(const std::string& cursor, ListQuery& query);
+
+    // Sorted names of all the files of the index, empty when it is not loaded
+    static void listNames(std::vector<std::string>& names);
+
+    static void renderJson(const ListPage& page, std::string& out);
+
+private:
+    static bool loadSnapshot();
+    static void unmapSnapshot();
+    static bool writeSnapshot(const std::vector<FileEntry>& entries, int64_t dirMtimeNs);
+    static bool rebuild();
+    // Applies the records of the journal from offset from, returns the offset after the last complete record
+    static off_t replayJournal(off_t from);
+
+    // Catches up with the snapshot and the journal written by the other processes of a shared index,
+    // the caller holds the write lock and the journal lock
+    static void refresh();
+    static void appendJournal(bool removed, const FileEntry& entry, int64_t dirMtimeNs);
+    static void compact();
+    // Merges the snapshot with the delta into the files of the index sorted by name, the caller holds a lock
+    static void collectEntries(std::vector<FileEntry>& entries);
+    static bool snapshotContains(const std::string& name);
+
+    // Applies a change to the delta and to the number of files, the caller holds the write lock
+    static void applyChange(bool removed, const FileEntry& entry);
+};
+
+#endif
@@ -1,86 +1,302 @@
 #include "./fileserver/fileserver.h"
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/types.h>
+#include "./prefork/prefork.h"
+#include "./upgrade/handoff.h"
 #include <unistd.h>
+#include <fcntl.h>
 #include <iostream>
-#include <search.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
 #include "utils/utils.h"
-#include <semaphore.h>
 
-void cache_manager() {
-    key_t key = get_shm_key("shmfile", 65);
-    int shmid = init_shared_memory(key, SHM_SIZE);
-    char* str = static_cast<char*>(attach_shared_memory(shmid));
+#define SERVER_PORT 8888
 
-    struct hsearch_data* htab = init_hash_table(50);
+static int workerNum = 1;   // Processes serving the port, the prefork mode starts from 2
+static int workerIndex = 0; // Index of this prefork worker
 
-    init_semaphores();
+// Listening sockets of the prefork workers, and the pipes the supervisor writes the changes of the storage to,
+// by worker
+static std::vector<int> listenFds;
+static std::vector<int> searchReadFds;
+static std::vector<int> searchWriteFds;
 
-    while (true) {
-        wait_semaphore(&cache_sem);
-
-        // Gérer les requêtes pour ajouter ou récupérer des éléments du cache
-
-        post_semaphore(&cache_sem);
+// Adds a rule for each address range of a comma-separated list of CIDR ("10.0.0.0/8,192.168.1.7"). The ranges
+// of RATE_LIMIT rules carry their limits ("10.0.0.0/8=64:500:1000", connections:requests per second:burst).
+static void addRateRules(RateLimits& limits, const char* list, RATEACTION action) {
+    if (list == nullptr) {
+        return;
     }
+    std::string ranges(list);
+    std::string::size_type begin = 0;
+    while (begin <= ranges.size()) {
+        std::string::size_type end = ranges.find(',', begin);
+        if (end == std::string::npos) {
+            end = ranges.size();
+        }
+        std::string entry = ranges.substr(begin, end - begin);
+        std::string cidr = entry;
+        RateRule rule = limits.defaults;
+        rule.action = action;
+        bool valid = true;
+        if (action == RATE_LIMIT) {
+            std::string::size_type equal = entry.find('=');
+            valid = equal != std::string::npos && RateLimiter::parseLimits(entry.substr(equal + 1), rule);
+            cidr = entry.substr(0, equal);
+        }
+        if (valid && !cidr.empty() && RateLimiter::parseCidr(cidr, rule)) {
+            limits.rules.push_back(rule);
+        } else if (!entry.empty()) {
+            std::cout << outHead("error") << "Invalid address range " << entry << " ignored" << std::endl;
+        }
+        begin = end + 1;
+    }
+}
 
-    detach_shared_memory(str);
-    destroy_shared_memory(shmid);
-    destroy_hash_table(htab);
+// The clients of a prefork worker are counted by that worker alone, and SO_REUSEPORT spreads the connections of
+// a client over all the workers: each one enforces its share of the limits
+static void shareRateRule(RateRule& rule) {
+    rule.maxConnections = std::max((rule.maxConnections + workerNum - 1) / workerNum, 1);
+    rule.requestsPerSec /= workerNum;
+    rule.burst = std::max(rule.burst / workerNum, 1.0);
 }
 
-int main() {
-    pid_t pid = fork();
+// Runs a server on listenFd, or on a listening socket of its own when it is -1
+static int serve(int listenFd) {
+    WebServer webserver;
 
-    if (pid == 0) {
-        // Processus enfant : gestionnaire de cache
-        cache_manager();
-    } else if (pid > 0) {
-        // Processus parent : serveur web
-        WebServer webserver;
+    // Creating a Thread Pool, sized from the available CPUs and the cgroup quota,
+    // it grows with the queue wait and shrinks when workers stay idle.
+    // The prefork workers share the CPUs. CHEROKEE_AFFINITY pins the reactor and the workers
+    // to one CPU each (cpu) or to the CPUs of one NUMA node each (numa), round robin.
+    PoolConfig poolConfig;
+    const char* affinity = getenv("CHEROKEE_AFFINITY");
+    if (affinity == nullptr || strcmp(affinity, "none") == 0) {
+        poolConfig.affinity = AFFINITY_NONE;
+    } else if (strcmp(affinity, "cpu") == 0) {
+        poolConfig.affinity = AFFINITY_CORE;
+    } else if (strcmp(affinity, "numa") == 0) {
+        poolConfig.affinity = AFFINITY_NUMA;
+    } else {
+        std::cout << outHead("error") << "Invalid affinity " << affinity << " ignored (none, cpu or numa)" << std::endl;
+    }
+    if (workerNum > 1) {
+        int cpuNum = std::max(getAvailableCpuNum() / workerNum, 1);
+        poolConfig.initThreads = cpuNum;
+        poolConfig.minThreads = std::max(cpuNum / 2, 1);
+        poolConfig.maxThreads = 2 * cpuNum;
+        poolConfig.firstSlot = workerIndex * cpuNum;
+    }
+    int ret = webserver.createThreadPool(poolConfig);
+    if(ret != 0){
+        std::cout << outHead("error") << "Failed to create thread pool" << std::endl;
+        return -1;
+    }
 
-        init_semaphores();
+    // Creating the executor for blocking filesystem calls
+    ret = webserver.createFsExecutor(2);
+    if(ret != 0){
+        std::cout << outHead("error") << "Failed to create filesystem executor" << std::endl;
+        return -1;
+    }
 
-        // Creating a Thread Pool
-        int ret = webserver.createThreadPool(4);
-        if(ret != 0){
-            std::cout << outHead("error") << "Failed to create thread pool" << std::endl;
-            return -1;
-        }
+    // Queue wait, service time and mutex contention of both pools are written to the log every minute
+    webserver.setStatsDumpInterval(60);
 
-        // Initialize sockets for listening
-        int port = 8888;
-        ret = webserver.createListenFd(port);
-        if(ret != 0){
-            std::cout << outHead("error") << "Failed to create and initialize listening socket" << std::endl;
-            return -2;
-        }
+    // Limits used to shed load under overload (connections, queue depth, queue delay)
+    OverloadLimits limits;
+    webserver.setOverloadLimits(limits);
 
-        // The epoll routine that initializes the listener
-        ret = webserver.createEpoll();
-        if(ret != 0){
-            std::cout << outHead("error") << "Failure to initialize listening epoll routine" << std::endl;
-            return -3;
-        }
+    // Requests with more than 32 KiB of headers get 431, bodies buffered over 8 MiB or connections holding more
+    // than 16 MiB get 413, and the connection is closed. Uploads and PUT bodies are written as they arrive.
+    MemoryLimits memoryLimits;
+    webserver.setMemoryLimits(memoryLimits);
 
-        // Adding a listening socket to epoll
-        ret = webserver.epollAddListenFd();
-        if(ret != 0){
-            std::cout << outHead("error") << "epoll failed to add listening socket" << std::endl;
-            return -4;
+    // Each client address may hold 256 connections and send 1000 requests per second (bursts of 2000), or the
+    // connections:rate:burst of CHEROKEE_RATE_DEFAULT ("64:500:1000"). CHEROKEE_RATE_LIMITS is a comma-separated
+    // list of CIDR with their own limits ("10.0.0.0/8=1024:10000:20000"), CHEROKEE_RATE_ALLOW and
+    // CHEROKEE_RATE_DENY are CIDR lists of addresses without limits and of refused addresses, the longest
+    // matching range wins. The prefork workers each get their share of the limits.
+    RateLimits rateLimits;
+    const char* rateDefault = getenv("CHEROKEE_RATE_DEFAULT");
+    if (rateDefault != nullptr && !RateLimiter::parseLimits(rateDefault, rateLimits.defaults)) {
+        std::cout << outHead("error") << "Invalid rate limits " << rateDefault << " ignored" << std::endl;
+    }
+    addRateRules(rateLimits, getenv("CHEROKEE_RATE_LIMITS"), RATE_LIMIT);
+    addRateRules(rateLimits, getenv("CHEROKEE_RATE_ALLOW"), RATE_ALLOW);
+    addRateRules(rateLimits, getenv("CHEROKEE_RATE_DENY"), RATE_DENY);
+    if (workerNum > 1) {
+        shareRateRule(rateLimits.defaults);
+        for (RateRule& rule : rateLimits.rules) {
+            shareRateRule(rule);
         }
+    }
+    webserver.setRateLimits(rateLimits);
 
-        // Enables listening and processing of requests
-        ret = webserver.waitEpoll();
-        if(ret != 0){
-            std::cout << outHead("error") << "epoll routine listening failure" << std::endl;
-            return -5;
-        }
+    // Downloads up to 8 KiB are sent from memory with their header, from 4 MiB they are read ahead sequentially.
+    // CHEROKEE_SMALL_FILE_MAX (-1: always sendfile) and CHEROKEE_SEQUENTIAL_FILE_MIN change the cutoffs, in bytes.
+    ServeLimits serveLimits;
+    const char* smallFileMax = getenv("CHEROKEE_SMALL_FILE_MAX");
+    if (smallFileMax != nullptr) {
+        serveLimits.smallFileMax = std::max(atoll(smallFileMax), -1LL);
+    }
+    const char* sequentialFileMin = getenv("CHEROKEE_SEQUENTIAL_FILE_MIN");
+    if (sequentialFileMin != nullptr) {
+        serveLimits.sequentialFileMin = std::max(atoll(sequentialFileMin), 0LL);
+    }
+    webserver.setServeLimits(serveLimits);
+
+    // The search index follows the files other processes create and delete in filedir, the prefork workers included.
+    // The supervisor of the prefork workers watches filedir for them.
+    if (workerNum <= 1) {
+        NameSearch::watch();
+    }
+
+    // Initialize sockets for listening
+    if (listenFd == -1) {
+        ret = webserver.createListenFd(SERVER_PORT);
     } else {
-        std::cerr << "Failed to fork" << std::endl;
-        return 1;
+        ret = webserver.setListenFd(listenFd);
+    }
+    if(ret != 0){
+        std::cout << outHead("error") << "Failed to create and initialize listening socket" << std::endl;
+        return -2;
+    }
+
+    // The epoll routine that initializes the listener
+    ret = webserver.createEpoll();
+    if(ret != 0){
+        std::cout << outHead("error") << "Failure to initialize listening epoll routine" << std::endl;
+        return -3;
+    }
+
+    // Adding a listening socket to epoll
+    ret = webserver.epollAddListenFd();
+    if(ret != 0){
+        std::cout << outHead("error") << "epoll failed to add listening socket" << std::endl;
+        return -4;
     }
 
+    // SIGUSR1 starts a binary upgrade: the socket is handed to the binary now at the path of this one, which
+    // serves right away while this server drains. The supervisor of prefork workers makes the handoff for them.
+    webserver.enableUpgrade(workerNum <= 1);
+    Handoff::notifyReady();
+
+    // Enables listening and processing of requests
+    ret = webserver.waitEpoll();
+    if(ret != 0){
+        std::cout << outHead("error") << "epoll routine listening failure" << std::endl;
+        return -5;
+    }
+    // Replaced by an upgrade, the threads of the pools are detached and the process leaves without destroying them
+    if (webserver.isDrained()) {
+        std::cout.flush();
+        _exit(0);
+    }
     return 0;
 }
+
+// A prefork worker serves the storage and the index loaded by the supervisor along with the other workers
+static int serveWorker(int listenFd) {
+    if (!Storage::setShared()) {
+        std::cout << outHead("error") << "Failed to open the lock of the object store (errno = " << errno << ")" << std::endl;
+    }
+    FileIndex::setShared();
+    size_t index = std::find(listenFds.begin(), listenFds.end(), listenFd) - listenFds.begin();
+    workerIndex = static_cast<int>(index);
+    for (size_t i = 0; i < searchReadFds.size(); ++i) {
+        if (i != index) {
+            close(searchReadFds[i]);
+        }
+    }
+    if (index < searchReadFds.size()) {
+        NameSearch::follow(searchReadFds[index]);
+    }
+    return serve(listenFd);
+}
+
+int main(int argc, char* argv[]) {
+    // Started by the upgrade of a running server, the listening sockets are the ones it passed
+    Handoff::setCommand(argc, argv);
+    std::vector<int> inheritedFds;
+    bool upgraded = Handoff::receive(inheritedFds);
+
+    // A client that closes its connection during a response makes the send fail with EPIPE rather than stop the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Request spans are written to per-thread rings in /tmp when CHEROKEE_TRACE is set, SIGUSR2 toggles them at runtime
+    // (in the process that receives it, each prefork worker has its own flag)
+    Trace::init("/tmp", 65536, getenv("CHEROKEE_TRACE") != nullptr);
+    Trace::installToggleSignal(SIGUSR2);
+
+    // Served files, in hashed subdirectories of filedir (make migrate moves the files of a flat filedir).
+    // With CHEROKEE_DEDUP set, written files are stored once per content and shared by their names.
+    if (!Storage::init("filedir", getenv("CHEROKEE_DEDUP") != nullptr)) {
+        std::cout << outHead("error") << "Deduplication needs extended attributes on filedir, files are stored without it" << std::endl;
+    }
+
+    // Uploads are gathered in 1 MiB buffers written in one pwrite each, through the page cache.
+    // The redirect of an upload is sent once the kernel has the data, SYNC_COMMIT waits for the disk.
+    // With CHEROKEE_VERIFY_DIGEST set, a file whose crc32c Repr-Digest or Content-Digest does not match is refused.
+    WritePolicy writePolicy;
+    writePolicy.verifyDigest = getenv("CHEROKEE_VERIFY_DIGEST") != nullptr;
+    Storage::setWritePolicy(writePolicy);
+
+    // Metadata index of the stored files behind GET /api/list, kept in filedir.index and its journal.
+    // During an upgrade, the server being replaced still writes them.
+    if (upgraded) {
+        Storage::setShared();
+        FileIndex::setShared();
+    }
+    FileIndex::init("filedir.index");
+
+    // In-memory index of the file names behind GET /api/search (substring and prefix queries), built on all the
+    // available CPUs before the prefork workers are forked, so that they share its memory until they change it
+    NameSearch::load(getAvailableCpuNum());
+
+    // With CHEROKEE_WORKERS set, a supervisor forks that many worker processes (0: one per available CPU), each
+    // with its own SO_REUSEPORT socket on the port, restarts those that crash, and the workers keep their
+    // counters in a shared-memory segment so that /metrics gives the totals of all
+    const char* workers = getenv("CHEROKEE_WORKERS");
+    if (upgraded) {
+        workerNum = static_cast<int>(inheritedFds.size());
+    } else if (workers != nullptr) {
+        workerNum = atoi(workers) > 0 ? atoi(workers) : getAvailableCpuNum();
+        workerNum = std::min(workerNum, PREFORK_MAX_WORKERS);
+    }
+    if (workerNum <= 1) {
+        workerNum = 1;
+        return serve(upgraded ? inheritedFds[0] : -1);
+    }
+
+    listenFds = inheritedFds;
+    for (int i = 0; !upgraded && i < workerNum; ++i) {
+        listenFds.push_back(WebServer::openListenSocket(SERVER_PORT, nullptr, true));
+    }
+    if (!StatsSegment::create(Storage::getRoot(), workerNum)) {
+        std::cout << outHead("error") << "Failed to create the stats segment (errno = " << errno << "), /metrics gives the counters of one worker" << std::endl;
+    }
+    // The changes of filedir reach the search index of each worker through its pipe, a worker that falls too far
+    // behind builds its index again
+    for (int i = 0; i < workerNum; ++i) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            std::cout << outHead("error") << "Failed to create the search pipes (errno = " << errno << "), the search index of the workers only sees their own changes" << std::endl;
+            for (size_t j = 0; j < searchReadFds.size(); ++j) {
+                close(searchReadFds[j]);
+                close(searchWriteFds[j]);
+            }
+            searchReadFds.clear();
+            searchWriteFds.clear();
+            break;
+        }
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        searchReadFds.push_back(fds[0]);
+        searchWriteFds.push_back(fds[1]);
+    }
+    if (!searchWriteFds.empty()) {
+        NameSearch::relay(searchWriteFds);
+    }
+    // The sockets queue the connections until the workers accept them
+    Handoff::notifyReady();
+    return Supervisor::run(listenFds, serveWorker);
+}
@@ -5,8 +5,15 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <memory>
+#include <vector>
 #include <unordered_map>
 
+#include "responsehead.h"
+#include "../storage/storage.h"
+
+class StorageWriter;
+
 // Indicates the processing status of the data in the Request or Response.
 enum MSGSTATUS {
     HANDLE_INIT,      // Header data being received/sent (request line, request header)
@@ -19,8 +26,28 @@ enum MSGSTATUS {
 // Indicates the type of message body
 enum MSGBODYTYPE {
     FILE_TYPE,      // The message body is the file
-    HTML_TYPE,      // The message body is an HTML page
+    HTML_TYPE,      // The message body is in memory (HTML page, JSON, small downloaded file)
     EMPTY_TYPE,     // Message body is empty
+    PARTS_TYPE,     // The message body is a sequence of parts, built in memory or sent from files (archives)
+    CHUNKED_TYPE,   // The message body is rendered while it is sent, one chunk at a time in msgBody (file list page)
+};
+
+// Part of a PARTS_TYPE message body: bytes built in memory, or a stored file sent with sendfile
+struct BodyPart {
+    std::string data;        // Sent when fileName is empty
+    std::string fileName;    // Stored file, opened by the filesystem executor shortly before its turn
+    int fd = -1;
+    long long fileLen = 0;   // Bytes of the file to send, its size when the body was built
+};
+
+// Progress of the file list page of a CHUNKED_TYPE body
+struct ListingState {
+    std::string cursor;      // nextCursor of the last page of the index rendered, the next batch starts after it
+    bool walk = false;       // Without the file index, the rows come from a walk of the storage
+    StorageCursor walkCursor;
+    std::string tail;        // End of the page template, rendered after the last row
+    bool rowsDone = false;
+    bool lastChunk = false;  // msgBody holds the end of the page and the last chunk
 };
 
 // When receiving a file, the message body will be divided into different parts,
@@ -36,7 +63,7 @@ enum FILEMSGBODYSTATUS {
 // the message body (you can get a field in the message header and modify the data associated with getting the message body)
 class Message {
 public:
-    Message() : status(HANDLE_INIT) {}
+    Message() : status(HANDLE_INIT), startTime(0) {}
 
     MSGSTATUS getStatus() const { return status; }
     void setStatus(MSGSTATUS newStatus) { status = newStatus; }
@@ -44,16 +71,20 @@ public:
     const std::unordered_map<std::string, std::string>& getHeaders() const { return msgHeader; }
     void setHeader(const std::string& key, const std::string& value) { msgHeader[key] = value; }
 
+    long long getStartTime() const { return startTime; }
+    void setStartTime(long long value) { startTime = value; }
+
 protected:
     MSGSTATUS status;                                        // Record the reception status of the message,
                                                              // indicating how much of the entire request message has been received/sent.
     std::unordered_map<std::string, std::string> msgHeader;  // Save Message Header
+    long long startTime;                                     // Arrival of the first byte of the request (monotonic, nanoseconds)
 };
 
 // Inherits Message, modifies and fetches the request line, and saves the received header options.
 class Request : public Message {
 public:
-    Request() : Message(), contentLength(0), msgBodyRecvLen(0), fileMsgStatus(FILE_BEGIN_FLAG) {}
+    Request() : Message(), contentLength(0), msgBodyRecvLen(0), headerLen(0), fileMsgStatus(FILE_BEGIN_FLAG) {}
 
     void setRequestLine(const std::string& requestLine) {
         std::istringstream lineStream(requestLine);
@@ -106,6 +137,14 @@ public:
     FILEMSGBODYSTATUS getFileMsgStatus() const { return fileMsgStatus; }
     void setFileMsgStatus(FILEMSGBODYSTATUS status) { fileMsgStatus = status; }
 
+    const std::shared_ptr<StorageWriter>& getUploadWriter() const { return uploadWriter; }
+    void setUploadWriter(const std::shared_ptr<StorageWriter>& writer) { uploadWriter = writer; }
+    const std::string& getUploadDigest() const { return uploadDigest; }
+    void setUploadDigest(const std::string& value) { uploadDigest = value; }
+
+    long long getHeaderLen() const { return headerLen; }
+    void setHeaderLen(long long len) { headerLen = len; }
+
     std::string recvMsg;  // Data received but not yet processed
 
 private:
@@ -115,58 +154,77 @@ private:
 
     long long contentLength;       // Record the length of the message body
     long long msgBodyRecvLen;      // The length of the message body that has been received
+    long long headerLen;           // Bytes of the request line and headers parsed so far
 
     std::string recvFileName;      // If the client is sending a file, record the name of the file
     FILEMSGBODYSTATUS fileMsgStatus;  // The record indicates what portion of the message body of the file has been processed
+    std::shared_ptr<StorageWriter> uploadWriter;  // Writer of the uploaded or PUT file, shared with the filesystem tasks of its chunks
+    std::string uploadDigest;      // Repr-Digest or Content-Digest given in the headers of the uploaded file part
 };
 
 // Inherit Message, for status line modification and retrieval, set the first option to be sent.
 class Response : public Message {
 public:
-    Response() : Message() {}
+    Response() : Message(), msgBodyLen(0), bodyType(EMPTY_TYPE), fileMsgFd(-1), curStatusHasSendLen(0), fsDone(false), fsResult(0), route(0), curPart(0) {}
 
     // Getters
     std::string getBodyFileName() const { return bodyFileName; }
-    std::string getBeforeBodyMsg() const { return beforeBodyMsg; }
-    std::string getMsgBody() const { return msgBody; }
+    const char* getBeforeBodyMsg() const { return head.data(); }
+    const std::string& getMsgBody() const { return msgBody; }
     unsigned long getMsgBodyLen() const { return msgBodyLen; }
-    int getBeforeBodyMsgLen() const { return beforeBodyMsgLen; }
+    int getBeforeBodyMsgLen() const { return head.size(); }
     MSGBODYTYPE getBodyType() const { return bodyType; }
     unsigned long getCurStatusHasSendLen() const { return curStatusHasSendLen; }
     int getFileMsgFd() const { return fileMsgFd; }
+    bool getFsDone() const { return fsDone; }
+    int getFsResult() const { return fsResult; }
+    int getRoute() const { return route; }
+    int getResponseStatusCode() const { return ResponseHead::getStatusCode(head.getStatus()); }
 
     // Setters
     void setBodyFileName(const std::string &value) { bodyFileName = value; }
-    void setBeforeBodyMsg(const std::string &value) { beforeBodyMsg = value; }
     void setMsgBody(const std::string &value) { msgBody = value; }
     void setMsgBodyLen(unsigned long value) { msgBodyLen = value; }
-    void setBeforeBodyMsgLen(int value) { beforeBodyMsgLen = value; }
     void setBodyType(MSGBODYTYPE value) { bodyType = value; }
     void setCurStatusHasSendLen(unsigned long value) { curStatusHasSendLen = value; }
     void setFileMsgFd(int value) { fileMsgFd = value; }
+    void setFsDone(bool value) { fsDone = value; }
+    void setFsResult(int value) { fsResult = value; }
+    void setRoute(int value) { route = value; }
 
-    // Additional Setters for Status Line
-    void setResponseHttpVersion(const std::string &value) { responseHttpVersion = value; }
-    void setResponseStatusCode(const std::string &value) { responseStatusCode = value; }
-    void setResponseStatusDes(const std::string &value) { responseStatusDes = value; }
+    // Status line and headers, built in place
+    ResponseHead& getHeadRef() { return head; }
 
     // New getter for non-const reference to msgBody
     std::string& getMsgBodyRef() { return msgBody; }
 
+    // Parts of a PARTS_TYPE message body and the part being sent
+    std::vector<BodyPart>& getBodyPartsRef() { return bodyParts; }
+    size_t getCurPart() const { return curPart; }
+    void setCurPart(size_t value) { curPart = value; }
+
+    // State of the file list page of a CHUNKED_TYPE body
+    ListingState& getListingRef() { return listing; }
+
+    // Repr-Digest header of the response
+    const std::string& getReprDigest() const { return reprDigest; }
+    void setReprDigest(const std::string& value) { reprDigest = value; }
+
 private:
     std::string bodyFileName;      // Path of the data to be sent
-    std::string beforeBodyMsg;     // All data before the message body
+    ResponseHead head;             // All data before the message body
     std::string msgBody;           // Storing HTML-type message bodies in strings
     unsigned long msgBodyLen;      // Length of the message body
-    int beforeBodyMsgLen;          // Length of all data before the message body
     MSGBODYTYPE bodyType;          // Types of messages
     int fileMsgFd;                 // The message body of the file type holds the file descriptor
     unsigned long curStatusHasSendLen;  // Record the length of time this data has been sent in the current state
-
-    // Additional members for Status Line
-    std::string responseHttpVersion;
-    std::string responseStatusCode;
-    std::string responseStatusDes;
+    bool fsDone;                   // The filesystem executor has run the blocking call of this response
+    int fsResult;                  // Return value of that call
+    int route;                     // Route of the request this response answers, a METRICSROUTE
+    std::vector<BodyPart> bodyParts;    // Message body of the PARTS_TYPE, with the file descriptors of the opened parts
+    size_t curPart;                // Part being sent, curStatusHasSendLen is the offset in it
+    ListingState listing;          // Rows of the file list page already rendered
+    std::string reprDigest;        // Value of the Repr-Digest header, empty when the digest of the body is not known
 };
 
 #endif
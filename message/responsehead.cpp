@@ -0,0 +1,185 @@
+#include "responsehead.h"
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+
+// Constant piece of a head, its length known at compile time
+struct HeadFragment {
+    const char* data;
+    size_t len;
+};
+
+#define HEAD_FRAGMENT(text) {text, sizeof(text) - 1}
+
+static constexpr HeadFragment statusLines[HTTP_STATUS_NUM] = {
+    HEAD_FRAGMENT("HTTP/1.1 200 OK\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 206 Partial Content\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 302 Moved Temporarily\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 304 Not Modified\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 400 Bad Request\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 403 Forbidden\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 404 Not Found\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 413 Payload Too Large\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 429 Too Many Requests\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 431 Request Header Fields Too Large\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 500 Internal Server Error\r\n"),
+    HEAD_FRAGMENT("HTTP/1.1 503 Service Unavailable\r\n"),
+};
+
+static constexpr int statusCodes[HTTP_STATUS_NUM] = {200, 206, 302, 304, 400, 403, 404, 413, 429, 431, 500, 503};
+
+static constexpr HeadFragment contentTypes[CONTENT_TYPE_NUM] = {
+    HEAD_FRAGMENT("Content-Type: text/html;charset=UTF-8\r\n"),
+    HEAD_FRAGMENT("Content-Type: application/octet-stream\r\n"),
+    HEAD_FRAGMENT("Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"),
+    HEAD_FRAGMENT("Content-Type: application/json\r\n"),
+    HEAD_FRAGMENT("Content-Type: application/x-tar\r\nContent-Disposition: attachment; filename=\"archive.tar\"\r\n"),
+};
+
+static constexpr HeadFragment contentLengthName = HEAD_FRAGMENT("Content-Length: ");
+static constexpr HeadFragment chunkedEncoding = HEAD_FRAGMENT("Transfer-Encoding: chunked\r\n");
+static constexpr HeadFragment headTail = HEAD_FRAGMENT("Connection: keep-alive\r\nDate: ");
+static constexpr HeadFragment closeTail = HEAD_FRAGMENT("Connection: close\r\nDate: ");
+static constexpr HeadFragment headEnd = HEAD_FRAGMENT("\r\n\r\n");
+
+// Date header shared by the threads: a seqlock over the rendered value, written by one thread once per second.
+// The value lives in atomic words so that a reader racing with the writer only sees a sequence that changed.
+#define DATE_WORDS ((HTTP_DATE_LEN + 7) / 8)
+
+static std::atomic<unsigned int> dateSeq(0);          // Odd while the value is written, 0 until the first one
+static std::atomic<uint64_t> dateWords[DATE_WORDS];
+static std::atomic<time_t> dateSecond(0);             // Second of the value
+static std::atomic_flag dateRefreshing = ATOMIC_FLAG_INIT;
+
+static void renderDate(time_t now, char out[DATE_WORDS * 8]) {
+    static const char dayNames[] = "SunMonTueWedThuFriSat";
+    static const char monthNames[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm fields;
+    gmtime_r(&now, &fields);
+    memset(out, 0, DATE_WORDS * 8);
+    memcpy(out, dayNames + 3 * fields.tm_wday, 3);
+    out[3] = ',';
+    out[4] = ' ';
+    out[5] = static_cast<char>('0' + fields.tm_mday / 10);
+    out[6] = static_cast<char>('0' + fields.tm_mday % 10);
+    out[7] = ' ';
+    memcpy(out + 8, monthNames + 3 * fields.tm_mon, 3);
+    out[11] = ' ';
+    int year = fields.tm_year + 1900;
+    for (int i = 15; i >= 12; --i, year /= 10) {
+        out[i] = static_cast<char>('0' + year % 10);
+    }
+    out[16] = ' ';
+    out[17] = static_cast<char>('0' + fields.tm_hour / 10);
+    out[18] = static_cast<char>('0' + fields.tm_hour % 10);
+    out[19] = ':';
+    out[20] = static_cast<char>('0' + fields.tm_min / 10);
+    out[21] = static_cast<char>('0' + fields.tm_min % 10);
+    out[22] = ':';
+    out[23] = static_cast<char>('0' + fields.tm_sec / 10);
+    out[24] = static_cast<char>('0' + fields.tm_sec % 10);
+    memcpy(out + 25, " GMT", 4);
+}
+
+// The first thread to see a new second renders it, the others keep the previous value meanwhile
+static void refreshDate() {
+    time_t now = time(nullptr);
+    if (now == dateSecond.load(std::memory_order_acquire) || dateRefreshing.test_and_set(std::memory_order_acquire)) {
+        return;
+    }
+    if (now != dateSecond.load(std::memory_order_relaxed)) {
+        uint64_t words[DATE_WORDS];
+        renderDate(now, reinterpret_cast<char*>(words));
+        unsigned int seq = dateSeq.load(std::memory_order_relaxed);
+        dateSeq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i = 0; i < DATE_WORDS; ++i) {
+            dateWords[i].store(words[i], std::memory_order_relaxed);
+        }
+        dateSeq.store(seq + 2, std::memory_order_release);
+        dateSecond.store(now, std::memory_order_release);
+    }
+    dateRefreshing.clear(std::memory_order_release);
+}
+
+void ResponseHead::copyDate(char out[HTTP_DATE_LEN]) {
+    refreshDate();
+    uint64_t words[DATE_WORDS];
+    while (true) {
+        unsigned int seq = dateSeq.load(std::memory_order_acquire);
+        if (seq == 0 || (seq & 1) != 0) {
+            continue;
+        }
+        for (int i = 0; i < DATE_WORDS; ++i) {
+            words[i] = dateWords[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (dateSeq.load(std::memory_order_relaxed) == seq) {
+            break;
+        }
+    }
+    memcpy(out, words, HTTP_DATE_LEN);
+}
+
+int ResponseHead::getStatusCode(HTTPSTATUS value) {
+    return value == HTTP_STATUS_NUM ? 0 : statusCodes[value];
+}
+
+bool ResponseHead::append(const char* data, size_t dataLen, size_t limit) {
+    if (len + dataLen > limit) {
+        return false;
+    }
+    memcpy(buf + len, data, dataLen);
+    len += dataLen;
+    return true;
+}
+
+void ResponseHead::start(HTTPSTATUS value) {
+    status = value;
+    len = 0;
+    append(statusLines[value].data, statusLines[value].len, RESPONSE_HEAD_MAX);
+}
+
+void ResponseHead::addContentLength(unsigned long long contentLength) {
+    // Digits written from the end of a line that also holds the name
+    char line[48];
+    char* digits = line + sizeof(line) - 2;
+    digits[0] = '\r';
+    digits[1] = '\n';
+    do {
+        *--digits = static_cast<char>('0' + contentLength % 10);
+        contentLength /= 10;
+    } while (contentLength != 0);
+    digits -= contentLengthName.len;
+    memcpy(digits, contentLengthName.data, contentLengthName.len);
+    append(digits, line + sizeof(line) - digits, RESPONSE_HEAD_MAX - RESPONSE_HEAD_TAIL);
+}
+
+void ResponseHead::addContentType(CONTENTTYPE type) {
+    append(contentTypes[type].data, contentTypes[type].len, RESPONSE_HEAD_MAX - RESPONSE_HEAD_TAIL);
+}
+
+void ResponseHead::addChunkedEncoding() {
+    append(chunkedEncoding.data, chunkedEncoding.len, RESPONSE_HEAD_MAX - RESPONSE_HEAD_TAIL);
+}
+
+void ResponseHead::addHeader(const char* name, const char* value, size_t valueLen) {
+    size_t nameLen = strlen(name);
+    if (len + nameLen + 2 + valueLen + 2 > RESPONSE_HEAD_MAX - RESPONSE_HEAD_TAIL) {
+        return;
+    }
+    append(name, nameLen, RESPONSE_HEAD_MAX);
+    append(": ", 2, RESPONSE_HEAD_MAX);
+    append(value, valueLen, RESPONSE_HEAD_MAX);
+    append("\r\n", 2, RESPONSE_HEAD_MAX);
+}
+
+void ResponseHead::finish(bool keepAlive) {
+    const HeadFragment& tail = keepAlive ? headTail : closeTail;
+    append(tail.data, tail.len, RESPONSE_HEAD_MAX);
+    copyDate(buf + len);
+    len += HTTP_DATE_LEN;
+    append(headEnd.data, headEnd.len, RESPONSE_HEAD_MAX);
+}
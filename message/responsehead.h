@@ -0,0 +1,80 @@
+#ifndef RESPONSEHEAD_H
+#define RESPONSEHEAD_H
+
+#include <string>
+#include <stddef.h>
+
+#define RESPONSE_HEAD_MAX 1024        // Status line and headers of a response, their values all have a bounded length
+#define RESPONSE_HEAD_TAIL 64         // Room kept for the Connection and Date lines and the empty line that end the head
+#define HTTP_DATE_LEN 29              // IMF-fixdate of the Date header, "Sun, 06 Nov 1994 08:49:37 GMT"
+
+// Status of a response, index of its status line in the fragments of responsehead.cpp
+enum HTTPSTATUS {
+    HTTP_OK,
+    HTTP_PARTIAL_CONTENT,
+    HTTP_FOUND,
+    HTTP_NOT_MODIFIED,
+    HTTP_BAD_REQUEST,
+    HTTP_FORBIDDEN,
+    HTTP_NOT_FOUND,
+    HTTP_PAYLOAD_TOO_LARGE,
+    HTTP_TOO_MANY_REQUESTS,
+    HTTP_HEADER_TOO_LARGE,
+    HTTP_INTERNAL_ERROR,
+    HTTP_SERVICE_UNAVAILABLE,
+    HTTP_STATUS_NUM        // No head built yet
+};
+
+// Content-Type of a body, with the headers that go with it
+enum CONTENTTYPE {
+    CONTENT_HTML,
+    CONTENT_FILE,
+    CONTENT_METRICS,
+    CONTENT_JSON,
+    CONTENT_TAR,
+    CONTENT_TYPE_NUM
+};
+
+// Status line and headers of a response, written in place into a buffer of the connection. The status lines, the
+// content types and the names of the headers are constant fragments, a head is built with a few memcpy and no
+// allocation. The value of the Date header is rendered once per second and shared by all the threads.
+class ResponseHead {
+public:
+    ResponseHead() : len(0), status(HTTP_STATUS_NUM) {}
+
+    // Starts a new head with its status line
+    void start(HTTPSTATUS value);
+
+    void addContentLength(unsigned long long contentLength);
+    void addContentType(CONTENTTYPE type);
+
+    // Transfer-Encoding: chunked, for a body whose length is not known when it starts
+    void addChunkedEncoding();
+
+    // Header line "name: value", dropped when it does not fit in the buffer
+    void addHeader(const char* name, const char* value, size_t valueLen);
+    void addHeader(const char* name, const std::string& value) { addHeader(name, value.data(), value.size()); }
+
+    // Ends the head with the Connection and Date headers and the empty line, the connection is closed after
+    // the response when keepAlive is false
+    void finish(bool keepAlive = true);
+
+    const char* data() const { return buf; }
+    size_t size() const { return len; }
+    HTTPSTATUS getStatus() const { return status; }
+
+    // Numeric code of a status, 0 for HTTP_STATUS_NUM
+    static int getStatusCode(HTTPSTATUS value);
+
+    // Current value of the Date header, HTTP_DATE_LEN characters without a NUL
+    static void copyDate(char out[HTTP_DATE_LEN]);
+
+private:
+    bool append(const char* data, size_t dataLen, size_t limit);
+
+    char buf[RESPONSE_HEAD_MAX];
+    size_t len;
+    HTTPSTATUS status;
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "metrics.h"
+
+#include <sstream>
+#include <iomanip>
+
+ThreadMetrics Metrics::localBlocks[MAX_METRICS_THREADS];
+ThreadMetrics* Metrics::blocks = Metrics::localBlocks;
+ThreadMetrics* Metrics::allBlocks = Metrics::localBlocks;
+int Metrics::allBlockNum = MAX_METRICS_THREADS;
+std::vector<Metrics::Gauge> Metrics::gauges;
+pthread_mutex_t Metrics::gaugeLocker = PTHREAD_MUTEX_INITIALIZER;
+
+// Status codes with their own slot, in slot order
+static const int statusSlotCodes[STATUS_SLOT_NUM - 1] = {200, 206, 302, 304, 400, 403, 404, 413, 429, 431, 500, 503};
+
+// Upper bounds of the exported Prometheus buckets, in microseconds
+static const unsigned long long exportBoundsUs[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                                    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+static int getStatusSlot(int statusCode) {
+    for (int i = 0; i < STATUS_SLOT_NUM - 1; ++i) {
+        if (statusSlotCodes[i] == statusCode) {
+            return i;
+        }
+    }
+    return STATUS_SLOT_NUM - 1;
+}
+
+// Gives the block of an exiting thread back, so that the counters of the elastic pool do not run out of blocks
+struct MetricsBlockGuard {
+    ThreadMetrics* block = nullptr;
+    ~MetricsBlockGuard() {
+        if (block != nullptr) {
+            block->inUse.store(false, std::memory_order_release);
+        }
+    }
+};
+
+ThreadMetrics* Metrics::getThreadBlock() {
+    static thread_local MetricsBlockGuard guard;
+    static thread_local ThreadMetrics* block = nullptr;
+    if (block != nullptr) {
+        return block;
+    }
+
+    for (int i = 0; i < MAX_METRICS_THREADS - 1; ++i) {
+        bool expected = false;
+        if (blocks[i].inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            guard.block = &blocks[i];
+            block = &blocks[i];
+            return block;
+        }
+    }
+    block = &blocks[MAX_METRICS_THREADS - 1];
+    return block;
+}
+
+void Metrics::add(ThreadMetrics* block, std::atomic<unsigned long long>& counter, unsigned long long value) {
+    // A block owned by one thread only needs a plain load and store, the overflow block is shared
+    if (block == &blocks[MAX_METRICS_THREADS - 1]) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    } else {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+}
+
+int Metrics::getBucketIndex(unsigned long long valueUs) {
+    if (valueUs < 16) {
+        return static_cast<int>(valueUs);
+    }
+    int msb = 63 - __builtin_clzll(valueUs);
+    int top = static_cast<int>(valueUs >> (msb - 3));   // The 4 most significant bits, in [8, 16)
+    int index = 16 + (msb - 4) * 8 + (top - 8);
+    return index < HIST_BUCKET_NUM ? index : HIST_BUCKET_NUM - 1;
+}
+
+unsigned long long Metrics::getBucketLowerBound(int index) {
+    if (index < 16) {
+        return index;
+    }
+    int msb = 4 + (index - 16) / 8;
+    unsigned long long top = 8 + (index - 16) % 8;
+    return top << (msb - 3);
+}
+
+void Metrics::record(ThreadMetrics* block, LatencyHistogram& hist, long long durationNs) {
+    unsigned long long durationUs = durationNs > 0 ? durationNs / 1000 : 0;
+    add(block, hist.buckets[getBucketIndex(durationUs)], 1);
+    add(block, hist.count, 1);
+    add(block, hist.sumUs, durationUs);
+}
+
+void Metrics::recordShared(LatencyHistogram& hist, long long durationNs) {
+    unsigned long long durationUs = durationNs > 0 ? durationNs / 1000 : 0;
+    hist.buckets[getBucketIndex(durationUs)].fetch_add(1, std::memory_order_relaxed);
+    hist.count.fetch_add(1, std::memory_order_relaxed);
+    hist.sumUs.fetch_add(durationUs, std::memory_order_relaxed);
+}
+
+unsigned long long Metrics::getQuantileUs(const LatencyHistogram& hist, double quantile) {
+    unsigned long long count = hist.count.load(std::memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    unsigned long long rank = static_cast<unsigned long long>(quantile * count);
+    unsigned long long cumulative = 0;
+    for (int b = 0; b < HIST_BUCKET_NUM; ++b) {
+        cumulative += hist.buckets[b].load(std::memory_order_relaxed);
+        if (cumulative > rank) {
+            // Upper bound of the bucket, the value is reported pessimistically
+            return b + 1 < HIST_BUCKET_NUM ? getBucketLowerBound(b + 1) : getBucketLowerBound(b);
+        }
+    }
+    return getBucketLowerBound(HIST_BUCKET_NUM - 1);
+}
+
+void Metrics::countRequest(METRICSROUTE route, int statusCode) {
+    ThreadMetrics* block = getThreadBlock();
+    add(block, block->requests[route][getStatusSlot(statusCode)], 1);
+}
+
+void Metrics::addBytesIn(long long len) {
+    ThreadMetrics* block = getThreadBlock();
+    add(block, block->bytesIn, len);
+}
+
+void Metrics::addBytesOut(long long len) {
+    ThreadMetrics* block = getThreadBlock();
+    add(block, block->bytesOut, len);
+}
+
+void Metrics::countSyscall(METRICSSYSCALL call) {
+    ThreadMetrics* block = getThreadBlock();
+    add(block, block->syscalls[call], 1);
+}
+
+void Metrics::recordFirstByte(METRICSROUTE route, long long durationNs) {
+    ThreadMetrics* block = getThreadBlock();
+    record(block, block->firstByte[route], durationNs);
+}
+
+void Metrics::recordTotal(METRICSROUTE route, long long durationNs) {
+    ThreadMetrics* block = getThreadBlock();
+    record(block, block->total[route], durationNs);
+}
+
+void Metrics::setBlocks(ThreadMetrics* own, ThreadMetrics* all, int allNum) {
+    blocks = own;
+    allBlocks = all;
+    allBlockNum = allNum;
+}
+
+void Metrics::registerGauge(const std::string& name, const std::string& help, long long (*reader)()) {
+    Gauge gauge;
+    gauge.name = name;
+    gauge.help = help;
+    gauge.reader = reader;
+    pthread_mutex_lock(&gaugeLocker);
+    gauges.push_back(gauge);
+    pthread_mutex_unlock(&gaugeLocker);
+}
+
+const char* Metrics::getRouteName(METRICSROUTE route) {
+    static const char* routeNames[ROUTE_NUM] = {"list", "downl", "del", "put", "upload", "metrics", "api_list", "archive", "api_search", "other"};
+    return routeNames[route];
+}
+
+void Metrics::renderHistogram(std::string& out, const std::string& name, const std::string& help, bool firstByte) {
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " histogram\n";
+
+    const int boundNum = sizeof(exportBoundsUs) / sizeof(exportBoundsUs[0]);
+    for (int route = 0; route < ROUTE_NUM; ++route) {
+        std::vector<unsigned long long> buckets(HIST_BUCKET_NUM, 0);
+        unsigned long long count = 0, sumUs = 0;
+        for (int i = 0; i < allBlockNum; ++i) {
+            LatencyHistogram& hist = firstByte ? allBlocks[i].firstByte[route] : allBlocks[i].total[route];
+            for (int b = 0; b < HIST_BUCKET_NUM; ++b) {
+                buckets[b] += hist.buckets[b].load(std::memory_order_relaxed);
+            }
+            count += hist.count.load(std::memory_order_relaxed);
+            sumUs += hist.sumUs.load(std::memory_order_relaxed);
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        // A fine bucket is counted under the first exported bound above its lower bound
+        std::string label = std::string("route=\"") + getRouteName(static_cast<METRICSROUTE>(route)) + "\"";
+        unsigned long long cumulative = 0;
+        int b = 0;
+        for (int i = 0; i < boundNum; ++i) {
+            while (b < HIST_BUCKET_NUM && getBucketLowerBound(b) < exportBoundsUs[i]) {
+                cumulative += buckets[b];
+                ++b;
+            }
+            std::ostringstream le;
+            le << exportBoundsUs[i] / 1e6;
+            out += name + "_bucket{" + label + ",le=\"" + le.str() + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        out += name + "_bucket{" + label + ",le=\"+Inf\"} " + std::to_string(count) + "\n";
+
+        std::ostringstream sum;
+        sum << std::fixed << std::setprecision(6) << sumUs / 1e6;
+        out += name + "_sum{" + label + "} " + sum.str() + "\n";
+        out += name + "_count{" + label + "} " + std::to_string(count) + "\n";
+    }
+}
+
+void Metrics::renderPrometheus(std::string& out) {
+    out += "# HELP cherokee_requests_total Responses sent, by route and status\n";
+    out += "# TYPE cherokee_requests_total counter\n";
+    for (int route = 0; route < ROUTE_NUM; ++route) {
+        for (int slot = 0; slot < STATUS_SLOT_NUM; ++slot) {
+            unsigned long long total = 0;
+            for (int i = 0; i < allBlockNum; ++i) {
+                total += allBlocks[i].requests[route][slot].load(std::memory_order_relaxed);
+            }
+            if (total == 0) {
+                continue;
+            }
+            std::string status = (slot < STATUS_SLOT_NUM - 1) ? std::to_string(statusSlotCodes[slot]) : "other";
+            out += std::string("cherokee_requests_total{route=\"") + getRouteName(static_cast<METRICSROUTE>(route)) +
+                   "\",status=\"" + status + "\"} " + std::to_string(total) + "\n";
+        }
+    }
+
+    unsigned long long bytesIn = 0, bytesOut = 0;
+    for (int i = 0; i < allBlockNum; ++i) {
+        bytesIn += allBlocks[i].bytesIn.load(std::memory_order_relaxed);
+        bytesOut += allBlocks[i].bytesOut.load(std::memory_order_relaxed);
+    }
+    out += "# HELP cherokee_received_bytes_total Bytes received from clients\n";
+    out += "# TYPE cherokee_received_bytes_total counter\n";
+    out += "cherokee_received_bytes_total " + std::to_string(bytesIn) + "\n";
+    out += "# HELP cherokee_sent_bytes_total Bytes sent to clients, headers and bodies\n";
+    out += "# TYPE cherokee_sent_bytes_total counter\n";
+    out += "cherokee_sent_bytes_total " + std::to_string(bytesOut) + "\n";
+
+    unsigned long long syscalls[SYSCALL_NUM] = {};
+    for (int i = 0; i < allBlockNum; ++i) {
+        for (int call = 0; call < SYSCALL_NUM; ++call) {
+            syscalls[call] += allBlocks[i].syscalls[call].load(std::memory_order_relaxed);
+        }
+    }
+    out += "# HELP cherokee_epoll_calls_total epoll system calls, waits of the reactor and interest changes of the connections\n";
+    out += "# TYPE cherokee_epoll_calls_total counter\n";
+    out += "cherokee_epoll_calls_total{call=\"wait\"} " + std::to_string(syscalls[SYSCALL_EPOLL_WAIT]) + "\n";
+    out += "cherokee_epoll_calls_total{call=\"ctl\"} " + std::to_string(syscalls[SYSCALL_EPOLL_CTL]) + "\n";
+    out += "# HELP cherokee_epoll_ctl_avoided_total Interest changes of the connections that made no system call\n";
+    out += "# TYPE cherokee_epoll_ctl_avoided_total counter\n";
+    out += "cherokee_epoll_ctl_avoided_total " + std::to_string(syscalls[SYSCALL_EPOLL_CTL_AVOIDED]) + "\n";
+
+    renderHistogram(out, "cherokee_time_to_first_byte_seconds", "Time from the first byte of the request to the first byte of the response", true);
+    renderHistogram(out, "cherokee_request_duration_seconds", "Time from the first byte of the request to the last byte of the response", false);
+
+    pthread_mutex_lock(&gaugeLocker);
+    std::vector<Gauge> gaugeCopy = gauges;
+    pthread_mutex_unlock(&gaugeLocker);
+    for (const Gauge& gauge : gaugeCopy) {
+        out += "# HELP " + gauge.name + " " + gauge.help + "\n";
+        out += "# TYPE " + gauge.name + " gauge\n";
+        out += gauge.name + " " + std::to_string(gauge.reader()) + "\n";
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#define MAX_METRICS_THREADS 128   // Blocks of counters, the last one is shared with atomic adds by threads that find no free block
+#define HIST_BUCKET_NUM 320       // Log-linear buckets: 16 exact values, then 8 sub-buckets per power of two
+
+// Route of a request, used as the route label of the metrics
+enum METRICSROUTE {
+    ROUTE_LIST,      // "/" : file list page
+    ROUTE_DOWNL,     // "/downl/<name>"
+    ROUTE_DEL,       // "/del/<name>"
+    ROUTE_PUT,       // PUT "/put/<name>"
+    ROUTE_UPLOAD,    // POST multipart upload
+    ROUTE_METRICS,   // "/metrics"
+    ROUTE_API_LIST,  // "/api/list?..." : JSON page of the file index
+    ROUTE_ARCHIVE,   // "/archive?..." : tar of several files
+    ROUTE_API_SEARCH, // "/api/search?q=..." : names found by the search index
+    ROUTE_OTHER,     // Redirects and everything else
+    ROUTE_NUM
+};
+
+// System calls of the event loop, counted to report the calls per request
+enum METRICSSYSCALL {
+    SYSCALL_EPOLL_WAIT,          // Waits of the reactor, with or without events
+    SYSCALL_EPOLL_CTL,           // Interest changes of the client connections
+    SYSCALL_EPOLL_CTL_AVOIDED,   // Interest changes skipped: unchanged interest, or a disarmed connection closed
+    SYSCALL_NUM
+};
+
+// Status codes counted separately, other codes share the "other" slot
+#define STATUS_SLOT_NUM 13
+
+// HDR-style latency histogram in microseconds. Values below 16 us are exact, larger values
+// fall in one of 8 sub-buckets per power of two, so the recorded value is within 12.5%.
+struct LatencyHistogram {
+    std::atomic<unsigned long long> buckets[HIST_BUCKET_NUM];
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> sumUs;
+};
+
+// Counters of one thread. Each block is written by a single thread, aligned on cache lines
+// so that threads never share a line, and only read by the scrape.
+struct alignas(64) ThreadMetrics {
+    std::atomic<unsigned long long> requests[ROUTE_NUM][STATUS_SLOT_NUM];
+    std::atomic<unsigned long long> bytesIn;
+    std::atomic<unsigned long long> bytesOut;
+    std::atomic<unsigned long long> syscalls[SYSCALL_NUM];
+    LatencyHistogram firstByte[ROUTE_NUM];   // From the first byte of the request to the first byte of the response
+    LatencyHistogram total[ROUTE_NUM];       // From the first byte of the request to the last byte of the response
+    std::atomic<bool> inUse;                 // Owned by a live thread, the block of an exited thread is reused
+};
+
+// Request counters and latency histograms kept per thread and merged on scrape.
+// Recording takes no lock: the thread finds its block through a thread_local pointer.
+class Metrics {
+public:
+    static void countRequest(METRICSROUTE route, int statusCode);
+    static void addBytesIn(long long len);
+    static void addBytesOut(long long len);
+    static void countSyscall(METRICSSYSCALL call);
+    static void recordFirstByte(METRICSROUTE route, long long durationNs);
+    static void recordTotal(METRICSROUTE route, long long durationNs);
+
+    // Moves the counters of the process into own, MAX_METRICS_THREADS blocks, and merges the allNum blocks of all
+    // on scrape, own among them. The prefork workers keep their blocks in a shared-memory segment so that any of
+    // them can render the counters of all. Must be called before any thread records.
+    static void setBlocks(ThreadMetrics* own, ThreadMetrics* all, int allNum);
+
+    // Registers a value read at scrape time, such as the number of open connections
+    static void registerGauge(const std::string& name, const std::string& help, long long (*reader)());
+
+    // Merges the blocks of all the threads and renders them in the Prometheus text format
+    static void renderPrometheus(std::string& out);
+
+    static const char* getRouteName(METRICSROUTE route);
+
+    // Records into a histogram that several threads update, such as the thread pool histograms
+    static void recordShared(LatencyHistogram& hist, long long durationNs);
+
+    // Value below which the given fraction of the recorded values fall, in microseconds
+    static unsigned long long getQuantileUs(const LatencyHistogram& hist, double quantile);
+
+    // Bucket of a value and lower bound of a bucket, in microseconds
+    static int getBucketIndex(unsigned long long valueUs);
+    static unsigned long long getBucketLowerBound(int index);
+
+private:
+    struct Gauge {
+        std::string name;
+        std::string help;
+        long long (*reader)();
+    };
+
+    static ThreadMetrics* getThreadBlock();
+    static void add(ThreadMetrics* block, std::atomic<unsigned long long>& counter, unsigned long long value);
+    static void record(ThreadMetrics* block, LatencyHistogram& hist, long long durationNs);
+    static void renderHistogram(std::string& out, const std::string& name, const std::string& help, bool firstByte);
+
+    static ThreadMetrics localBlocks[MAX_METRICS_THREADS];
+    static ThreadMetrics* blocks;         // Blocks written by the threads of this process
+    static ThreadMetrics* allBlocks;      // Blocks merged on scrape
+    static int allBlockNum;
+    static std::vector<Gauge> gauges;
+    static pthread_mutex_t gaugeLocker;
+};
+
+#endif
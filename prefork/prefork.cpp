@@ -0,0 +1,286 @@
+#include "prefork.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "../utils/utils.h"
+#include "../upgrade/handoff.h"
+
+StatsHeader* StatsSegment::header = nullptr;
+volatile sig_atomic_t Supervisor::stopSignal = 0;
+volatile sig_atomic_t Supervisor::upgradeSignal = 0;
+
+static size_t getSegmentSize(int workerNum) {
+    // The header is a multiple of a cache line, so the blocks stay aligned
+    return sizeof(StatsHeader) + sizeof(ThreadMetrics) * MAX_METRICS_THREADS * workerNum;
+}
+
+bool StatsSegment::isCompatible(const StatsHeader* candidate, size_t segmentSize, int workerNum) {
+    return candidate->magic == STATS_SEGMENT_MAGIC && candidate->version == STATS_SEGMENT_VERSION &&
+           candidate->workerNum == static_cast<uint32_t>(workerNum) && candidate->segmentSize == segmentSize &&
+           candidate->blockSize == sizeof(ThreadMetrics) && candidate->blocksPerWorker == MAX_METRICS_THREADS;
+}
+
+bool StatsSegment::create(const std::string& path, int workerNum) {
+    if (workerNum < 1 || workerNum > PREFORK_MAX_WORKERS) {
+        errno = EINVAL;
+        return false;
+    }
+    size_t segmentSize = getSegmentSize(workerNum);
+    key_t key = get_shm_key(path.c_str(), STATS_SEGMENT_KEY_ID);
+    if (key == -1) {
+        return false;
+    }
+    int shmid = init_shared_memory(key, segmentSize);
+    struct shmid_ds segmentStat;
+    if (shmid != -1 && shmctl(shmid, IPC_STAT, &segmentStat) == 0 && segmentStat.shm_nattch > 0) {
+        // Still attached by the server this one replaces: its workers keep their blocks until they exit
+        destroy_shared_memory(shmid);
+        shmid = init_shared_memory(key, segmentSize);
+    } else if (shmid == -1 && errno == EINVAL) {
+        // A smaller segment under the key, left by a server with fewer workers or smaller blocks
+        int oldShmid = shmget(key, 0, 0);
+        if (oldShmid != -1) {
+            destroy_shared_memory(oldShmid);
+        }
+        shmid = init_shared_memory(key, segmentSize);
+    }
+    if (shmid == -1) {
+        return false;
+    }
+    void* addr = attach_shared_memory(shmid);
+    if (addr == reinterpret_cast<void*>(-1)) {
+        return false;
+    }
+
+    StatsHeader* candidate = static_cast<StatsHeader*>(addr);
+    bool kept = isCompatible(candidate, segmentSize, workerNum);
+    if (!kept) {
+        // A new segment is zeroed by the kernel, one of another layout is cleared before its header is written
+        memset(addr, 0, segmentSize);
+        candidate->magic = STATS_SEGMENT_MAGIC;
+        candidate->version = STATS_SEGMENT_VERSION;
+        candidate->workerNum = workerNum;
+        candidate->segmentSize = segmentSize;
+        candidate->blockSize = sizeof(ThreadMetrics);
+        candidate->blocksPerWorker = MAX_METRICS_THREADS;
+    }
+    header = candidate;
+    for (int i = 0; i < workerNum; ++i) {
+        header->workers[i].pid.store(0, std::memory_order_relaxed);
+        releaseWorker(i);
+    }
+    std::cout << outHead("info") << (kept ? "Reusing" : "Created") << " the stats segment of " << workerNum << " workers, "
+              << segmentSize / 1024 << " KiB" << std::endl;
+    return true;
+}
+
+ThreadMetrics* StatsSegment::getWorkerBlocks(int index) {
+    ThreadMetrics* blocks = reinterpret_cast<ThreadMetrics*>(reinterpret_cast<char*>(header) + sizeof(StatsHeader));
+    return blocks + static_cast<size_t>(index) * MAX_METRICS_THREADS;
+}
+
+void StatsSegment::attachWorker(int index) {
+    Metrics::setBlocks(getWorkerBlocks(index), getWorkerBlocks(0), header->workerNum * MAX_METRICS_THREADS);
+    Metrics::registerGauge("cherokee_workers", "Worker processes running", getRunningWorkerNum);
+    Metrics::registerGauge("cherokee_worker_restarts", "Times a worker process exited and was started again", getRestartNum);
+}
+
+void StatsSegment::releaseWorker(int index) {
+    ThreadMetrics* blocks = getWorkerBlocks(index);
+    for (int i = 0; i < MAX_METRICS_THREADS; ++i) {
+        blocks[i].inUse.store(false, std::memory_order_release);
+    }
+}
+
+long long StatsSegment::getRunningWorkerNum() {
+    long long running = 0;
+    for (uint32_t i = 0; i < header->workerNum; ++i) {
+        running += header->workers[i].pid.load(std::memory_order_relaxed) != 0 ? 1 : 0;
+    }
+    return running;
+}
+
+long long StatsSegment::getRestartNum() {
+    unsigned long long restarts = 0;
+    for (uint32_t i = 0; i < header->workerNum; ++i) {
+        restarts += header->workers[i].restarts.load(std::memory_order_relaxed);
+    }
+    return static_cast<long long>(restarts);
+}
+
+void Supervisor::onStopSignal(int signo) {
+    stopSignal = signo;
+}
+
+void Supervisor::onUpgradeSignal(int signo) {
+    upgradeSignal = signo;
+}
+
+pid_t Supervisor::startWorker(int index, const std::vector<int>& listenFds, int (*serve)(int listenFd)) {
+    pid_t supervisorPid = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::cout << outHead("error") << "Failed to fork worker " << index << " (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    if (pid == 0) {
+        // The worker stops with the supervisor, even when the supervisor is killed without passing the signal on
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != supervisorPid) {
+            _exit(1);
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        // Until the server of the worker routes it to its event pipe
+        signal(UPGRADE_SIGNAL, SIG_IGN);
+        for (size_t i = 0; i < listenFds.size(); ++i) {
+            if (static_cast<int>(i) != index) {
+                close(listenFds[i]);
+            }
+        }
+        if (StatsSegment::getHeader() != nullptr) {
+            StatsSegment::attachWorker(index);
+        }
+        // The threads of the server may still run, the worker leaves without running the static destructors
+        int ret = serve(listenFds[index]);
+        std::cout.flush();
+        _exit(ret);
+    }
+
+    StatsHeader* header = StatsSegment::getHeader();
+    if (header != nullptr) {
+        header->workers[index].pid.store(pid, std::memory_order_relaxed);
+        header->workers[index].startTimeSec.store(time(nullptr), std::memory_order_relaxed);
+    }
+    std::cout << outHead("info") << "Worker " << index << " started, pid " << pid << std::endl;
+    return pid;
+}
+
+int Supervisor::run(const std::vector<int>& listenFds, int (*serve)(int listenFd)) {
+    // Without SA_RESTART, the signal interrupts waitpid
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = onStopSignal;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    struct sigaction upgradeAct = act;
+    upgradeAct.sa_handler = onUpgradeSignal;
+    if (sigaction(SIGINT, &act, nullptr) < 0 || sigaction(SIGTERM, &act, nullptr) < 0 || sigaction(UPGRADE_SIGNAL, &upgradeAct, nullptr) < 0) {
+        std::cout << outHead("error") << "Failed to set the signal handlers of the supervisor" << std::endl;
+        return -1;
+    }
+
+    int workerNum = static_cast<int>(listenFds.size());
+    std::vector<pid_t> pids(workerNum, -1);
+    std::vector<long long> startNs(workerNum, 0);
+    StatsHeader* header = StatsSegment::getHeader();
+    bool draining = false;
+    long long drainDeadlineNs = 0;
+    while (stopSignal == 0) {
+        if (upgradeSignal != 0 && !draining) {
+            upgradeSignal = 0;
+            if (Handoff::start(listenFds) > 0) {
+                // The workers stop accepting and exit once their connections are closed
+                draining = true;
+                drainDeadlineNs = getMonotonicNs() + (HANDOFF_DRAIN_TIMEOUT_SEC + 5) * 1000000000LL;
+                for (int i = 0; i < workerNum; ++i) {
+                    if (pids[i] > 0) {
+                        kill(pids[i], UPGRADE_SIGNAL);
+                    }
+                }
+            }
+        }
+        if (draining && std::count_if(pids.begin(), pids.end(), [](pid_t pid) { return pid > 0; }) == 0) {
+            std::cout << outHead("info") << "The workers drained, the supervisor leaves" << std::endl;
+            return 0;
+        }
+
+        // Workers that could not be forked are tried again after the delay
+        for (int i = 0; !draining && i < workerNum; ++i) {
+            if (pids[i] == -1) {
+                pids[i] = startWorker(i, listenFds, serve);
+                startNs[i] = getMonotonicNs();
+            }
+        }
+
+        // While draining, the workers that outlive their own drain timeout are stopped
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, draining ? WNOHANG : 0);
+        if (pid == 0) {
+            if (getMonotonicNs() >= drainDeadlineNs) {
+                for (int i = 0; i < workerNum; ++i) {
+                    if (pids[i] > 0) {
+                        kill(pids[i], SIGTERM);
+                    }
+                }
+            }
+            usleep(100 * 1000);
+            continue;
+        }
+        if (pid == -1) {
+            if (errno == ECHILD) {
+                usleep(PREFORK_RESTART_DELAY_MS * 1000);
+            }
+            continue;
+        }
+        int index = -1;
+        for (int i = 0; i < workerNum; ++i) {
+            if (pids[i] == pid) {
+                index = i;
+            }
+        }
+        if (index == -1) {
+            continue;
+        }
+
+        if (draining) {
+            std::cout << outHead("info") << "Worker " << index << " (pid " << pid << ") drained" << std::endl;
+            pids[index] = -1;
+            if (header != nullptr) {
+                header->workers[index].pid.store(0, std::memory_order_relaxed);
+            }
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            std::cout << outHead("error") << "Worker " << index << " (pid " << pid << ") killed by signal " << WTERMSIG(status) << std::endl;
+        } else {
+            std::cout << outHead("error") << "Worker " << index << " (pid " << pid << ") exited with status " << WEXITSTATUS(status) << std::endl;
+        }
+        pids[index] = -1;
+        if (header != nullptr) {
+            header->workers[index].pid.store(0, std::memory_order_relaxed);
+            StatsSegment::releaseWorker(index);
+        }
+        if (stopSignal != 0) {
+            break;
+        }
+        // A worker that fails at startup is not restarted in a tight loop
+        if (getMonotonicNs() - startNs[index] < PREFORK_MIN_UPTIME_SEC * 1000000000LL) {
+            usleep(PREFORK_RESTART_DELAY_MS * 1000);
+        }
+        if (header != nullptr && stopSignal == 0) {
+            header->workers[index].restarts.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::cout << outHead("info") << "Stopping the workers (signal " << stopSignal << ")" << std::endl;
+    for (int i = 0; i < workerNum; ++i) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < workerNum; ++i) {
+        while (pids[i] > 0 && waitpid(pids[i], nullptr, 0) == -1 && errno == EINTR) {
+        }
+        if (header != nullptr) {
+            header->workers[i].pid.store(0, std::memory_order_relaxed);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "../metrics/metrics.h"
+
+#define PREFORK_MAX_WORKERS 64
+#define PREFORK_MIN_UPTIME_SEC 1          // A worker that exits sooner is restarted after PREFORK_RESTART_DELAY_MS
+#define PREFORK_RESTART_DELAY_MS 1000
+#define STATS_SEGMENT_MAGIC 0x5354415453484b43ULL   // "CHKSTATS" read as a little-endian integer
+#define STATS_SEGMENT_VERSION 3
+#define STATS_SEGMENT_KEY_ID 'S'          // ftok id of the segment, with the path of the served directory
+
+// State of one worker, written by the supervisor
+struct WorkerSlot {
+    std::atomic<int> pid;                         // 0 while the worker is not running
+    std::atomic<unsigned long long> restarts;     // Times the worker exited and was started again
+    std::atomic<long long> startTimeSec;
+};
+
+// Header of the stats segment shared by the supervisor and its workers. The blocks of counters of the workers
+// follow it, blocksPerWorker per worker. A segment left by a server whose layout differs in any field, an older
+// binary for instance, is replaced rather than read.
+struct alignas(64) StatsHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t workerNum;
+    uint64_t segmentSize;         // Bytes of the whole segment
+    uint32_t blockSize;           // sizeof(ThreadMetrics)
+    uint32_t blocksPerWorker;     // MAX_METRICS_THREADS
+    WorkerSlot workers[PREFORK_MAX_WORKERS];
+};
+
+// Shared-memory segment of the counters of the prefork workers. Each worker records into its own blocks and
+// renders the blocks of all the workers on scrape, so /metrics gives the totals of the server whichever worker
+// answers. The counters of a worker survive its restarts.
+class StatsSegment {
+public:
+    // Creates the segment of the served directory for workerNum workers, or attaches the one a previous server
+    // left with the same layout and keeps its counters. Returns false with errno set.
+    static bool create(const std::string& path, int workerNum);
+
+    static StatsHeader* getHeader() { return header; }
+
+    // In a worker, after the fork: records into the blocks of the worker and registers the gauges of the workers
+    static void attachWorker(int index);
+
+    // In the supervisor, once a worker exited: frees the blocks its threads held
+    static void releaseWorker(int index);
+
+    // Gauges of /metrics
+    static long long getRunningWorkerNum();
+    static long long getRestartNum();
+
+private:
+    static ThreadMetrics* getWorkerBlocks(int index);
+    static bool isCompatible(const StatsHeader* candidate, size_t segmentSize, int workerNum);
+
+    static StatsHeader* header;
+};
+
+// Prefork mode: the supervisor forks one worker process per listening socket, each running its own server on a
+// socket bound to the shared port with SO_REUSEPORT. The supervisor keeps the sockets, so the connections waiting
+// in the queue of a worker that crashed are served by the worker started in its place. On UPGRADE_SIGNAL the
+// supervisor hands the sockets to a new binary (see upgrade/handoff.h), then its workers drain and it exits.
+class Supervisor {
+public:
+    // Forks the workers, each calling serve with its socket and exiting with its result, and restarts those that
+    // exit until SIGINT or SIGTERM, which is passed on to the workers, or until an upgrade. Returns in the supervisor
+    // once they all exited.
+    static int run(const std::vector<int>& listenFds, int (*serve)(int listenFd));
+
+private:
+    // Forks worker index, returns its pid or -1
+    static pid_t startWorker(int index, const std::vector<int>& listenFds, int (*serve)(int listenFd));
+
+    static void onStopSignal(int signo);
+    static void onUpgradeSignal(int signo);
+
+    static volatile sig_atomic_t stopSignal;
+    static volatile sig_atomic_t upgradeSignal;
+};
+
+#endif
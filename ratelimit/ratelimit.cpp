@@ -0,0 +1,198 @@
+#include "ratelimit.h"
+
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <arpa/inet.h>
+
+#include "../utils/utils.h"
+
+RateLimits RateLimiter::limits;
+RateLimiter::Shard RateLimiter::shards[RATE_SHARDS];
+std::atomic<uint32_t> RateLimiter::fdAddress[RATE_MAX_FD];
+
+void RateLimiter::setLimits(const RateLimits& value) {
+    limits = value;
+    for (RateRule& rule : limits.rules) {
+        rule.network &= rule.mask;
+    }
+}
+
+bool RateLimiter::parseCidr(const std::string& cidr, RateRule& rule) {
+    std::string::size_type slash = cidr.find('/');
+    std::string address = cidr.substr(0, slash);
+    int prefixLen = 32;
+    if (slash != std::string::npos) {
+        char* end = nullptr;
+        long value = strtol(cidr.c_str() + slash + 1, &end, 10);
+        if (end == cidr.c_str() + slash + 1 || *end != '\0' || value < 0 || value > 32) {
+            return false;
+        }
+        prefixLen = static_cast<int>(value);
+    }
+    struct in_addr addr;
+    if (inet_pton(AF_INET, address.c_str(), &addr) != 1) {
+        return false;
+    }
+    rule.mask = prefixLen == 0 ? 0 : ~0u << (32 - prefixLen);
+    rule.network = ntohl(addr.s_addr) & rule.mask;
+    return true;
+}
+
+bool RateLimiter::parseLimits(const std::string& value, RateRule& rule) {
+    const char* pos = value.c_str();
+    char* end = nullptr;
+    long connections = strtol(pos, &end, 10);
+    if (end == pos || *end != ':' || connections < 0) {
+        return false;
+    }
+    pos = end + 1;
+    double rate = strtod(pos, &end);
+    if (end == pos || *end != ':' || !(rate >= 0)) {
+        return false;
+    }
+    pos = end + 1;
+    double burst = strtod(pos, &end);
+    if (end == pos || *end != '\0' || !(burst >= 1)) {
+        return false;
+    }
+    rule.maxConnections = static_cast<int>(std::min(connections, 1L << 30));
+    rule.requestsPerSec = rate;
+    rule.burst = burst;
+    return true;
+}
+
+int RateLimiter::findRule(uint32_t address) {
+    int found = -1;
+    for (size_t i = 0; i < limits.rules.size(); ++i) {
+        const RateRule& rule = limits.rules[i];
+        if ((address & rule.mask) == rule.network && (found < 0 || rule.mask > limits.rules[found].mask)) {
+            found = static_cast<int>(i);
+        }
+    }
+    return found;
+}
+
+int RateLimiter::getShard(uint32_t address) {
+    // Multiplicative hash, the high bits mix all the bits of the address
+    return static_cast<int>((address * 2654435761u) >> 26) % RATE_SHARDS;
+}
+
+void RateLimiter::evictIdle(int shard, long long nowNs) {
+    long long idleNs = static_cast<long long>(limits.idleSec) * 1000000000LL;
+    std::unordered_map<uint32_t, Client>& clients = shards[shard].clients;
+    for (std::unordered_map<uint32_t, Client>::iterator it = clients.begin(); it != clients.end();) {
+        if (it->second.connections == 0 && nowNs - it->second.lastSeenNs > idleNs) {
+            it = clients.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    shards[shard].lastEvictNs = nowNs;
+}
+
+RATEVERDICT RateLimiter::acquireConnection(int fd, const sockaddr_in& addr) {
+    if (!limits.enabled || fd < 0 || fd >= RATE_MAX_FD) {
+        return RATE_ACCEPTED;
+    }
+    uint32_t address = ntohl(addr.sin_addr.s_addr);
+    int rule = findRule(address);
+    if (getRule(rule).action == RATE_DENY) {
+        return RATE_DENIED;
+    }
+    if (getRule(rule).action == RATE_ALLOW || address == 0) {
+        fdAddress[fd].store(0, std::memory_order_relaxed);
+        return RATE_ACCEPTED;
+    }
+
+    long long nowNs = getMonotonicNs();
+    int shard = getShard(address);
+    RATEVERDICT verdict = RATE_ACCEPTED;
+    pthread_mutex_lock(&shards[shard].lock);
+    if (nowNs - shards[shard].lastEvictNs > RATE_EVICT_INTERVAL_SEC * 1000000000LL) {
+        evictIdle(shard, nowNs);
+    }
+    std::unordered_map<uint32_t, Client>::iterator it = shards[shard].clients.find(address);
+    if (it == shards[shard].clients.end()) {
+        Client client;
+        client.tokens = getRule(rule).burst;
+        client.refillNs = nowNs;
+        client.lastSeenNs = nowNs;
+        client.connections = 0;
+        client.rule = rule;
+        it = shards[shard].clients.insert(std::make_pair(address, client)).first;
+    }
+    Client& client = it->second;
+    client.lastSeenNs = nowNs;
+    if (client.connections >= getRule(client.rule).maxConnections) {
+        verdict = RATE_TOO_MANY_CONNECTIONS;
+    } else {
+        ++client.connections;
+    }
+    pthread_mutex_unlock(&shards[shard].lock);
+
+    fdAddress[fd].store(verdict == RATE_ACCEPTED ? address : 0, std::memory_order_relaxed);
+    return verdict;
+}
+
+void RateLimiter::releaseConnection(int fd) {
+    if (fd < 0 || fd >= RATE_MAX_FD) {
+        return;
+    }
+    uint32_t address = fdAddress[fd].exchange(0, std::memory_order_relaxed);
+    if (address == 0) {
+        return;
+    }
+    int shard = getShard(address);
+    pthread_mutex_lock(&shards[shard].lock);
+    std::unordered_map<uint32_t, Client>::iterator it = shards[shard].clients.find(address);
+    if (it != shards[shard].clients.end() && it->second.connections > 0) {
+        --it->second.connections;
+        it->second.lastSeenNs = getMonotonicNs();
+    }
+    pthread_mutex_unlock(&shards[shard].lock);
+}
+
+bool RateLimiter::allowRequest(int fd, int& retryAfterSec) {
+    if (fd < 0 || fd >= RATE_MAX_FD) {
+        return true;
+    }
+    uint32_t address = fdAddress[fd].load(std::memory_order_relaxed);
+    if (address == 0) {
+        return true;
+    }
+
+    long long nowNs = getMonotonicNs();
+    int shard = getShard(address);
+    bool allowed = true;
+    pthread_mutex_lock(&shards[shard].lock);
+    std::unordered_map<uint32_t, Client>::iterator it = shards[shard].clients.find(address);
+    if (it != shards[shard].clients.end()) {
+        Client& client = it->second;
+        const RateRule& rule = getRule(client.rule);
+        client.tokens += (nowNs - client.refillNs) * rule.requestsPerSec / 1e9;
+        if (client.tokens > rule.burst) {
+            client.tokens = rule.burst;
+        }
+        client.refillNs = nowNs;
+        client.lastSeenNs = nowNs;
+        if (client.tokens >= 1) {
+            client.tokens -= 1;
+        } else {
+            allowed = false;
+            retryAfterSec = rule.requestsPerSec > 0 ? static_cast<int>(std::ceil((1 - client.tokens) / rule.requestsPerSec)) : 1;
+        }
+    }
+    pthread_mutex_unlock(&shards[shard].lock);
+    return allowed;
+}
+
+long long RateLimiter::getClientNum() {
+    long long clientNum = 0;
+    for (Shard& shard : shards) {
+        pthread_mutex_lock(&shard.lock);
+        clientNum += shard.clients.size();
+        pthread_mutex_unlock(&shard.lock);
+    }
+    return clientNum;
+}
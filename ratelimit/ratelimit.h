@@ -0,0 +1,109 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define RATE_SHARDS 64                // Lock stripes of the table of clients, a client always falls in the same one
+#define RATE_MAX_FD 65536             // Connections with a larger descriptor are not limited
+#define RATE_EVICT_INTERVAL_SEC 10    // A shard looks for idle clients at most this often
+
+// What a rule does with the clients of its addresses
+enum RATEACTION {
+    RATE_LIMIT,   // The limits of the rule apply
+    RATE_ALLOW,   // No limit, the clients are not even tracked
+    RATE_DENY,    // Connections are refused with 403
+};
+
+// Limits of the clients of an address range, one client being one IPv4 address
+struct RateRule {
+    uint32_t network = 0;             // Host byte order, only the bits of mask count
+    uint32_t mask = 0;
+    RATEACTION action = RATE_LIMIT;
+    int maxConnections = 256;         // Connections open at once
+    double requestsPerSec = 1000;     // Refill rate of the token bucket of a client
+    double burst = 2000;              // Capacity of the bucket, requests allowed at once after an idle period
+};
+
+struct RateLimits {
+    bool enabled = true;
+    RateRule defaults;                // Limits of the addresses matched by no rule, its network and mask are ignored
+    std::vector<RateRule> rules;      // The rule with the longest prefix matching the address wins
+    int idleSec = 60;                 // Clients without connections and unseen for this long leave the table
+};
+
+// Result of the admission of a new connection
+enum RATEVERDICT {
+    RATE_ACCEPTED,
+    RATE_DENIED,                 // A RATE_DENY rule matches the address
+    RATE_TOO_MANY_CONNECTIONS,   // The client already has maxConnections open
+};
+
+// Limits per client address: concurrent connections, checked at accept, and request rate, a token bucket taken
+// at the start of each request. The clients are kept in RATE_SHARDS hash tables, each with its own lock, so that
+// two workers only contend when their clients hash to the same shard. A bucket is refilled lazily from the time
+// since it was last taken from, and each shard drops its idle clients every RATE_EVICT_INTERVAL_SEC.
+class RateLimiter {
+public:
+    // Must be called before the server accepts connections
+    static void setLimits(const RateLimits& limits);
+
+    // Parses "a.b.c.d/len" or "a.b.c.d" into the network and mask of rule, false when it is not valid
+    static bool parseCidr(const std::string& cidr, RateRule& rule);
+
+    // Parses "connections:rate:burst" ("64:500:1000") into the limits of rule, false when it is not valid
+    static bool parseLimits(const std::string& value, RateRule& rule);
+
+    // Counts a new connection of the address and remembers the address of fd until releaseConnection
+    static RATEVERDICT acquireConnection(int fd, const sockaddr_in& addr);
+
+    // Forgets the connection of fd, to call before the descriptor is closed and can be reused
+    static void releaseConnection(int fd);
+
+    // Takes a token from the bucket of the client of fd at the start of a request. Returns false when the bucket
+    // is empty, retryAfterSec is then the wait for the next token, rounded up.
+    static bool allowRequest(int fd, int& retryAfterSec);
+
+    // Clients in the table, read at scrape time
+    static long long getClientNum();
+
+private:
+    struct Client {
+        double tokens;
+        long long refillNs;      // Time the tokens were computed at
+        long long lastSeenNs;
+        int connections;
+        int rule;                // Index in the rules, -1 for the defaults
+    };
+
+    struct Shard {
+        Shard() : lastEvictNs(0) { pthread_mutex_init(&lock, nullptr); }
+
+        pthread_mutex_t lock;
+        std::unordered_map<uint32_t, Client> clients;
+        long long lastEvictNs;
+    };
+
+    static const RateRule& getRule(int rule) { return rule < 0 ? limits.defaults : limits.rules[rule]; }
+
+    // Index of the rule of an address, -1 for the defaults
+    static int findRule(uint32_t address);
+
+    static int getShard(uint32_t address);
+
+    // Drops the idle clients of a shard, its lock held
+    static void evictIdle(int shard, long long nowNs);
+
+    static RateLimits limits;
+    static Shard shards[RATE_SHARDS];
+
+    // Address of the client of each connection in host byte order, 0 when the connection is not limited
+    static std::atomic<uint32_t> fdAddress[RATE_MAX_FD];
+};
+
+#endif
@@ -0,0 +1,909 @@
+#include "namesearch.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "../utils/utils.h"
+#include "../index/fileindex.h"
+#include "../storage/storage.h"
+
+// Readers search under the read lock, the index is changed or replaced under the write lock
+static pthread_rwlock_t searchLock = PTHREAD_RWLOCK_INITIALIZER;
+static std::unique_ptr<SearchIndex> current(new SearchIndex());
+
+// Directory of the storage watched by inotify, level 0 is the root
+struct WatchDir {
+    std::string path;
+    int depth;
+};
+
+// Only used by the watcher thread once it started
+static int inotifyFd = -1;
+static std::unordered_map<int, WatchDir> watchDirs;
+static bool watchLimitLogged = false;
+
+// Pipes of the followers the watcher passes the changes on to, and the followers that missed changes because
+// their pipe was full. Set before the watcher starts.
+static std::vector<int> relayFds;
+static std::vector<bool> relayLost;
+
+const unsigned char* NameArena::add(const char* name, size_t len) {
+    if (m_used + 1 + len > SEARCH_ARENA_BLOCK) {
+        m_blocks.push_back(std::unique_ptr<unsigned char[]>(new unsigned char[SEARCH_ARENA_BLOCK]));
+        m_used = 0;
+    }
+    unsigned char* entry = m_blocks.back().get() + m_used;
+    entry[0] = static_cast<unsigned char>(len);
+    memcpy(entry + 1, name, len);
+    m_used += 1 + len;
+    return entry;
+}
+
+void NameArena::append(NameArena& other) {
+    // The names added after this keep filling the last block of other
+    for (std::unique_ptr<unsigned char[]>& block : other.m_blocks) {
+        m_blocks.push_back(std::move(block));
+    }
+    if (!other.m_blocks.empty()) {
+        m_used = other.m_used;
+    }
+    other.m_blocks.clear();
+    other.m_used = SEARCH_ARENA_BLOCK;
+}
+
+static void appendVarint(std::vector<unsigned char>& bytes, uint32_t value) {
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<unsigned char>(value));
+}
+
+// Reads the varint at pos and moves pos after it
+static uint32_t readVarint(const unsigned char* bytes, size_t& pos) {
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        unsigned char c = bytes[pos++];
+        value |= static_cast<uint32_t>(c & 0x7f) << shift;
+        if (c < 0x80) {
+            return value;
+        }
+    }
+}
+
+void Posting::append(uint32_t id) {
+    if (count > 0 && id == last) {
+        return;
+    }
+    appendVarint(bytes, count == 0 ? id : id - last);
+    last = id;
+    ++count;
+    if (count % SEARCH_SKIP_INTERVAL == 0) {
+        skips.push_back(PostingSkip{id, static_cast<uint32_t>(bytes.size()), count});
+    }
+}
+
+void Posting::appendList(const Posting& other) {
+    if (other.count == 0) {
+        return;
+    }
+    // The first id of other is stored as is, it becomes a delta from the last id of this list
+    size_t pos = 0;
+    append(readVarint(other.bytes.data(), pos));
+    // The skips of other move by the bytes and the ids before its second id
+    uint32_t posShift = static_cast<uint32_t>(bytes.size() - pos);
+    uint32_t readShift = count - 1;
+    bytes.insert(bytes.end(), other.bytes.begin() + pos, other.bytes.end());
+    for (const PostingSkip& skip : other.skips) {
+        skips.push_back(PostingSkip{skip.id, skip.pos + posShift, skip.read + readShift});
+    }
+    last = other.last;
+    count += other.count - 1;
+}
+
+static uint32_t getTrigram(const unsigned char* text) {
+    return (static_cast<uint32_t>(text[0]) << 16) | (static_cast<uint32_t>(text[1]) << 8) | text[2];
+}
+
+static void addTrigrams(std::unordered_map<uint32_t, Posting>& trigrams, uint32_t id, const unsigned char* name, size_t len) {
+    for (size_t i = 0; i + 3 <= len; ++i) {
+        trigrams[getTrigram(name + i)].append(id);
+    }
+}
+
+// FNV-1a
+static uint64_t hashName(const char* name, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint32_t findId(const SearchIndex& index, const char* name, size_t len) {
+    if (index.slots.empty()) {
+        return SEARCH_NONE;
+    }
+    size_t mask = index.slots.size() - 1;
+    for (size_t i = hashName(name, len) & mask; index.slots[i] != 0; i = (i + 1) & mask) {
+        const unsigned char* entry = index.names[index.slots[i] - 1];
+        if (entry[0] == len && memcmp(entry + 1, name, len) == 0) {
+            return index.slots[i] - 1;
+        }
+    }
+    return SEARCH_NONE;
+}
+
+// Adds id to the intern table, the ids below it are already there
+static void intern(SearchIndex& index, uint32_t id) {
+    if ((static_cast<size_t>(id) + 1) * 2 > index.slots.size()) {
+        size_t slotNum = std::max<size_t>(index.slots.size() * 2, 1024);
+        while ((static_cast<size_t>(id) + 1) * 2 > slotNum) {
+            slotNum *= 2;
+        }
+        index.slots.assign(slotNum, 0);
+        for (uint32_t i = 0; i < id; ++i) {
+            intern(index, i);
+        }
+    }
+    const unsigned char* entry = index.names[id];
+    size_t mask = index.slots.size() - 1;
+    size_t i = hashName(reinterpret_cast<const char*>(entry + 1), entry[0]) & mask;
+    while (index.slots[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    index.slots[i] = id + 1;
+}
+
+static const unsigned char* getLabel(const SearchIndex& index, const TrieNode& node) {
+    return index.names[node.labelName] + 1 + node.labelStart;
+}
+
+static uint32_t addNode(SearchIndex& index, uint32_t labelName, size_t labelStart, size_t labelLen) {
+    TrieNode node;
+    node.labelName = labelName;
+    node.labelStart = static_cast<uint8_t>(labelStart);
+    node.labelLen = static_cast<uint8_t>(labelLen);
+    node.firstByte = labelLen > 0 ? index.names[labelName][1 + labelStart] : 0;
+    node.firstChild = SEARCH_NONE;
+    node.nextSibling = SEARCH_NONE;
+    node.nameId = SEARCH_NONE;
+    index.nodes.push_back(node);
+    return static_cast<uint32_t>(index.nodes.size() - 1);
+}
+
+static void insertTrie(SearchIndex& index, uint32_t id) {
+    if (index.nodes.empty()) {
+        addNode(index, 0, 0, 0);
+    }
+    // Nodes are referred to by position, addNode may move them
+    const unsigned char* name = index.names[id] + 1;
+    size_t len = index.names[id][0];
+    uint32_t node = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        uint32_t prev = SEARCH_NONE;
+        uint32_t child = index.nodes[node].firstChild;
+        while (child != SEARCH_NONE && index.nodes[child].firstByte < name[pos]) {
+            prev = child;
+            child = index.nodes[child].nextSibling;
+        }
+        if (child == SEARCH_NONE || index.nodes[child].firstByte != name[pos]) {
+            uint32_t leaf = addNode(index, id, pos, len - pos);
+            index.nodes[leaf].nameId = id;
+            index.nodes[leaf].nextSibling = child;
+            if (prev == SEARCH_NONE) {
+                index.nodes[node].firstChild = leaf;
+            } else {
+                index.nodes[prev].nextSibling = leaf;
+            }
+            return;
+        }
+
+        const unsigned char* label = getLabel(index, index.nodes[child]);
+        size_t labelLen = index.nodes[child].labelLen;
+        size_t common = 1;
+        while (common < labelLen && pos + common < len && label[common] == name[pos + common]) {
+            ++common;
+        }
+        if (common < labelLen) {
+            // The child is split: a node for the common part takes its place and gets it as only child
+            uint32_t middle = addNode(index, index.nodes[child].labelName, index.nodes[child].labelStart, common);
+            index.nodes[middle].firstChild = child;
+            index.nodes[middle].nextSibling = index.nodes[child].nextSibling;
+            if (prev == SEARCH_NONE) {
+                index.nodes[node].firstChild = middle;
+            } else {
+                index.nodes[prev].nextSibling = middle;
+            }
+            index.nodes[child].labelStart += common;
+            index.nodes[child].labelLen -= common;
+            index.nodes[child].firstByte = label[common];
+            index.nodes[child].nextSibling = SEARCH_NONE;
+            child = middle;
+        }
+        node = child;
+        pos += common;
+    }
+    index.nodes[node].nameId = id;
+}
+
+// Adds a name to an index that is not built from scratch, the caller holds the write lock
+static void addName(SearchIndex& index, const char* name, size_t len) {
+    uint32_t id = findId(index, name, len);
+    if (id != SEARCH_NONE) {
+        // A name deleted then created again keeps its id, its trie node and its postings
+        if (!index.alive[id]) {
+            index.alive[id] = 1;
+            ++index.aliveNum;
+        }
+        return;
+    }
+    id = static_cast<uint32_t>(index.names.size());
+    index.names.push_back(index.arena.add(name, len));
+    index.alive.push_back(1);
+    ++index.aliveNum;
+    intern(index, id);
+    insertTrie(index, id);
+    addTrigrams(index.trigrams, id, index.names[id] + 1, len);
+}
+
+static bool isSearchableName(const std::string& name) {
+    return Storage::isValidName(name) && name.size() <= SEARCH_QUERY_MAX;
+}
+
+// Part of the names given to one thread of a build
+struct BuildPart {
+    const std::vector<std::string>* names;
+    SearchIndex* index;
+    size_t begin;
+    size_t end;
+    NameArena arena;
+    std::unordered_map<uint32_t, Posting> trigrams;
+    // Direct-mapped: the nodes of the hash table do not move, their posting lists are appended to in place
+    uint32_t cacheKeys[SEARCH_BUILD_CACHE];
+    Posting* cachePostings[SEARCH_BUILD_CACHE];
+};
+
+static void* buildPart(void* arg) {
+    BuildPart* part = static_cast<BuildPart*>(arg);
+    std::fill(part->cachePostings, part->cachePostings + SEARCH_BUILD_CACHE, nullptr);
+    for (size_t i = part->begin; i < part->end; ++i) {
+        const std::string& name = (*part->names)[i];
+        // An invalid name keeps its id, with an empty name that no query finds
+        bool valid = isSearchableName(name);
+        part->index->names[i] = part->arena.add(name.data(), valid ? name.size() : 0);
+        part->index->alive[i] = valid ? 1 : 0;
+        const unsigned char* text = part->index->names[i] + 1;
+        for (size_t j = 0; valid && j + 3 <= name.size(); ++j) {
+            uint32_t key = getTrigram(text + j);
+            size_t slot = ((key * 2654435761u) >> 20) & (SEARCH_BUILD_CACHE - 1);
+            if (part->cachePostings[slot] == nullptr || part->cacheKeys[slot] != key) {
+                part->cacheKeys[slot] = key;
+                part->cachePostings[slot] = &part->trigrams[key];
+            }
+            part->cachePostings[slot]->append(static_cast<uint32_t>(i));
+        }
+    }
+    return nullptr;
+}
+
+static void* buildTrie(void* arg) {
+    SearchIndex* index = static_cast<SearchIndex*>(arg);
+    // Sized once for all the names, intern does not grow it
+    size_t slotNum = 1024;
+    while (index->names.size() * 2 >= slotNum) {
+        slotNum *= 2;
+    }
+    index->slots.assign(slotNum, 0);
+    for (uint32_t id = 0; id < index->names.size(); ++id) {
+        intern(*index, id);
+        if (index->alive[id]) {
+            insertTrie(*index, id);
+        }
+    }
+    return nullptr;
+}
+
+static size_t getBuildThreadNum(size_t nameNum, int threadNum) {
+    return std::max<size_t>(std::min<size_t>(threadNum, nameNum / SEARCH_BUILD_CHUNK), 1);
+}
+
+// The names are copied into arenas and their trigrams listed by threadNum threads, each on a range of ids. The
+// posting lists of the ranges are then appended in order while another thread builds the trie and the intern table.
+static SearchIndex* buildIndex(const std::vector<std::string>& names, int threadNum) {
+    SearchIndex* index = new SearchIndex();
+    index->names.resize(names.size());
+    index->alive.resize(names.size());
+    size_t partNum = getBuildThreadNum(names.size(), threadNum);
+    std::vector<BuildPart> parts(partNum);
+    std::vector<pthread_t> threads(partNum);
+    for (size_t i = 0; i < partNum; ++i) {
+        parts[i].names = &names;
+        parts[i].index = index;
+        parts[i].begin = names.size() * i / partNum;
+        parts[i].end = names.size() * (i + 1) / partNum;
+        if (i > 0 && pthread_create(&threads[i], nullptr, buildPart, &parts[i]) != 0) {
+            buildPart(&parts[i]);
+            threads[i] = 0;
+        }
+    }
+    buildPart(&parts[0]);
+    for (size_t i = 1; i < partNum; ++i) {
+        if (threads[i] != 0) {
+            pthread_join(threads[i], nullptr);
+        }
+    }
+    for (BuildPart& part : parts) {
+        index->arena.append(part.arena);
+    }
+
+    pthread_t trieThread;
+    bool trieThreaded = pthread_create(&trieThread, nullptr, buildTrie, index) == 0;
+    if (!trieThreaded) {
+        buildTrie(index);
+    }
+    index->trigrams = std::move(parts[0].trigrams);
+    for (size_t i = 1; i < partNum; ++i) {
+        for (const auto& entry : parts[i].trigrams) {
+            index->trigrams[entry.first].appendList(entry.second);
+        }
+        parts[i].trigrams.clear();
+    }
+    for (auto& entry : index->trigrams) {
+        entry.second.bytes.shrink_to_fit();
+        entry.second.skips.shrink_to_fit();
+    }
+    if (trieThreaded) {
+        pthread_join(trieThread, nullptr);
+    }
+    index->aliveNum = std::count(index->alive.begin(), index->alive.end(), 1);
+    index->builtNs = getMonotonicNs();
+    return index;
+}
+
+// Builds the index again from its live names, the caller holds the write lock
+static void compact() {
+    std::vector<std::string> names;
+    names.reserve(current->aliveNum);
+    for (uint32_t id = 0; id < current->names.size(); ++id) {
+        if (current->alive[id]) {
+            names.push_back(std::string(reinterpret_cast<const char*>(current->names[id] + 1), current->names[id][0]));
+        }
+    }
+    std::sort(names.begin(), names.end());
+    size_t deadNum = current->names.size() - current->aliveNum;
+    current.reset(buildIndex(names, getAvailableCpuNum()));
+    std::cout << outHead("info") << "Search index compacted, " << deadNum << " deleted names dropped" << std::endl;
+}
+
+void NameSearch::build(const std::vector<std::string>& names, int threadNum) {
+    long long startNs = getMonotonicNs();
+    std::unique_ptr<SearchIndex> index(buildIndex(names, threadNum));
+    pthread_rwlock_wrlock(&searchLock);
+    current.swap(index);
+    pthread_rwlock_unlock(&searchLock);
+    std::cout << outHead("info") << "Search index of " << names.size() << " names built in " << (getMonotonicNs() - startNs) / 1000000
+              << " ms on " << getBuildThreadNum(names.size(), threadNum) << " threads, "
+              << getMemoryBytes() / 1024 << " KiB" << std::endl;
+}
+
+void NameSearch::load(int threadNum) {
+    std::vector<std::string> names;
+    if (FileIndex::isReady()) {
+        FileIndex::listNames(names);
+    } else if (!Storage::listFiles(names)) {
+        std::cout << outHead("error") << "Failed to read " << Storage::getRoot() << ", the search index starts empty" << std::endl;
+    }
+    build(names, threadNum);
+}
+
+void NameSearch::add(const std::string& name) {
+    if (!isSearchableName(name)) {
+        return;
+    }
+    pthread_rwlock_wrlock(&searchLock);
+    addName(*current, name.data(), name.size());
+    pthread_rwlock_unlock(&searchLock);
+}
+
+void NameSearch::remove(const std::string& name) {
+    pthread_rwlock_wrlock(&searchLock);
+    uint32_t id = findId(*current, name.data(), name.size());
+    if (id != SEARCH_NONE && current->alive[id]) {
+        current->alive[id] = 0;
+        --current->aliveNum;
+        size_t deadNum = current->names.size() - current->aliveNum;
+        if (deadNum > SEARCH_COMPACT_MIN && deadNum > current->aliveNum) {
+            compact();
+        }
+    }
+    pthread_rwlock_unlock(&searchLock);
+}
+
+bool NameSearch::parseQuery(const std::string& queryString, SearchQuery& query, std::string& error) {
+    bool hasText = false;
+    for (const auto& param : parseQueryString(queryString)) {
+        const std::string& key = param.first;
+        const std::string& value = param.second;
+        if (key == "q") {
+            query.text = value;
+            hasText = true;
+        } else if (key == "limit") {
+            if (value.empty() || value.size() > 4 || value.find_first_not_of("0123456789") != std::string::npos ||
+                atoi(value.c_str()) < 1 || atoi(value.c_str()) > SEARCH_RESULT_MAX) {
+                error = "limit must be between 1 and " + std::to_string(SEARCH_RESULT_MAX);
+                return false;
+            }
+            query.limit = atoi(value.c_str());
+        } else if (key == "mode") {
+            if (value == "substring") {
+                query.mode = SEARCH_SUBSTRING;
+            } else if (value == "prefix") {
+                query.mode = SEARCH_PREFIX;
+            } else {
+                error = "mode must be substring or prefix";
+                return false;
+            }
+        }
+    }
+    if (!hasText || query.text.empty() || query.text.size() > SEARCH_QUERY_MAX) {
+        error = "q must hold between 1 and " + std::to_string(SEARCH_QUERY_MAX) + " bytes";
+        return false;
+    }
+    return true;
+}
+
+// Names of the subtree of the trie node matching the query, in name order
+static void searchPrefix(const SearchIndex& index, const SearchQuery& query, std::vector<uint32_t>& ids, bool& truncated) {
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(query.text.data());
+    size_t len = query.text.size();
+    if (index.nodes.empty()) {
+        return;
+    }
+    uint32_t node = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        uint32_t child = index.nodes[node].firstChild;
+        while (child != SEARCH_NONE && index.nodes[child].firstByte < text[pos]) {
+            child = index.nodes[child].nextSibling;
+        }
+        if (child == SEARCH_NONE || index.nodes[child].firstByte != text[pos]) {
+            return;
+        }
+        // The query may end inside the label
+        size_t compared = std::min<size_t>(index.nodes[child].labelLen, len - pos);
+        if (memcmp(getLabel(index, index.nodes[child]), text + pos, compared) != 0) {
+            return;
+        }
+        node = child;
+        pos += compared;
+    }
+
+    // A node comes before its children, and the children are sorted, so the walk gives the names in order
+    std::vector<uint32_t> stack(1, node);
+    while (!stack.empty()) {
+        const TrieNode& cur = index.nodes[stack.back()];
+        stack.pop_back();
+        if (cur.nameId != SEARCH_NONE && index.alive[cur.nameId]) {
+            if (ids.size() == static_cast<size_t>(query.limit)) {
+                truncated = true;
+                return;
+            }
+            ids.push_back(cur.nameId);
+        }
+        size_t first = stack.size();
+        for (uint32_t child = cur.firstChild; child != SEARCH_NONE; child = index.nodes[child].nextSibling) {
+            stack.push_back(child);
+        }
+        std::reverse(stack.begin() + first, stack.end());
+    }
+}
+
+static bool containsText(const SearchIndex& index, uint32_t id, const std::string& text) {
+    const unsigned char* entry = index.names[id];
+    return memmem(entry + 1, entry[0], text.data(), text.size()) != nullptr;
+}
+
+// Reads the ids of a posting list in increasing order
+struct PostingCursor {
+    const Posting* posting;
+    size_t pos;
+    uint32_t read;
+    uint32_t id;
+    size_t nextSkip;          // First skip entry ahead of the cursor
+
+    explicit PostingCursor(const Posting* list) : posting(list), pos(0), read(0), id(0), nextSkip(0) {}
+
+    // Moves to the first id not below target, false at the end of the list
+    bool seek(uint32_t target) {
+        if (read > 0 && id >= target) {
+            return true;
+        }
+        const std::vector<PostingSkip>& skips = posting->skips;
+        while (nextSkip < skips.size() && skips[nextSkip].read <= read) {
+            ++nextSkip;
+        }
+        if (nextSkip < skips.size() && skips[nextSkip].id < target) {
+            // The last skip entry before target
+            std::vector<PostingSkip>::const_iterator skip = std::lower_bound(skips.begin() + nextSkip, skips.end(), target,
+                [](const PostingSkip& entry, uint32_t value) { return entry.id < value; }) - 1;
+            id = skip->id;
+            pos = skip->pos;
+            read = skip->read;
+            nextSkip = skip - skips.begin() + 1;
+        }
+        while (read == 0 || id < target) {
+            if (read == posting->count) {
+                return false;
+            }
+            id += readVarint(posting->bytes.data(), pos);
+            ++read;
+        }
+        return true;
+    }
+};
+
+// Candidates from the shortest posting list of the trigrams of the query, kept when the next lists that are not
+// much longer have them too, then checked against the whole query. A query of one or two bytes has no trigram,
+// every name is checked.
+static void searchSubstring(const SearchIndex& index, const SearchQuery& query, std::vector<uint32_t>& ids, bool& truncated) {
+    const std::string& text = query.text;
+    if (text.size() < 3) {
+        for (uint32_t id = 0; id < index.names.size(); ++id) {
+            if (index.alive[id] && containsText(index, id, text)) {
+                if (ids.size() == static_cast<size_t>(query.limit)) {
+                    truncated = true;
+                    return;
+                }
+                ids.push_back(id);
+            }
+        }
+        return;
+    }
+
+    std::vector<uint32_t> keys;
+    for (size_t i = 0; i + 3 <= text.size(); ++i) {
+        keys.push_back(getTrigram(reinterpret_cast<const unsigned char*>(text.data()) + i));
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    std::vector<const Posting*> postings;
+    for (uint32_t key : keys) {
+        std::unordered_map<uint32_t, Posting>::const_iterator it = index.trigrams.find(key);
+        if (it == index.trigrams.end()) {
+            return;
+        }
+        postings.push_back(&it->second);
+    }
+    std::sort(postings.begin(), postings.end(), [](const Posting* a, const Posting* b) { return a->count < b->count; });
+    std::vector<PostingCursor> filters;
+    for (size_t i = 1; i < postings.size() && postings[i]->count / SEARCH_INTERSECT_RATIO <= postings[0]->count; ++i) {
+        filters.push_back(PostingCursor(postings[i]));
+    }
+
+    // An id missing from a filter moves the candidates to the next id of that filter
+    PostingCursor candidates(postings[0]);
+    uint32_t target = 0;
+    while (candidates.seek(target)) {
+        uint32_t id = candidates.id;
+        target = id + 1;
+        bool found = true;
+        for (size_t i = 0; found && i < filters.size(); ++i) {
+            if (!filters[i].seek(id)) {
+                return;
+            }
+            if (filters[i].id != id) {
+                target = filters[i].id;
+                found = false;
+            }
+        }
+        if (found && index.alive[id] && containsText(index, id, text)) {
+            if (ids.size() == static_cast<size_t>(query.limit)) {
+                truncated = true;
+                return;
+            }
+            ids.push_back(id);
+        }
+    }
+}
+
+void NameSearch::search(const SearchQuery& query, SearchResult& result) {
+    result.names.clear();
+    result.truncated = false;
+    std::vector<uint32_t> ids;
+    pthread_rwlock_rdlock(&searchLock);
+    result.indexed = current->aliveNum;
+    if (query.mode == SEARCH_PREFIX) {
+        searchPrefix(*current, query, ids, result.truncated);
+    } else {
+        searchSubstring(*current, query, ids, result.truncated);
+    }
+    result.names.reserve(ids.size());
+    for (uint32_t id : ids) {
+        result.names.push_back(std::string(reinterpret_cast<const char*>(current->names[id] + 1), current->names[id][0]));
+    }
+    pthread_rwlock_unlock(&searchLock);
+    // The ids of the names created since the build are not in name order
+    if (query.mode == SEARCH_SUBSTRING) {
+        std::sort(result.names.begin(), result.names.end());
+    }
+}
+
+void NameSearch::renderJson(const SearchQuery& query, const SearchResult& result, std::string& out) {
+    out += "{\"query\":";
+    appendJsonString(out, query.text);
+    out += query.mode == SEARCH_PREFIX ? ",\"mode\":\"prefix\"" : ",\"mode\":\"substring\"";
+    out += ",\"indexed\":" + std::to_string(result.indexed) + ",\"matches\":[";
+    for (size_t i = 0; i < result.names.size(); ++i) {
+        if (i > 0) {
+            out += ',';
+        }
+        appendJsonString(out, result.names[i]);
+    }
+    out += "],\"truncated\":";
+    out += result.truncated ? "true}\n" : "false}\n";
+}
+
+long long NameSearch::getNameNum() {
+    pthread_rwlock_rdlock(&searchLock);
+    long long nameNum = static_cast<long long>(current->aliveNum);
+    pthread_rwlock_unlock(&searchLock);
+    return nameNum;
+}
+
+long long NameSearch::getMemoryBytes() {
+    pthread_rwlock_rdlock(&searchLock);
+    const SearchIndex& index = *current;
+    size_t bytes = index.arena.getBytes() + index.names.capacity() * sizeof(index.names[0]) + index.alive.capacity() +
+                   index.slots.capacity() * sizeof(uint32_t) + index.nodes.capacity() * sizeof(TrieNode) +
+                   index.trigrams.bucket_count() * sizeof(void*);
+    for (const auto& entry : index.trigrams) {
+        // The node of the hash table holds the key, the posting and the link to the next node
+        bytes += sizeof(void*) + sizeof(entry) + entry.second.bytes.capacity() + entry.second.skips.capacity() * sizeof(PostingSkip);
+    }
+    pthread_rwlock_unlock(&searchLock);
+    return static_cast<long long>(bytes);
+}
+
+static bool isShardName(const char* name) {
+    return isxdigit(static_cast<unsigned char>(name[0])) && isxdigit(static_cast<unsigned char>(name[1])) && name[2] == '\0';
+}
+
+// Change of a relay record, or seen by the watcher
+enum SEARCHCHANGE {
+    CHANGE_ADD = '+',
+    CHANGE_REMOVE = '-',
+    CHANGE_REBUILD = '*',   // Changes were missed, the index is built again from the storage
+};
+
+// Applies a change to the index of this process
+static void applyChange(char change, const std::string& name) {
+    if (change == CHANGE_ADD) {
+        NameSearch::add(name);
+    } else if (change == CHANGE_REMOVE) {
+        // A file migrated from the root to its shard, or replaced by a rename, is still stored
+        struct stat fileStat;
+        if (Storage::statFile(name, fileStat) != 0) {
+            NameSearch::remove(name);
+        }
+    } else if (change == CHANGE_REBUILD) {
+        std::vector<std::string> names;
+        if (Storage::listFiles(names)) {
+            NameSearch::build(names, getAvailableCpuNum());
+        }
+    }
+}
+
+// Applies a change seen by the watcher, or passes it on to the followers. A record is one byte of change, one
+// byte of length and the name: a name has at most NAME_MAX bytes, so a record is written atomically.
+static void publishChange(char change, const std::string& name) {
+    if (relayFds.empty()) {
+        applyChange(change, name);
+        return;
+    }
+    std::string record;
+    record += change;
+    record += static_cast<char>(std::min<size_t>(name.size(), 255));
+    record.append(name, 0, 255);
+    for (size_t i = 0; i < relayFds.size(); ++i) {
+        if (relayLost[i]) {
+            const char rebuild[2] = {CHANGE_REBUILD, 0};
+            if (write(relayFds[i], rebuild, sizeof(rebuild)) != static_cast<ssize_t>(sizeof(rebuild))) {
+                continue;
+            }
+            relayLost[i] = false;
+        }
+        if (write(relayFds[i], record.data(), record.size()) != static_cast<ssize_t>(record.size())) {
+            relayLost[i] = true;
+        }
+    }
+}
+
+bool NameSearch::watch() {
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd == -1) {
+        std::cout << outHead("error") << "inotify is not available (errno = " << errno << "), the search index only sees the changes of this server" << std::endl;
+        return false;
+    }
+    // The watches are added before the thread starts: the supervisor of the prefork workers forks while it runs
+    watchDir(Storage::getRoot(), 0, false);
+    std::cout << outHead("info") << "Watching " << watchDirs.size() << " directories of " << Storage::getRoot() << " for the search index" << std::endl;
+    pthread_t thread;
+    int ret = pthread_create(&thread, nullptr, runWatcher, nullptr);
+    if (ret != 0) {
+        std::cout << outHead("error") << "Failed to start the search index watcher: " << strerror(ret) << std::endl;
+        close(inotifyFd);
+        inotifyFd = -1;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+bool NameSearch::relay(const std::vector<int>& fds) {
+    relayFds = fds;
+    relayLost.assign(fds.size(), false);
+    for (int fd : fds) {
+        fcntl(fd, F_SETPIPE_SZ, SEARCH_RELAY_PIPE);
+    }
+    return watch();
+}
+
+bool NameSearch::follow(int fd) {
+    // Forked from the supervisor, the worker leaves its watch and its pipes to it
+    for (int relayFd : relayFds) {
+        close(relayFd);
+    }
+    relayFds.clear();
+    if (inotifyFd != -1) {
+        close(inotifyFd);
+        inotifyFd = -1;
+        watchDirs.clear();
+    }
+    pthread_t thread;
+    int ret = pthread_create(&thread, nullptr, runFollower, reinterpret_cast<void*>(static_cast<intptr_t>(fd)));
+    if (ret != 0) {
+        std::cout << outHead("error") << "Failed to start the search index follower: " << strerror(ret) << std::endl;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void* NameSearch::runFollower(void* arg) {
+    int fd = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+    pthread_rwlock_rdlock(&searchLock);
+    long long builtNs = current->builtNs;
+    pthread_rwlock_unlock(&searchLock);
+    if (getMonotonicNs() - builtNs > SEARCH_RESCAN_AGE_SEC * 1000000000LL) {
+        // A prefork worker restarted long after the supervisor built the index. The records left in the pipe
+        // are applied again after the build, which is harmless.
+        applyChange(CHANGE_REBUILD, "");
+    }
+
+    std::vector<char> buffer(SEARCH_WATCH_BUFFER);
+    size_t bufferLen = 0;
+    while (true) {
+        ssize_t len = read(fd, buffer.data() + bufferLen, buffer.size() - bufferLen);
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            std::cout << outHead("error") << "Failed to read the changes of the storage (errno = " << errno << "), the search index stops following them" << std::endl;
+            return nullptr;
+        }
+        bufferLen += len;
+        size_t pos = 0;
+        while (bufferLen - pos >= 2) {
+            size_t nameLen = static_cast<unsigned char>(buffer[pos + 1]);
+            if (bufferLen - pos < 2 + nameLen) {
+                break;
+            }
+            applyChange(buffer[pos], std::string(buffer.data() + pos + 2, nameLen));
+            pos += 2 + nameLen;
+        }
+        // A record cut by the end of the buffer is completed by the next read
+        memmove(buffer.data(), buffer.data() + pos, bufferLen - pos);
+        bufferLen -= pos;
+    }
+    return nullptr;
+}
+
+void NameSearch::watchDir(const std::string& dir, int depth, bool scan) {
+    int wd = inotify_add_watch(inotifyFd, dir.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd != -1) {
+        watchDirs[wd] = WatchDir{dir, depth};
+    } else if (errno == ENOSPC && !watchLimitLogged) {
+        watchLimitLogged = true;
+        std::cout << outHead("error") << "Too many inotify watches (fs.inotify.max_user_watches), the search index misses the changes "
+                  << "other processes make from " << dir << std::endl;
+    }
+    // The directories of the last level are only read for their files
+    if (depth == STORAGE_SHARD_LEVELS && !scan) {
+        return;
+    }
+    DIR* dirp = opendir(dir.c_str());
+    if (dirp == nullptr) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != nullptr) {
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat entryStat;
+            if (fstatat(dirfd(dirp), entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISDIR(entryStat.st_mode) ? DT_DIR : S_ISREG(entryStat.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR && depth < STORAGE_SHARD_LEVELS && isShardName(entry->d_name)) {
+            watchDir(dir + "/" + entry->d_name, depth + 1, scan);
+        } else if (type == DT_REG && scan) {
+            publishChange(CHANGE_ADD, entry->d_name);
+        }
+    }
+    closedir(dirp);
+}
+
+void* NameSearch::runWatcher(void*) {
+    std::vector<char> buffer(SEARCH_WATCH_BUFFER);
+    while (true) {
+        ssize_t len = read(inotifyFd, buffer.data(), buffer.size());
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            std::cout << outHead("error") << "Failed to read the inotify events (errno = " << errno << "), the search index stops following the storage" << std::endl;
+            return nullptr;
+        }
+        for (char* pos = buffer.data(); pos < buffer.data() + len;) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(pos);
+            pos += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                std::cout << outHead("error") << "The inotify queue overflowed, the search index is built again" << std::endl;
+                publishChange(CHANGE_REBUILD, "");
+                continue;
+            }
+            std::unordered_map<int, WatchDir>::iterator it = watchDirs.find(event->wd);
+            if (it == watchDirs.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watchDirs.erase(it);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+            int depth = it->second.depth;
+            std::string name(event->name);
+            if (event->mask & IN_ISDIR) {
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && depth < STORAGE_SHARD_LEVELS && isShardName(event->name)) {
+                    watchDir(it->second.path + "/" + name, depth + 1, true);
+                }
+                continue;
+            }
+            // Files are in the last level, or in the root for the flat layout
+            if (depth != 0 && depth != STORAGE_SHARD_LEVELS) {
+                continue;
+            }
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                publishChange(CHANGE_ADD, name);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                publishChange(CHANGE_REMOVE, name);
+            }
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,151 @@
+#ifndef NAMESEARCH_H
+#define NAMESEARCH_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <stdint.h>
+
+#define SEARCH_RESULT_MAX 1000              // Largest limit of /api/search
+#define SEARCH_QUERY_MAX 255                // Longest query, a stored name has at most NAME_MAX bytes
+#define SEARCH_ARENA_BLOCK (1024 * 1024)    // Bytes of one block of the name arena
+#define SEARCH_INTERSECT_RATIO 32           // A posting list filters the candidates of the rarest one up to this many times longer
+#define SEARCH_SKIP_INTERVAL 128            // Ids of a posting list between two skip entries
+#define SEARCH_BUILD_CHUNK 16384            // Fewest names given to one thread of a build
+#define SEARCH_COMPACT_MIN 65536            // Deleted names kept before a compaction, which needs as many as the live ones
+#define SEARCH_BUILD_CACHE 4096             // Posting lists of recent trigrams found without the hash table during a build
+#define SEARCH_WATCH_BUFFER 65536           // Bytes of inotify events read at once
+#define SEARCH_RESCAN_AGE_SEC 5             // A process whose index is older when it starts following reads the storage again
+#define SEARCH_RELAY_PIPE (1024 * 1024)     // Bytes of changes a prefork worker can fall behind before it builds again
+#define SEARCH_NONE 0xffffffffu             // No id, or no trie node
+
+enum SEARCHMODE {
+    SEARCH_SUBSTRING,
+    SEARCH_PREFIX
+};
+
+// Parameters of GET /api/search?q=&mode=&limit=
+struct SearchQuery {
+    std::string text;
+    SEARCHMODE mode = SEARCH_SUBSTRING;
+    int limit = 100;
+};
+
+struct SearchResult {
+    std::vector<std::string> names;   // Sorted by name
+    bool truncated = false;           // More names match than the limit
+    uint64_t indexed = 0;             // Names in the search index, not the number of matches
+};
+
+// Storage of the indexed names: each name is copied once into large blocks, after a byte holding its length, and
+// is then referred to by its address. The blocks are only freed with the arena.
+class NameArena {
+public:
+    // Returns the address of the length byte, valid until the arena is destroyed
+    const unsigned char* add(const char* name, size_t len);
+
+    // Takes the blocks of other, whose names keep their address
+    void append(NameArena& other);
+
+    size_t getBytes() const { return m_blocks.size() * static_cast<size_t>(SEARCH_ARENA_BLOCK); }
+
+private:
+    std::vector<std::unique_ptr<unsigned char[]> > m_blocks;
+    size_t m_used = SEARCH_ARENA_BLOCK;   // Bytes used in the last block
+};
+
+// Position in a posting list, where a reader can start instead of decoding the list from its beginning
+struct PostingSkip {
+    uint32_t id;              // Last id read
+    uint32_t pos;             // Offset of the next varint
+    uint32_t read;            // Ids read
+};
+
+// Ids of the names containing one trigram, in increasing order, as varint deltas
+struct Posting {
+    std::vector<unsigned char> bytes;
+    std::vector<PostingSkip> skips;   // One every SEARCH_SKIP_INTERVAL ids, in increasing order
+    uint32_t last = 0;
+    uint32_t count = 0;
+
+    // id is larger than the ids already in the list, or equal to the last one and then ignored
+    void append(uint32_t id);
+
+    // Appends the ids of other, all larger than the ids of this list
+    void appendList(const Posting& other);
+};
+
+// Node of the prefix trie. The label is a range of the name of an id, so the trie holds no copy of the names.
+struct TrieNode {
+    uint32_t labelName;       // Id of the name holding the label
+    uint8_t labelStart;
+    uint8_t labelLen;
+    uint8_t firstByte;        // First byte of the label, the children are compared without reading the names
+    uint32_t firstChild;      // Children sorted by the first byte of their label
+    uint32_t nextSibling;
+    uint32_t nameId;          // Name ending at this node, SEARCH_NONE when none does
+};
+
+// Names and structures of the search index, replaced as a whole when the index is built
+struct SearchIndex {
+    NameArena arena;
+    std::vector<const unsigned char*> names;   // By id: the length byte, then the name
+    std::vector<uint8_t> alive;                // By id: 0 once the name is deleted
+    uint64_t aliveNum = 0;
+    std::vector<uint32_t> slots;               // Intern table of the names by open addressing: id + 1, 0 when empty
+    std::vector<TrieNode> nodes;               // Node 0 is the root, its label is empty
+    std::unordered_map<uint32_t, Posting> trigrams;
+    long long builtNs = 0;                     // Monotonic time of the build
+};
+
+// In-memory index of the names of the stored files, for GET /api/search. Each name has an id, given in name order
+// when the index is built and then in the order of creation. A substring query reads the ids of the rarest trigram
+// of the query from a posting list and checks the names they give, a prefix query walks a radix trie. A deleted name
+// only loses its id's flag, the index is built again once the deleted names outnumber the live ones.
+//
+// The index is built at startup from the file index, on several threads, then kept current by the uploads and
+// deletions of the server and by an inotify watch of the storage, which sees the files changed by other processes.
+// With prefork workers, the supervisor alone watches the storage and passes the changes on to the workers by pipes.
+class NameSearch {
+public:
+    // Builds the index from the sorted names, on up to threadNum threads
+    static void build(const std::vector<std::string>& names, int threadNum);
+
+    // Builds the index from the file index when it is loaded, from the storage otherwise
+    static void load(int threadNum);
+
+    // Starts a thread following the creations and deletions of files in the storage, returns false when inotify
+    // cannot be used, the index then only sees the changes made by this server
+    static bool watch();
+
+    // Starts the watch in the supervisor of the prefork workers: the changes are written to the pipes in fds, one
+    // per worker, instead of the index of this process. A worker whose pipe is full builds its index again.
+    static bool relay(const std::vector<int>& fds);
+
+    // Starts a thread applying the changes read from the pipe fd, written by the relay of the supervisor
+    static bool follow(int fd);
+
+    static void add(const std::string& name);
+    static void remove(const std::string& name);
+
+    // Fills query from the query string of the request, returns false with an error message on invalid parameters
+    static bool parseQuery(const std::string& queryString, SearchQuery& query, std::string& error);
+
+    static void search(const SearchQuery& query, SearchResult& result);
+
+    static void renderJson(const SearchQuery& query, const SearchResult& result, std::string& out);
+
+    // Gauges of /metrics
+    static long long getNameNum();
+    static long long getMemoryBytes();
+
+private:
+    static void* runWatcher(void* arg);
+    static void* runFollower(void* arg);
+    // Watches dir, at level depth of the storage, and the shard directories below it. With scan, the files found
+    // are added, they may have been created before the watch.
+    static void watchDir(const std::string& dir, int depth, bool scan);
+};
+
+#endif
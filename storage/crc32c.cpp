@@ -0,0 +1,67 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAS_SSE42 1
+#endif
+
+// Reflected polynomial of CRC32C
+static const uint32_t crcPolynomial = 0x82f63b78;
+
+struct CrcTable {
+    uint32_t entries[256];
+
+    CrcTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ ((crc & 1) ? crcPolynomial : 0);
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+static uint32_t updateTable(uint32_t crc, const unsigned char* bytes, size_t len) {
+    static const CrcTable table;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table.entries[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAS_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t updateSse42(uint32_t crc, const unsigned char* bytes, size_t len) {
+    for (; len > 0 && (reinterpret_cast<uintptr_t>(bytes) & 7) != 0; --len) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; len >= 8; len -= 8, bytes += 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    for (; len > 0; --len) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return crc;
+}
+#endif
+
+void Crc32c::update(const void* data, size_t len) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+#ifdef CRC32C_HAS_SSE42
+    static const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+    if (hasSse42) {
+        crc = updateSse42(crc, bytes, len);
+        return;
+    }
+#endif
+    crc = updateTable(crc, bytes, len);
+}
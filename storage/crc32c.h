@@ -0,0 +1,28 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental CRC32C (Castagnoli), fed with the data of a file as it is written. It uses the crc32 instruction
+// of SSE4.2 when the CPU has it, 8 bytes at a time, and a table otherwise.
+class Crc32c {
+public:
+    Crc32c() : crc(0xffffffff) {}
+
+    void update(const void* data, size_t len);
+
+    // CRC of all the data given to update, the object can still be updated afterwards
+    uint32_t value() const { return crc ^ 0xffffffff; }
+
+    static uint32_t compute(const void* data, size_t len) {
+        Crc32c crc32c;
+        crc32c.update(data, len);
+        return crc32c.value();
+    }
+
+private:
+    uint32_t crc;
+};
+
+#endif
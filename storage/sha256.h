@@ -0,0 +1,31 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+
+// Incremental SHA-256 (FIPS 180-4), fed with the data of an upload as it arrives
+class Sha256 {
+public:
+    Sha256();
+
+    void update(const void* data, size_t len);
+
+    // Digest of all the data given to update, the object must not be updated afterwards
+    void final(unsigned char digest[SHA256_DIGEST_LEN]);
+
+    // Digest as 64 lowercase hex digits
+    std::string finalHex();
+
+private:
+    void transform(const unsigned char block[64]);
+
+    uint32_t state[8];
+    uint64_t totalLen;           // Bytes given to update
+    unsigned char buffer[64];    // Start of the block not yet transformed
+};
+
+#endif
@@ -0,0 +1,819 @@
+#include "storage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+
+std::string Storage::root = "filedir";
+bool Storage::dedup = false;
+WritePolicy Storage::writePolicy;
+
+// Serializes the link counts of the objects: a name linked to an object and the release of its last name.
+// Processes sharing the root also take the flock of objectLockFd.
+static pthread_mutex_t objectLock = PTHREAD_MUTEX_INITIALIZER;
+static int objectLockFd = -1;
+static std::atomic<unsigned long long> stagingCounter(0);
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static void lockObjects() {
+    pthread_mutex_lock(&objectLock);
+    if (objectLockFd != -1) {
+        while (flock(objectLockFd, LOCK_EX) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+static void unlockObjects() {
+    if (objectLockFd != -1) {
+        flock(objectLockFd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&objectLock);
+}
+
+// A missing shard directory, or a flat file with the name of a shard directory, also means the file is not there
+static bool isMissing(int err) {
+    return err == ENOENT || err == ENOTDIR;
+}
+
+static bool isShardName(const char* name) {
+    return std::strchr(hexDigits, name[0]) != nullptr && name[0] != '\0' &&
+           std::strchr(hexDigits, name[1]) != nullptr && name[1] != '\0' && name[2] == '\0';
+}
+
+// Type of a directory entry, without a stat call when the filesystem fills d_type
+static unsigned char getEntryType(int dirFd, const struct dirent* entry) {
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type;
+    }
+    struct stat entryStat;
+    if (fstatat(dirFd, entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0) {
+        return DT_UNKNOWN;
+    }
+    return S_ISREG(entryStat.st_mode) ? DT_REG : (S_ISDIR(entryStat.st_mode) ? DT_DIR : DT_UNKNOWN);
+}
+
+// Visits the files of the shard directory name of parentFd, level is the depth of that directory
+static void walkShardDir(int parentFd, const char* name, int level, const std::function<void(int dirFd, const char* name)>& visit) {
+    int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return;
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == nullptr) {
+        close(fd);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        unsigned char type = getEntryType(dirfd(dir), entry);
+        if (level == STORAGE_SHARD_LEVELS && type == DT_REG) {
+            visit(dirfd(dir), entry->d_name);
+        } else if (level < STORAGE_SHARD_LEVELS && type == DT_DIR && isShardName(entry->d_name)) {
+            walkShardDir(dirfd(dir), entry->d_name, level + 1, visit);
+        }
+    }
+    closedir(dir);
+}
+
+static bool pwriteAll(int fd, const char* data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, data, len, offset);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        data += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+static long long getMonotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool syncDirectory(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool Storage::init(const std::string& dir, bool dedupEnabled) {
+    root = dir;
+    dedup = false;
+
+    // The staging directory also holds the files that replace a stored file, with or without deduplication
+    std::string objectDir = root + "/" + STORAGE_OBJECT_DIR;
+    std::string stagingDir = objectDir + "/tmp";
+    if ((mkdir(objectDir.c_str(), 0755) != 0 && errno != EEXIST) || (mkdir(stagingDir.c_str(), 0755) != 0 && errno != EEXIST)) {
+        return !dedupEnabled;
+    }
+    // Staging files left by a server that stopped during an upload. A file is named after the pid of its writer: the
+    // server replaced by an upgrade, or the other prefork workers, still write theirs.
+    DIR* staging = opendir(stagingDir.c_str());
+    if (staging != nullptr) {
+        struct dirent* entry;
+        while ((entry = readdir(staging)) != nullptr) {
+            pid_t writer = static_cast<pid_t>(atol(entry->d_name));
+            if (writer > 0 && (kill(writer, 0) == 0 || errno != ESRCH)) {
+                continue;
+            }
+            unlinkat(dirfd(staging), entry->d_name, 0);
+        }
+        closedir(staging);
+    }
+    if (!dedupEnabled) {
+        return true;
+    }
+
+    // The digest of an object is kept in an extended attribute, which the filesystem must support
+    std::string probePath = getStagingPath();
+    int fd = open(probePath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    bool supported = fsetxattr(fd, STORAGE_DIGEST_XATTR, "0", 1, 0) == 0;
+    close(fd);
+    unlink(probePath.c_str());
+    dedup = supported;
+    return supported;
+}
+
+bool Storage::setShared() {
+    if (!dedup) {
+        return true;
+    }
+    // Opened by each process, the flock of a descriptor inherited from the parent would be shared with it. An
+    // upgrade switches while the workers write, the descriptor is replaced under the lock of the objects.
+    std::string lockPath = root + "/" + STORAGE_OBJECT_DIR + "/" + STORAGE_OBJECT_LOCK;
+    int lockFd = open(lockPath.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    pthread_mutex_lock(&objectLock);
+    if (objectLockFd != -1) {
+        close(objectLockFd);
+    }
+    objectLockFd = lockFd;
+    pthread_mutex_unlock(&objectLock);
+    return lockFd != -1;
+}
+
+void Storage::setWritePolicy(const WritePolicy& policy) {
+    writePolicy = policy;
+    writePolicy.bufferLen = std::max<size_t>(policy.bufferLen / STORAGE_WRITE_ALIGN, 1) * STORAGE_WRITE_ALIGN;
+}
+
+void Storage::getShard(const std::string& name, unsigned int shard[STORAGE_SHARD_LEVELS]) {
+    // FNV-1a, each level takes the next 8 bits
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    for (int i = 0; i < STORAGE_SHARD_LEVELS; ++i) {
+        shard[i] = (hash >> (8 * i)) % STORAGE_SHARD_FANOUT;
+    }
+}
+
+std::string Storage::getShardPath(const std::string& name) {
+    unsigned int shard[STORAGE_SHARD_LEVELS];
+    getShard(name, shard);
+    std::string path = root;
+    for (int i = 0; i < STORAGE_SHARD_LEVELS; ++i) {
+        path += '/';
+        path += hexDigits[shard[i] >> 4];
+        path += hexDigits[shard[i] & 0xf];
+    }
+    return path + "/" + name;
+}
+
+bool Storage::isValidName(const std::string& name) {
+    return !name.empty() && name != "." && name != ".." && name.find('/') == std::string::npos;
+}
+
+int Storage::makeShardDirs(const std::string& name) {
+    std::string path = getShardPath(name);
+    for (std::string::size_type pos = root.size() + 1; (pos = path.find('/', pos)) != std::string::npos; ++pos) {
+        if (mkdir(path.substr(0, pos).c_str(), 0755) != 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool Storage::syncShardDirs(const std::string& name) {
+    // The shard directories may have been created for this name, their own entries are synced too
+    std::string path = getShardPath(name);
+    bool ok = true;
+    for (std::string::size_type pos = path.rfind('/'); pos != std::string::npos && pos >= root.size(); pos = path.rfind('/', pos - 1)) {
+        ok = syncDirectory(path.substr(0, pos)) && ok;
+        if (pos == root.size()) {
+            break;
+        }
+    }
+    return ok;
+}
+
+bool Storage::getFileCrc32c(int fd, uint32_t& crc) {
+    char crcHex[9] = {0};
+    if (fgetxattr(fd, STORAGE_CRC32C_XATTR, crcHex, 8) != 8) {
+        return false;
+    }
+    char* end = nullptr;
+    crc = static_cast<uint32_t>(strtoul(crcHex, &end, 16));
+    return end == crcHex + 8;
+}
+
+int Storage::openFile(const std::string& name, int flags, mode_t mode) {
+    if (!isValidName(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::string shardPath = getShardPath(name);
+    int lookupFlags = flags & ~(O_CREAT | O_EXCL);
+
+    int fd = open(shardPath.c_str(), lookupFlags);
+    if (fd == -1 && isMissing(errno)) {
+        fd = open(getFlatPath(name).c_str(), lookupFlags);
+    }
+    if (fd != -1) {
+        if (flags & O_EXCL) {
+            close(fd);
+            errno = EEXIST;
+            return -1;
+        }
+        return fd;
+    }
+    if (!isMissing(errno)) {
+        return -1;
+    }
+
+    // The file may have been moved into its shard between the two lookups, opening the shard path again finds it.
+    // A new file is created there, with its shard directories on the first file of the shard.
+    fd = open(shardPath.c_str(), flags, mode);
+    if (fd == -1 && errno == ENOENT && (flags & O_CREAT) && makeShardDirs(name) == 0) {
+        fd = open(shardPath.c_str(), flags, mode);
+    }
+    return fd;
+}
+
+int Storage::statFile(const std::string& name, struct stat& fileStat) {
+    if (!isValidName(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::string shardPath = getShardPath(name);
+    int ret = stat(shardPath.c_str(), &fileStat);
+    if (ret == -1 && isMissing(errno)) {
+        ret = stat(getFlatPath(name).c_str(), &fileStat);
+        if (ret == -1 && isMissing(errno)) {
+            ret = stat(shardPath.c_str(), &fileStat);
+        }
+    }
+    return ret;
+}
+
+int Storage::unlinkFile(const std::string& name) {
+    if (!isValidName(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    lockObjects();
+    std::string digest = getFileDigest(name);
+
+    // The flat path goes first: a migration that linked the file into its shard before this unlink
+    // is undone by the unlink of the shard path that follows
+    int flatRet = unlink(getFlatPath(name).c_str());
+    int flatErrno = errno;
+    int shardRet = unlink(getShardPath(name).c_str());
+    int shardErrno = errno;
+    if (!digest.empty()) {
+        releaseObject(digest);
+    }
+    unlockObjects();
+
+    errno = shardErrno;
+    if (flatRet == 0 || shardRet == 0) {
+        return 0;
+    }
+    if (isMissing(errno) && !isMissing(flatErrno)) {
+        errno = flatErrno;
+    }
+    return -1;
+}
+
+bool Storage::walk(const std::function<void(int dirFd, const char* name)>& visit) {
+    DIR* dir = opendir(root.c_str());
+    if (dir == nullptr) {
+        return false;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        unsigned char type = getEntryType(dirfd(dir), entry);
+        if (type == DT_REG) {
+            visit(dirfd(dir), entry->d_name);
+        } else if (type == DT_DIR && isShardName(entry->d_name)) {
+            walkShardDir(dirfd(dir), entry->d_name, 1, visit);
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+// Path of the leaf shard directory of index shard, whose digits at each level are its base-FANOUT digits
+static std::string getLeafDirPath(const std::string& root, int shard, int levels) {
+    std::string path = root;
+    for (int level = levels - 1; level >= 0; --level) {
+        int digit = shard;
+        for (int i = 0; i < level; ++i) {
+            digit /= STORAGE_SHARD_FANOUT;
+        }
+        digit %= STORAGE_SHARD_FANOUT;
+        path += '/';
+        path += hexDigits[digit >> 4];
+        path += hexDigits[digit & 15];
+    }
+    return path;
+}
+
+bool Storage::walkNext(StorageCursor& cursor, size_t maxNames, std::vector<std::string>& names) {
+    int shardNum = 1;
+    for (int level = 0; level < STORAGE_SHARD_LEVELS; ++level) {
+        shardNum *= STORAGE_SHARD_FANOUT;
+    }
+    size_t found = 0;
+    while (!cursor.done && found < maxNames) {
+        if (cursor.dir == nullptr) {
+            if (cursor.shard >= shardNum) {
+                cursor.done = true;
+                break;
+            }
+            cursor.dir = opendir(cursor.shard == -1 ? root.c_str() : getLeafDirPath(root, cursor.shard, STORAGE_SHARD_LEVELS).c_str());
+            if (cursor.dir == nullptr) {
+                // The shards under a missing first-level directory are skipped together
+                int span = shardNum / STORAGE_SHARD_FANOUT;
+                if (cursor.shard >= 0 && cursor.shard % span == 0 &&
+                    access(getLeafDirPath(root, cursor.shard / span, 1).c_str(), F_OK) != 0) {
+                    cursor.shard += span;
+                } else {
+                    ++cursor.shard;
+                }
+                continue;
+            }
+        }
+        struct dirent* entry = readdir(cursor.dir);
+        if (entry == nullptr) {
+            closedir(cursor.dir);
+            cursor.dir = nullptr;
+            ++cursor.shard;
+            continue;
+        }
+        // The root also holds the shard directories and the object store, only its files are listed
+        if (getEntryType(dirfd(cursor.dir), entry) == DT_REG) {
+            names.push_back(entry->d_name);
+            ++found;
+        }
+    }
+    return !cursor.done;
+}
+
+void Storage::closeCursor(StorageCursor& cursor) {
+    if (cursor.dir != nullptr) {
+        closedir(cursor.dir);
+        cursor.dir = nullptr;
+    }
+    cursor.done = true;
+}
+
+bool Storage::listFiles(std::vector<std::string>& names) {
+    if (!walk([&names](int, const char* name) { names.push_back(name); })) {
+        return false;
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return true;
+}
+
+MIGRATERESULT Storage::migrateFile(const std::string& name) {
+    if (!isValidName(name)) {
+        errno = EINVAL;
+        return MIGRATE_ERROR;
+    }
+    std::string flatPath = getFlatPath(name);
+    std::string shardPath = getShardPath(name);
+
+    // link fails instead of replacing a file the server created in the shard
+    int ret = link(flatPath.c_str(), shardPath.c_str());
+    if (ret == -1 && errno == ENOENT && access(flatPath.c_str(), F_OK) == 0) {
+        if (makeShardDirs(name) != 0) {
+            return MIGRATE_ERROR;
+        }
+        ret = link(flatPath.c_str(), shardPath.c_str());
+    }
+    if (ret == -1) {
+        if (errno == ENOENT) {
+            return MIGRATE_MISSING;
+        }
+        if (errno != EEXIST) {
+            return MIGRATE_ERROR;
+        }
+        // Already linked by a migration that stopped before its unlink
+        struct stat flatStat, shardStat;
+        if (stat(flatPath.c_str(), &flatStat) != 0 || stat(shardPath.c_str(), &shardStat) != 0) {
+            return isMissing(errno) ? MIGRATE_MISSING : MIGRATE_ERROR;
+        }
+        if (flatStat.st_dev != shardStat.st_dev || flatStat.st_ino != shardStat.st_ino) {
+            return MIGRATE_CONFLICT;
+        }
+    }
+
+    if (unlink(flatPath.c_str()) != 0) {
+        // Deleted by the server between the link and the unlink, which also removes the shard path
+        return isMissing(errno) ? MIGRATE_MISSING : MIGRATE_ERROR;
+    }
+    return MIGRATE_MOVED;
+}
+
+std::string Storage::getObjectPath(const std::string& digest) {
+    return root + "/" + STORAGE_OBJECT_DIR + "/" + digest.substr(0, 2) + "/" + digest;
+}
+
+std::string Storage::getStagingPath() {
+    return root + "/" + STORAGE_OBJECT_DIR + "/tmp/" + std::to_string(getpid()) + "-" +
+           std::to_string(stagingCounter.fetch_add(1, std::memory_order_relaxed));
+}
+
+std::string Storage::getFileDigest(const std::string& name) {
+    char digest[2 * SHA256_DIGEST_LEN];
+    ssize_t len = getxattr(getShardPath(name).c_str(), STORAGE_DIGEST_XATTR, digest, sizeof(digest));
+    if (len == -1 && isMissing(errno)) {
+        len = getxattr(getFlatPath(name).c_str(), STORAGE_DIGEST_XATTR, digest, sizeof(digest));
+    }
+    return len == static_cast<ssize_t>(sizeof(digest)) ? std::string(digest, len) : std::string();
+}
+
+void Storage::releaseObject(const std::string& digest) {
+    std::string objectPath = getObjectPath(digest);
+    struct stat objectStat;
+    if (stat(objectPath.c_str(), &objectStat) == 0 && objectStat.st_nlink <= 1) {
+        unlink(objectPath.c_str());
+    }
+}
+
+int Storage::linkObject(const std::string& objectPath, const std::string& digest, const std::string& name) {
+    // The link is made in the staging directory then renamed over the name
+    std::string linkPath = getStagingPath();
+    if (link(objectPath.c_str(), linkPath.c_str()) != 0) {
+        return -1;
+    }
+    int ret = replaceFile(linkPath, digest, name);
+    // rename does nothing when the name already links to the object, the staging link is left behind
+    unlink(linkPath.c_str());
+    return ret;
+}
+
+int Storage::replaceFile(const std::string& path, const std::string& digest, const std::string& name) {
+    std::string previousDigest = getFileDigest(name);
+
+    std::string shardPath = getShardPath(name);
+    int ret = rename(path.c_str(), shardPath.c_str());
+    if (ret != 0 && errno == ENOENT && makeShardDirs(name) == 0) {
+        ret = rename(path.c_str(), shardPath.c_str());
+    }
+    if (ret != 0) {
+        return -1;
+    }
+
+    // A previous file of the flat layout would come back once this one is deleted
+    unlink(getFlatPath(name).c_str());
+    if (!previousDigest.empty() && previousDigest != digest) {
+        releaseObject(previousDigest);
+    }
+    return 0;
+}
+
+StorageWriter::StorageWriter(const std::string& fileName, bool appendData, long long expectedLen)
+    : name(fileName), append(appendData), sizeHint(expectedLen), fd(-1), hasExpectedCrc(false), expectedCrc(0),
+      failed(false), committed(false), created(false), startOffset(0), buf(nullptr), bufLen(0), bufCap(0), offset(0), direct(false), lastSyncNs(0) {}
+
+StorageWriter::~StorageWriter() {
+    if (fd != -1) {
+        close(fd);
+    }
+    if (!committed && !stagingPath.empty()) {
+        unlink(stagingPath.c_str());
+    }
+    free(buf);
+}
+
+bool StorageWriter::openFile() {
+    // O_DIRECT is refused with EINVAL by the filesystems that do not support it, the file is then written through the cache
+    direct = Storage::getWritePolicy().direct;
+    int flags = O_WRONLY | O_CREAT | (direct ? O_DIRECT : 0);
+    if (Storage::isDedup() || !append) {
+        stagingPath = Storage::getStagingPath();
+        fd = open(stagingPath.c_str(), flags | O_EXCL, 0644);
+        if (fd == -1 && direct && errno == EINVAL) {
+            direct = false;
+            fd = open(stagingPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        return fd != -1;
+    }
+
+    fd = openName(flags);
+    if (fd == -1 && direct && errno == EINVAL) {
+        direct = false;
+        flags &= ~O_DIRECT;
+        fd = openName(flags);
+    }
+    if (fd == -1) {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        return false;
+    }
+    if (fileStat.st_nlink > 1) {
+        // Shared with other names by a deduplicated object, which must not change: the file is replaced
+        close(fd);
+        Storage::unlinkFile(name);
+        fd = Storage::openFile(name, flags | O_TRUNC);
+        created = true;
+        return fd != -1;
+    }
+    // The CRC of the previous content no longer holds while the file is written
+    fremovexattr(fd, STORAGE_CRC32C_XATTR);
+    startOffset = offset = fileStat.st_size;
+    return true;
+}
+
+int StorageWriter::openName(int flags) {
+    int nameFd = Storage::openFile(name, flags & ~O_CREAT);
+    if (nameFd == -1 && errno == ENOENT) {
+        nameFd = Storage::openFile(name, flags);
+        created = nameFd != -1;
+    }
+    return nameFd;
+}
+
+bool StorageWriter::rollback() {
+    // A staging file is removed with the writer
+    if (Storage::isDedup() || !append) {
+        return true;
+    }
+    if (created) {
+        return Storage::unlinkFile(name) == 0;
+    }
+    return ftruncate(fd, startOffset) == 0;
+}
+
+bool StorageWriter::allocBuffer() {
+    if (buf != nullptr) {
+        return true;
+    }
+    bufCap = Storage::getWritePolicy().bufferLen;
+    if (sizeHint >= 0 && static_cast<unsigned long long>(sizeHint) < bufCap) {
+        bufCap = std::max<size_t>((sizeHint + STORAGE_WRITE_ALIGN - 1) / STORAGE_WRITE_ALIGN, 1) * STORAGE_WRITE_ALIGN;
+    }
+    void* mem = nullptr;
+    if (posix_memalign(&mem, STORAGE_WRITE_ALIGN, bufCap) != 0) {
+        errno = ENOMEM;
+        return false;
+    }
+    buf = static_cast<char*>(mem);
+    return true;
+}
+
+size_t StorageWriter::buffer(const char* data, size_t len) {
+    if (failed || committed || !allocBuffer()) {
+        failed = true;
+        return 0;
+    }
+    size_t copyLen = std::min(len, bufCap - bufLen);
+    memcpy(buf + bufLen, data, copyLen);
+    bufLen += copyLen;
+    return copyLen;
+}
+
+bool StorageWriter::writeData(const char* data, size_t len, bool digest) {
+    // The staging file of the deduplicating store is only created once data must be written
+    if (fd == -1 && !openFile()) {
+        failed = true;
+        return false;
+    }
+    if (direct && (len % STORAGE_WRITE_ALIGN != 0 || offset % STORAGE_WRITE_ALIGN != 0)) {
+        // The end of the file, or a file appended at an unaligned size, goes through the page cache
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+            failed = true;
+            return false;
+        }
+        direct = false;
+    }
+    if (!pwriteAll(fd, data, len, offset)) {
+        failed = true;
+        return false;
+    }
+    offset += len;
+    if (digest) {
+        digestData(data, len);
+    }
+
+    const WritePolicy& policy = Storage::getWritePolicy();
+    if (policy.sync == SYNC_PERIODIC) {
+        long long now = getMonotonicNs();
+        if (now - lastSyncNs >= policy.syncIntervalMs * 1000000LL) {
+            fdatasync(fd);
+            lastSyncNs = now;
+        }
+    }
+    return true;
+}
+
+void StorageWriter::digestData(const char* data, size_t len) {
+    crc.update(data, len);
+    if (Storage::isDedup()) {
+        sha.update(data, len);
+    }
+}
+
+bool StorageWriter::flushBuffer() {
+    bool ok = writeData(buf, bufLen);
+    bufLen = 0;
+    return ok;
+}
+
+bool StorageWriter::write(const char* data, size_t len) {
+    if (failed || committed) {
+        return false;
+    }
+    if ((fd == -1 && !Storage::isDedup() && !openFile()) || !allocBuffer()) {
+        failed = true;
+        return false;
+    }
+    while (true) {
+        if (isBufferFull() && !flushBuffer()) {
+            return false;
+        }
+        if (len == 0) {
+            return true;
+        }
+        if (bufLen == 0 && len >= bufCap && !direct) {
+            // Whole buffers of data are written from it without a copy, O_DIRECT needs the aligned buffer
+            size_t writeLen = len - len % bufCap;
+            if (!writeData(data, writeLen)) {
+                return false;
+            }
+            data += writeLen;
+            len -= writeLen;
+            continue;
+        }
+        size_t copyLen = buffer(data, len);
+        data += copyLen;
+        len -= copyLen;
+    }
+}
+
+bool StorageWriter::commit() {
+    // An empty file is created by its commit
+    if (failed || committed || (fd == -1 && !write("", 0))) {
+        return false;
+    }
+    if (Storage::isDedup()) {
+        return commitObject();
+    }
+    if (bufLen > 0 && !flushBuffer()) {
+        return false;
+    }
+    if (hasExpectedCrc && Storage::getWritePolicy().verifyDigest && crc.value() != expectedCrc) {
+        rollback();
+        failed = true;
+        errno = EBADMSG;
+        return false;
+    }
+    bool durable = Storage::getWritePolicy().sync == SYNC_COMMIT;
+    if (durable && fdatasync(fd) != 0) {
+        failed = true;
+        return false;
+    }
+
+    // Kept on the inode, so that all the names of a deduplicated object share it. A filesystem without
+    // extended attributes leaves the CRC unknown.
+    char crcHex[9];
+    snprintf(crcHex, sizeof(crcHex), "%08x", crc.value());
+    if (startOffset == 0) {
+        fsetxattr(fd, STORAGE_CRC32C_XATTR, crcHex, 8, 0);
+    }
+
+    committed = true;
+    int ret = close(fd);
+    fd = -1;
+    if (ret == 0 && !append) {
+        // A deduplicated object the name linked to is released
+        lockObjects();
+        ret = Storage::replaceFile(stagingPath, "", name);
+        unlockObjects();
+        if (ret != 0) {
+            unlink(stagingPath.c_str());
+        }
+    }
+    return ret == 0 && (!durable || Storage::syncShardDirs(name));
+}
+
+bool StorageWriter::completeStaging(const std::string& digest, const char* crcHex) {
+    if ((bufLen > 0 || fd == -1) && !writeData(buf, bufLen, false)) {
+        return false;
+    }
+    bufLen = 0;
+    if (Storage::getWritePolicy().sync == SYNC_COMMIT && fdatasync(fd) != 0) {
+        failed = true;
+        return false;
+    }
+    fsetxattr(fd, STORAGE_CRC32C_XATTR, crcHex, 8, 0);
+    bool ok = fsetxattr(fd, STORAGE_DIGEST_XATTR, digest.c_str(), digest.size(), 0) == 0;
+    ok = close(fd) == 0 && ok;
+    fd = -1;
+    failed = !ok;
+    return ok;
+}
+
+bool StorageWriter::commitObject() {
+    // The end of the data is hashed before it is written, so that the object of the content is known first
+    digestData(buf, bufLen);
+    if (hasExpectedCrc && Storage::getWritePolicy().verifyDigest && crc.value() != expectedCrc) {
+        failed = true;
+        errno = EBADMSG;
+        return false;
+    }
+    char crcHex[9];
+    snprintf(crcHex, sizeof(crcHex), "%08x", crc.value());
+    std::string digest = sha.finalHex();
+    std::string objectPath = Storage::getObjectPath(digest);
+
+    lockObjects();
+    struct stat objectStat;
+    bool stored = stat(objectPath.c_str(), &objectStat) == 0;
+    if (!stored) {
+        // New content: the staging file is completed and made durable without holding the lock, then becomes the
+        // object unless another upload stored the same content in the meantime
+        unlockObjects();
+        if (!completeStaging(digest, crcHex)) {
+            return false;
+        }
+        lockObjects();
+        stored = stat(objectPath.c_str(), &objectStat) == 0;
+    }
+    bool ok = true;
+    if (stored) {
+        // Same content as an object already stored: the staging file is dropped as it is, a duplicate that fit
+        // in the buffer was never written and none is synced. An object stored before the CRC was kept gets it now.
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+        if (!stagingPath.empty()) {
+            unlink(stagingPath.c_str());
+        }
+        setxattr(objectPath.c_str(), STORAGE_CRC32C_XATTR, crcHex, 8, XATTR_CREATE);
+    } else {
+        std::string objectDir = objectPath.substr(0, objectPath.rfind('/'));
+        if ((mkdir(objectDir.c_str(), 0755) != 0 && errno != EEXIST) || rename(stagingPath.c_str(), objectPath.c_str()) != 0) {
+            ok = false;
+        }
+    }
+    committed = true;
+    ok = ok && Storage::linkObject(objectPath, digest, name) == 0;
+    if (!ok) {
+        // An object created for this upload and linked by no name
+        Storage::releaseObject(digest);
+    }
+    unlockObjects();
+    if (!ok) {
+        if (!stagingPath.empty()) {
+            unlink(stagingPath.c_str());
+        }
+        return false;
+    }
+    if (Storage::getWritePolicy().sync == SYNC_COMMIT) {
+        ok = (stored || syncDirectory(objectPath.substr(0, objectPath.rfind('/')))) && Storage::syncShardDirs(name);
+    }
+    return ok;
+}
@@ -0,0 +1,232 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "sha256.h"
+#include "crc32c.h"
+
+#define STORAGE_SHARD_LEVELS 2        // Subdirectories between the root and a file
+#define STORAGE_SHARD_FANOUT 256      // Subdirectories per level, named 00 to ff
+#define STORAGE_OBJECT_DIR ".objects" // Content-addressed files of the deduplicating store, under the root
+#define STORAGE_OBJECT_LOCK "lock"    // File of the object store locked by the processes sharing the root
+#define STORAGE_DIGEST_XATTR "user.cherokee.sha256"   // Digest of a stored object, shared by all its names
+#define STORAGE_CRC32C_XATTR "user.cherokee.crc32c"   // CRC32C of a stored file, in hex, computed while it was written
+#define STORAGE_WRITE_ALIGN 4096      // Alignment of the write buffers, of their length and of the O_DIRECT writes
+
+// Result of the migration of one file of the flat layout
+enum MIGRATERESULT {
+    MIGRATE_MOVED,       // The file is now in its shard
+    MIGRATE_MISSING,     // The file is gone, deleted or moved by the server in the meantime
+    MIGRATE_CONFLICT,    // Another file of the same name is already in the shard, both are kept
+    MIGRATE_ERROR        // errno is set
+};
+
+// When the data of a written file is made durable
+enum SYNCPOLICY {
+    SYNC_NONE,        // When the kernel writes it back
+    SYNC_COMMIT,      // commit returns once the data and the name are on disk (fdatasync, then fsync of the directories)
+    SYNC_PERIODIC,    // At most syncIntervalMs after it is written, commit does not wait
+};
+
+// How StorageWriter writes: the data is gathered in an aligned buffer and written in large pwrite calls
+struct WritePolicy {
+    size_t bufferLen = 1024 * 1024;     // Data gathered before a write, a multiple of STORAGE_WRITE_ALIGN
+    bool direct = false;                // Write with O_DIRECT, bypassing the page cache, where the filesystem allows it
+    SYNCPOLICY sync = SYNC_NONE;
+    int syncIntervalMs = 1000;          // Period of SYNC_PERIODIC
+    bool verifyDigest = false;          // Refuse the commit of a file whose CRC32C differs from the one given by the client
+};
+
+// Position of a walk of the storage read a batch at a time: the files of the root, then the leaf shard directories
+// in order. The directory being read stays open between two batches.
+struct StorageCursor {
+    DIR* dir = nullptr;
+    int shard = -1;           // Leaf shard directory read, -1 for the root
+    bool done = false;
+};
+
+// Storage of the served files. A name is stored at root/ab/cd/name, where ab and cd come from a hash of the name,
+// so that no directory holds more than a few files per 65536 and a lookup, a create or an unlink costs the same
+// with thousands or millions of files. Files of the old flat layout (root/name) are still found, tools/migrate moves
+// them into their shard while the server runs. A file moves with link and unlink, so it is always at one of the two
+// paths and a descriptor opened on either one stays valid.
+//
+// With deduplication, written files are stored once per content in root/.objects/ab/<sha256>, and each name is a
+// hard link to its object. The object keeps its digest in an extended attribute, so that deleting the last name
+// of an object also deletes the object.
+class Storage {
+public:
+    // Directory holding the files, "filedir" until it is set. Returns false when deduplication is asked but the
+    // filesystem cannot store it (no extended attributes), the storage then runs without it.
+    static bool init(const std::string& root, bool dedup = false);
+    static const std::string& getRoot() { return root; }
+    static bool isDedup() { return dedup; }
+
+    // The root is served by several processes, such as the prefork workers: the link counts of the objects are
+    // also locked between them. Called in each process once it is forked, returns false with errno set.
+    static bool setShared();
+
+    static void setWritePolicy(const WritePolicy& policy);
+    static const WritePolicy& getWritePolicy() { return writePolicy; }
+
+    // Path of a name in the sharded layout and in the flat layout
+    static std::string getShardPath(const std::string& name);
+    static std::string getFlatPath(const std::string& name) { return root + "/" + name; }
+
+    // Names containing a slash, ".", ".." and the empty name are refused with EINVAL
+    static bool isValidName(const std::string& name);
+
+    // open(2) of a stored file. With O_CREAT a missing file is created in its shard, creating the shard directories.
+    // Returns the descriptor, or -1 with errno set.
+    static int openFile(const std::string& name, int flags, mode_t mode = 0644);
+
+    // stat(2) of a stored file, returns 0 or -1 with errno set
+    static int statFile(const std::string& name, struct stat& fileStat);
+
+    // CRC32C of the file of an open descriptor, false when it is not known (not written by a StorageWriter, or appended to)
+    static bool getFileCrc32c(int fd, uint32_t& crc);
+
+    // Removes the file from both layouts and releases its object, returns 0 when a file was removed or -1 with errno set
+    static int unlinkFile(const std::string& name);
+
+    // Calls visit for every stored file with a descriptor of its directory, so that the caller can fstatat it.
+    // A file being migrated may be seen twice. Returns false if the root cannot be read.
+    static bool walk(const std::function<void(int dirFd, const char* name)>& visit);
+
+    // Sorted names of all stored files
+    static bool listFiles(std::vector<std::string>& names);
+
+    // Appends the names of up to maxNames more stored files to names, in the order of the walk, and returns false
+    // once the walk is over. The cursor keeps a directory open until then or until closeCursor.
+    static bool walkNext(StorageCursor& cursor, size_t maxNames, std::vector<std::string>& names);
+    static void closeCursor(StorageCursor& cursor);
+
+    // Moves a file of the flat layout into its shard
+    static MIGRATERESULT migrateFile(const std::string& name);
+
+private:
+    friend class StorageWriter;
+
+    // Makes name a link to the object of digest, replacing the previous file of that name
+    static int linkObject(const std::string& objectPath, const std::string& digest, const std::string& name);
+
+    // Renames path over the name, so that a reader of the name sees either the previous file or the new one,
+    // and releases the object the previous file linked to unless it is digest. Called with the objects locked.
+    static int replaceFile(const std::string& path, const std::string& digest, const std::string& name);
+
+    // Deletes the object once no name links to it
+    static void releaseObject(const std::string& digest);
+
+    // Digest of the object a stored file links to, empty when it is not deduplicated
+    static std::string getFileDigest(const std::string& name);
+
+    static std::string getObjectPath(const std::string& digest);
+
+    // New path in the staging directory of the object store
+    static std::string getStagingPath();
+
+    // Index of the shard directory at each level
+    static void getShard(const std::string& name, unsigned int shard[STORAGE_SHARD_LEVELS]);
+
+    // Creates the shard directories of a name
+    static int makeShardDirs(const std::string& name);
+
+    // fsync of the directories from the shard of a name up to the root, so that a new name survives a crash
+    static bool syncShardDirs(const std::string& name);
+
+    static std::string root;
+    static bool dedup;
+    static WritePolicy writePolicy;
+};
+
+// Writes a stored file. Without deduplication, appended data goes to the file itself and a new content to a staging
+// file that commit renames over the name. With it, the data goes to a staging file and is hashed as it arrives, commit then links the name to the object of that content, created
+// from the staging file only when no upload stored it before: a duplicate costs no second copy on disk, and one
+// that fits in the buffer is not written at all.
+//
+// The data is gathered in a buffer of WritePolicy::bufferLen bytes and written with one pwrite per full buffer,
+// at offsets that are multiples of the buffer length. buffer() only copies, so that a thread serving sockets can
+// gather an upload and leave the writes to the filesystem executor. The CRC32C of the data is computed as it is
+// written and kept with the file, so that a download can give it without reading the file again.
+// Not thread-safe, the chunks of an upload are written one after the other.
+class StorageWriter {
+public:
+    // append   : without deduplication, add to the content of an existing file instead of replacing it. A replaced
+    //            file keeps its previous content until the commit.
+    // sizeHint : expected length of the data, -1 when unknown, so that a small file gets a small buffer
+    StorageWriter(const std::string& name, bool append, long long sizeHint = -1);
+    ~StorageWriter();
+
+    StorageWriter(const StorageWriter&) = delete;
+    StorageWriter& operator=(const StorageWriter&) = delete;
+
+    const std::string& getName() const { return name; }
+
+    // Copies data into the buffer without any system call, returns the bytes taken, fewer than len once it is full
+    size_t buffer(const char* data, size_t len);
+    bool isBufferFull() const { return buf != nullptr && bufLen == bufCap; }
+    size_t getBufferCapacity() const { return buf != nullptr ? bufCap : 0; }
+
+    // Writes out a full buffer, then buffers data and writes every buffer it fills.
+    // Returns false with errno set on a write error, the writer then fails its commit.
+    bool write(const char* data, size_t len);
+
+    // CRC32C announced by the client. With WritePolicy::verifyDigest, commit fails with EBADMSG when the data
+    // differs and leaves the name as it was: the staging file is dropped, or the appended data is truncated
+    // and a file created by the writer removed.
+    void setExpectedCrc32c(uint32_t crc) { hasExpectedCrc = true; expectedCrc = crc; }
+
+    // CRC32C of the written data, once committed. Without deduplication, data appended to an existing file
+    // has no CRC of the whole file: hasCrc32c is then false.
+    bool hasCrc32c() const { return committed && startOffset == 0; }
+    uint32_t getCrc32c() const { return crc.value(); }
+
+    // Writes the rest of the buffer and makes the file visible under its name, durable with SYNC_COMMIT.
+    // A writer that is destroyed before its commit removes its staging file.
+    bool commit();
+
+private:
+    bool openFile();
+    int openName(int flags);
+    bool rollback();
+    bool allocBuffer();
+    bool flushBuffer();
+    // digest : add the data to the CRC32C, and to the SHA-256 with deduplication
+    bool writeData(const char* data, size_t len, bool digest = true);
+    void digestData(const char* data, size_t len);
+
+    // Commit with deduplication. The rest of the buffer is hashed first: a duplicate is linked to its object
+    // without writing or syncing that rest, the staging file of new content is completed by completeStaging.
+    bool commitObject();
+    bool completeStaging(const std::string& digest, const char* crcHex);
+
+    std::string name;
+    bool append;
+    long long sizeHint;
+    int fd;                    // File or staging file being written, -1 until the first write, with deduplication until a buffer is written
+    std::string stagingPath;   // Staging file of the deduplicating store, or of a replaced file
+    Sha256 sha;
+    Crc32c crc;
+    bool hasExpectedCrc;
+    uint32_t expectedCrc;
+    bool failed;
+    bool committed;
+    bool created;              // The file did not exist before the writer, without deduplication
+    off_t startOffset;         // Size of the file the data is appended to
+
+    char* buf;                 // Aligned on STORAGE_WRITE_ALIGN, allocated by the first buffer or write
+    size_t bufLen;
+    size_t bufCap;
+    off_t offset;              // Where the next write goes in the file
+    bool direct;               // fd is open with O_DIRECT
+    long long lastSyncNs;      // Last fdatasync of SYNC_PERIODIC
+};
+
+#endif
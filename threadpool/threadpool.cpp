@@ -1,47 +1,132 @@
 #include "threadpool.h"
 
-ThreadPool::ThreadPool(int threadNum) : m_threadNum(threadNum), m_threads(threadNum) {
+// A fixed size pool never grows nor shrinks
+static PoolConfig getFixedConfig(int threadNum) {
+    PoolConfig config;
+    config.initThreads = threadNum;
+    config.minThreads = threadNum;
+    config.maxThreads = threadNum;
+    return config;
+}
+
+ThreadPool::ThreadPool(int threadNum, SCHEDPOLICY policy) : ThreadPool(getFixedConfig(threadNum), policy) {}
+
+ThreadPool::ThreadPool(const PoolConfig& config, SCHEDPOLICY policy)
+    : m_threadNum(0), m_queuedNum(0), m_idleNum(0),
+      m_policy(policy), m_starvationLimit(64), m_batchNum(0), m_batchEventNum(0),
+      m_delayTarget(0), m_delayInterval(0), m_intervalEnd(0), m_minDelay(0), m_overloaded(false), m_dropNum(0),
+      m_growWait(config.growWaitUs * 1000LL), m_idleShrink(config.idleShrinkMs * 1000000LL), m_affinity(config.affinity),
+      m_firstSlot(config.firstSlot), m_nextWorkerId(0), m_lastResize(0), m_avgWait(0), m_resizeNum(0),
+      m_lockNum(0), m_lockContendedNum(0), m_lockWait(0), m_idleTime(0), m_busyTime(0), m_dumpInterval(0), m_nextDump(0) {
+    // The histograms live in a heap object, their atomics start uninitialized
+    for (int t = 0; t < EVENT_TYPE_NUM; ++t) {
+        LatencyHistogram* hists[2] = {&m_waitHist[t], &m_serviceHist[t]};
+        for (LatencyHistogram* hist : hists) {
+            for (int b = 0; b < HIST_BUCKET_NUM; ++b) {
+                hist->buckets[b].store(0, std::memory_order_relaxed);
+            }
+            hist->count.store(0, std::memory_order_relaxed);
+            hist->sumUs.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Connection setup and small requests are favoured over bulk transfers and disk work
+    const int defaultWeight[EVENT_CLASS_NUM] = {8, 8, 2, 1};
+    for (int i = 0; i < EVENT_CLASS_NUM; ++i) {
+        m_classWeight[i] = defaultWeight[i];
+        m_classCredit[i] = defaultWeight[i];
+        m_classSkipped[i] = 0;
+    }
+
+    int cpuNum = getAvailableCpuNum();
+    m_maxThreads = config.maxThreads > 0 ? config.maxThreads : 2 * cpuNum;
+    m_minThreads = std::min(config.minThreads > 0 ? config.minThreads : std::max(1, cpuNum / 2), m_maxThreads);
+    int initThreads = config.initThreads > 0 ? config.initThreads : cpuNum;
+    initThreads = std::max(m_minThreads, std::min(initThreads, m_maxThreads));
+
     int ret = pthread_mutex_init(&queueLocker, nullptr);
     if (ret != 0) {
         throw std::runtime_error("Failed to initialize mutex: " + std::string(strerror(errno)));
     }
 
-    ret = sem_init(&queueEventNum, 0, 0);
+    // Idle workers wait with a monotonic deadline before exiting
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    ret = pthread_cond_init(&queueNotEmpty, &condAttr);
+    pthread_condattr_destroy(&condAttr);
     if (ret != 0) {
         pthread_mutex_destroy(&queueLocker);
-        throw std::runtime_error("Failed to initialize semaphore: " + std::string(strerror(errno)));
+        throw std::runtime_error("Failed to initialize condition variable: " + std::string(strerror(ret)));
     }
 
-    for (int i = 0; i < m_threadNum; ++i) {
-        ret = pthread_create(&m_threads[i], nullptr, worker, this);
-        if (ret != 0) {
-            pthread_mutex_destroy(&queueLocker);
-            sem_destroy(&queueEventNum);
+    startWorkers(initThreads);
+    std::cout << outHead("init") << "Thread pool started with " << initThreads << " workers (min " << m_minThreads << ", max " << m_maxThreads << ", " << cpuNum << " available CPUs)" << std::endl;
+}
+
+ThreadPool::~ThreadPool() {
+    pthread_mutex_destroy(&queueLocker);
+    pthread_cond_destroy(&queueNotEmpty);
+}
+
+void ThreadPool::startWorkers(int threadNum) {
+    pthread_mutex_lock(&queueLocker);
+    for (int i = 0; i < threadNum; ++i) {
+        if (!addWorker()) {
+            pthread_mutex_unlock(&queueLocker);
             throw std::runtime_error("Thread creation failure: " + std::string(strerror(errno)));
         }
-        ret = pthread_detach(m_threads[i]);
-        if (ret != 0) {
-            pthread_mutex_destroy(&queueLocker);
-            sem_destroy(&queueEventNum);
-            throw std::runtime_error("Failed to set up detached thread: " + std::string(strerror(errno)));
-        }
     }
+    pthread_mutex_unlock(&queueLocker);
 }
 
-ThreadPool::~ThreadPool() {
-    pthread_mutex_destroy(&queueLocker);
-    sem_destroy(&queueEventNum);
+bool ThreadPool::addWorker() {
+    pthread_t thread;
+    int ret = pthread_create(&thread, nullptr, worker, this);
+    if (ret != 0) {
+        errno = ret;
+        return false;
+    }
+    ret = pthread_detach(thread);
+    if (ret != 0) {
+        std::cout << outHead("error") << "Failed to set up detached thread: " << strerror(ret) << std::endl;
+    }
+    m_threads.push_back(thread);
+    ++m_threadNum;
+    return true;
 }
 
-int ThreadPool::appendEvent(EventBase* event, const std::string& eventType) {
-    int ret = pthread_mutex_lock(&queueLocker);
+std::vector<int> ThreadPool::getSlotCpus(AFFINITYPOLICY affinity, int slot) {
+    std::vector<int> cpus;
+    if (affinity == AFFINITY_CORE) {
+        std::vector<int> allowed = getAllowedCpus();
+        cpus.push_back(allowed[slot % allowed.size()]);
+    } else if (affinity == AFFINITY_NUMA) {
+        std::vector<std::vector<int> > nodes = getNumaNodeCpus();
+        cpus = nodes[slot % nodes.size()];
+    }
+    return cpus;
+}
+
+int ThreadPool::appendEvent(EventBase* event, const std::string& eventType, EVENTCLASS eventClass) {
+    if (eventClass < 0 || eventClass >= EVENT_CLASS_NUM) {
+        eventClass = EVENT_CONTROL;
+    }
+
+    int ret = lockQueue();
     if (ret != 0) {
         std::cout << outHead("error") << "Event queue lock failure" << std::endl;
         return -1;
     }
 
-    m_workQueue.push(event);
-    std::cout << outHead("info") << eventType << " successfully added, number of events remaining in the thread pool event queue: " << m_workQueue.size() << std::endl;
+    event->setEnqueueTime(getMonotonicNs());
+    m_workQueue[eventClass].push(event);
+    ++m_queuedNum;
+    std::cout << outHead("info") << eventType << " successfully added, number of events remaining in the thread pool event queue of class " << eventClass << ": " << m_workQueue[eventClass].size() << std::endl;
+
+    if (m_idleNum > 0) {
+        pthread_cond_signal(&queueNotEmpty);
+    }
 
     ret = pthread_mutex_unlock(&queueLocker);
     if (ret != 0) {
@@ -49,15 +134,60 @@ int ThreadPool::appendEvent(EventBase* event, const std::string& eventType) {
         return -2;
     }
 
-    ret = sem_post(&queueEventNum);
+    return 0;
+}
+
+int ThreadPool::appendEvents(EventBase* const* events, const EVENTCLASS* eventClasses, int eventNum) {
+    if (eventNum <= 0) {
+        return 0;
+    }
+
+    int ret = lockQueue();
+    if (ret != 0) {
+        std::cout << outHead("error") << "Event queue lock failure" << std::endl;
+        return -1;
+    }
+
+    long long now = getMonotonicNs();
+    for (int i = 0; i < eventNum; ++i) {
+        events[i]->setEnqueueTime(now);
+        EVENTCLASS eventClass = eventClasses[i];
+        if (eventClass < 0 || eventClass >= EVENT_CLASS_NUM) {
+            eventClass = EVENT_CONTROL;
+        }
+        m_workQueue[eventClass].push(events[i]);
+    }
+    m_queuedNum += eventNum;
+    ++m_batchNum;
+    m_batchEventNum += eventNum;
+
+    // Wake only as many idle workers as there are new events, a single broadcast when all of them are needed
+    if (eventNum >= m_idleNum) {
+        if (m_idleNum > 0) {
+            pthread_cond_broadcast(&queueNotEmpty);
+        }
+    } else {
+        for (int i = 0; i < eventNum; ++i) {
+            pthread_cond_signal(&queueNotEmpty);
+        }
+    }
+
+    ret = pthread_mutex_unlock(&queueLocker);
     if (ret != 0) {
-        std::cout << outHead("error") << "Event queue semaphore post failed" << std::endl;
-        return -3;
+        std::cout << outHead("error") << "Failed to unlock event queue" << std::endl;
+        return -2;
     }
 
     return 0;
 }
 
+void ThreadPool::getBatchStats(unsigned long long& batchNum, unsigned long long& batchEventNum) {
+    pthread_mutex_lock(&queueLocker);
+    batchNum = m_batchNum;
+    batchEventNum = m_batchEventNum;
+    pthread_mutex_unlock(&queueLocker);
+}
+
 void* ThreadPool::worker(void* arg) {
     ThreadPool* thiz = static_cast<ThreadPool*>(arg);
     thiz->run();
@@ -65,26 +195,71 @@ void* ThreadPool::worker(void* arg) {
 }
 
 void ThreadPool::run() {
-    while (true) {
-        int ret = sem_wait(&queueEventNum);
-        if (ret != 0) {
-            std::cout << outHead("error") << "Waiting for queue events to fail" << std::endl;
-            return;
-        }
+    pthread_mutex_lock(&queueLocker);
+    int workerId = m_nextWorkerId++;
+    pthread_mutex_unlock(&queueLocker);
+
+    if (m_affinity != AFFINITY_NONE && !pinCurrentThread(getSlotCpus(m_affinity, m_firstSlot + workerId + 1))) {
+        std::cout << outHead("error") << "Failed to pin worker " << workerId << " to its CPUs" << std::endl;
+    }
 
-        ret = pthread_mutex_lock(&queueLocker);
+    while (true) {
+        int ret = lockQueue();
         if (ret != 0) {
             std::cout << outHead("error") << "ThreadPool::run() : Event queue lock failure" << std::endl;
             return;
         }
 
-        if (m_workQueue.empty()) {
-            pthread_mutex_unlock(&queueLocker);
-            continue;
+        while (m_queuedNum == 0) {
+            ++m_idleNum;
+            long long idleStart = getMonotonicNs();
+            if (m_threadNum > m_minThreads) {
+                timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += m_idleShrink / 1000000000LL;
+                deadline.tv_nsec += m_idleShrink % 1000000000LL;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec += 1;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                ret = pthread_cond_timedwait(&queueNotEmpty, &queueLocker, &deadline);
+            } else {
+                ret = pthread_cond_wait(&queueNotEmpty, &queueLocker);
+            }
+            --m_idleNum;
+            m_idleTime += getMonotonicNs() - idleStart;
+
+            if (ret == ETIMEDOUT) {
+                // Idle for a whole period and above the minimum size: this worker exits
+                if (m_queuedNum == 0 && m_threadNum > m_minThreads) {
+                    --m_threadNum;
+                    m_resizeNum.fetch_add(1, std::memory_order_relaxed);
+                    m_threads.erase(std::remove(m_threads.begin(), m_threads.end(), pthread_self()), m_threads.end());
+                    std::cout << outHead("info") << "Worker " << workerId << " idle, removed from the thread pool, " << m_threadNum << " workers left" << std::endl;
+                    pthread_mutex_unlock(&queueLocker);
+                    return;
+                }
+            } else if (ret != 0) {
+                pthread_mutex_unlock(&queueLocker);
+                std::cout << outHead("error") << "Waiting for queue events to fail" << std::endl;
+                return;
+            }
         }
 
-        EventBase* curEvent = m_workQueue.front();
-        m_workQueue.pop();
+        EventBase* curEvent = dequeueEvent();
+        --m_queuedNum;
+        bool dropEvent = false;
+        bool dumpNow = false;
+        long long dequeueTime = 0;
+        if (curEvent != nullptr) {
+            dequeueTime = getMonotonicNs();
+            dropEvent = shouldDrop(dequeueTime, curEvent->getEnqueueTime());
+            adjustSize(dequeueTime, dequeueTime - curEvent->getEnqueueTime());
+            if (m_dumpInterval != 0 && dequeueTime >= m_nextDump) {
+                m_nextDump = dequeueTime + m_dumpInterval;
+                dumpNow = true;
+            }
+        }
 
         ret = pthread_mutex_unlock(&queueLocker);
         if (ret != 0) {
@@ -96,11 +271,224 @@ void ThreadPool::run() {
             continue;
         }
 
-        curEvent->process();
+        if (dumpNow) {
+            dumpStats();
+        }
+
+        EVENTTYPE eventType = curEvent->getEventType();
+        Metrics::recordShared(m_waitHist[eventType], dequeueTime - curEvent->getEnqueueTime());
+
+        if (dropEvent && curEvent->reject()) {
+            m_dropNum.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            curEvent->process();
+        }
         delete curEvent;
+
+        long long serviceTime = getMonotonicNs() - dequeueTime;
+        Metrics::recordShared(m_serviceHist[eventType], serviceTime);
+        m_busyTime.fetch_add(serviceTime, std::memory_order_relaxed);
+    }
+}
+
+int ThreadPool::lockQueue() {
+    // The uncontended case costs one trylock, the clock is only read when the mutex is held by another thread
+    int ret = pthread_mutex_trylock(&queueLocker);
+    if (ret == 0) {
+        ++m_lockNum;
+        return 0;
+    }
+    if (ret != EBUSY) {
+        return ret;
+    }
+
+    long long waitStart = getMonotonicNs();
+    ret = pthread_mutex_lock(&queueLocker);
+    if (ret != 0) {
+        return ret;
+    }
+    ++m_lockNum;
+    ++m_lockContendedNum;
+    m_lockWait += getMonotonicNs() - waitStart;
+    return 0;
+}
+
+void ThreadPool::getStats(PoolStats& stats) {
+    for (int t = 0; t < EVENT_TYPE_NUM; ++t) {
+        EventTypeStats& typeStats = stats.types[t];
+        typeStats.count = m_serviceHist[t].count.load(std::memory_order_relaxed);
+        unsigned long long waitNum = m_waitHist[t].count.load(std::memory_order_relaxed);
+        typeStats.waitAvgUs = waitNum > 0 ? m_waitHist[t].sumUs.load(std::memory_order_relaxed) / waitNum : 0;
+        typeStats.waitP50Us = Metrics::getQuantileUs(m_waitHist[t], 0.5);
+        typeStats.waitP99Us = Metrics::getQuantileUs(m_waitHist[t], 0.99);
+        typeStats.serviceAvgUs = typeStats.count > 0 ? m_serviceHist[t].sumUs.load(std::memory_order_relaxed) / typeStats.count : 0;
+        typeStats.serviceP50Us = Metrics::getQuantileUs(m_serviceHist[t], 0.5);
+        typeStats.serviceP99Us = Metrics::getQuantileUs(m_serviceHist[t], 0.99);
+    }
+
+    pthread_mutex_lock(&queueLocker);
+    stats.lockNum = m_lockNum;
+    stats.lockContendedNum = m_lockContendedNum;
+    stats.lockWaitUs = m_lockWait / 1000;
+    stats.idleUs = m_idleTime / 1000;
+    stats.queuedNum = m_queuedNum;
+    pthread_mutex_unlock(&queueLocker);
+
+    stats.busyUs = m_busyTime.load(std::memory_order_relaxed) / 1000;
+    stats.busyRatio = stats.busyUs + stats.idleUs > 0 ? static_cast<double>(stats.busyUs) / (stats.busyUs + stats.idleUs) : 0;
+    stats.threadNum = m_threadNum;
+}
+
+void ThreadPool::setStatsDumpInterval(int intervalSec) {
+    pthread_mutex_lock(&queueLocker);
+    m_dumpInterval = intervalSec > 0 ? intervalSec * 1000000000LL : 0;
+    m_nextDump = getMonotonicNs() + m_dumpInterval;
+    pthread_mutex_unlock(&queueLocker);
+}
+
+void ThreadPool::dumpStats() {
+    PoolStats stats;
+    getStats(stats);
+
+    std::ostringstream out;
+    out << outHead("stats") << "Thread pool: " << stats.threadNum << " workers, " << stats.queuedNum << " queued, busy ratio "
+        << std::fixed << std::setprecision(1) << stats.busyRatio * 100 << "%, queue mutex " << stats.lockContendedNum << "/" << stats.lockNum
+        << " contended, " << stats.lockWaitUs << " us waited" << std::endl;
+    for (int t = 0; t < EVENT_TYPE_NUM; ++t) {
+        const EventTypeStats& typeStats = stats.types[t];
+        if (typeStats.count == 0) {
+            continue;
+        }
+        out << outHead("stats") << "  " << getEventTypeName(static_cast<EVENTTYPE>(t)) << ": " << typeStats.count << " events, queue wait avg/p50/p99 "
+            << typeStats.waitAvgUs << "/" << typeStats.waitP50Us << "/" << typeStats.waitP99Us << " us, service avg/p50/p99 "
+            << typeStats.serviceAvgUs << "/" << typeStats.serviceP50Us << "/" << typeStats.serviceP99Us << " us" << std::endl;
+    }
+    std::cout << out.str();
+}
+
+const char* ThreadPool::getEventTypeName(EVENTTYPE eventType) {
+    static const char* typeNames[EVENT_TYPE_NUM] = {"AcceptConn", "HandleRecv", "HandleSend", "HandleFs", "HandleSig"};
+    return eventType >= 0 && eventType < EVENT_TYPE_NUM ? typeNames[eventType] : "unknown";
+}
+
+void ThreadPool::adjustSize(long long now, long long wait) {
+    long long avgWait = m_avgWait.load(std::memory_order_relaxed);
+    avgWait += (wait - avgWait) / 8;
+    m_avgWait.store(avgWait, std::memory_order_relaxed);
+
+    if (avgWait > m_growWait && m_queuedNum > 0 && m_threadNum < m_maxThreads && now - m_lastResize >= 50 * 1000000LL) {
+        if (addWorker()) {
+            m_lastResize = now;
+            m_resizeNum.fetch_add(1, std::memory_order_relaxed);
+            std::cout << outHead("info") << "Average queue wait " << avgWait / 1000 << " us, worker added to the thread pool, " << m_threadNum << " workers" << std::endl;
+        } else {
+            std::cout << outHead("error") << "Failed to add a worker to the thread pool: " << strerror(errno) << std::endl;
+        }
     }
 }
 
+void ThreadPool::setClassWeight(EVENTCLASS eventClass, int weight) {
+    if (eventClass < 0 || eventClass >= EVENT_CLASS_NUM || weight < 1) {
+        return;
+    }
+    pthread_mutex_lock(&queueLocker);
+    m_classWeight[eventClass] = weight;
+    m_classCredit[eventClass] = weight;
+    pthread_mutex_unlock(&queueLocker);
+}
+
+void ThreadPool::setStarvationLimit(int limit) {
+    pthread_mutex_lock(&queueLocker);
+    m_starvationLimit = limit > 0 ? limit : 1;
+    pthread_mutex_unlock(&queueLocker);
+}
+
+void ThreadPool::setQueueDelayTarget(int targetMs, int intervalMs) {
+    pthread_mutex_lock(&queueLocker);
+    m_delayTarget = targetMs > 0 ? targetMs * 1000000LL : 0;
+    m_delayInterval = intervalMs > 0 ? intervalMs * 1000000LL : 100 * 1000000LL;
+    m_intervalEnd = 0;
+    m_overloaded = false;
+    pthread_mutex_unlock(&queueLocker);
+}
+
+bool ThreadPool::shouldDrop(long long now, long long enqueueTime) {
+    if (m_delayTarget == 0) {
+        return false;
+    }
+
+    long long delay = now - enqueueTime;
+
+    // A standing queue is detected when even the fastest event of an interval waited more than the target,
+    // bursts that drain within an interval do not trigger dropping
+    if (now >= m_intervalEnd) {
+        m_overloaded = (m_intervalEnd != 0) && (m_minDelay > m_delayTarget);
+        m_minDelay = delay;
+        m_intervalEnd = now + m_delayInterval;
+    } else if (delay < m_minDelay) {
+        m_minDelay = delay;
+    }
+
+    return m_overloaded && delay > 2 * m_delayTarget;
+}
+
+EventBase* ThreadPool::dequeueEvent() {
+    int chosen = -1;
+
+    // A class that has been passed over too many times is served first, whatever the policy
+    for (int i = 0; i < EVENT_CLASS_NUM; ++i) {
+        if (!m_workQueue[i].empty() && m_classSkipped[i] >= m_starvationLimit) {
+            chosen = i;
+            break;
+        }
+    }
+
+    // Weighted round: serve the first class that still has credit, start a new round when all waiting classes are out of credit
+    if (chosen == -1 && m_policy == SCHED_WEIGHTED) {
+        for (int round = 0; round < 2 && chosen == -1; ++round) {
+            for (int i = 0; i < EVENT_CLASS_NUM; ++i) {
+                if (!m_workQueue[i].empty() && m_classCredit[i] > 0) {
+                    chosen = i;
+                    break;
+                }
+            }
+            if (chosen == -1) {
+                for (int i = 0; i < EVENT_CLASS_NUM; ++i) {
+                    m_classCredit[i] = m_classWeight[i];
+                }
+            }
+        }
+    }
+
+    // Strict priority: the enum order of the classes is their priority
+    if (chosen == -1) {
+        for (int i = 0; i < EVENT_CLASS_NUM; ++i) {
+            if (!m_workQueue[i].empty()) {
+                chosen = i;
+                break;
+            }
+        }
+    }
+
+    if (chosen == -1) {
+        return nullptr;
+    }
+
+    for (int i = 0; i < EVENT_CLASS_NUM; ++i) {
+        if (i != chosen && !m_workQueue[i].empty()) {
+            ++m_classSkipped[i];
+        }
+    }
+    m_classSkipped[chosen] = 0;
+    if (m_classCredit[chosen] > 0) {
+        --m_classCredit[chosen];
+    }
+
+    EventBase* event = m_workQueue[chosen].front();
+    m_workQueue[chosen].pop();
+    return event;
+}
+
 std::string ThreadPool::outHead(const std::string& level) {
     return "[" + level + "] ";
 }
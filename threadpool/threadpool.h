@@ -4,30 +4,187 @@
 #include <queue>
 #include <stdexcept>
 #include <pthread.h>
-#include <semaphore.h>
 #include <vector>
 #include <iostream>
-#include <cstring> 
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <errno.h>
+#include <time.h>
+#include <sstream>
+#include <iomanip>
 #include "../event/myevent.h"
 
+// How the worker chooses the next class queue to serve
+enum SCHEDPOLICY {
+    SCHED_STRICT,     // Always serve the highest priority non-empty queue
+    SCHED_WEIGHTED,   // Weighted round robin between the non-empty queues
+};
+
+// How worker threads (and the reactor thread) are placed on the CPUs
+enum AFFINITYPOLICY {
+    AFFINITY_NONE,    // Let the scheduler place the threads
+    AFFINITY_CORE,    // Pin each thread to one allowed CPU, round robin
+    AFFINITY_NUMA,    // Pin each thread to the CPUs of one NUMA node, round robin over the nodes
+};
+
+// Sizing and placement of the worker threads, a value of 0 is derived from the available CPUs
+struct PoolConfig {
+    int initThreads = 0;          // Workers started with the pool, 0: one per available CPU
+    int minThreads = 0;           // Idle workers exit down to this number, 0: half of the available CPUs
+    int maxThreads = 0;           // Workers are added up to this number, 0: twice the available CPUs
+    int growWaitUs = 2000;        // Average queue wait above which a worker is added
+    int idleShrinkMs = 10000;     // Time a worker waits for an event before it exits, while above minThreads
+    AFFINITYPOLICY affinity = AFFINITY_NONE;
+    int firstSlot = 0;            // Slot of the reactor, the workers follow it: the prefork workers each start at their share
+};
+
+// Queue wait and service time of one event type, in microseconds
+struct EventTypeStats {
+    unsigned long long count = 0;   // Events processed (or rejected)
+    long long waitAvgUs = 0;        // From appendEvent to dequeue
+    long long waitP50Us = 0;
+    long long waitP99Us = 0;
+    long long serviceAvgUs = 0;     // From dequeue to the end of process()
+    long long serviceP50Us = 0;
+    long long serviceP99Us = 0;
+};
+
+// Snapshot of the thread pool instrumentation, given by ThreadPool::getStats
+struct PoolStats {
+    EventTypeStats types[EVENT_TYPE_NUM];
+    unsigned long long lockNum = 0;           // Acquisitions of the queue mutex by appendEvent(s) and the workers
+    unsigned long long lockContendedNum = 0;  // Acquisitions that found the mutex held
+    long long lockWaitUs = 0;                 // Time spent waiting for the mutex when it was held
+    long long busyUs = 0;                     // Time the workers spent processing events
+    long long idleUs = 0;                     // Time the workers spent waiting for events
+    double busyRatio = 0;                     // busyUs / (busyUs + idleUs)
+    int threadNum = 0;
+    int queuedNum = 0;
+};
+
 class ThreadPool {
 public:
-    ThreadPool(int threadNum);
+    // Fixed size pool
+    ThreadPool(int threadNum, SCHEDPOLICY policy = SCHED_WEIGHTED);
+    // Elastic pool sized from the available CPUs and the cgroup quota
+    ThreadPool(const PoolConfig& config, SCHEDPOLICY policy = SCHED_WEIGHTED);
     ~ThreadPool();
 
-    // Adds a pending event to the event queue, and threads in the thread pool will loop through it to process the event
-    int appendEvent(EventBase* event, const std::string& eventType);
+    // CPUs a thread in the given slot is pinned to, slot 0 is the reactor and worker i uses slot i + 1
+    static std::vector<int> getSlotCpus(AFFINITYPOLICY affinity, int slot);
+
+    // Adds a pending event to the event queue of its class, and threads in the thread pool will loop through it to process the event
+    int appendEvent(EventBase* event, const std::string& eventType, EVENTCLASS eventClass = EVENT_CONTROL);
+
+    // Adds the events of a whole epoll_wait result in one operation: the queue lock is taken once
+    // and only as many idle workers as there are events are woken up
+    // Returns -1 when the queue could not be locked: no event was queued and the caller still owns them
+    int appendEvents(EventBase* const* events, const EVENTCLASS* eventClasses, int eventNum);
+
+    // Number of batches submitted with appendEvents and number of events they carried
+    void getBatchStats(unsigned long long& batchNum, unsigned long long& batchEventNum);
+
+    // Number of events served from a class per weighted round (only used by SCHED_WEIGHTED)
+    void setClassWeight(EVENTCLASS eventClass, int weight);
+
+    // Number of dequeues a non-empty class may be passed over before it is served first
+    void setStarvationLimit(int limit);
+
+    // Queue delay based dropping: when the smallest queue delay seen during an interval stays above the target,
+    // the pool is overloaded and events that waited more than twice the target are rejected instead of processed.
+    // A target of 0 disables dropping.
+    void setQueueDelayTarget(int targetMs, int intervalMs);
+
+    // Number of events waiting in all the class queues
+    int getQueuedNum() const { return m_queuedNum.load(std::memory_order_relaxed); }
+
+    // Number of events rejected because of queue delay
+    unsigned long long getDropNum() const { return m_dropNum.load(std::memory_order_relaxed); }
+
+    // Current number of workers, number of times workers were added or removed, and average queue wait
+    int getThreadNum() const { return m_threadNum.load(std::memory_order_relaxed); }
+    unsigned long long getResizeNum() const { return m_resizeNum.load(std::memory_order_relaxed); }
+    long long getAvgQueueWaitUs() const { return m_avgWait.load(std::memory_order_relaxed) / 1000; }
+
+    // Snapshot of the queue wait and service time histograms, mutex contention and busy ratio
+    void getStats(PoolStats& stats);
+
+    // Writes the snapshot to the log every intervalSec seconds (checked by the workers when they dequeue), 0 disables it
+    void setStatsDumpInterval(int intervalSec);
+
+    // Writes the snapshot to the log now
+    void dumpStats();
+
+    static const char* getEventTypeName(EVENTTYPE eventType);
 
 private:
     static void* worker(void* arg);
     void run();
     std::string outHead(const std::string& level);
 
-    int m_threadNum;                  
-    std::vector<pthread_t> m_threads; 
-    std::queue<EventBase*> m_workQueue;  
-    pthread_mutex_t queueLocker;    
-    sem_t queueEventNum;             
+    // Pick the next event from the class queues, must be called with queueLocker held
+    EventBase* dequeueEvent();
+
+    // Whether an event that waited since enqueueTime must be dropped, must be called with queueLocker held
+    bool shouldDrop(long long now, long long enqueueTime);
+
+    // Locks queueLocker and counts the acquisitions that had to wait for it
+    int lockQueue();
+
+    // Starts the initial workers, called by the constructors
+    void startWorkers(int threadNum);
+
+    // Starts one more detached worker, must be called with queueLocker held
+    bool addWorker();
+
+    // Adds a worker when the average queue wait is above the threshold, must be called with queueLocker held
+    void adjustSize(long long now, long long wait);
+
+    std::atomic<int> m_threadNum;     // Current number of workers, only modified with queueLocker held
+    std::vector<pthread_t> m_threads;
+    std::queue<EventBase*> m_workQueue[EVENT_CLASS_NUM];  // One FIFO per event class
+    pthread_mutex_t queueLocker;
+    pthread_cond_t queueNotEmpty;     // Signalled when events are added and workers are idle
+    std::atomic<int> m_queuedNum;     // Number of events in all the class queues, only modified with queueLocker held
+    int m_idleNum;                    // Number of workers waiting for events
+
+    SCHEDPOLICY m_policy;
+    int m_classWeight[EVENT_CLASS_NUM];   // Weight of each class in a weighted round
+    int m_classCredit[EVENT_CLASS_NUM];   // Remaining dequeues of each class in the current round
+    int m_classSkipped[EVENT_CLASS_NUM];  // Number of dequeues a waiting class has been passed over
+    int m_starvationLimit;
+
+    unsigned long long m_batchNum;       // Number of calls to appendEvents
+    unsigned long long m_batchEventNum;  // Number of events added by appendEvents
+
+    long long m_delayTarget;          // Queue delay target in nanoseconds, 0 when dropping is disabled
+    long long m_delayInterval;        // Measurement interval in nanoseconds
+    long long m_intervalEnd;          // End of the current measurement interval
+    long long m_minDelay;             // Smallest queue delay seen during the current interval
+    bool m_overloaded;                // The smallest delay of the last interval was above the target
+    std::atomic<unsigned long long> m_dropNum;
+
+    int m_minThreads;
+    int m_maxThreads;
+    long long m_growWait;             // Average queue wait in nanoseconds above which a worker is added
+    long long m_idleShrink;           // Idle time in nanoseconds after which a worker above m_minThreads exits
+    AFFINITYPOLICY m_affinity;
+    int m_firstSlot;
+    int m_nextWorkerId;               // Slot given to the next worker that starts
+    long long m_lastResize;           // Time of the last added worker, additions are spaced by at least 50 ms
+    std::atomic<long long> m_avgWait; // Moving average of the queue wait in nanoseconds
+    std::atomic<unsigned long long> m_resizeNum;
+
+    LatencyHistogram m_waitHist[EVENT_TYPE_NUM];     // Queue wait per event type
+    LatencyHistogram m_serviceHist[EVENT_TYPE_NUM];  // Service time per event type
+    unsigned long long m_lockNum;             // Counters of lockQueue, only modified with queueLocker held
+    unsigned long long m_lockContendedNum;
+    long long m_lockWait;                     // Nanoseconds
+    long long m_idleTime;                     // Nanoseconds spent in the condition wait, only modified with queueLocker held
+    std::atomic<long long> m_busyTime;        // Nanoseconds spent in process()
+    long long m_dumpInterval;                 // Nanoseconds between two dumps of the statistics, 0 when disabled
+    long long m_nextDump;                     // Time of the next dump, only modified with queueLocker held
 };
 
 #endif
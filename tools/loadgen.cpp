@@ -0,0 +1,769 @@
+// Load generator for the server started locally (./main, port 8888).
+//
+// Closed loop: each connection sends its next request as soon as the previous response is read.
+// Open loop: requests are scheduled at a constant total rate and the latency is measured from the time a
+// request was due, not from the time it was sent, so a stalled server is not hidden by the client waiting
+// (coordinated omission). Closed loop results are corrected after the run with the mean latency as the
+// expected interval, as HdrHistogram does.
+//
+//   ./loadgen --mode closed --connections 16 --duration 10 --mix list=60,downl=30,upload=5,put=3,del=2
+//   ./loadgen --mode open --rate 2000 --connections 32 --range 4096
+//   ./loadgen --matrix                   built-in scenario matrix
+//   ./loadgen --matrix scenarios.txt     one scenario per line: "<name>: <options>"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define HDR_SUB_BITS 7                                  // 128 sub-buckets per power of two: values within 0.8%
+#define HDR_SUB_COUNT (1 << HDR_SUB_BITS)
+#define HDR_MAX_MSB 40                                  // Values up to 2^41 ns, about 36 minutes
+#define HDR_BUCKET_NUM ((HDR_MAX_MSB - HDR_SUB_BITS + 2) * HDR_SUB_COUNT)
+
+static long long getMonotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Log-linear latency histogram in nanoseconds, in the manner of HdrHistogram
+class HdrHistogram {
+public:
+    HdrHistogram() : m_counts(HDR_BUCKET_NUM, 0), m_total(0), m_max(0), m_sum(0) {}
+
+    void record(long long value, unsigned long long count = 1) {
+        value = std::max(0LL, value);
+        m_counts[getIndex(value)] += count;
+        m_total += count;
+        m_max = std::max(m_max, value);
+        m_sum += static_cast<double>(value) * count;
+    }
+
+    // Adds the requests a closed loop client would have sent while it waited: a value larger than the
+    // expected interval also records value - interval, value - 2 * interval, ...
+    void recordCorrected(long long value, long long expectedInterval, unsigned long long count = 1) {
+        record(value, count);
+        if (expectedInterval <= 0) {
+            return;
+        }
+        for (long long missing = value - expectedInterval; missing >= expectedInterval; missing -= expectedInterval) {
+            record(missing, count);
+        }
+    }
+
+    HdrHistogram getCorrected(long long expectedInterval) const {
+        HdrHistogram corrected;
+        for (int i = 0; i < HDR_BUCKET_NUM; ++i) {
+            if (m_counts[i] != 0) {
+                corrected.recordCorrected(getHighestEquivalent(i), expectedInterval, m_counts[i]);
+            }
+        }
+        corrected.m_max = std::max(corrected.m_max, m_max);
+        return corrected;
+    }
+
+    void add(const HdrHistogram& other) {
+        for (int i = 0; i < HDR_BUCKET_NUM; ++i) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        m_max = std::max(m_max, other.m_max);
+        m_sum += other.m_sum;
+    }
+
+    long long getPercentile(double percentile) const {
+        if (m_total == 0) {
+            return 0;
+        }
+        unsigned long long rank = static_cast<unsigned long long>(percentile / 100 * m_total + 0.5);
+        rank = std::max(1ULL, std::min(rank, m_total));
+        unsigned long long cumulative = 0;
+        for (int i = 0; i < HDR_BUCKET_NUM; ++i) {
+            cumulative += m_counts[i];
+            if (cumulative >= rank) {
+                return std::min(getHighestEquivalent(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    unsigned long long getCount() const { return m_total; }
+    long long getMax() const { return m_max; }
+    double getMean() const { return m_total > 0 ? m_sum / m_total : 0; }
+
+private:
+    static int getIndex(long long value) {
+        if (value < 2 * HDR_SUB_COUNT) {
+            return static_cast<int>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        if (msb > HDR_MAX_MSB) {
+            return HDR_BUCKET_NUM - 1;
+        }
+        int shift = msb - HDR_SUB_BITS;
+        return (shift + 1) * HDR_SUB_COUNT + static_cast<int>((value >> shift) - HDR_SUB_COUNT);
+    }
+
+    static long long getHighestEquivalent(int index) {
+        if (index < 2 * HDR_SUB_COUNT) {
+            return index;
+        }
+        int shift = index / HDR_SUB_COUNT - 1;
+        long long top = index % HDR_SUB_COUNT + HDR_SUB_COUNT;
+        return ((top + 1) << shift) - 1;
+    }
+
+    std::vector<unsigned long long> m_counts;
+    unsigned long long m_total;
+    long long m_max;
+    double m_sum;
+};
+
+enum OPERATION {
+    OP_LIST,      // GET /
+    OP_DOWNL,     // GET /downl/<seed file>, with a Range header when --range is set
+    OP_UPLOAD,    // POST multipart upload of a new file
+    OP_PUT,       // PUT /put/<new file>
+    OP_DEL,       // GET /del/<oldest file created by the connection>, a listing when there is none
+    OP_NUM
+};
+
+static const char* operationNames[OP_NUM] = {"list", "downl", "upload", "put", "del"};
+
+struct LoadConfig {
+    std::string name = "run";
+    std::string host = "127.0.0.1";
+    int port = 8888;
+    bool openLoop = false;
+    double rate = 1000;            // Requests per second of all the connections, open loop only
+    int connections = 8;
+    double duration = 10;          // Seconds
+    bool keepAlive = true;
+    int mix[OP_NUM] = {100, 0, 0, 0, 0};
+    long long rangeBytes = 0;      // Bytes asked by each download, 0 for the whole file
+    long long bodySize = 64 * 1024;  // Size of the uploaded and PUT files and of the downloaded seed file
+};
+
+// Counters and histograms of one connection, merged after the run
+struct ConnResult {
+    HdrHistogram hist[OP_NUM];
+    unsigned long long errors = 0;
+    unsigned long long bytes = 0;
+};
+
+static const std::string seedName = "loadgen-seed.bin";
+
+class Connection {
+public:
+    Connection(const LoadConfig& config, int id) : m_config(config), m_id(id), m_fd(-1), m_fileNum(0) {}
+    ~Connection() { disconnect(); }
+
+    // Sends one request of the mix and reads its response, returns the status code or -1 on failure
+    int execute(OPERATION op, const std::string& payload, unsigned long long& bytes) {
+        return exchange(buildRequest(op, payload), bytes);
+    }
+
+    // The body of the response is copied to body when it is given
+    int exchange(const std::string& request, unsigned long long& bytes, std::string* body = nullptr) {
+        // The server may have closed an idle keep-alive connection, the request is then retried once on a new connection
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            bool reused = m_fd != -1;
+            if (m_fd == -1 && !connectServer()) {
+                return -1;
+            }
+            int status = sendAll(request) ? readResponse(bytes, body) : -1;
+            if (status == -1 || !m_config.keepAlive) {
+                disconnect();
+            }
+            if (status != -1 || !reused) {
+                return status;
+            }
+        }
+        return -1;
+    }
+
+    // Removes the files this connection created and that are still on the server
+    void cleanup(const std::string& payload) {
+        unsigned long long bytes = 0;
+        while (!m_createdFiles.empty()) {
+            execute(OP_DEL, payload, bytes);
+        }
+    }
+
+    // Operation actually sent for op: a delete without a file of its own lists the files instead
+    OPERATION resolve(OPERATION op) const {
+        return (op == OP_DEL && m_createdFiles.empty()) ? OP_LIST : op;
+    }
+
+private:
+    std::string buildRequest(OPERATION op, const std::string& payload) {
+        std::string host = "Host: " + m_config.host + ":" + std::to_string(m_config.port) + "\r\n";
+        std::string connection = m_config.keepAlive ? "" : "Connection: close\r\n";
+        op = resolve(op);
+
+        if (op == OP_LIST) {
+            return "GET / HTTP/1.1\r\n" + host + connection + "\r\n";
+        }
+        if (op == OP_DOWNL) {
+            std::string range = m_config.rangeBytes > 0 ? "Range: bytes=0-" + std::to_string(m_config.rangeBytes - 1) + "\r\n" : "";
+            return "GET /downl/" + seedName + " HTTP/1.1\r\n" + host + range + connection + "\r\n";
+        }
+        if (op == OP_DEL) {
+            std::string name = m_createdFiles.front();
+            m_createdFiles.pop_front();
+            return "GET /del/" + name + " HTTP/1.1\r\n" + host + connection + "\r\n";
+        }
+
+        std::string name = "loadgen-" + std::to_string(getpid()) + "-" + std::to_string(m_id) + "-" + std::to_string(m_fileNum++) + ".bin";
+        m_createdFiles.push_back(name);
+        if (op == OP_PUT) {
+            return "PUT /put/" + name + " HTTP/1.1\r\n" + host + connection + "Content-Length: " + std::to_string(payload.size()) + "\r\n\r\n" + payload;
+        }
+
+        const std::string boundary = "------------------------loadgen0123456789";
+        std::string body = "--" + boundary + "\r\nContent-Disposition: form-data; name=\"upload\"; filename=\"" + name +
+                           "\"\r\nContent-Type: application/octet-stream\r\n\r\n" + payload + "\r\n--" + boundary + "--\r\n";
+        return "POST /upload HTTP/1.1\r\n" + host + connection + "Content-Type: multipart/form-data; boundary=" + boundary +
+               "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    }
+
+    bool connectServer() {
+        m_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_fd == -1) {
+            return false;
+        }
+        int one = 1;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        timeval timeout = {10, 0};
+        setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_config.port);
+        inet_pton(AF_INET, m_config.host.c_str(), &addr.sin_addr);
+        if (connect(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    void disconnect() {
+        if (m_fd != -1) {
+            close(m_fd);
+            m_fd = -1;
+        }
+        m_buffer.clear();
+    }
+
+    bool sendAll(const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t len = send(m_fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (len <= 0) {
+                if (len == -1 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            sent += len;
+        }
+        return true;
+    }
+
+    bool fill() {
+        char buf[65536];
+        ssize_t len = recv(m_fd, buf, sizeof(buf), 0);
+        while (len == -1 && errno == EINTR) {
+            len = recv(m_fd, buf, sizeof(buf), 0);
+        }
+        if (len <= 0) {
+            return false;
+        }
+        m_buffer.append(buf, len);
+        return true;
+    }
+
+    int readResponse(unsigned long long& bytes, std::string* body) {
+        std::string::size_type headerEnd;
+        while ((headerEnd = m_buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (!fill()) {
+                return -1;
+            }
+        }
+
+        std::string header = m_buffer.substr(0, headerEnd + 4);
+        int status = -1;
+        if (sscanf(header.c_str(), "HTTP/%*s %d", &status) != 1) {
+            return -1;
+        }
+        long long contentLength = 0;
+        std::string lower = header;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (lower.find("\r\ntransfer-encoding: chunked") != std::string::npos) {
+            return readChunkedBody(headerEnd + 4, status, bytes, body);
+        }
+        std::string::size_type lengthIndex = lower.find("\r\ncontent-length:");
+        if (lengthIndex != std::string::npos) {
+            contentLength = atoll(lower.c_str() + lengthIndex + strlen("\r\ncontent-length:"));
+        }
+
+        while (m_buffer.size() < headerEnd + 4 + contentLength) {
+            if (!fill()) {
+                return -1;
+            }
+        }
+        bytes += headerEnd + 4 + contentLength;
+        if (body != nullptr) {
+            body->assign(m_buffer, headerEnd + 4, contentLength);
+        }
+        m_buffer.erase(0, headerEnd + 4 + contentLength);
+        return status;
+    }
+
+    // Reads the chunks of a body starting at offset of the buffer, the file list page is sent this way
+    int readChunkedBody(std::string::size_type offset, int status, unsigned long long& bytes, std::string* body) {
+        if (body != nullptr) {
+            body->clear();
+        }
+        while (true) {
+            std::string::size_type lineEnd;
+            while ((lineEnd = m_buffer.find("\r\n", offset)) == std::string::npos) {
+                if (!fill()) {
+                    return -1;
+                }
+            }
+            long long chunkLen = strtoll(m_buffer.c_str() + offset, nullptr, 16);
+            std::string::size_type chunkEnd = lineEnd + 2 + chunkLen + 2;
+            while (m_buffer.size() < chunkEnd) {
+                if (!fill()) {
+                    return -1;
+                }
+            }
+            if (body != nullptr) {
+                body->append(m_buffer, lineEnd + 2, chunkLen);
+            }
+            offset = chunkEnd;
+            if (chunkLen == 0) {
+                break;
+            }
+        }
+        bytes += offset;
+        m_buffer.erase(0, offset);
+        return status;
+    }
+
+    const LoadConfig& m_config;
+    int m_id;
+    int m_fd;
+    std::string m_buffer;                    // Data received and not yet consumed
+    std::deque<std::string> m_createdFiles;  // Files uploaded by this connection, deleted oldest first
+    int m_fileNum;
+};
+
+// Picks the operations of a connection from the mix, with its own generator
+class MixPicker {
+public:
+    MixPicker(const int* mix, unsigned int seed) : m_seed(seed), m_total(0) {
+        for (int i = 0; i < OP_NUM; ++i) {
+            m_total += mix[i];
+            m_bounds[i] = m_total;
+        }
+    }
+
+    OPERATION next() {
+        m_seed = m_seed * 1103515245 + 12345;
+        int value = m_total > 0 ? static_cast<int>((m_seed >> 8) % m_total) : 0;
+        for (int i = 0; i < OP_NUM; ++i) {
+            if (value < m_bounds[i]) {
+                return static_cast<OPERATION>(i);
+            }
+        }
+        return OP_LIST;
+    }
+
+private:
+    unsigned int m_seed;
+    int m_total;
+    int m_bounds[OP_NUM];
+};
+
+static bool isSuccess(OPERATION op, int status) {
+    // Uploads and deletes answer with a redirect to the file list
+    return status >= 200 && status < 400 && !(op == OP_DOWNL && status == 404);
+}
+
+static void sleepUntil(long long deadlineNs) {
+    timespec ts;
+    ts.tv_sec = deadlineNs / 1000000000LL;
+    ts.tv_nsec = deadlineNs % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+
+static void runConnection(const LoadConfig& config, int id, const std::string& payload, long long startNs, long long endNs, ConnResult& result) {
+    Connection conn(config, id);
+    MixPicker picker(config.mix, 7919 * (id + 1));
+
+    // Each open loop connection sends rate / connections requests per second, offset so that they do not fire together
+    long long interval = config.openLoop ? static_cast<long long>(1e9 * config.connections / config.rate) : 0;
+    long long due = startNs + (config.openLoop ? interval * id / config.connections : 0);
+
+    sleepUntil(due);
+    while (true) {
+        long long now = getMonotonicNs();
+        if (config.openLoop) {
+            if (due >= endNs) {
+                break;
+            }
+            if (now < due) {
+                sleepUntil(due);
+            }
+        } else if (now >= endNs) {
+            break;
+        }
+
+        OPERATION op = conn.resolve(picker.next());
+        long long sent = getMonotonicNs();
+        int status = conn.execute(op, payload, result.bytes);
+        long long done = getMonotonicNs();
+
+        if (!isSuccess(op, status)) {
+            ++result.errors;
+        }
+        // Open loop latency starts when the request was due, even if the connection was still busy with the previous one
+        result.hist[op].record(done - (config.openLoop ? due : sent));
+        due += interval;
+    }
+
+    conn.cleanup(payload);
+}
+
+struct RunSummary {
+    std::string name;
+    LoadConfig config;
+    double seconds = 0;
+    unsigned long long requests = 0;
+    unsigned long long errors = 0;
+    unsigned long long bytes = 0;
+    HdrHistogram total;            // Corrected for coordinated omission
+    HdrHistogram perOp[OP_NUM];
+    long long rawP99 = 0;          // Closed loop p99 before correction
+    double waitsPerRequest = -1;   // epoll_wait and epoll_ctl calls of the server per request, -1 without its metrics
+    double ctlsPerRequest = -1;
+};
+
+// Writes the file downloaded by the scenarios, or deletes it when remove is set
+static bool prepareSeed(const LoadConfig& config, const std::string& payload, bool remove) {
+    Connection conn(config, -1);
+    std::string host = "Host: " + config.host + ":" + std::to_string(config.port) + "\r\n";
+    std::string request = remove ? "GET /del/" + seedName + " HTTP/1.1\r\n" + host + "\r\n"
+                                 : "PUT /put/" + seedName + " HTTP/1.1\r\n" + host + "Content-Length: " + std::to_string(payload.size()) + "\r\n\r\n" + payload;
+    unsigned long long bytes = 0;
+    return isSuccess(OP_PUT, conn.exchange(request, bytes));
+}
+
+// Reads the epoll calls of the server from /metrics, returns false when the server does not report them
+static bool scrapeEpollCalls(const LoadConfig& config, unsigned long long& waits, unsigned long long& ctls) {
+    Connection conn(config, -1);
+    std::string host = "Host: " + config.host + ":" + std::to_string(config.port) + "\r\n";
+    std::string body;
+    unsigned long long bytes = 0;
+    if (conn.exchange("GET /metrics HTTP/1.1\r\n" + host + "\r\n", bytes, &body) != 200) {
+        return false;
+    }
+    const char* waitName = "cherokee_epoll_calls_total{call=\"wait\"} ";
+    const char* ctlName = "cherokee_epoll_calls_total{call=\"ctl\"} ";
+    std::string::size_type waitIndex = body.find(waitName);
+    std::string::size_type ctlIndex = body.find(ctlName);
+    if (waitIndex == std::string::npos || ctlIndex == std::string::npos) {
+        return false;
+    }
+    waits = strtoull(body.c_str() + waitIndex + strlen(waitName), nullptr, 10);
+    ctls = strtoull(body.c_str() + ctlIndex + strlen(ctlName), nullptr, 10);
+    return true;
+}
+
+static RunSummary runScenario(const LoadConfig& config) {
+    std::string payload(config.bodySize, '\0');
+    unsigned int seed = 42;
+    for (char& c : payload) {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<char>(seed >> 16);
+    }
+
+    RunSummary summary;
+    summary.name = config.name;
+    summary.config = config;
+
+    // The calls of the cleanup deletes and of the scrapes are counted too, a few requests over the whole run
+    unsigned long long waitsBefore = 0, ctlsBefore = 0, waitsAfter = 0, ctlsAfter = 0;
+    bool scraped = scrapeEpollCalls(config, waitsBefore, ctlsBefore);
+
+    std::vector<ConnResult> results(config.connections);
+    std::vector<std::thread> threads;
+    long long startNs = getMonotonicNs() + 50 * 1000000LL;
+    long long endNs = startNs + static_cast<long long>(config.duration * 1e9);
+    for (int i = 0; i < config.connections; ++i) {
+        threads.push_back(std::thread(runConnection, std::cref(config), i, std::cref(payload), startNs, endNs, std::ref(results[i])));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    summary.seconds = config.duration;
+    scraped = scraped && scrapeEpollCalls(config, waitsAfter, ctlsAfter);
+
+    HdrHistogram raw;
+    for (const ConnResult& result : results) {
+        for (int op = 0; op < OP_NUM; ++op) {
+            raw.add(result.hist[op]);
+            summary.perOp[op].add(result.hist[op]);
+        }
+        summary.errors += result.errors;
+        summary.bytes += result.bytes;
+    }
+    summary.requests = raw.getCount();
+    summary.rawP99 = raw.getPercentile(99);
+    summary.total = config.openLoop ? raw : raw.getCorrected(static_cast<long long>(raw.getMean()));
+    if (scraped && summary.requests > 0) {
+        summary.waitsPerRequest = static_cast<double>(waitsAfter - waitsBefore) / summary.requests;
+        summary.ctlsPerRequest = static_cast<double>(ctlsAfter - ctlsBefore) / summary.requests;
+    }
+    return summary;
+}
+
+static std::string formatUs(long long ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1f", ns / 1000.0);
+    return buf;
+}
+
+static std::string formatPerRequest(double value) {
+    if (value < 0) {
+        return "-";
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2f", value);
+    return buf;
+}
+
+static void printTable(const std::vector<RunSummary>& summaries, bool csv) {
+    if (csv) {
+        printf("scenario,mode,connections,target_rps,keepalive,requests,rps,errors,mb_per_s,p50_us,p99_us,p999_us,max_us,raw_p99_us,"
+               "epoll_wait_per_req,epoll_ctl_per_req\n");
+    } else {
+        printf("%-26s %-6s %5s %8s %4s %9s %9s %7s %8s %9s %9s %9s %9s %9s %9s\n", "scenario", "mode", "conns", "target", "ka",
+               "requests", "req/s", "errors", "MB/s", "p50 us", "p99 us", "p99.9 us", "max us", "wait/req", "ctl/req");
+    }
+    for (const RunSummary& s : summaries) {
+        double rps = s.requests / s.seconds;
+        double mbps = s.bytes / s.seconds / 1e6;
+        std::string target = s.config.openLoop ? std::to_string(static_cast<long long>(s.config.rate)) : "-";
+        if (csv) {
+            printf("%s,%s,%d,%s,%d,%llu,%.1f,%llu,%.2f,%s,%s,%s,%s,%s,%s,%s\n", s.name.c_str(), s.config.openLoop ? "open" : "closed",
+                   s.config.connections, target.c_str(), s.config.keepAlive ? 1 : 0, s.requests, rps, s.errors, mbps,
+                   formatUs(s.total.getPercentile(50)).c_str(), formatUs(s.total.getPercentile(99)).c_str(),
+                   formatUs(s.total.getPercentile(99.9)).c_str(), formatUs(s.total.getMax()).c_str(), formatUs(s.rawP99).c_str(),
+                   formatPerRequest(s.waitsPerRequest).c_str(), formatPerRequest(s.ctlsPerRequest).c_str());
+        } else {
+            printf("%-26s %-6s %5d %8s %4s %9llu %9.1f %7llu %8.2f %9s %9s %9s %9s %9s %9s\n", s.name.c_str(), s.config.openLoop ? "open" : "closed",
+                   s.config.connections, target.c_str(), s.config.keepAlive ? "on" : "off", s.requests, rps, s.errors, mbps,
+                   formatUs(s.total.getPercentile(50)).c_str(), formatUs(s.total.getPercentile(99)).c_str(),
+                   formatUs(s.total.getPercentile(99.9)).c_str(), formatUs(s.total.getMax()).c_str(),
+                   formatPerRequest(s.waitsPerRequest).c_str(), formatPerRequest(s.ctlsPerRequest).c_str());
+        }
+    }
+}
+
+static void printOperations(const RunSummary& s) {
+    printf("\n%-8s %9s %9s %9s %9s %9s\n", "op", "requests", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op < OP_NUM; ++op) {
+        const HdrHistogram& hist = s.perOp[op];
+        if (hist.getCount() == 0) {
+            continue;
+        }
+        printf("%-8s %9llu %9s %9s %9s %9s\n", operationNames[op], hist.getCount(), formatUs(hist.getPercentile(50)).c_str(),
+               formatUs(hist.getPercentile(99)).c_str(), formatUs(hist.getPercentile(99.9)).c_str(), formatUs(hist.getMax()).c_str());
+    }
+    if (!s.config.openLoop) {
+        printf("\nClosed loop: percentiles corrected for coordinated omission, p99 before correction %s us\n", formatUs(s.rawP99).c_str());
+    }
+}
+
+static bool parseMix(const std::string& value, int* mix) {
+    std::fill(mix, mix + OP_NUM, 0);
+    std::stringstream stream(value);
+    std::string item;
+    while (getline(stream, item, ',')) {
+        std::string::size_type eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        int weight = eq == std::string::npos ? 1 : atoi(item.c_str() + eq + 1);
+        int op = std::find(operationNames, operationNames + OP_NUM, name) - operationNames;
+        if (op == OP_NUM) {
+            std::cerr << "[error] Unknown operation in mix: " << name << std::endl;
+            return false;
+        }
+        mix[op] = weight;
+    }
+    return true;
+}
+
+// Applies the options of args to config, returns false on an unknown option
+static bool parseOptions(const std::vector<std::string>& args, LoadConfig& config, std::string* matrixPath, bool* matrix, bool* csv) {
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "--csv" && csv != nullptr) {
+            *csv = true;
+            continue;
+        }
+        if (arg == "--matrix" && matrix != nullptr) {
+            *matrix = true;
+            if (i + 1 < args.size() && args[i + 1].compare(0, 2, "--") != 0) {
+                *matrixPath = args[++i];
+            }
+            continue;
+        }
+        if (i + 1 >= args.size()) {
+            std::cerr << "[error] Missing value for " << arg << std::endl;
+            return false;
+        }
+        const std::string& value = args[++i];
+        if (arg == "--host") {
+            config.host = value;
+        } else if (arg == "--port") {
+            config.port = atoi(value.c_str());
+        } else if (arg == "--mode") {
+            config.openLoop = (value == "open");
+        } else if (arg == "--rate") {
+            config.rate = std::max(1.0, atof(value.c_str()));
+        } else if (arg == "--connections") {
+            config.connections = std::max(1, atoi(value.c_str()));
+        } else if (arg == "--duration") {
+            config.duration = std::max(0.1, atof(value.c_str()));
+        } else if (arg == "--keepalive") {
+            config.keepAlive = (value != "off");
+        } else if (arg == "--mix") {
+            if (!parseMix(value, config.mix)) {
+                return false;
+            }
+        } else if (arg == "--range") {
+            config.rangeBytes = atoll(value.c_str());
+        } else if (arg == "--size") {
+            config.bodySize = std::max(1LL, atoll(value.c_str()));
+        } else if (arg == "--name") {
+            config.name = value;
+        } else {
+            std::cerr << "[error] Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Scenarios run by --matrix without a file, on top of the options given on the command line
+static const char* defaultMatrix[] = {
+    "list-c1: --mode closed --connections 1 --mix list",
+    "list-c16: --mode closed --connections 16 --mix list",
+    "list-c16-close: --mode closed --connections 16 --mix list --keepalive off",
+    "downl-c16: --mode closed --connections 16 --mix downl",
+    "downl-range-c16: --mode closed --connections 16 --mix downl --range 4096",
+    "mixed-c16: --mode closed --connections 16 --mix list=50,downl=35,upload=5,put=5,del=5",
+    "mixed-open-500: --mode open --rate 500 --connections 16 --mix list=50,downl=35,upload=5,put=5,del=5",
+    "mixed-open-2000: --mode open --rate 2000 --connections 32 --mix list=50,downl=35,upload=5,put=5,del=5",
+};
+
+static std::vector<std::string> splitWords(const std::string& line) {
+    std::vector<std::string> words;
+    std::istringstream stream(line);
+    std::string word;
+    while (stream >> word) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+int main(int argc, char* argv[]) {
+    LoadConfig base;
+    std::string matrixPath;
+    bool matrix = false, csv = false;
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (!parseOptions(args, base, &matrixPath, &matrix, &csv)) {
+        std::cerr << "usage: " << argv[0] << " [--mode closed|open] [--rate N] [--connections N] [--duration S] [--keepalive on|off]\n"
+                  << "       [--mix list=N,downl=N,upload=N,put=N,del=N] [--range BYTES] [--size BYTES] [--host IP] [--port N]\n"
+                  << "       [--matrix [file]] [--csv]" << std::endl;
+        return 2;
+    }
+
+    std::vector<LoadConfig> scenarios;
+    if (!matrix) {
+        scenarios.push_back(base);
+    } else {
+        std::vector<std::string> lines;
+        if (matrixPath.empty()) {
+            lines.assign(defaultMatrix, defaultMatrix + sizeof(defaultMatrix) / sizeof(defaultMatrix[0]));
+        } else {
+            std::ifstream file(matrixPath);
+            if (!file) {
+                std::cerr << "[error] Cannot open " << matrixPath << std::endl;
+                return 2;
+            }
+            std::string line;
+            while (getline(file, line)) {
+                if (!line.empty() && line[0] != '#') {
+                    lines.push_back(line);
+                }
+            }
+        }
+        for (const std::string& line : lines) {
+            std::string::size_type colon = line.find(':');
+            LoadConfig config = base;
+            config.name = line.substr(0, colon);
+            if (colon == std::string::npos || !parseOptions(splitWords(line.substr(colon + 1)), config, nullptr, nullptr, nullptr)) {
+                std::cerr << "[error] Invalid scenario: " << line << std::endl;
+                return 2;
+            }
+            scenarios.push_back(config);
+        }
+    }
+
+    std::vector<RunSummary> summaries;
+    for (const LoadConfig& config : scenarios) {
+        std::string seedPayload(config.bodySize, 'x');
+        if (config.mix[OP_DOWNL] > 0 && !prepareSeed(config, seedPayload, false)) {
+            std::cerr << "[error] Cannot create the file to download, is the server running on " << config.host << ":" << config.port << "?" << std::endl;
+            return 1;
+        }
+        std::cerr << "[info] Running " << config.name << " for " << config.duration << " s" << std::endl;
+        summaries.push_back(runScenario(config));
+        if (!matrix) {
+            printTable(summaries, csv);
+            if (!csv) {
+                printOperations(summaries.back());
+            }
+        }
+    }
+    if (matrix) {
+        printTable(summaries, csv);
+    }
+
+    prepareSeed(base, "", true);
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Moves the files of a flat directory (dir/name) into the hashed layout of the storage (storage/storage.h).
+// It runs while the server serves the directory: each file is linked into its shard then unlinked, and the server
+// looks in both places, so a file is never missing for a request. --rate limits the files moved per second.
+//
+//   ./migrate [--dir filedir] [--rate N] [--dry-run]
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../storage/storage.h"
+
+struct MigrateCounts {
+    long long moved = 0;
+    long long missing = 0;
+    long long conflicts = 0;
+    long long errors = 0;
+};
+
+static long long getNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// One pass over the root. Files are moved as they are read: a flat file with the name of a shard directory
+// stops the files of that shard until it is moved itself, so the caller runs passes until nothing moves.
+static bool migratePass(const std::string& root, long long rate, bool dryRun, MigrateCounts& counts, long long& flatNum) {
+    DIR* dir = opendir(root.c_str());
+    if (dir == nullptr) {
+        std::cerr << "[error] Cannot open " << root << " (" << strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    long long startNs = getNowNs();
+    long long passMoved = 0;
+    flatNum = 0;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        struct stat entryStat;
+        if (fstatat(dirfd(dir), entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(entryStat.st_mode)) {
+            continue;
+        }
+        ++flatNum;
+        if (dryRun) {
+            continue;
+        }
+
+        MIGRATERESULT result = Storage::migrateFile(entry->d_name);
+        if (result == MIGRATE_MOVED) {
+            ++counts.moved;
+            ++passMoved;
+            if (counts.moved % 10000 == 0) {
+                std::cerr << "[info] " << counts.moved << " files moved" << std::endl;
+            }
+        } else if (result == MIGRATE_MISSING) {
+            ++counts.missing;
+        } else if (result == MIGRATE_CONFLICT) {
+            ++counts.conflicts;
+            std::cerr << "[error] " << entry->d_name << " is also in its shard with other content, both are kept" << std::endl;
+        } else {
+            ++counts.errors;
+            std::cerr << "[error] Cannot move " << entry->d_name << " (" << strerror(errno) << ")" << std::endl;
+        }
+
+        // Spread the moves over time so that the server keeps the disk
+        if (rate > 0) {
+            long long dueNs = startNs + passMoved * 1000000000LL / rate;
+            long long nowNs = getNowNs();
+            if (dueNs > nowNs) {
+                usleep((dueNs - nowNs) / 1000);
+            }
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::string root = "filedir";
+    long long rate = 0;
+    bool dryRun = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--dir" && i + 1 < argc) {
+            root = argv[++i];
+        } else if (arg == "--rate" && i + 1 < argc) {
+            rate = atoll(argv[++i]);
+        } else if (arg == "--dry-run") {
+            dryRun = true;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--dir filedir] [--rate N] [--dry-run]" << std::endl;
+            return 1;
+        }
+    }
+    Storage::init(root);
+
+    MigrateCounts counts;
+    long long flatNum = 0;
+    long long movedBefore = -1;
+    while (counts.moved != movedBefore) {
+        movedBefore = counts.moved;
+        // A file that failed in a pass may move in the next one, only the failures of the last pass are reported
+        counts.conflicts = 0;
+        counts.errors = 0;
+        if (!migratePass(root, rate, dryRun, counts, flatNum)) {
+            return 1;
+        }
+        if (dryRun) {
+            break;
+        }
+    }
+
+    if (dryRun) {
+        std::cout << flatNum << " files to move in " << root << std::endl;
+        return 0;
+    }
+    std::cout << counts.moved << " files moved, " << counts.missing << " deleted during the migration, "
+              << counts.conflicts << " conflicts, " << counts.errors << " errors, " << flatNum << " files left in the flat layout" << std::endl;
+    return (counts.conflicts != 0 || counts.errors != 0) ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+// Checks the answers of the search index (search/namesearch.h) without a server: first on a few known names, then
+// on a generated index changed by additions, deletions and renames, where every query is compared with a scan of
+// the names that should be live. Exits with 1 on the first wrong answer.
+//
+//   ./searchcheck [--names N] [--seed S]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+
+#include "../search/namesearch.h"
+
+static int checkNum = 0;
+
+static std::string joinNames(const std::vector<std::string>& names) {
+    std::ostringstream out;
+    out << "[";
+    for (size_t i = 0; i < names.size(); ++i) {
+        out << (i == 0 ? "" : ", ") << names[i];
+    }
+    out << "]";
+    return out.str();
+}
+
+// Runs the query and compares its names, in order, and its truncation with the expected ones
+static bool expectSearch(const std::string& what, const std::string& text, SEARCHMODE mode, int limit,
+                         const std::vector<std::string>& expected, bool expectedTruncated = false) {
+    SearchQuery query;
+    query.text = text;
+    query.mode = mode;
+    query.limit = limit;
+    SearchResult result;
+    NameSearch::search(query, result);
+    ++checkNum;
+    if (result.names != expected || result.truncated != expectedTruncated) {
+        std::cerr << "[error] " << what << ": " << (mode == SEARCH_PREFIX ? "prefix " : "substring ") << "\"" << text << "\" limit " << limit
+                  << " gave " << joinNames(result.names) << (result.truncated ? " (truncated)" : "") << ", expected "
+                  << joinNames(expected) << (expectedTruncated ? " (truncated)" : "") << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Answer of the query computed by a scan of the live names, in name order
+static std::vector<std::string> scanNames(const std::set<std::string>& live, const std::string& text, SEARCHMODE mode) {
+    std::vector<std::string> names;
+    for (const std::string& name : live) {
+        if (mode == SEARCH_PREFIX ? name.compare(0, text.size(), text) == 0 : name.find(text) != std::string::npos) {
+            names.push_back(name);
+        }
+    }
+    return names;
+}
+
+static bool checkKnownNames() {
+    std::vector<std::string> names = {"IMG_0001.jpg", "IMG_0002.jpg", "budget-2024.csv", "draft_report.docx", "report.pdf",
+                                      "report_final.pdf", "reports.tar.gz", "thesis.pdf"};
+    NameSearch::build(names, 2);
+    bool ok = true;
+    ok = ok && expectSearch("substring", "report", SEARCH_SUBSTRING, 100, {"draft_report.docx", "report.pdf", "report_final.pdf", "reports.tar.gz"});
+    ok = ok && expectSearch("substring", ".pdf", SEARCH_SUBSTRING, 100, {"report.pdf", "report_final.pdf", "thesis.pdf"});
+    ok = ok && expectSearch("short substring", "_0", SEARCH_SUBSTRING, 100, {"IMG_0001.jpg", "IMG_0002.jpg"});
+    ok = ok && expectSearch("case", "img", SEARCH_SUBSTRING, 100, {});
+    ok = ok && expectSearch("missing trigram", "reportx", SEARCH_SUBSTRING, 100, {});
+    ok = ok && expectSearch("whole name", "thesis.pdf", SEARCH_SUBSTRING, 100, {"thesis.pdf"});
+    ok = ok && expectSearch("truncated substring", "pdf", SEARCH_SUBSTRING, 2, {"report.pdf", "report_final.pdf"}, true);
+    ok = ok && expectSearch("prefix", "report", SEARCH_PREFIX, 100, {"report.pdf", "report_final.pdf", "reports.tar.gz"});
+    ok = ok && expectSearch("prefix inside a label", "repo", SEARCH_PREFIX, 100, {"report.pdf", "report_final.pdf", "reports.tar.gz"});
+    ok = ok && expectSearch("prefix of a whole name", "report.pdf", SEARCH_PREFIX, 100, {"report.pdf"});
+    ok = ok && expectSearch("prefix longer than the names", "report.pdf.bak", SEARCH_PREFIX, 100, {});
+    ok = ok && expectSearch("prefix not at the start", "eport", SEARCH_PREFIX, 100, {});
+    ok = ok && expectSearch("truncated prefix", "IMG", SEARCH_PREFIX, 1, {"IMG_0001.jpg"}, true);
+
+    NameSearch::remove("report.pdf");
+    NameSearch::remove("absent.txt");
+    ok = ok && expectSearch("delete", "report", SEARCH_SUBSTRING, 100, {"draft_report.docx", "report_final.pdf", "reports.tar.gz"});
+    ok = ok && expectSearch("delete", "report", SEARCH_PREFIX, 100, {"report_final.pdf", "reports.tar.gz"});
+
+    // A rename is seen by the index as the deletion of the old name and the creation of the new one
+    NameSearch::remove("draft_report.docx");
+    NameSearch::add("final_report.docx");
+    ok = ok && expectSearch("rename", "report", SEARCH_SUBSTRING, 100, {"final_report.docx", "report_final.pdf", "reports.tar.gz"});
+    ok = ok && expectSearch("rename", "draft", SEARCH_SUBSTRING, 100, {});
+    ok = ok && expectSearch("rename", "final_", SEARCH_PREFIX, 100, {"final_report.docx"});
+
+    NameSearch::add("report.pdf");
+    NameSearch::add("report.pdf");
+    ok = ok && expectSearch("deleted name added again", "report", SEARCH_PREFIX, 100, {"report.pdf", "report_final.pdf", "reports.tar.gz"});
+    ok = ok && expectSearch("deleted name added again", "rt.p", SEARCH_SUBSTRING, 100, {"report.pdf"});
+
+    SearchQuery query;
+    std::string error;
+    ++checkNum;
+    if (!NameSearch::parseQuery("q=rep%20ort&mode=prefix&limit=5", query, error) || query.text != "rep ort" ||
+        query.mode != SEARCH_PREFIX || query.limit != 5) {
+        std::cerr << "[error] parseQuery: the query string of a prefix search is not read back" << std::endl;
+        ok = false;
+    }
+    ++checkNum;
+    if (NameSearch::parseQuery("q=a&limit=0", query, error) || NameSearch::parseQuery("mode=prefix", query, error)) {
+        std::cerr << "[error] parseQuery: a limit of 0 or a missing q is accepted" << std::endl;
+        ok = false;
+    }
+    return ok;
+}
+
+// Names shaped like the files of a shared directory, the words make common trigrams with long posting lists
+static std::string makeName(uint32_t& seed, size_t i) {
+    static const char* words[] = {"report", "invoice", "IMG", "backup", "draft", "photo", "scan", "notes",
+                                  "budget", "video", "export", "thesis", "slides", "contract", "release", "meeting"};
+    static const char* extensions[] = {".pdf", ".jpg", ".png", ".txt", ".tar.gz", ".docx", ".mp4", ".csv"};
+    seed = seed * 1103515245 + 12345;
+    return std::string(words[(seed >> 8) % 16]) + "_" + words[(seed >> 16) % 16] + "-" + std::to_string(i) + extensions[(seed >> 24) % 8];
+}
+
+// Queries taken from the live names: prefixes and substrings of several lengths, and texts no name contains
+static bool checkQueries(const std::string& what, const std::set<std::string>& live, uint32_t& seed, int queryNum) {
+    std::vector<std::string> names(live.begin(), live.end());
+    for (int i = 0; i < queryNum; ++i) {
+        seed = seed * 1103515245 + 12345;
+        const std::string& name = names[(seed >> 4) % names.size()];
+        size_t len = 1 + (seed >> 20) % std::min<size_t>(name.size(), 12);
+        SEARCHMODE mode = (seed >> 28) & 1 ? SEARCH_PREFIX : SEARCH_SUBSTRING;
+        size_t start = mode == SEARCH_PREFIX ? 0 : (seed >> 12) % (name.size() - len + 1);
+        std::string text = name.substr(start, len);
+        if (i % 10 == 9) {
+            text += "~";
+        }
+        std::vector<std::string> expected = scanNames(live, text, mode);
+        if (expected.size() > SEARCH_RESULT_MAX) {
+            // Too many matches to compare, only the truncation is checked
+            SearchQuery query;
+            query.text = text;
+            query.mode = mode;
+            query.limit = SEARCH_RESULT_MAX;
+            SearchResult result;
+            NameSearch::search(query, result);
+            ++checkNum;
+            if (!result.truncated || result.names.size() != SEARCH_RESULT_MAX) {
+                std::cerr << "[error] " << what << ": \"" << text << "\" matches " << expected.size() << " names but gave "
+                          << result.names.size() << (result.truncated ? " (truncated)" : "") << std::endl;
+                return false;
+            }
+            continue;
+        }
+        if (!expectSearch(what, text, mode, SEARCH_RESULT_MAX, expected)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool checkGeneratedNames(size_t nameNum, uint32_t seed) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < nameNum; ++i) {
+        names.push_back(makeName(seed, i));
+    }
+    std::sort(names.begin(), names.end());
+    std::set<std::string> live(names.begin(), names.end());
+    NameSearch::build(names, 4);
+    if (!checkQueries("generated index", live, seed, 400)) {
+        return false;
+    }
+
+    // Renames and deletions of a quarter of the names, then additions: the ids of the new names follow the ids of
+    // the build instead of the name order
+    size_t nextName = nameNum;
+    for (size_t i = 0; i < nameNum / 4; ++i) {
+        seed = seed * 1103515245 + 12345;
+        std::set<std::string>::iterator it = live.begin();
+        std::advance(it, (seed >> 8) % std::min<size_t>(live.size(), 64));
+        std::string oldName = *it;
+        live.erase(it);
+        NameSearch::remove(oldName);
+        if (i % 2 == 0) {
+            std::string newName = "renamed-" + oldName;
+            live.insert(newName);
+            NameSearch::add(newName);
+        }
+    }
+    for (size_t i = 0; i < nameNum / 8; ++i) {
+        std::string name = makeName(seed, nextName++);
+        live.insert(name);
+        NameSearch::add(name);
+    }
+    if (!checkQueries("after renames and deletions", live, seed, 400)) {
+        return false;
+    }
+
+    // Enough deletions to rebuild the index without its deleted names
+    if (nameNum > 2 * SEARCH_COMPACT_MIN) {
+        std::vector<std::string> removed;
+        for (const std::string& name : live) {
+            if (removed.size() > live.size() / 2 + 1) {
+                break;
+            }
+            removed.push_back(name);
+        }
+        for (const std::string& name : removed) {
+            live.erase(name);
+            NameSearch::remove(name);
+        }
+        if (!checkQueries("after the compaction", live, seed, 400)) {
+            return false;
+        }
+    }
+    ++checkNum;
+    if (static_cast<size_t>(NameSearch::getNameNum()) != live.size()) {
+        std::cerr << "[error] The index counts " << NameSearch::getNameNum() << " names, " << live.size() << " are live" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    size_t nameNum = 150000;
+    uint32_t seed = 12345;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--names" && i + 1 < argc) {
+            nameNum = std::max(atol(argv[++i]), 100L);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--names N] [--seed S]" << std::endl;
+            return 2;
+        }
+    }
+
+    // The index logs its builds on std::cout, the results are written on std::cerr
+    std::ofstream devNull("/dev/null");
+    std::streambuf* coutBuf = std::cout.rdbuf(devNull.rdbuf());
+    bool ok = checkKnownNames() && checkGeneratedNames(nameNum, seed);
+    std::cout.rdbuf(coutBuf);
+    std::cerr << (ok ? "[info] " : "[error] ") << checkNum << " checks of the search index, " << (ok ? "all passed" : "the last one failed") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+// Converts the trace rings written by the server (trace/trace.h) into a Chrome trace (chrome://tracing, Perfetto)
+// or a text summary of the time spent in each phase of the requests.
+//
+//   ./tracedump [--chrome | --text] [--top N] /tmp/cherokee-trace-<pid>-*.ring > out
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+
+#include "../trace/trace.h"
+#include "../metrics/metrics.h"
+
+// Phases of a request, each one between two consecutive trace points
+static const TRACEPOINT phaseStart[] = {TRACE_FIRST_READ, TRACE_HEADER_DONE, TRACE_BODY_DONE, TRACE_HANDLER_START, TRACE_FIRST_WRITE};
+static const TRACEPOINT phaseEnd[] = {TRACE_HEADER_DONE, TRACE_BODY_DONE, TRACE_HANDLER_START, TRACE_FIRST_WRITE, TRACE_LAST_WRITE};
+static const char* phaseNames[] = {"read_header", "read_body", "wait_handler", "handler", "write"};
+static const int PHASE_NUM = 5;
+
+// One request rebuilt from the records of its connection
+struct TracedRequest {
+    uint32_t connId = 0;
+    int fd = -1;
+    int route = 0;
+    uint64_t points[TRACE_POINT_NUM] = {0};   // Time of each point, 0 when it was not recorded
+};
+
+static bool readRing(const std::string& path, std::vector<TraceRecord>& records) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "[error] Cannot open " << path << std::endl;
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(TraceRingHeader)) {
+        std::cerr << "[error] " << path << " is too small to be a trace ring" << std::endl;
+        return false;
+    }
+
+    const TraceRingHeader* header = reinterpret_cast<const TraceRingHeader*>(data.data());
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->recordSize != sizeof(TraceRecord) ||
+        data.size() < sizeof(TraceRingHeader) + header->capacity * sizeof(TraceRecord)) {
+        std::cerr << "[error] " << path << " is not a trace ring of this version" << std::endl;
+        return false;
+    }
+
+    // Only the last capacity records are still in the ring
+    uint64_t end = header->writeIndex.load(std::memory_order_acquire);
+    uint64_t begin = end > header->capacity ? end - header->capacity : 0;
+    const TraceRecord* ring = reinterpret_cast<const TraceRecord*>(header + 1);
+    for (uint64_t i = begin; i < end; ++i) {
+        records.push_back(ring[i % header->capacity]);
+    }
+    return true;
+}
+
+// Keep-alive requests of a connection follow each other, a request starts with its first read
+static void buildRequests(std::vector<TraceRecord>& records, std::vector<TracedRequest>& requests) {
+    std::sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a.connId != b.connId ? a.connId < b.connId : a.timeNs < b.timeNs;
+    });
+
+    TracedRequest cur;
+    bool open = false;
+    for (const TraceRecord& rec : records) {
+        if (rec.point >= TRACE_POINT_NUM || rec.point == TRACE_ACCEPT) {
+            continue;
+        }
+        if (open && (rec.connId != cur.connId || rec.point == TRACE_FIRST_READ)) {
+            requests.push_back(cur);
+            open = false;
+        }
+        if (!open) {
+            cur = TracedRequest();
+            cur.connId = rec.connId;
+            cur.fd = rec.fd;
+            open = true;
+        }
+        if (cur.points[rec.point] == 0) {
+            cur.points[rec.point] = rec.timeNs;
+        }
+        if (rec.point >= TRACE_BODY_DONE) {
+            cur.route = rec.route;
+        }
+        if (rec.point == TRACE_LAST_WRITE) {
+            requests.push_back(cur);
+            open = false;
+        }
+    }
+    if (open) {
+        requests.push_back(cur);
+    }
+}
+
+static const char* getRouteLabel(int route) {
+    return route >= 0 && route < ROUTE_NUM ? Metrics::getRouteName(static_cast<METRICSROUTE>(route)) : "unknown";
+}
+
+static void writeChrome(const std::vector<TraceRecord>& accepts, const std::vector<TracedRequest>& requests, std::ostream& out) {
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool first = true;
+    // One row per connection: the connection id is the thread id of the events
+    for (const TraceRecord& rec : accepts) {
+        out << (first ? "" : ",") << "\n{\"name\":\"accept\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << rec.timeNs / 1000.0
+            << ",\"pid\":0,\"tid\":" << rec.connId << "}";
+        first = false;
+    }
+    for (const TracedRequest& req : requests) {
+        uint64_t start = req.points[TRACE_FIRST_READ];
+        uint64_t end = req.points[TRACE_LAST_WRITE];
+        if (start != 0 && end != 0) {
+            out << (first ? "" : ",") << "\n{\"name\":\"" << getRouteLabel(req.route) << "\",\"ph\":\"X\",\"ts\":" << start / 1000.0
+                << ",\"dur\":" << (end - start) / 1000.0 << ",\"pid\":0,\"tid\":" << req.connId << ",\"args\":{\"fd\":" << req.fd << "}}";
+            first = false;
+        }
+        for (int p = 0; p < PHASE_NUM; ++p) {
+            uint64_t phaseBegin = req.points[phaseStart[p]];
+            uint64_t phaseFinish = req.points[phaseEnd[p]];
+            if (phaseBegin == 0 || phaseFinish == 0 || phaseFinish < phaseBegin) {
+                continue;
+            }
+            out << (first ? "" : ",") << "\n{\"name\":\"" << phaseNames[p] << "\",\"ph\":\"X\",\"ts\":" << phaseBegin / 1000.0
+                << ",\"dur\":" << (phaseFinish - phaseBegin) / 1000.0 << ",\"pid\":0,\"tid\":" << req.connId << "}";
+            first = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+// The values must be sorted
+static uint64_t getPercentile(const std::vector<uint64_t>& values, double quantile) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(quantile * (values.size() - 1));
+    return values[index];
+}
+
+static void writeText(const std::vector<TracedRequest>& requests, int top, std::ostream& out) {
+    // Phase durations per route, in microseconds
+    std::map<int, std::vector<uint64_t> > phaseUs[PHASE_NUM + 1];
+    std::vector<const TracedRequest*> complete;
+    for (const TracedRequest& req : requests) {
+        uint64_t start = req.points[TRACE_FIRST_READ];
+        uint64_t end = req.points[TRACE_LAST_WRITE];
+        if (start == 0 || end == 0) {
+            continue;
+        }
+        complete.push_back(&req);
+        phaseUs[PHASE_NUM][req.route].push_back((end - start) / 1000);
+        for (int p = 0; p < PHASE_NUM; ++p) {
+            if (req.points[phaseStart[p]] != 0 && req.points[phaseEnd[p]] >= req.points[phaseStart[p]]) {
+                phaseUs[p][req.route].push_back((req.points[phaseEnd[p]] - req.points[phaseStart[p]]) / 1000);
+            }
+        }
+    }
+
+    out << complete.size() << " complete requests, " << requests.size() - complete.size() << " incomplete (cut by the ring or in progress)\n\n";
+    out << "route      phase         count      p50 us      p99 us      max us\n";
+    for (std::map<int, std::vector<uint64_t> >::iterator it = phaseUs[PHASE_NUM].begin(); it != phaseUs[PHASE_NUM].end(); ++it) {
+        int route = it->first;
+        for (int p = 0; p <= PHASE_NUM; ++p) {
+            std::vector<uint64_t>& values = phaseUs[p][route];
+            std::sort(values.begin(), values.end());
+            char line[160];
+            snprintf(line, sizeof(line), "%-10s %-12s %6zu %11llu %11llu %11llu\n", getRouteLabel(route), p < PHASE_NUM ? phaseNames[p] : "total",
+                     values.size(), (unsigned long long)getPercentile(values, 0.5), (unsigned long long)getPercentile(values, 0.99),
+                     (unsigned long long)(values.empty() ? 0 : values.back()));
+            out << line;
+        }
+    }
+
+    std::sort(complete.begin(), complete.end(), [](const TracedRequest* a, const TracedRequest* b) {
+        return a->points[TRACE_LAST_WRITE] - a->points[TRACE_FIRST_READ] > b->points[TRACE_LAST_WRITE] - b->points[TRACE_FIRST_READ];
+    });
+    out << "\nSlowest requests (us per phase: read_header read_body wait_handler handler write)\n";
+    for (int i = 0; i < top && i < static_cast<int>(complete.size()); ++i) {
+        const TracedRequest& req = *complete[i];
+        out << "conn " << req.connId << " fd " << req.fd << " " << getRouteLabel(req.route) << " total "
+            << (req.points[TRACE_LAST_WRITE] - req.points[TRACE_FIRST_READ]) / 1000 << " us:";
+        for (int p = 0; p < PHASE_NUM; ++p) {
+            if (req.points[phaseStart[p]] != 0 && req.points[phaseEnd[p]] >= req.points[phaseStart[p]]) {
+                out << " " << (req.points[phaseEnd[p]] - req.points[phaseStart[p]]) / 1000;
+            } else {
+                out << " -";
+            }
+        }
+        out << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool chrome = false;
+    int top = 10;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--chrome") {
+            chrome = true;
+        } else if (arg == "--text") {
+            chrome = false;
+        } else if (arg == "--top" && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) {
+        std::cerr << "usage: " << argv[0] << " [--chrome | --text] [--top N] ring..." << std::endl;
+        return 1;
+    }
+
+    // Each thread has its own ring, the records of a connection are spread over the rings of the threads that served it
+    std::vector<TraceRecord> records;
+    for (const std::string& path : paths) {
+        readRing(path, records);
+    }
+
+    std::vector<TraceRecord> accepts;
+    for (const TraceRecord& rec : records) {
+        if (rec.point == TRACE_ACCEPT) {
+            accepts.push_back(rec);
+        }
+    }
+    std::vector<TracedRequest> requests;
+    buildRequests(records, requests);
+
+    if (chrome) {
+        writeChrome(accepts, requests, std::cout);
+    } else {
+        writeText(requests, top, std::cout);
+    }
+    return 0;
+}
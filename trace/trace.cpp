@@ -0,0 +1,133 @@
+#include "trace.h"
+
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "../utils/utils.h"
+
+std::atomic<bool> Trace::enabledFlag(false);
+std::atomic<uint32_t> Trace::nextConnId(1);
+std::atomic<uint32_t> Trace::connIds[MAX_TRACE_FD];
+
+static std::string traceDir = "/tmp";
+static uint64_t traceCapacity = 65536;
+
+// Rings of exited threads, reused by the next threads so that an elastic pool does not leave a file per thread
+static std::vector<TraceRingHeader*> freeRings;
+static int nextRingId = 0;
+static pthread_mutex_t ringLocker = PTHREAD_MUTEX_INITIALIZER;
+
+struct TraceRingGuard {
+    TraceRingHeader* ring = nullptr;
+    ~TraceRingGuard() {
+        if (ring != nullptr) {
+            pthread_mutex_lock(&ringLocker);
+            freeRings.push_back(ring);
+            pthread_mutex_unlock(&ringLocker);
+        }
+    }
+};
+
+void Trace::init(const std::string& dir, uint64_t capacity, bool enabled) {
+    traceDir = dir;
+    traceCapacity = capacity > 0 ? capacity : 65536;
+    setEnabled(enabled);
+}
+
+bool Trace::installToggleSignal(int signo) {
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = onToggleSignal;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    return sigaction(signo, &act, nullptr) == 0;
+}
+
+void Trace::onToggleSignal(int) {
+    // A lock-free atomic is safe to use from a signal handler
+    enabledFlag.store(!enabledFlag.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void Trace::beginConnection(int fd) {
+    uint32_t connId = nextConnId.fetch_add(1, std::memory_order_relaxed);
+    if (fd >= 0 && fd < MAX_TRACE_FD) {
+        connIds[fd].store(connId, std::memory_order_relaxed);
+    }
+    record(fd, TRACE_ACCEPT);
+}
+
+TraceRingHeader* Trace::getThreadRing() {
+    static thread_local TraceRingGuard guard;
+    static thread_local bool failed = false;
+    if (guard.ring != nullptr || failed) {
+        return guard.ring;
+    }
+
+    pthread_mutex_lock(&ringLocker);
+    if (!freeRings.empty()) {
+        guard.ring = freeRings.back();
+        freeRings.pop_back();
+        pthread_mutex_unlock(&ringLocker);
+        return guard.ring;
+    }
+    int ringId = nextRingId++;
+    pthread_mutex_unlock(&ringLocker);
+
+    // Created once per thread, the file keeps the records after the process exits
+    std::string path = traceDir + "/cherokee-trace-" + std::to_string(getpid()) + "-" + std::to_string(ringId) + ".ring";
+    size_t size = sizeof(TraceRingHeader) + traceCapacity * sizeof(TraceRecord);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, size) != 0) {
+        std::cout << outHead("error") << "Failed to create the trace ring " << path << ": " << strerror(errno) << std::endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        failed = true;
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cout << outHead("error") << "Failed to map the trace ring " << path << ": " << strerror(errno) << std::endl;
+        failed = true;
+        return nullptr;
+    }
+
+    TraceRingHeader* ring = static_cast<TraceRingHeader*>(addr);
+    ring->version = TRACE_VERSION;
+    ring->recordSize = sizeof(TraceRecord);
+    ring->capacity = traceCapacity;
+    ring->writeIndex.store(0, std::memory_order_relaxed);
+    ring->pid = getpid();
+    ring->ringId = ringId;
+    // The magic is written last, a reader ignores a ring whose header is not complete
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->magic = TRACE_MAGIC;
+    guard.ring = ring;
+    return ring;
+}
+
+void Trace::write(int fd, TRACEPOINT point, int route, uint32_t arg) {
+    TraceRingHeader* ring = getThreadRing();
+    if (ring == nullptr) {
+        return;
+    }
+
+    uint64_t index = ring->writeIndex.load(std::memory_order_relaxed);
+    TraceRecord* records = reinterpret_cast<TraceRecord*>(ring + 1);
+    TraceRecord& rec = records[index % ring->capacity];
+    rec.timeNs = getMonotonicNs();
+    rec.connId = (fd >= 0 && fd < MAX_TRACE_FD) ? connIds[fd].load(std::memory_order_relaxed) : 0;
+    rec.fd = fd;
+    rec.point = point;
+    rec.route = route;
+    rec.arg = arg;
+    // Only the owning thread writes the ring, the release store publishes the record to readers
+    ring->writeIndex.store(index + 1, std::memory_order_release);
+}
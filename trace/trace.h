@@ -0,0 +1,87 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x45434152544b4843ULL   // "CHKTRACE" read as a little-endian integer
+#define TRACE_VERSION 1
+#define MAX_TRACE_FD 65536                  // Connections with a larger descriptor are traced with connection id 0
+
+// Points of the life of a request recorded in the trace rings
+enum TRACEPOINT {
+    TRACE_ACCEPT,          // Connection accepted
+    TRACE_FIRST_READ,      // First byte of a request read
+    TRACE_HEADER_DONE,     // Request line and header parsed
+    TRACE_BODY_DONE,       // Request body received, a response is prepared
+    TRACE_HANDLER_START,   // HandleSend starts building the response
+    TRACE_FIRST_WRITE,     // First byte of the response written
+    TRACE_LAST_WRITE,      // Last byte of the response written
+    TRACE_POINT_NUM
+};
+
+// One record of a ring, 24 bytes
+struct TraceRecord {
+    uint64_t timeNs;       // Monotonic clock
+    uint32_t connId;       // Connection, given at accept, keep-alive requests of a connection share it
+    int32_t fd;            // Socket of the connection
+    uint16_t point;        // TRACEPOINT
+    uint16_t route;        // METRICSROUTE of the response, from TRACE_BODY_DONE on
+    uint32_t arg;          // Point specific value: bytes read or written
+};
+
+// Header of a ring file, the records follow it. The ring is written by a single thread,
+// writeIndex counts all the records ever written, record i is at slot i % capacity.
+struct TraceRingHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;
+    std::atomic<uint64_t> writeIndex;
+    int32_t pid;
+    int32_t ringId;
+    uint64_t reserved[3];
+};
+
+// Lightweight spans of the request handlers. Each thread writes into its own fixed size ring, a file mapped
+// with MAP_SHARED so that the data survives a crash and can be read while the server runs (tools/tracedump).
+// A disabled trace costs one relaxed load per point.
+class Trace {
+public:
+    // Sets the directory and size of the rings, the rings are created by the threads on their first record
+    static void init(const std::string& dir, uint64_t capacity, bool enabled);
+
+    static void setEnabled(bool enabled) { enabledFlag.store(enabled, std::memory_order_relaxed); }
+    static bool isEnabled() { return enabledFlag.load(std::memory_order_relaxed); }
+
+    // Toggles the trace when the process receives signo (SIGUSR2 by default)
+    static bool installToggleSignal(int signo);
+
+    // Gives the connection a new id and records TRACE_ACCEPT
+    static void beginConnection(int fd);
+
+    static void record(int fd, TRACEPOINT point, int route = 0, uint32_t arg = 0) {
+        if (isEnabled()) {
+            write(fd, point, route, arg);
+        }
+    }
+
+    // Inline so that tools/tracedump can use it without linking the server
+    static const char* getPointName(TRACEPOINT point) {
+        static const char* pointNames[TRACE_POINT_NUM] = {"accept", "first_read", "header_done", "body_done",
+                                                          "handler_start", "first_write", "last_write"};
+        return point < TRACE_POINT_NUM ? pointNames[point] : "unknown";
+    }
+
+private:
+    static void write(int fd, TRACEPOINT point, int route, uint32_t arg);
+    static TraceRingHeader* getThreadRing();
+    static void onToggleSignal(int signo);
+
+    static std::atomic<bool> enabledFlag;
+    static std::atomic<uint32_t> nextConnId;
+    static std::atomic<uint32_t> connIds[MAX_TRACE_FD];
+};
+
+#endif
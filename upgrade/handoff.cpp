@@ -0,0 +1,195 @@
+#include "handoff.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../utils/utils.h"
+
+extern char** environ;
+
+std::string Handoff::commandPath;
+std::vector<std::string> Handoff::commandArgs;
+int Handoff::readyFd = -1;
+
+void Handoff::setCommand(int argc, char* argv[]) {
+    commandArgs.assign(argv, argv + argc);
+    char path[PATH_MAX];
+    if (argc > 0 && strchr(argv[0], '/') != nullptr && realpath(argv[0], path) != nullptr) {
+        commandPath = path;
+        return;
+    }
+    // Started through the PATH
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len > 0) {
+        commandPath.assign(path, len);
+    }
+}
+
+pid_t Handoff::start(const std::vector<int>& listenFds) {
+    if (commandPath.empty() || listenFds.empty() || listenFds.size() > HANDOFF_MAX_FDS) {
+        std::cout << outHead("error") << "Upgrade impossible: no command or no listening socket" << std::endl;
+        return -1;
+    }
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+        std::cout << outHead("error") << "Upgrade failed to create the handoff socket (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+
+    // Everything exec needs is built before the fork, the child of a threaded process only makes system calls
+    std::vector<char*> argv;
+    for (std::string& arg : commandArgs) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+    std::string fdEnv = std::string(HANDOFF_FD_ENV) + "=" + std::to_string(HANDOFF_FD);
+    std::vector<char*> envp;
+    for (char** env = environ; *env != nullptr; ++env) {
+        if (strncmp(*env, HANDOFF_FD_ENV "=", sizeof(HANDOFF_FD_ENV)) != 0) {
+            envp.push_back(*env);
+        }
+    }
+    envp.push_back(&fdEnv[0]);
+    envp.push_back(nullptr);
+    long maxFd = sysconf(_SC_OPEN_MAX);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::cout << outHead("error") << "Upgrade failed to fork (errno = " << errno << ")" << std::endl;
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // Only the handoff socket crosses exec: client connections left open in the new server would never be closed
+        dup2(pair[1], HANDOFF_FD);
+        fcntl(HANDOFF_FD, F_SETFD, 0);
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, HANDOFF_FD + 1, ~0U, 0) != 0)
+#endif
+        {
+            for (long fd = HANDOFF_FD + 1; fd < maxFd; ++fd) {
+                close(fd);
+            }
+        }
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigprocmask(SIG_SETMASK, &signals, nullptr);
+        execve(commandPath.c_str(), argv.data(), envp.data());
+        _exit(127);
+    }
+    close(pair[1]);
+
+    HandoffHello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = HANDOFF_MAGIC;
+    hello.version = HANDOFF_VERSION;
+    hello.fdNum = listenFds.size();
+    struct iovec iov;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * listenFds.size());
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listenFds.size());
+    memcpy(CMSG_DATA(cmsg), listenFds.data(), sizeof(int) * listenFds.size());
+
+    bool ready = sendmsg(pair[0], &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(hello));
+    if (ready) {
+        // One byte once the new server accepts, the end of the socket if it exits first
+        struct pollfd pfd;
+        pfd.fd = pair[0];
+        pfd.events = POLLIN;
+        char ack = 0;
+        int ret;
+        while ((ret = poll(&pfd, 1, HANDOFF_READY_TIMEOUT_MS)) == -1 && errno == EINTR) {
+        }
+        ready = ret == 1 && recv(pair[0], &ack, 1, 0) == 1;
+    }
+    close(pair[0]);
+    if (!ready) {
+        std::cout << outHead("error") << "The new server " << commandPath << " (pid " << pid << ") did not take over, still serving" << std::endl;
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        return -1;
+    }
+    std::cout << outHead("info") << "The new server " << commandPath << " (pid " << pid << ") took over "
+              << listenFds.size() << " listening sockets" << std::endl;
+    return pid;
+}
+
+bool Handoff::receive(std::vector<int>& listenFds) {
+    listenFds.clear();
+    const char* value = getenv(HANDOFF_FD_ENV);
+    if (value == nullptr) {
+        return false;
+    }
+    int fd = atoi(value);
+    // A later upgrade of this server sets it again
+    unsetenv(HANDOFF_FD_ENV);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    HandoffHello hello;
+    struct iovec iov;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t len;
+    while ((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+
+    struct cmsghdr* cmsg = len > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t fdNum = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        listenFds.resize(fdNum);
+        memcpy(listenFds.data(), CMSG_DATA(cmsg), sizeof(int) * fdNum);
+    }
+    if (len != static_cast<ssize_t>(sizeof(hello)) || hello.magic != HANDOFF_MAGIC || hello.version != HANDOFF_VERSION ||
+        hello.fdNum != listenFds.size() || listenFds.empty() || (msg.msg_flags & MSG_CTRUNC) != 0) {
+        std::cout << outHead("error") << "Invalid handoff from the old server, starting without its sockets" << std::endl;
+        for (int listenFd : listenFds) {
+            close(listenFd);
+        }
+        listenFds.clear();
+        close(fd);
+        return false;
+    }
+    readyFd = fd;
+    std::cout << outHead("info") << "Took over " << listenFds.size() << " listening sockets from the old server" << std::endl;
+    return true;
+}
+
+void Handoff::notifyReady() {
+    if (readyFd == -1) {
+        return;
+    }
+    char ack = 'R';
+    if (send(readyFd, &ack, 1, MSG_NOSIGNAL) != 1) {
+        std::cout << outHead("error") << "Failed to tell the old server this one is ready (errno = " << errno << ")" << std::endl;
+    }
+    close(readyFd);
+    readyFd = -1;
+}
@@ -0,0 +1,53 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#define UPGRADE_SIGNAL SIGUSR1                // Starts a binary upgrade, or the drain of a prefork worker
+#define HANDOFF_FD 3                          // Descriptor of the handoff socket in the new server
+#define HANDOFF_FD_ENV "CHEROKEE_HANDOFF_FD"  // Set for the new server, tells it to take the sockets of the old one
+#define HANDOFF_MAX_FDS 64                    // Listening sockets passed at once, one per prefork worker
+#define HANDOFF_MAGIC 0x46464f444e414843ULL   // "CHANDOFF" read as a little-endian integer
+#define HANDOFF_VERSION 1
+#define HANDOFF_READY_TIMEOUT_MS 10000        // The old server keeps accepting if the new one is not ready by then
+#define HANDOFF_DRAIN_TIMEOUT_SEC 30          // Connections still open after this are closed by the exit of the old server
+
+// Message sent with the listening sockets
+struct HandoffHello {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t fdNum;           // Descriptors in the SCM_RIGHTS message
+};
+
+// Binary upgrade without dropping connections. The old server starts the binary found at its own path, passes it
+// its listening sockets over a Unix socket (SCM_RIGHTS) and waits until the new server reports that it accepts
+// connections. The old server then stops accepting and drains the connections it has, the sockets themselves stay
+// open in the new server, so no connection waiting in their queue is refused.
+class Handoff {
+public:
+    // Records the command line of the server, main calls it first. The path is resolved now, so that a binary
+    // replaced on disk since the start is the one started by the upgrade.
+    static void setCommand(int argc, char* argv[]);
+
+    // In the old server: starts the new binary and passes it listenFds. Returns the pid of the new server once it
+    // is ready, or -1 when it failed or timed out, the old server then keeps serving.
+    static pid_t start(const std::vector<int>& listenFds);
+
+    // In the new server: receives the listening sockets of the old one. Returns false when the process was not
+    // started by an upgrade, or when the handoff failed (listenFds is then empty).
+    static bool receive(std::vector<int>& listenFds);
+
+    // In the new server, once it accepts connections: the old server stops accepting and drains
+    static void notifyReady();
+
+private:
+    static std::string commandPath;
+    static std::vector<std::string> commandArgs;
+    static int readyFd;       // Handoff socket of the new server until it is ready, -1 otherwise
+};
+
+#endif
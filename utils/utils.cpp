@@ -1,5 +1,12 @@
 #include "utils.h"
 #include <cstring>  
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <sched.h>
+#include <pthread.h>
+#include <algorithm>
+#include <unistd.h>
 
 key_t get_shm_key(const char *path, int id) {
     return ftok(path, id);
@@ -98,6 +105,10 @@ std::string outHead(const std::string& logType) {
     return outStr;
 }
 
+long long getMonotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 int addWaitFd(int epollFd, int newFd, bool edgeTrigger, bool isOneshot) {
     epoll_event event;
     event.data.fd = newFd;
@@ -155,3 +166,234 @@ int setNonBlocking(int fd) {
     int ret = fcntl(fd, F_SETFL, oldFlag | O_NONBLOCK);
     return (ret == 0) ? 0 : -1;
 }
+
+std::vector<int> getAllowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &cpuSet)) {
+                cpus.push_back(i);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        long cpuNum = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = 0; i < (cpuNum > 0 ? cpuNum : 1); ++i) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+// Number of CPUs allowed by the cgroup CPU quota (v2 cpu.max, then v1 cfs quota), 0 when there is no quota
+static int getCgroupCpuLimit() {
+    long long quota = -1, period = 0;
+
+    std::ifstream cpuMax("/sys/fs/cgroup/cpu.max");
+    if (cpuMax) {
+        std::string quotaStr;
+        cpuMax >> quotaStr >> period;
+        if (quotaStr != "max") {
+            quota = atoll(quotaStr.c_str());
+        }
+    } else {
+        std::ifstream quotaFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream periodFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (quotaFile && periodFile) {
+            quotaFile >> quota;
+            periodFile >> period;
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return static_cast<int>(std::ceil(static_cast<double>(quota) / period));
+}
+
+int getAvailableCpuNum() {
+    int cpuNum = static_cast<int>(getAllowedCpus().size());
+    int cgroupLimit = getCgroupCpuLimit();
+    if (cgroupLimit > 0 && cgroupLimit < cpuNum) {
+        cpuNum = cgroupLimit;
+    }
+    return cpuNum > 0 ? cpuNum : 1;
+}
+
+// Parses a kernel CPU list such as "0-3,8-11"
+static std::vector<int> parseCpuList(const std::string& cpuList) {
+    std::vector<int> cpus;
+    std::stringstream listStream(cpuList);
+    std::string range;
+    while (std::getline(listStream, range, ',')) {
+        if (range.empty()) {
+            continue;
+        }
+        std::string::size_type dashIndex = range.find('-');
+        int first = atoi(range.c_str());
+        int last = (dashIndex == std::string::npos) ? first : atoi(range.c_str() + dashIndex + 1);
+        for (int i = first; i <= last; ++i) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int> > getNumaNodeCpus() {
+    std::vector<int> allowed = getAllowedCpus();
+    std::vector<std::vector<int> > nodes;
+
+    for (int node = 0; ; ++node) {
+        std::ifstream cpuListFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!cpuListFile) {
+            break;
+        }
+        std::string cpuList;
+        std::getline(cpuListFile, cpuList);
+
+        std::vector<int> nodeCpus;
+        for (int cpu : parseCpuList(cpuList)) {
+            if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                nodeCpus.push_back(cpu);
+            }
+        }
+        if (!nodeCpus.empty()) {
+            nodes.push_back(nodeCpus);
+        }
+    }
+
+    // Without NUMA information all the allowed CPUs form a single node
+    if (nodes.empty()) {
+        nodes.push_back(allowed);
+    }
+    return nodes;
+}
+
+bool pinCurrentThread(const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &cpuSet);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) == 0;
+}
+
+static int getHexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+std::string urlDecode(const std::string& value) {
+    std::string res;
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '+') {
+            res += ' ';
+        } else if (value[i] == '%' && i + 2 < value.size() && getHexValue(value[i + 1]) >= 0 && getHexValue(value[i + 2]) >= 0) {
+            res += static_cast<char>((getHexValue(value[i + 1]) << 4) | getHexValue(value[i + 2]));
+            i += 2;
+        } else {
+            res += value[i];
+        }
+    }
+    return res;
+}
+
+std::vector<std::pair<std::string, std::string> > parseQueryString(const std::string& queryString) {
+    std::vector<std::pair<std::string, std::string> > params;
+    std::string::size_type begin = 0;
+    while (begin < queryString.size()) {
+        std::string::size_type end = queryString.find('&', begin);
+        if (end == std::string::npos) {
+            end = queryString.size();
+        }
+        std::string param = queryString.substr(begin, end - begin);
+        begin = end + 1;
+
+        std::string::size_type eqIndex = param.find('=');
+        params.push_back(std::make_pair(urlDecode(param.substr(0, eqIndex)),
+                                        eqIndex == std::string::npos ? std::string() : urlDecode(param.substr(eqIndex + 1))));
+    }
+    return params;
+}
+
+void appendJsonString(std::string& out, const std::string& value) {
+    static const char hexDigits[] = "0123456789abcdef";
+    out += '"';
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            out += "\\u00";
+            out += hexDigits[c >> 4];
+            out += hexDigits[c & 0xf];
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+static const char base64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64Encode(const std::string& data) {
+    std::string text;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t group = static_cast<unsigned char>(data[i]) << 16;
+        if (i + 1 < data.size()) {
+            group |= static_cast<unsigned char>(data[i + 1]) << 8;
+        }
+        if (i + 2 < data.size()) {
+            group |= static_cast<unsigned char>(data[i + 2]);
+        }
+        text += base64Digits[(group >> 18) & 0x3f];
+        text += base64Digits[(group >> 12) & 0x3f];
+        text += i + 1 < data.size() ? base64Digits[(group >> 6) & 0x3f] : '=';
+        text += i + 2 < data.size() ? base64Digits[group & 0x3f] : '=';
+    }
+    return text;
+}
+
+bool base64Decode(const std::string& text, std::string& data) {
+    if (text.size() % 4 != 0) {
+        return false;
+    }
+    data.clear();
+    for (size_t i = 0; i < text.size(); i += 4) {
+        uint32_t group = 0;
+        int padding = 0;
+        for (size_t j = i; j < i + 4; ++j) {
+            const char* digit = text[j] == '\0' ? nullptr : strchr(base64Digits, text[j]);
+            if (text[j] == '=' && i + 4 == text.size() && j >= i + 2) {
+                ++padding;
+                group <<= 6;
+                continue;
+            }
+            if (digit == nullptr || padding > 0) {
+                return false;
+            }
+            group = (group << 6) | static_cast<uint32_t>(digit - base64Digits);
+        }
+        data += static_cast<char>(group >> 16);
+        if (padding < 2) {
+            data += static_cast<char>((group >> 8) & 0xff);
+        }
+        if (padding < 1) {
+            data += static_cast<char>(group & 0xff);
+        }
+    }
+    return true;
+}
@@ -13,9 +13,7 @@
 #include <sys/types.h>
 #include <semaphore.h>
 #include <search.h>
-
-// Taille de la mémoire partagée
-#define SHM_SIZE 1024  
+#include <vector>
 
 // Fonctions pour gérer la mémoire partagée
 key_t get_shm_key(const char *path, int id);
@@ -37,11 +35,29 @@ void post_semaphore(sem_t* sem);
 
 extern sem_t cache_sem;  // Déclaration externe de cache_sem
 
+// Fonctions pour le placement des threads sur les CPU
+std::vector<int> getAllowedCpus();                    // CPU sur lesquels le processus peut s'exécuter
+int getAvailableCpuNum();                             // Nombre de CPU utilisables, borné par le quota du cgroup
+std::vector<std::vector<int> > getNumaNodeCpus();     // CPU autorisés de chaque nœud NUMA
+bool pinCurrentThread(const std::vector<int>& cpus);
+
 // Fonctions existantes
 std::string outHead(const std::string& logType);
+long long getMonotonicNs();
 int addWaitFd(int epollFd, int newFd, bool edgeTrigger = false, bool isOneshot = false);
 int modifyWaitFd(int epollFd, int modFd, bool edgeTrigger = false, bool resetOneshot = false, bool addEpollout = false);
 int deleteWaitFd(int epollFd, int deleteFd);
 int setNonBlocking(int fd);
 
+// Fonctions pour les paramètres d'URL
+std::string urlDecode(const std::string& value);     // Décode les %XX et les + d'un paramètre
+std::vector<std::pair<std::string, std::string> > parseQueryString(const std::string& queryString);   // Paires clé/valeur décodées, dans l'ordre
+
+// Fonctions pour le JSON de l'API
+void appendJsonString(std::string& out, const std::string& value);   // Ajoute la chaîne entre guillemets, échappée
+
+// Fonctions pour le base64 des en-têtes Digest
+std::string base64Encode(const std::string& data);
+bool base64Decode(const std::string& text, std::string& data);   // Faux si le texte n'est pas du base64 valide
+
 #endif